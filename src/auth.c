@@ -0,0 +1,229 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include "auth.h"
+#include "util.h"
+#include "list.h"
+#include "memory.h"
+#include "logging.h"
+#include "uthash.h"
+
+/*
+ * Recently verified credentials, identified by a digest of username, password
+ * and salt so that no clear text password is kept around. Entries are kept
+ * in insertion order by UTHASH, hits are re-inserted to be moved to the tail,
+ * the head is thus always the least recently used one, to be evicted first.
+ */
+struct auth_cache_entry {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    UT_hash_handle hh; /* UTHASH handle, needed to use UTHASH macros */
+};
+
+static struct auth_pool {
+    bool stop;
+    int workers_nr;
+    pthread_t *workers;
+    List *requests;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t cache_size;
+    struct auth_cache_entry *cache;
+    pthread_mutex_t cache_mutex;
+} pool;
+
+static void auth_digest(const char *username, const char *password,
+                        const char *salt, unsigned char *digest) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(ctx, username, strlen(username) + 1);
+    EVP_DigestUpdate(ctx, password, strlen(password) + 1);
+    EVP_DigestUpdate(ctx, salt, strlen(salt));
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+}
+
+bool auth_cache_hit(const char *username, const char *password,
+                    const char *salt) {
+    if (pool.cache_size == 0)
+        return false;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct auth_cache_entry *entry = NULL;
+    auth_digest(username, password, salt, digest);
+    pthread_mutex_lock(&pool.cache_mutex);
+    HASH_FIND(hh, pool.cache, digest, SHA256_DIGEST_LENGTH, entry);
+    if (entry) {
+        HASH_DELETE(hh, pool.cache, entry);
+        HASH_ADD(hh, pool.cache, digest, SHA256_DIGEST_LENGTH, entry);
+    }
+    pthread_mutex_unlock(&pool.cache_mutex);
+    return entry != NULL;
+}
+
+static void auth_cache_put(const char *username, const char *password,
+                           const char *salt) {
+    if (pool.cache_size == 0)
+        return;
+    struct auth_cache_entry *entry = try_alloc(sizeof(*entry)), *lru = NULL;
+    auth_digest(username, password, salt, entry->digest);
+    pthread_mutex_lock(&pool.cache_mutex);
+    HASH_FIND(hh, pool.cache, entry->digest, SHA256_DIGEST_LENGTH, lru);
+    if (lru) {
+        // Raced with another worker on the same credentials
+        pthread_mutex_unlock(&pool.cache_mutex);
+        free_memory(entry);
+        return;
+    }
+    if (HASH_COUNT(pool.cache) >= pool.cache_size) {
+        lru = pool.cache;
+        HASH_DELETE(hh, pool.cache, lru);
+    }
+    HASH_ADD(hh, pool.cache, digest, SHA256_DIGEST_LENGTH, entry);
+    pthread_mutex_unlock(&pool.cache_mutex);
+    free_memory(lru);
+}
+
+static void auth_request_free(const struct ref *refcount) {
+    struct auth_request *req =
+        container_of(refcount, struct auth_request, refcount);
+    // Don't leave clear text passwords behind on the heap
+    memset(req->password, 0x00, strlen(req->password));
+    free_memory(req->username);
+    free_memory(req->password);
+    free_memory(req->salt);
+    free_memory(req);
+}
+
+struct auth_request *auth_request_new(const char *username,
+                                      const char *password,
+                                      const char *salt) {
+    struct auth_request *req = try_alloc(sizeof(*req));
+    req->username = try_strdup(username);
+    req->password = try_strdup(password);
+    req->salt = try_strdup(salt);
+    req->verified = false;
+    req->cancelled = false;
+    req->data = NULL;
+    req->done = NULL;
+    req->refcount = (struct ref) { auth_request_free, 0 };
+    INCREF(req, struct auth_request);
+    return req;
+}
+
+void auth_submit(struct auth_request *req,
+                 void (*done)(struct auth_request *), void *data) {
+    req->done = done;
+    req->data = data;
+    INCREF(req, struct auth_request);
+    pthread_mutex_lock(&pool.mutex);
+    pool.requests = list_push_back(pool.requests, req);
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void auth_cancel(struct auth_request *req) {
+    pthread_mutex_lock(&pool.mutex);
+    req->cancelled = true;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/*
+ * Worker routine, pops requests in FIFO order verifying them, the done
+ * callback is executed under the pool lock, this way a cancellation can't
+ * interleave with it.
+ */
+static void *auth_worker(void *arg) {
+    (void) arg;
+    struct auth_request *req = NULL;
+    while (1) {
+        pthread_mutex_lock(&pool.mutex);
+        while (pool.stop == false && list_size(pool.requests) == 0)
+            pthread_cond_wait(&pool.cond, &pool.mutex);
+        if (pool.stop == true) {
+            pthread_mutex_unlock(&pool.mutex);
+            break;
+        }
+        req = list_pop(pool.requests);
+        bool cancelled = req->cancelled;
+        pthread_mutex_unlock(&pool.mutex);
+        if (cancelled == false) {
+            req->verified = check_passwd(req->password, req->salt);
+            if (req->verified == true)
+                auth_cache_put(req->username, req->password, req->salt);
+            pthread_mutex_lock(&pool.mutex);
+            if (req->cancelled == false)
+                req->done(req);
+            pthread_mutex_unlock(&pool.mutex);
+        }
+        DECREF(req, struct auth_request);
+    }
+    return NULL;
+}
+
+int auth_pool_start(int workers_nr, size_t cache_size) {
+    pool.stop = false;
+    pool.requests = list_new(NULL);
+    pool.cache_size = cache_size;
+    pool.cache = NULL;
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_mutex_init(&pool.cache_mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.workers = try_calloc(workers_nr, sizeof(pthread_t));
+    for (pool.workers_nr = 0; pool.workers_nr < workers_nr; ++pool.workers_nr) {
+        if (pthread_create(pool.workers + pool.workers_nr,
+                           NULL, auth_worker, NULL) != 0) {
+            log_error("Unable to start auth worker %d", pool.workers_nr);
+            break;
+        }
+    }
+    return pool.workers_nr > 0 ? 0 : -1;
+}
+
+void auth_pool_stop(void) {
+    pthread_mutex_lock(&pool.mutex);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int i = 0; i < pool.workers_nr; ++i)
+        pthread_join(pool.workers[i], NULL);
+    struct auth_request *req = NULL;
+    while ((req = list_pop(pool.requests)))
+        DECREF(req, struct auth_request);
+    list_destroy(pool.requests, 0);
+    struct auth_cache_entry *entry, *tmp;
+    HASH_ITER(hh, pool.cache, entry, tmp) {
+        HASH_DELETE(hh, pool.cache, entry);
+        free_memory(entry);
+    }
+    free_memory(pool.workers);
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_mutex_destroy(&pool.cache_mutex);
+    pthread_cond_destroy(&pool.cond);
+}
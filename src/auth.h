@@ -0,0 +1,83 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stdbool.h>
+#include "ref.h"
+
+/*
+ * Password verification request, carried to the auth worker pool as hashing
+ * passwords with crypt can take milliseconds, way too much to be done on an
+ * event loop. The done callback is executed by the worker thread once the
+ * password has been verified, unless the request has been cancelled in the
+ * meanwhile, so it must be cheap, usually just a notification to the thread
+ * owning the request.
+ */
+struct auth_request {
+    char *username;
+    char *password;
+    char *salt;
+    bool verified;
+    bool cancelled;
+    void *data; // opaque pointer for the done callback args
+    void (*done)(struct auth_request *);
+    struct ref refcount;
+};
+
+/* Start the worker pool with a cache bounded to a number of credentials */
+int auth_pool_start(int, size_t);
+
+void auth_pool_stop(void);
+
+/*
+ * Create a new verification request of a password against a salt, the
+ * reference returned belongs to the caller
+ */
+struct auth_request *auth_request_new(const char *, const char *, const char *);
+
+/*
+ * Schedule a request on the worker pool, which takes its own reference till
+ * the request has been verified
+ */
+void auth_submit(struct auth_request *,
+                 void (*done)(struct auth_request *), void *);
+
+/*
+ * Cancel a pending request, once returned the done callback is guaranteed
+ * not to be called anymore
+ */
+void auth_cancel(struct auth_request *);
+
+/*
+ * Check if a username, password and salt triple has been recently verified,
+ * moving it to the most recently used position if so
+ */
+bool auth_cache_hit(const char *, const char *, const char *);
+
+#endif
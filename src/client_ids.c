@@ -0,0 +1,197 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string.h>
+#include <pthread.h>
+#include "memory.h"
+#include "logging.h"
+#include "sol_internal.h"
+
+/*
+ * Entries are allocated in chunks which never move, so that an entry can be
+ * read without taking the lock of the table, only interning and releasing a
+ * handle need it. The first chunk is static, holding the empty id of the
+ * handle 0 given to clients not connected yet.
+ */
+#define CHUNK_BITS          12
+#define CHUNK_SIZE          (1 << CHUNK_BITS)
+#define MAX_CHUNKS          (1 << 16)
+#define INDEX_MIN_SLOTS     4096
+
+static struct client_id first_chunk[CHUNK_SIZE] = { [0] = { .id = "" } };
+
+static struct {
+    pthread_mutex_t lock;
+    struct client_id *chunks[MAX_CHUNKS];
+    uint32_t next;          // first handle never given out
+    uint32_t free;          // last handle released, 0 if none
+    uint32_t *slots;        // open addressing index by id, 0 is empty
+    size_t nslots;          // power of two
+    size_t count;           // slots in use
+} ids = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .chunks = { first_chunk },
+    .next = 1
+};
+
+static inline struct client_id *entry(uint32_t handle) {
+    return &ids.chunks[handle >> CHUNK_BITS][handle & (CHUNK_SIZE - 1)];
+}
+
+/* FNV-1a of a client id */
+static uint32_t id_hash(const char *id, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (unsigned char) id[i]) * 16777619u;
+    return h;
+}
+
+/* Linear probing, returns the slot of the id or the empty one ending the run */
+static size_t slot_find(const char *id, uint32_t hash) {
+    size_t mask = ids.nslots - 1, i = hash & mask;
+    while (ids.slots[i]) {
+        const struct client_id *e = entry(ids.slots[i]);
+        if (e->hash == hash && strcmp(e->id, id) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void index_grow(void) {
+    uint32_t *old = ids.slots;
+    size_t nslots = ids.nslots;
+    ids.nslots = nslots ? nslots * 2 : INDEX_MIN_SLOTS;
+    ids.slots = try_calloc(ids.nslots, sizeof(*ids.slots));
+    for (size_t i = 0; i < nslots; ++i) {
+        if (!old[i])
+            continue;
+        size_t j = entry(old[i])->hash & (ids.nslots - 1);
+        while (ids.slots[j])
+            j = (j + 1) & (ids.nslots - 1);
+        ids.slots[j] = old[i];
+    }
+    free_memory(old);
+}
+
+/*
+ * Empty a slot shifting back the entries following it in the same run which
+ * wouldn't be found anymore, those whose home slot isn't between the emptied
+ * slot and their own.
+ */
+static void slot_remove(size_t i) {
+    size_t mask = ids.nslots - 1, j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!ids.slots[j])
+            break;
+        size_t home = entry(ids.slots[j])->hash & mask;
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays)
+            continue;
+        ids.slots[i] = ids.slots[j];
+        i = j;
+    }
+    ids.slots[i] = 0;
+}
+
+static uint32_t handle_alloc(void) {
+    uint32_t handle = ids.free;
+    if (handle) {
+        ids.free = entry(handle)->refs;
+        return handle;
+    }
+    handle = ids.next;
+    size_t chunk = handle >> CHUNK_BITS;
+    if (chunk >= MAX_CHUNKS)
+        log_fatal("Client ids exhausted, %u in use", handle);
+    if (!ids.chunks[chunk])
+        ids.chunks[chunk] = try_calloc(CHUNK_SIZE, sizeof(struct client_id));
+    ids.next++;
+    return handle;
+}
+
+/*
+ * Return the handle of a client id, adding it to the table if not present,
+ * the handle is valid till released as many times as it's been interned or
+ * retained.
+ */
+uint32_t client_id_intern(const char *id) {
+    size_t len = strlen(id);
+    uint32_t hash = id_hash(id, len);
+    pthread_mutex_lock(&ids.lock);
+    if ((ids.count + 1) * 2 > ids.nslots)
+        index_grow();
+    size_t i = slot_find(id, hash);
+    uint32_t handle = ids.slots[i];
+    if (!handle) {
+        handle = handle_alloc();
+        char *dup = try_alloc(len + 1);
+        memcpy(dup, id, len + 1);
+        *entry(handle) = (struct client_id) { .id = dup, .hash = hash };
+        ids.slots[i] = handle;
+        ids.count++;
+    }
+    entry(handle)->refs++;
+    pthread_mutex_unlock(&ids.lock);
+    return handle;
+}
+
+void client_id_retain(uint32_t handle) {
+    if (handle == CLIENT_ID_NONE)
+        return;
+    pthread_mutex_lock(&ids.lock);
+    entry(handle)->refs++;
+    pthread_mutex_unlock(&ids.lock);
+}
+
+/*
+ * Drop a reference to a handle, the last one gives the slot back to the
+ * table, to be reused by the next id interned.
+ */
+void client_id_release(uint32_t handle) {
+    if (handle == CLIENT_ID_NONE)
+        return;
+    pthread_mutex_lock(&ids.lock);
+    struct client_id *e = entry(handle);
+    if (--e->refs == 0) {
+        size_t i = e->hash & (ids.nslots - 1);
+        while (ids.slots[i] != handle)
+            i = (i + 1) & (ids.nslots - 1);
+        slot_remove(i);
+        ids.count--;
+        free_memory((char *) e->id);
+        *e = (struct client_id) { .refs = ids.free };
+        ids.free = handle;
+    }
+    pthread_mutex_unlock(&ids.lock);
+}
+
+struct client_id *client_id_get(uint32_t handle) {
+    return entry(handle);
+}
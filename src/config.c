@@ -37,6 +37,7 @@
 #include "config.h"
 #include "network.h"
 #include "logging.h"
+#include "wal.h"
 
 /* The main configuration structure */
 static struct config config;
@@ -194,6 +195,48 @@ static int parse_config_tls_protocols(char *token) {
     return protocols;
 }
 
+static int parse_config_queue_policy(const char *token) {
+    if (STREQ(token, "drop_newest", 11) == true)
+        return SOL_QUEUE_DROP_NEWEST;
+    if (STREQ(token, "reject", 6) == true)
+        return SOL_QUEUE_REJECT;
+    return SOL_QUEUE_DROP_OLDEST;
+}
+
+static int parse_config_durability(const char *token) {
+    if (STREQ(token, "none", 4) == true)
+        return WAL_DURABILITY_NONE;
+    if (STREQ(token, "async", 5) == true)
+        return WAL_DURABILITY_ASYNC;
+    if (STREQ(token, "sync", 4) == true)
+        return WAL_DURABILITY_SYNC;
+    return WAL_DURABILITY_GROUP;
+}
+
+static const char *durability_to_string(int durability) {
+    switch (durability) {
+        case WAL_DURABILITY_NONE:
+            return "none";
+        case WAL_DURABILITY_ASYNC:
+            return "async";
+        case WAL_DURABILITY_SYNC:
+            return "sync";
+        default:
+            return "group";
+    }
+}
+
+static const char *queue_policy_to_string(int policy) {
+    switch (policy) {
+        case SOL_QUEUE_DROP_NEWEST:
+            return "drop_newest";
+        case SOL_QUEUE_REJECT:
+            return "reject";
+        default:
+            return "drop_oldest";
+    }
+}
+
 /* Set configuration values based on what is read from the persistent
    configuration on disk */
 static void add_config_value(const char *key, const char *value) {
@@ -202,12 +245,17 @@ static void add_config_value(const char *key, const char *value) {
     size_t vlen = strlen(value);
 
     if (STREQ("log_level", key, klen) == true) {
-        for (int i = 0; i < 3; i++) {
+        for (int i = 0; i < 5; i++) {
             if (STREQ(lmap[i].lname, value, vlen) == true)
                 config.loglevel = lmap[i].loglevel;
         }
     } else if (STREQ("log_path", key, klen) == true) {
         strcpy(config.logpath, value);
+    } else if (STREQ("log_format", key, klen) == true) {
+        if (STREQ("binary", value, vlen) == true)
+            config.log_format = LOG_BINARY;
+        else if (STREQ("text", value, vlen) == true)
+            config.log_format = LOG_TEXT;
     } else if (STREQ("unix_socket", key, klen) == true) {
         config.socket_family = UNIX;
         strcpy(config.hostname, value);
@@ -216,6 +264,10 @@ static void add_config_value(const char *key, const char *value) {
         strcpy(config.hostname, value);
     } else if (STREQ("ip_port", key, klen) == true) {
         strcpy(config.port, value);
+    } else if (STREQ("metrics_address", key, klen) == true) {
+        strcpy(config.metrics_address, value);
+    } else if (STREQ("metrics_port", key, klen) == true) {
+        strcpy(config.metrics_port, value);
     } else if (STREQ("max_memory", key, klen) == true) {
         config.max_memory = read_memory_with_mul(value);
     } else if (STREQ("max_request_size", key, klen) == true) {
@@ -227,6 +279,25 @@ static void add_config_value(const char *key, const char *value) {
         config.stats_pub_interval = read_time_with_mul(value);
     } else if (STREQ("keepalive", key, klen) == true) {
         config.keepalive = read_time_with_mul(value);
+    } else if (STREQ("max_queued_messages", key, klen) == true) {
+        config.max_queued_messages = parse_int(value);
+    } else if (STREQ("max_queued_bytes", key, klen) == true) {
+        config.max_queued_bytes = read_memory_with_mul(value);
+    } else if (STREQ("max_inflight_messages", key, klen) == true) {
+        int max_inflight = parse_int(value);
+        config.max_inflight_messages =
+            max_inflight > 0 && max_inflight < UINT16_MAX
+            ? max_inflight : UINT16_MAX;
+    } else if (STREQ("queue_spill_threshold", key, klen) == true) {
+        config.queue_spill_threshold = read_memory_with_mul(value);
+    } else if (STREQ("queue_policy", key, klen) == true) {
+        config.queue_policy = parse_config_queue_policy(value);
+    } else if (STREQ("output_high_watermark", key, klen) == true) {
+        config.output_high_watermark = read_memory_with_mul(value);
+    } else if (STREQ("output_low_watermark", key, klen) == true) {
+        config.output_low_watermark = read_memory_with_mul(value);
+    } else if (STREQ("pause_publishers", key, klen) == true) {
+        config.pause_publishers = STREQ(value, "true", 4);
     } else if (STREQ("cafile", key, klen) == true) {
         config.tls = true;
         strcpy(config.cafile, value);
@@ -240,6 +311,26 @@ static void add_config_value(const char *key, const char *value) {
         else config.allow_anonymous = true;
     } else if (STREQ("password_file", key, klen) == true) {
         strcpy(config.password_file, value);
+    } else if (STREQ("auth_workers", key, klen) == true) {
+        int workers = parse_int(value);
+        config.auth_workers = workers > 0 ? workers : 1;
+    } else if (STREQ("auth_cache_size", key, klen) == true) {
+        config.auth_cache_size = parse_int(value);
+    } else if (STREQ("slow_op_threshold", key, klen) == true) {
+        config.slow_op_threshold = parse_int(value);
+    } else if (STREQ("data_dir", key, klen) == true) {
+        strcpy(config.data_dir, value);
+    } else if (STREQ("wal_segment_size", key, klen) == true) {
+        config.wal_segment_size = read_memory_with_mul(value);
+    } else if (STREQ("wal_durability", key, klen) == true) {
+        config.wal_durability = parse_config_durability(value);
+    } else if (STREQ("wal_commit_interval", key, klen) == true) {
+        int interval = parse_int(value);
+        config.wal_commit_interval = interval > 0 ? interval : 1;
+    } else if (STREQ("wal_commit_bytes", key, klen) == true) {
+        config.wal_commit_bytes = read_memory_with_mul(value);
+    } else if (STREQ("snapshot_interval", key, klen) == true) {
+        config.snapshot_interval = read_time_with_mul(value);
     } else if (STREQ("tls_protocols", key, klen) == true) {
         if (vlen == 0) return;
         config.tls_protocols = 0;
@@ -317,6 +408,17 @@ int config_load(const char *configpath) {
         add_config_value(key, value);
     }
 
+    fclose(fh);
+
+    /*
+     * The output of a client can't exceed its write buffer, which is sized
+     * after the max request size
+     */
+    if (config.output_high_watermark > config.max_request_size)
+        config.output_high_watermark = config.max_request_size;
+    if (config.output_low_watermark > config.output_high_watermark)
+        config.output_low_watermark = config.output_high_watermark / 4;
+
     return true;
 }
 
@@ -329,9 +431,12 @@ void config_set_default(void) {
     config.version = VERSION;
     config.socket_family = DEFAULT_SOCKET_FAMILY;
     config.loglevel = DEFAULT_LOG_LEVEL;
+    config.log_format = DEFAULT_LOG_FORMAT;
     memset(config.logpath, 0x00, 0xFFF);
     strcpy(config.hostname, DEFAULT_HOSTNAME);
     strcpy(config.port, DEFAULT_PORT);
+    strcpy(config.metrics_address, DEFAULT_METRICS_ADDRESS);
+    memset(config.metrics_port, 0x00, 0xFF);
 #ifdef __linux__
     config.run = eventfd(0, EFD_NONBLOCK);
 #else
@@ -342,9 +447,27 @@ void config_set_default(void) {
     config.tcp_backlog = SOMAXCONN;
     config.stats_pub_interval = read_time_with_mul(DEFAULT_STATS_INTERVAL);
     config.keepalive = read_time_with_mul(DEFAULT_KEEPALIVE);
+    config.max_queued_messages = DEFAULT_MAX_QUEUED_MESSAGES;
+    config.max_queued_bytes = read_memory_with_mul(DEFAULT_MAX_QUEUED_BYTES);
+    config.max_inflight_messages = DEFAULT_MAX_INFLIGHT_MESSAGES;
+    config.queue_spill_threshold =
+        read_memory_with_mul(DEFAULT_QUEUE_SPILL_THRESHOLD);
+    config.queue_policy = DEFAULT_QUEUE_POLICY;
+    config.output_high_watermark = read_memory_with_mul(DEFAULT_OUTPUT_HIGH_WM);
+    config.output_low_watermark = read_memory_with_mul(DEFAULT_OUTPUT_LOW_WM);
+    config.pause_publishers = DEFAULT_PAUSE_PUBLISHERS;
     config.tls = false;
     config.tls_protocols = DEFAULT_TLS_PROTOCOLS;
     config.allow_anonymous = true;
+    config.auth_workers = DEFAULT_AUTH_WORKERS;
+    config.auth_cache_size = DEFAULT_AUTH_CACHE_SIZE;
+    config.slow_op_threshold = DEFAULT_SLOW_OP_THRESHOLD;
+    memset(config.data_dir, 0x00, 0xFFF);
+    config.wal_segment_size = read_memory_with_mul(DEFAULT_WAL_SEGMENT_SIZE);
+    config.wal_durability = DEFAULT_WAL_DURABILITY;
+    config.wal_commit_interval = DEFAULT_WAL_COMMIT_INTERVAL;
+    config.wal_commit_bytes = read_memory_with_mul(DEFAULT_WAL_COMMIT_BYTES);
+    config.snapshot_interval = read_time_with_mul(DEFAULT_SNAPSHOT_INTERVAL);
 }
 
 void config_print_tls_versions(void) {
@@ -395,13 +518,71 @@ void config_print(void) {
         log_info("\tMax request size: %s", human_rsize);
         log_info("Logging:");
         log_info("\tlevel: %s", llevel);
-        if (config.logpath[0])
+        if (config.logpath[0]) {
             log_info("\tlogpath: %s", config.logpath);
+            log_info("\tformat: %s",
+                     config.log_format == LOG_BINARY ? "binary" : "text");
+        }
         const char *human_memory = memory_to_string(config.max_memory);
         log_info("Max memory: %s", human_memory);
+        const char *human_qbytes = memory_to_string(config.max_queued_bytes);
+        log_info("Offline queues:");
+        log_info("\tmax messages: %lu", config.max_queued_messages);
+        log_info("\tmax bytes: %s", human_qbytes);
+        log_info("\tpolicy: %s", queue_policy_to_string(config.queue_policy));
+        log_info("Max inflight messages: %lu", config.max_inflight_messages);
+        const char *human_hwm = memory_to_string(config.output_high_watermark);
+        const char *human_lwm = memory_to_string(config.output_low_watermark);
+        log_info("Output watermarks:");
+        log_info("\thigh: %s", human_hwm);
+        log_info("\tlow: %s", human_lwm);
+        log_info("\tpause publishers: %s",
+                 config.pause_publishers == true ? "true" : "false");
+        if (config.allow_anonymous == false) {
+            log_info("Authentication:");
+            log_info("\tworkers: %d", config.auth_workers);
+            log_info("\tcache size: %lu", config.auth_cache_size);
+        }
+        if (config.metrics_port[0]) {
+            log_info("Metrics:");
+            log_info("\taddress: %s", config.metrics_address);
+            log_info("\tport: %s", config.metrics_port);
+        }
+        if (config.data_dir[0]) {
+            const char *human_wal = memory_to_string(config.wal_segment_size);
+            log_info("Persistence:");
+            log_info("\tdata dir: %s", config.data_dir);
+            log_info("\tlog segment size: %s", human_wal);
+            log_info("\tdurability: %s",
+                     durability_to_string(config.wal_durability));
+            if (config.wal_durability == WAL_DURABILITY_GROUP) {
+                const char *human_commit =
+                    memory_to_string(config.wal_commit_bytes);
+                log_info("\tcommit window: %uus or %s",
+                         config.wal_commit_interval, human_commit);
+                free_memory((char *) human_commit);
+            }
+            if (config.queue_spill_threshold > 0) {
+                const char *human_spill =
+                    memory_to_string(config.queue_spill_threshold);
+                log_info("\tqueue spill threshold: %s", human_spill);
+                free_memory((char *) human_spill);
+            }
+            if (config.snapshot_interval > 0)
+                log_info("\tsnapshot interval: %lus", config.snapshot_interval);
+            else
+                log_info("\tsnapshots: disabled");
+            free_memory((char *) human_wal);
+        }
+        if (config.slow_op_threshold > 0)
+            log_info("Slow operations threshold: %lums",
+                     config.slow_op_threshold);
         log_info("Event loop backend: %s", EVENTLOOP_BACKEND);
         free_memory((char *) human_memory);
         free_memory((char *) human_rsize);
+        free_memory((char *) human_qbytes);
+        free_memory((char *) human_hwm);
+        free_memory((char *) human_lwm);
     }
 }
 
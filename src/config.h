@@ -61,18 +61,42 @@
 #define SOL_TLSv1_2     0x04
 #define SOL_TLSv1_3     0x08
 
+// Offline queues policies, applied when a session queue reaches its limits
+
+#define SOL_QUEUE_DROP_OLDEST   0
+#define SOL_QUEUE_DROP_NEWEST   1
+#define SOL_QUEUE_REJECT        2
+
 // Default parameters
 
 #define VERSION                     "0.18.5"
 #define DEFAULT_SOCKET_FAMILY       INET
 #define DEFAULT_LOG_LEVEL           DEBUG
+#define DEFAULT_LOG_FORMAT          LOG_TEXT
 #define DEFAULT_CONF_PATH           "/etc/sol/sol.conf"
 #define DEFAULT_HOSTNAME            "127.0.0.1"
 #define DEFAULT_PORT                "1883"
+#define DEFAULT_METRICS_ADDRESS     "127.0.0.1"
 #define DEFAULT_MAX_MEMORY          "2GB"
 #define DEFAULT_MAX_REQUEST_SIZE    "512KB"
 #define DEFAULT_STATS_INTERVAL      "10s"
 #define DEFAULT_KEEPALIVE           "60s"
+#define DEFAULT_MAX_QUEUED_MESSAGES 1000
+#define DEFAULT_MAX_QUEUED_BYTES    "32MB"
+#define DEFAULT_MAX_INFLIGHT_MESSAGES 1000
+#define DEFAULT_QUEUE_SPILL_THRESHOLD "1MB"
+#define DEFAULT_QUEUE_POLICY        SOL_QUEUE_DROP_OLDEST
+#define DEFAULT_OUTPUT_HIGH_WM      "256KB"
+#define DEFAULT_OUTPUT_LOW_WM       "64KB"
+#define DEFAULT_PAUSE_PUBLISHERS    false
+#define DEFAULT_AUTH_WORKERS        2
+#define DEFAULT_AUTH_CACHE_SIZE     1024
+#define DEFAULT_SLOW_OP_THRESHOLD   50
+#define DEFAULT_WAL_SEGMENT_SIZE    "64MB"
+#define DEFAULT_WAL_DURABILITY      WAL_DURABILITY_GROUP
+#define DEFAULT_WAL_COMMIT_INTERVAL 2000
+#define DEFAULT_WAL_COMMIT_BYTES    "1MB"
+#define DEFAULT_SNAPSHOT_INTERVAL   "10m"
 #ifdef TLS1_3_VERSION
 #define DEFAULT_TLS_PROTOCOLS       (SOL_TLSv1_2 | SOL_TLSv1_3)
 #else
@@ -94,11 +118,17 @@ struct config {
     int socket_family;
     /* Log file path */
     char logpath[0xFFF];
+    /* Log file format, plain text or binary records */
+    int log_format;
     /* Hostname to listen on */
     char hostname[0xFF];
     /* Port to open while listening, only if socket_family is INET,
      * otherwise it's ignored */
     char port[0xFF];
+    /* Address and port of the HTTP metrics endpoint, disabled if the port
+     * is empty */
+    char metrics_address[0xFF];
+    char metrics_port[0xFF];
     /* Max memory to be used, after which the system starts to reclaim back by
      * freeing older items stored */
     size_t max_memory;
@@ -109,10 +139,41 @@ struct config {
     /* Delay between every automatic publish of broker stats on topic */
     size_t stats_pub_interval;
     /*
-     * Seconds to keep alive any connection,
-     * **CURRENTLY USED AS ACK TIMER AS WELL**
+     * Seconds to keep alive any connection till a CONNECT negotiates its own
+     * keepalive, **CURRENTLY USED AS ACK TIMER AS WELL**
      */
     size_t keepalive;
+    /* Max number of messages queued for each offline session, 0 unlimited */
+    size_t max_queued_messages;
+    /* Max bytes queued for each offline session, 0 unlimited */
+    size_t max_queued_bytes;
+    /*
+     * Max number of QoS > 0 messages sent to a session and not acknowledged
+     * yet, the following ones wait in its queue, 0 for the 65535 allowed by
+     * the identifiers
+     */
+    size_t max_inflight_messages;
+    /*
+     * Bytes an offline session keeps queued in memory, the following messages
+     * are spilled to disk under data_dir, 0 keeps them all in memory
+     */
+    size_t queue_spill_threshold;
+    /* Policy to apply to a full session queue on new incoming messages */
+    int queue_policy;
+    /*
+     * Bytes pending on the output of a client, above which the client is
+     * considered a slow consumer: QoS 0 messages are dropped and QoS > 0 ones
+     * are queued on its session till the output goes down to the low mark
+     */
+    size_t output_high_watermark;
+    size_t output_low_watermark;
+    /* Pause reading from publishers feeding slow consumers */
+    bool pause_publishers;
+    /*
+     * Milliseconds a single packet handler may run before being reported in
+     * the log as a slow operation, 0 disables the reports
+     */
+    size_t slow_op_threshold;
     /* TLS flag */
     bool tls;
     /* TLS protocol version */
@@ -127,6 +188,24 @@ struct config {
     bool allow_anonymous;
     /* File path on the filesystem pointing to the password_file */
     char password_file[0xFFF];
+    /* Number of threads verifying passwords off the event loops */
+    int auth_workers;
+    /* Max number of recently verified credentials cached, 0 disables it */
+    size_t auth_cache_size;
+    /*
+     * Directory holding the write-ahead log of the persistent sessions,
+     * persistence is disabled if empty
+     */
+    char data_dir[0xFFF];
+    /* Size past which a new log segment is started */
+    size_t wal_segment_size;
+    /* When log records are synced, one of enum wal_durability */
+    int wal_durability;
+    /* Group commit window, in microseconds and in bytes pending */
+    unsigned wal_commit_interval;
+    size_t wal_commit_bytes;
+    /* Seconds between snapshots compacting the log, 0 disables them */
+    size_t snapshot_interval;
 };
 
 extern struct config *conf;
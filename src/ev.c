@@ -490,7 +490,7 @@ static int ev_api_poll(struct ev_ctx *ctx, time_t timeout) {
     ts_timeout.tv_sec = timeout;
     ts_timeout.tv_nsec = 0;
     int err = kevent(k_api->fd, NULL, 0,
-                     k_api->events, ctx->maxevents, &ts_timeout);
+                     k_api->events, ctx->events_nr, &ts_timeout);
     if (err < 0)
         return -EV_ERR;
     return err;
@@ -586,12 +586,24 @@ static int ev_process_event(struct ev_ctx *ctx, int idx, int mask) {
             e->rcallback(ctx, e->rdata);
             ++fired;
         }
-        if (mask & EV_WRITE) {
+        /*
+         * The read callback may have closed and unregistered the descriptor,
+         * clearing its callbacks, nothing left to write to in that case
+         */
+        if ((mask & EV_WRITE) && e->wcallback) {
             if (!fired || e->wcallback != e->rcallback) {
                 e->wcallback(ctx, e->wdata);
                 ++fired;
             }
         }
+        /*
+         * A descriptor monitored for nothing but errors and hang ups, let the
+         * read callback find out about the disconnection
+         */
+        if (!fired && (mask & EV_DISCONNECT) && e->rcallback) {
+            e->rcallback(ctx, e->rdata);
+            ++fired;
+        }
     }
     return fired;
 }
@@ -609,15 +621,17 @@ static void ev_add_monitored(struct ev_ctx *ctx, int fd, int mask,
      * That is because FD_SETSIZE is fixed to 1024, fd_set is an array of 32
      * i32 and each FD is represented by a bit so 32 x 32 = 1024 as hard limit
      */
-    if (fd > ctx->maxevents) {
-        int i = ctx->maxevents;
-        ctx->maxevents = fd;
-        if (fd > ctx->events_nr) {
-            ctx->events_monitored = try_realloc(ctx->events_monitored,
-                                                (fd + 1) * sizeof(struct ev));
-            for (; i < ctx->maxevents; ++i)
-                ctx->events_monitored[i].mask = EV_NONE;
-        }
+    if (fd >= ctx->maxevents) {
+        /*
+         * Grow geometrically, a burst of connections would otherwise cost a
+         * realloc each
+         */
+        int size = ctx->maxevents * 2 > fd ? ctx->maxevents * 2 : fd + 1;
+        ctx->events_monitored = try_realloc(ctx->events_monitored,
+                                            size * sizeof(struct ev));
+        memset(ctx->events_monitored + ctx->maxevents, 0x00,
+               (size - ctx->maxevents) * sizeof(struct ev));
+        ctx->maxevents = size;
     }
     ctx->events_monitored[fd].fd = fd;
     ctx->events_monitored[fd].mask |= mask;
@@ -644,6 +658,11 @@ int ev_init(struct ev_ctx *ctx, int events_nr) {
     ctx->maxevents = events_nr;
     ctx->events_nr = events_nr;
     ctx->events_monitored = try_calloc(events_nr, sizeof(struct ev));
+    ctx->now = time(NULL);
+    ctx->wheel_armed = 0;
+    ctx->wheel_tick = ctx->now;
+    memset(ctx->wheel, 0x00, sizeof(ctx->wheel));
+    ctx->probe = NULL;
     return EV_OK;
 }
 
@@ -663,11 +682,14 @@ int ev_poll(struct ev_ctx *ctx, time_t timeout) {
 
 int ev_run(struct ev_ctx *ctx) {
     int n = 0, events = 0;
+    uint64_t start = 0, polled = 0;
     /*
      * Start an infinite loop, can be stopped only by scheduling an ev_stop
      * callback or if an error on the underlying backend occur
      */
     while (!ctx->stop) {
+        if (ctx->probe)
+            start = clock_ns();
         /*
          * blocks polling for events, -1 means forever. Returns only in case of
          * valid events ready to be processed or errors
@@ -680,10 +702,19 @@ int ev_run(struct ev_ctx *ctx) {
             /* Error occured, break the loop */
             break;
         }
+        /*
+         * Cache the wall clock once per cycle, callbacks can rely on it
+         * avoiding a clock read per event
+         */
+        ctx->now = time(NULL);
+        if (ctx->probe)
+            polled = clock_ns();
         for (int i = 0; i < n; ++i) {
             events = ev_get_event_type(ctx, i);
             ctx->fired_events += ev_process_event(ctx, i, events);
         }
+        if (ctx->probe)
+            ctx->probe(ctx, polled - start, clock_ns() - polled);
     }
     return n;
 }
@@ -692,6 +723,12 @@ void ev_stop(struct ev_ctx *ctx) {
    ctx->stop = 1;
 }
 
+void ev_set_probe(struct ev_ctx *ctx,
+                  void (*probe)(struct ev_ctx *, unsigned long long,
+                                unsigned long long)) {
+    ctx->probe = probe;
+}
+
 int ev_watch_fd(struct ev_ctx *ctx, int fd, int mask) {
     ev_add_monitored(ctx, fd, mask, NULL, NULL);
     return ev_api_watch_fd(ctx, fd);
@@ -768,6 +805,69 @@ int ev_register_cron(struct ev_ctx *ctx,
 #endif // __linux__
 }
 
+/*
+ * Cron callback advancing the timing wheel, every slot passed since the last
+ * tick is visited, firing the timers expired, those scheduled for a later
+ * round are left in place. On long stalls a single revolution is enough to
+ * visit every timer.
+ */
+static void ev_wheel_advance(struct ev_ctx *ctx, void *data) {
+    (void) data;
+    ctx->now = time(NULL);
+    time_t ticks = ctx->now - ctx->wheel_tick;
+    if (ticks > EV_WHEEL_SLOTS)
+        ticks = EV_WHEEL_SLOTS;
+    struct ev_timer *timer, *next;
+    for (time_t t = ctx->now - ticks + 1; t <= ctx->now; ++t) {
+        timer = ctx->wheel[t & (EV_WHEEL_SLOTS - 1)];
+        while (timer) {
+            next = timer->next;
+            if (timer->expire <= ctx->now) {
+                ev_timer_del(timer);
+                timer->callback(ctx, timer->data);
+            }
+            timer = next;
+        }
+    }
+    ctx->wheel_tick = ctx->now;
+}
+
+void ev_timer_init(struct ev_timer *timer,
+                   void (*callback)(struct ev_ctx *, void *), void *data) {
+    timer->expire = 0;
+    timer->data = data;
+    timer->callback = callback;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+int ev_timer_add(struct ev_ctx *ctx, struct ev_timer *timer, time_t secs) {
+    if (!ctx->wheel_armed) {
+        if (ev_register_cron(ctx, ev_wheel_advance, NULL, 1, 0) < 0)
+            return -EV_ERR;
+        ctx->wheel_armed = 1;
+    }
+    ev_timer_del(timer);
+    timer->expire = ctx->now + (secs > 0 ? secs : 1);
+    struct ev_timer **slot = &ctx->wheel[timer->expire & (EV_WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+    return EV_OK;
+}
+
+void ev_timer_del(struct ev_timer *timer) {
+    if (!timer->pprev)
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
 /*
  * Set a callback and an argument to be passed to for the next loop cycle,
  * associating it to a file descriptor, ultimately resulting in an event to be
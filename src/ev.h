@@ -50,6 +50,26 @@ enum ev_type {
 
 struct ev_ctx;
 
+/*
+ * Number of one-second slots of the timing wheel carried by every context,
+ * must be a power of two. Timers expiring further away than a full revolution
+ * are simply skipped until their round comes.
+ */
+#define EV_WHEEL_SLOTS 512
+
+/*
+ * Timer scheduled on the timing wheel of a context, with a resolution of one
+ * second. It's meant to be embedded into the structure it refers to so that
+ * scheduling, rescheduling and removal are all O(1) and allocation free.
+ */
+struct ev_timer {
+    time_t expire;
+    void *data; // opaque pointer for the expiry callback args
+    void (*callback)(struct ev_ctx *, void *); // expiry callback
+    struct ev_timer *next;
+    struct ev_timer **pprev; // NULL if the timer is not scheduled
+};
+
 /*
  * Event struture used as the main carrier of clients informations, it will be
  * tracked by an array in every context created
@@ -83,6 +103,12 @@ struct ev_ctx {
     unsigned long long fired_events;
     struct ev *events_monitored;
     void *api; // opaque pointer to platform defined backends
+    time_t now; // coarse clock, refreshed once per loop cycle
+    int wheel_armed; // whether the wheel tick cron is registered
+    time_t wheel_tick; // last second processed by the timing wheel
+    struct ev_timer *wheel[EV_WHEEL_SLOTS];
+    // optional instrumentation, called at the end of every cycle
+    void (*probe)(struct ev_ctx *, unsigned long long, unsigned long long);
 };
 
 int ev_init(struct ev_ctx *, int);
@@ -108,6 +134,16 @@ int ev_run(struct ev_ctx *);
  */
 void ev_stop(struct ev_ctx *);
 
+/*
+ * Set a probe to be called at the end of every loop cycle with the time, in
+ * nanoseconds, spent waiting for events in ev_poll and the time spent running
+ * the callbacks of the events fired. NULL disables it, the clock isn't read
+ * at all then.
+ */
+void ev_set_probe(struct ev_ctx *,
+                  void (*)(struct ev_ctx *, unsigned long long,
+                           unsigned long long));
+
 /*
  * Add a single FD to the underlying backend of the event loop. Equal to
  * ev_fire_event just without an event to be carried. Useful to add simple
@@ -136,6 +172,25 @@ int ev_register_cron(struct ev_ctx *,
                      void *,
                      long long, long long);
 
+/*
+ * Initialize a timer with the callback to be executed on expiration, it
+ * doesn't schedule it.
+ */
+void ev_timer_init(struct ev_timer *,
+                   void (*callback)(struct ev_ctx *, void *), void *);
+
+/*
+ * Schedule a timer to expire after a number of seconds on the wheel of the
+ * context, rescheduling it if already present. Callbacks are executed on the
+ * context thread and they can only reschedule or delete the timer being fired.
+ */
+int ev_timer_add(struct ev_ctx *, struct ev_timer *, time_t);
+
+/*
+ * Remove a timer from the wheel it's scheduled on, no-op if it's not
+ */
+void ev_timer_del(struct ev_timer *);
+
 /*
  * Register a new event for the next loop cycle to a FD. Equal to ev_watch_fd
  * but allow to carry an event object for the next cycle.
@@ -33,6 +33,9 @@
 #include "logging.h"
 #include "handlers.h"
 #include "sol_internal.h"
+#include "trace.h"
+#include "wal.h"
+#include "retained.h"
 
 /* Prototype for a command handler */
 typedef int handler(struct io_event *);
@@ -51,12 +54,52 @@ static int pingreq_handler(struct io_event *);
 
 static void session_init(struct client_session *, const char *);
 
+static void session_unsubscribe_all(struct client_session *);
+
 static struct client_session *client_session_alloc(const char *);
 
 static unsigned next_free_mid(struct client_session *);
 
 static void inflight_msg_init(struct inflight_msg *, struct mqtt_packet *);
 
+static int session_enqueue(struct client_session *,
+                           struct mqtt_packet *, unsigned char, size_t);
+
+/*
+ * Slow operations reports are limited to one per interval, in seconds, for
+ * each loop thread, a stalled loop would otherwise flood the log
+ */
+#define SLOW_OP_LOG_INTERVAL 1
+
+/*
+ * What the running handler is working on, filled along the way by the
+ * handlers involving a topic, reported in case they turn out to be slow
+ */
+static _Thread_local struct {
+    const struct topic *topic;
+    int subscribers;
+} op_context;
+
+/* Rate limiting of the slow operations reports of the calling thread */
+static _Thread_local time_t slow_op_logged;
+static _Thread_local size_t slow_op_suppressed;
+
+/* Highest write-ahead log sequence number recorded by the packet handled */
+static _Thread_local uint64_t op_lsn;
+
+/*
+ * An ack to a publisher held back till the records of its message reach the
+ * disk, in group durability mode
+ */
+struct held_ack {
+    uint64_t lsn;
+    unsigned short pkt_id;
+    unsigned char type;
+};
+
+/* Clients of the calling loop with acks held back, see release_held_acks */
+static _Thread_local List *held_clients;
+
 /* Command handler mapped usign their position paired with their type */
 static handler *handlers[15] = {
     NULL,
@@ -82,15 +125,35 @@ static handler *handlers[15] = {
  * =========================
  */
 
+static int queued_msg_destructor(struct list_node *node) {
+    if (!node)
+        return -SOL_ERR;
+    struct queued_msg *qmsg = node->data;
+    STAT_DEC(queued_messages);
+    STAT_SUB(queued_bytes, qmsg->size);
+    DECREF(qmsg->packet, struct mqtt_packet);
+    free_memory(qmsg);
+    free_memory(node);
+    return SOL_OK;
+}
+
 static void session_free(const struct ref *refcount) {
     struct client_session *session =
         container_of(refcount, struct client_session, refcount);
+    // A newer session may have taken over the ID already
+    struct client_id *id = client_id_get(session->handle);
+    if (id->session == session)
+        id->session = NULL;
+    client_id_release(session->handle);
     list_destroy(session->subscriptions, 0);
     list_destroy(session->outgoing_msgs, 0);
+    spill_clear(&session->spilled);
     if (has_inflight(session)) {
         for (int i = 0; i < MAX_INFLIGHT_MSGS; ++i) {
-            if (session->i_msgs[i].packet)
+            if (session->i_msgs[i].packet) {
                 DECREF(session->i_msgs[i].packet, struct mqtt_packet);
+                STAT_DEC(inflight_messages);
+            }
         }
     }
     free_memory(session->i_acks);
@@ -102,8 +165,12 @@ static void session_init(struct client_session *session, const char *session_id)
     session->inflights = ATOMIC_VAR_INIT(0);
     session->next_free_mid = 1;
     session->subscriptions = list_new(NULL);
-    session->outgoing_msgs = list_new(NULL);
-    snprintf(session->session_id, MQTT_CLIENT_ID_LEN, "%s", session_id);
+    session->outgoing_msgs = list_new(queued_msg_destructor);
+    session->outgoing_bytes = 0;
+    session->spilled = (struct spill_queue) { 0 };
+    session->handle = client_id_intern(session_id);
+    session->session_id = client_id_get(session->handle)->id;
+    client_id_get(session->handle)->session = session;
     session->i_acks = try_calloc(MAX_INFLIGHT_MSGS, sizeof(time_t));
     session->i_msgs = try_calloc(MAX_INFLIGHT_MSGS, sizeof(struct inflight_msg));
     session->refcount = (struct ref) { session_free, 0 };
@@ -121,43 +188,458 @@ static inline unsigned next_free_mid(struct client_session *session) {
     return session->next_free_mid++;
 }
 
+/*
+ * Check if a session can't take another inflight message, either its receive
+ * window is full or the next identifier, once wrapped around, is still held
+ * by a message not acknowledged yet
+ */
+static inline bool session_window_full(const struct client_session *s) {
+    unsigned mid = s->next_free_mid == MAX_INFLIGHT_MSGS ? 1 : s->next_free_mid;
+    return s->inflights >= conf->max_inflight_messages
+        || s->i_msgs[mid].packet != NULL;
+}
+
 static inline void inflight_msg_init(struct inflight_msg *imsg,
                                      struct mqtt_packet *p) {
-    imsg->seen = time(NULL);
+    imsg->sent = clock_ns();
     imsg->packet = p;
     imsg->qos = p->header.bits.qos;
 }
 
+/*
+ * Record a change to a persistent session in the write-ahead log, clean
+ * sessions don't outlive their connection and are never recorded. Messages
+ * are recorded with their topic and payload, the QoS is the one granted.
+ */
+static void session_log(const struct client_session *s, unsigned char type,
+                        const char *topic, unsigned char qos,
+                        unsigned short mid) {
+    if (!wal_enabled || s->clean_session == true)
+        return;
+    struct wal_record r = {
+        .type = type,
+        .qos = qos,
+        .mid = mid,
+        .session_id = s->session_id,
+        .topic = topic
+    };
+    uint64_t lsn = wal_append(&r);
+    if (lsn > op_lsn)
+        op_lsn = lsn;
+}
+
+static void session_log_msg(const struct client_session *s, unsigned char type,
+                            const struct mqtt_packet *pkt, unsigned char qos,
+                            unsigned short mid) {
+    if (!wal_enabled || s->clean_session == true)
+        return;
+    struct wal_record r = {
+        .type = type,
+        .qos = qos,
+        .mid = mid,
+        .session_id = s->session_id,
+        .topic = (const char *) pkt->publish.topic,
+        .payload = pkt->publish.payload,
+        .payloadlen = pkt->publish.payloadlen
+    };
+    uint64_t lsn = wal_append(&r);
+    if (lsn > op_lsn)
+        op_lsn = lsn;
+}
+
+/*
+ * Acks held back by a client are bounded to half of what its output buffer
+ * can hold, past that its reads are paused till they're down to half again,
+ * a slow or failing disk would hold them indefinitely otherwise.
+ */
+static inline size_t held_acks_max(void) {
+    return conf->max_request_size / MQTT_ACK_LEN / 2;
+}
+
+/*
+ * Hold back an ack till the write-ahead log is committed up to a sequence
+ * number, acks already held keep the following ones waiting as well, as
+ * they must be sent in the order the messages were received.
+ * Must be called by the loop owning the client.
+ */
+static void hold_ack(struct client *c, unsigned char type,
+                     unsigned short pkt_id, uint64_t lsn) {
+    if (!c->held_acks) {
+        c->held_acks = list_new(NULL);
+        if (!held_clients)
+            held_clients = list_new(NULL);
+        list_push_back(held_clients, c);
+    } else if (list_size(c->held_acks) > 0) {
+        const struct held_ack *last = c->held_acks->tail->data;
+        if (last->lsn > lsn)
+            lsn = last->lsn;
+    }
+    struct held_ack *ack = try_alloc(sizeof(*ack));
+    *ack = (struct held_ack) { .lsn = lsn, .pkt_id = pkt_id, .type = type };
+    list_push_back(c->held_acks, ack);
+    if (c->acks_blocked == false && list_size(c->held_acks) >= held_acks_max()) {
+        log_debug("Pausing %s, %lu acks held", c->client_id,
+                  list_size(c->held_acks));
+        c->acks_blocked = true;
+#if THREADSNR > 0
+        pthread_mutex_lock(&c->mutex);
+#endif
+        if (c->paused == PAUSE_NONE)
+            c->paused = PAUSE_REQUESTED;
+#if THREADSNR > 0
+        pthread_mutex_unlock(&c->mutex);
+#endif
+    }
+}
+
+static inline bool session_queue_full(const struct client_session *s,
+                                      size_t size) {
+    if (conf->max_queued_messages > 0
+        && queued_count(s) >= conf->max_queued_messages)
+        return true;
+    return conf->max_queued_bytes > 0
+        && s->outgoing_bytes + size > conf->max_queued_bytes;
+}
+
+/* Size of the message at the head of the queue of a session */
+static inline size_t session_head_size(const struct client_session *s) {
+    if (list_size(s->outgoing_msgs) > 0) {
+        const struct queued_msg *qmsg = s->outgoing_msgs->head->data;
+        return qmsg->size;
+    }
+    return spill_at(&s->spilled, 0)->size;
+}
+
+/*
+ * Drop the oldest message queued on a session, releasing the session reference
+ * to the packet, or the space on disk if spilled, and updating the byte budget
+ * of the queue.
+ */
+static void session_drop_oldest(struct client_session *s) {
+    size_t size = session_head_size(s);
+    if (list_size(s->outgoing_msgs) > 0) {
+        struct queued_msg *old = list_pop(s->outgoing_msgs);
+        DECREF(old->packet, struct mqtt_packet);
+        free_memory(old);
+    } else {
+        spill_pop(&s->spilled);
+    }
+    s->outgoing_bytes -= size;
+    STAT_DEC(queued_messages);
+    STAT_SUB(queued_bytes, size);
+    STAT_INC(queued_dropped);
+    log_debug("Dropping queued message for %s (%lu bytes)",
+              s->session_id, size);
+    session_log(s, WAL_DROP, NULL, 0, 0);
+}
+
+/*
+ * Spill a message to the tail of the queue of a session once the bytes it
+ * holds in memory pass the threshold, from then on every following message
+ * goes to disk as well to keep them in order, till the queue is drained.
+ * The message is written packed with the QoS granted, as it's going to be
+ * sent, but no identifier, assigned only as it goes inflight.
+ * Returns true if it has been spilled, false if it's to be kept in memory.
+ */
+static bool session_spill(struct client_session *s, struct mqtt_packet *pkt,
+                          unsigned char qos, size_t size) {
+    if (!spill_enabled || conf->queue_spill_threshold == 0)
+        return false;
+    if (s->spilled.count == 0 && s->outgoing_bytes + size
+        <= conf->queue_spill_threshold)
+        return false;
+    struct mqtt_packet copy = *pkt;
+    copy.header.bits.qos = qos;
+    copy.publish.pkt_id = 0;
+    size_t packed = mqtt_size(&copy, NULL);
+    unsigned char *buf = try_alloc(packed);
+    mqtt_pack(&copy, buf);
+    int err = spill_push(&s->spilled, buf, packed, qos);
+    free_memory(buf);
+    if (err < 0)
+        return false;
+    s->outgoing_bytes += packed;
+    STAT_INC(queued_messages);
+    STAT_ADD(queued_bytes, packed);
+    return true;
+}
+
+/*
+ * Read back a message spilled, as a new packet with no references taken.
+ * Returns NULL on errors.
+ */
+static struct mqtt_packet *spill_load(const struct spill_ref *ref) {
+    unsigned char *buf = try_alloc(ref->size);
+    struct mqtt_packet *pkt = NULL;
+    if (spill_read(ref, buf) < 0)
+        goto exit;
+    unsigned pos = 0;
+    size_t len = mqtt_decode_length(buf + 1, &pos);
+    pkt = mqtt_packet_alloc(*buf);
+    if (mqtt_unpack(buf + 1 + pos, pkt, *buf, len) != MQTT_OK) {
+        log_error("Corrupted spilled message (%u bytes)", ref->size);
+        INCREF(pkt, struct mqtt_packet);
+        DECREF(pkt, struct mqtt_packet);
+        pkt = NULL;
+    }
+exit:
+    free_memory(buf);
+    return pkt;
+}
+
+/*
+ * Append a message to the queue of a session, taking a reference to it unless
+ * it's spilled to disk
+ */
+static void session_push(struct client_session *s, struct mqtt_packet *pkt,
+                         unsigned char qos, size_t size) {
+    if (session_spill(s, pkt, qos, size) == true)
+        return;
+    struct queued_msg *qmsg = try_alloc(sizeof(*qmsg));
+    *qmsg = (struct queued_msg) { .size = size, .qos = qos, .packet = pkt };
+    INCREF(pkt, struct mqtt_packet);
+    list_push_back(s->outgoing_msgs, qmsg);
+    s->outgoing_bytes += size;
+    STAT_INC(queued_messages);
+    STAT_ADD(queued_bytes, size);
+}
+
+/*
+ * Move the message at the head of the queue of a session to the inflight
+ * ones under a message identifier, the queue reference to the packet is now
+ * owned by the inflight slot, a message spilled is read back in a new packet.
+ * Returns the size of the packed message, 0 if it couldn't be read back and
+ * has been dropped.
+ */
+static size_t session_dequeue(struct client_session *s, unsigned short mid) {
+    struct mqtt_packet *pkt = NULL;
+    unsigned char qos = 0;
+    size_t size = session_head_size(s);
+    if (list_size(s->outgoing_msgs) > 0) {
+        struct queued_msg *qmsg = list_pop(s->outgoing_msgs);
+        pkt = qmsg->packet;
+        qos = qmsg->qos;
+        free_memory(qmsg);
+    } else {
+        const struct spill_ref *ref = spill_at(&s->spilled, 0);
+        qos = ref->qos;
+        pkt = spill_load(ref);
+        if (pkt)
+            INCREF(pkt, struct mqtt_packet);
+        spill_pop(&s->spilled);
+    }
+    s->outgoing_bytes -= size;
+    STAT_DEC(queued_messages);
+    STAT_SUB(queued_bytes, size);
+    if (!pkt) {
+        STAT_INC(queued_dropped);
+        return 0;
+    }
+    pkt->header.bits.qos = qos;
+    pkt->publish.pkt_id = mid;
+    inflight_msg_init(&s->i_msgs[mid], pkt);
+    s->i_acks[mid] = time(NULL);
+    ++s->inflights;
+    STAT_INC(inflight_messages);
+    return size;
+}
+
+/*
+ * Release an inflight message once acknowledged, a duplicated or unexpected
+ * ack has no packet left to release. Returns true if there was one.
+ */
+static bool session_ack(struct client_session *s, unsigned short mid) {
+    s->i_acks[mid] = -1;
+    struct mqtt_packet *pkt = s->i_msgs[mid].packet;
+    if (!pkt)
+        return false;
+    STAT_DEC(inflight_messages);
+    /*
+     * Unlinked before being released, acks don't take the global lock and a
+     * snapshot may be forked meanwhile, it must never find the slot pointing
+     * to a packet already freed
+     */
+    s->i_msgs[mid].packet = NULL;
+    DECREF(pkt, struct mqtt_packet);
+    --s->inflights;
+    return true;
+}
+
+/*
+ * Enqueue a message to be delivered later to a session, enforcing the limits
+ * set by configuration on both the number of messages and the bytes held by
+ * the queue. If the queue is full, the configured policy decides if the
+ * oldest messages have to be dropped to make room for the new one or if the
+ * new one has to be refused.
+ * Returns SOL_OK if the message has been queued, -ERRQUEUEFULL otherwise.
+ */
+static int session_enqueue(struct client_session *s, struct mqtt_packet *pkt,
+                           unsigned char qos, size_t size) {
+    if (conf->queue_policy == SOL_QUEUE_DROP_OLDEST) {
+        while (has_queued(s) && session_queue_full(s, size))
+            session_drop_oldest(s);
+    }
+    if (session_queue_full(s, size)) {
+        log_debug("Queue full for %s, refusing message (%lu bytes)",
+                  s->session_id, size);
+        STAT_INC(queued_dropped);
+        return -ERRQUEUEFULL;
+    }
+    session_push(s, pkt, qos, size);
+    session_log_msg(s, WAL_ENQUEUE, pkt, qos, 0);
+    return SOL_OK;
+}
+
+/*
+ * Trim the queue of a session down to a maximum of `keep` messages, dropping
+ * the oldest ones first. Used to reclaim memory under pressure, the caller
+ * must hold the global mutex.
+ * Returns the number of messages dropped.
+ */
+size_t session_trim_queue(struct client_session *s, size_t keep) {
+    size_t dropped = 0;
+    while (queued_count(s) > keep) {
+        session_drop_oldest(s);
+        dropped++;
+    }
+    return dropped;
+}
+
+/*
+ * Write out the messages queued on the session of a client, up to the output
+ * high watermark, assigning them a message identifier and tracking them as
+ * inflight, till the receive window of the session is full. It's called
+ * after the CONNACK of a resuming session, then every time the socket has
+ * been completely flushed and every time an ack opens the window again, this
+ * way the backlog is paced by the writability of the socket and by the
+ * client instead of being copied all at once into the write buffer.
+ * Returns true if any message has been written.
+ */
+bool session_drain_queue(struct client *c) {
+    struct client_session *s = c->session;
+    unsigned short mid = 0;
+    bool written = false;
+#if THREADSNR > 0
+    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&c->mutex);
+#endif
+    while (has_queued(s) && session_window_full(s) == false) {
+        size_t head = session_head_size(s);
+        if (c->towrite > 0
+            && c->towrite + head > conf->output_high_watermark)
+            break;
+        if (c->towrite + head > conf->max_request_size) {
+            // Can't fit in the write buffer even when it's empty, drop it
+            if (c->towrite > 0)
+                break;
+            log_warning("Dropping queued message for %s, exceeds max "
+                        "request size (%lu bytes)", s->session_id, head);
+            session_drop_oldest(s);
+            continue;
+        }
+        mid = next_free_mid(s);
+        size_t size = session_dequeue(s, mid);
+        /*
+         * A spilled message that can't be read back is gone, it must be
+         * replayed as dropped, not as inflight under an identifier, which
+         * is given back
+         */
+        if (size == 0) {
+            s->next_free_mid = mid;
+            session_log(s, WAL_DROP, NULL, 0, 0);
+            continue;
+        }
+        session_log(s, WAL_DEQUEUE, NULL, 0, mid);
+        mqtt_pack(s->i_msgs[mid].packet, c->wbuf + c->towrite);
+        c->towrite += size;
+        written = true;
+        STAT_INC(messages_sent);
+        STAT_INC(packets_sent[PUBLISH]);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&c->mutex);
+    pthread_mutex_unlock(&mutex);
+#endif
+    return written;
+}
+
+/*
+ * Check if the output of a client has room for a packet of a given size, a
+ * client with an output above the high watermark is a slow consumer and keeps
+ * being considered as such till the pending bytes go down to the low
+ * watermark, the write buffer must be able to hold the packet as well.
+ * Must be called with the client lock held.
+ */
+static inline bool output_has_room(struct client *c, size_t size) {
+    if (c->towrite - c->wrote >= conf->output_high_watermark)
+        c->congested = true;
+    return c->congested == false && c->towrite + size <= conf->max_request_size;
+}
+
+/*
+ * Request the pause of the reads of a publisher feeding a slow consumer, it
+ * will be resumed as soon as the consumer output goes down to the low
+ * watermark. A publisher is paused by a single consumer at a time, as after
+ * the request no more packets are read from it.
+ * Must be called with the consumer lock held.
+ */
+static void pause_publisher(struct client *consumer, struct client *publisher) {
+    if (!publisher || publisher == consumer || !conf->pause_publishers)
+        return;
+#if THREADSNR > 0
+    pthread_mutex_lock(&publisher->mutex);
+#endif
+    if (publisher->paused == PAUSE_NONE) {
+        log_debug("Pausing %s, %s is a slow consumer",
+                  publisher->client_id, consumer->client_id);
+        publisher->paused = PAUSE_REQUESTED;
+        if (!consumer->blocked)
+            consumer->blocked = list_new(NULL);
+        list_push(consumer->blocked, publisher);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&publisher->mutex);
+#endif
+}
+
 /*
  * One of the two exposed functions of the module, it's also needed on server
  * module to publish periodic messages (e.g. $SOL stats). It's responsible
  * of the normal publish but also taking care of disconnected clients, enqueuing
  * packets and setting up inflight messages for QoS > 0.
- * Returns the number of publish done or an error code in case of conditions
- * that requires de-allocation of the pkt argument occurs.
+ * Slow consumers, those with an output above the high watermark, are spared
+ * of QoS 0 messages while QoS > 0 ones are queued on their session, the
+ * publisher, if any, may be paused as well.
+ * The caller is expected to hold a reference to the packet for the entire
+ * duration of the call, every subscriber tracking it takes its own.
+ * Returns the number of publish done or -ERRQUEUEFULL in case one or more
+ * offline sessions refused the message as their queue was full.
  */
-int publish_message(struct mqtt_packet *pkt, const struct topic *t) {
+int publish_message(struct mqtt_packet *pkt, const struct topic *t,
+                    struct client *publisher) {
 
-    bool all_at_most_once = true;
+    bool all_at_most_once = true, rejected = false, room = true;
+    uint64_t start = publisher ? clock_ns() : 0;
     size_t len = 0;
     unsigned short mid = 0;
     unsigned char qos = pkt->header.bits.qos;
 #if THREADSNR > 0
     pthread_mutex_lock(&mutex);
 #endif
-    int count = HASH_COUNT(t->subscribers);
+    int count = t->subscribers.size;
 
-    if (count == 0) {
-        INCREF(pkt, struct mqtt_packet);
+    if (count == 0)
         goto exit;
-    }
 
     // first run check
-    struct subscriber *sub, *dummy;
-    HASH_ITER(hh, t->subscribers, sub, dummy) {
-        struct client_session *s = sub->session;
-        struct client *sc = NULL;
-        HASH_FIND_STR(server.clients_map, s->session_id, sc);
+    const struct subscriber *subs = t->subscribers.items;
+    for (int i = 0; i < count; ++i) {
+        const struct subscriber *sub = &subs[i];
+        const struct client_id *id = client_id_get(sub->handle);
+        struct client_session *s = id->session;
+        struct client *sc = id->client;
+        if (!s)
+            continue;
         /*
          * Update QoS according to subscriber's one, following MQTT
          * rules: The min between the original QoS and the subscriber
@@ -174,30 +656,54 @@ int publish_message(struct mqtt_packet *pkt, const struct topic *t) {
          */
         pkt->publish.pkt_id = 0;
 
+        room = true;
+        if (sc && sc->online == true) {
+#if THREADSNR > 0
+            pthread_mutex_lock(&sc->mutex);
+#endif
+            room = output_has_room(sc, len);
+            if (room == false)
+                pause_publisher(sc, publisher);
+#if THREADSNR > 0
+            pthread_mutex_unlock(&sc->mutex);
+#endif
+        }
+
         /*
          * if QoS > 0 we set packet identifier and track the inflight
          * message, proceed with the publish towards online subscriber.
          */
         if (pkt->header.bits.qos > AT_MOST_ONCE) {
-            mid = next_free_mid(s);
-            pkt->publish.pkt_id = mid;
-            INCREF(pkt, struct mqtt_packet);
             /*
-             * If offline, we must enqueue messages in the inflight queue
-             * of the client, they will be sent out only in case of a
-             * clean_session == false connection
+             * If offline, we must enqueue messages in the outgoing queue
+             * of the session, they will be sent out only in case of a
+             * clean_session == false connection. The same goes if there's
+             * still a backlog to be written out, to preserve the ordering,
+             * if the subscriber is a slow consumer or if its receive window
+             * is full.
              */
-            if (!sc || sc->online == false) {
-                if (s->clean_session == false) {
-                    list_push(s->outgoing_msgs, pkt);
-                    all_at_most_once = false;
-                    INCREF(pkt, struct mqtt_packet);
-                    inflight_msg_init(&s->i_msgs[mid], pkt);
-                    s->i_acks[mid] = time(NULL);
-                    ++s->inflights;
+            if (!sc || sc->online == false || has_queued(s) || room == false
+                || session_window_full(s) == true) {
+                bool online = sc && sc->online == true;
+                if (s->clean_session == false || online == true) {
+                    if (session_enqueue(s, pkt,
+                                        pkt->header.bits.qos, len) == SOL_OK) {
+                        TRACE(publish__enqueue, online ? sc : NULL,
+                              s->session_id, t->name, pkt->header.bits.qos, 1);
+                        all_at_most_once = false;
+                    }
+                    else if (conf->queue_policy == SOL_QUEUE_REJECT)
+                        rejected = true;
+                    // Resuming client, wake it up to drain the backlog
+                    if (online == true && room == true
+                        && session_window_full(s) == false)
+                        enqueue_event_write(sc);
                 }
                 continue;
             }
+            mid = next_free_mid(s);
+            pkt->publish.pkt_id = mid;
+            INCREF(pkt, struct mqtt_packet);
 #if THREADSNR > 0
             pthread_mutex_lock(&sc->mutex);
 #endif
@@ -209,16 +715,28 @@ int publish_message(struct mqtt_packet *pkt, const struct topic *t) {
             inflight_msg_init(&sc->session->i_msgs[mid], pkt);
             sc->session->i_acks[mid] = time(NULL);
             ++sc->session->inflights;
+            session_log_msg(s, WAL_INFLIGHT, pkt, pkt->header.bits.qos, mid);
 #if THREADSNR > 0
             pthread_mutex_unlock(&sc->mutex);
 #endif
+            STAT_INC(inflight_messages);
             all_at_most_once = false;
+        } else if (room == false) {
+            // Slow consumer, QoS 0 messages can be safely dropped
+            log_debug("Dropping PUBLISH to %s, slow consumer", sc->client_id);
+            STAT_INC(messages_dropped);
+            continue;
         }
+        // Offline subscriber, QoS 0 messages are not queued
+        if (!sc || sc->online == false)
+            continue;
 #if THREADSNR > 0
         pthread_mutex_lock(&sc->mutex);
 #endif
         mqtt_pack(pkt, sc->wbuf + sc->towrite);
         sc->towrite += len;
+        TRACE(publish__enqueue, sc, sc->client_id, t->name,
+              pkt->header.bits.qos, 0);
 #if THREADSNR > 0
         pthread_mutex_unlock(&sc->mutex);
 #endif
@@ -226,7 +744,8 @@ int publish_message(struct mqtt_packet *pkt, const struct topic *t) {
         // Schedule a write for the current subscriber on the next event cycle
         enqueue_event_write(sc);
 
-        info.messages_sent++;
+        STAT_INC(messages_sent);
+        STAT_INC(packets_sent[PUBLISH]);
 
         log_debug("Sending PUBLISH to %s (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
                   sc->client_id,
@@ -242,58 +761,58 @@ int publish_message(struct mqtt_packet *pkt, const struct topic *t) {
     if (all_at_most_once == true)
         count = 0;
 
+    if (rejected == true)
+        count = -ERRQUEUEFULL;
+
 exit:
 
 #if THREADSNR > 0
     pthread_mutex_unlock(&mutex);
 #endif
+    // Inbound publishes only, internal ones would skew the figures
+    if (publisher)
+        STAT_LATENCY(LATENCY_PUBLISH, clock_ns() - start);
     return count;
 }
 
 /*
- * Check if a topic match a wildcard subscription. It works with + and # as
- * well
+ * Set the retained message of a topic, packed ready to be sent, into the
+ * mapped store when persistence is enabled, on the topic itself otherwise.
+ * A message with an empty payload clears it, as per MQTT specs.
+ * Must be called with the global lock held.
  */
-static inline int match_subscription(const char *topic,
-                                     const char *wtopic, bool multilevel) {
-    size_t len = strlen(wtopic);
-    int i = 0, j = 0;
-    bool found = false;
-    char *ptopic = (char *) topic;
-    /*
-     * Cycle through the wildcard topic, char by char, seeking for '+' char and
-     * at the same time assuring that every char is equal in the topic as well,
-     * we don't want to accept different topics
-     */
-    while (i < len && wtopic[i]) {
-        j = 0;
-        for (; i < len; ++i) {
-            if (wtopic[i] == '+') {
-                found = true;
-                break;
-            } else if (!ptopic || (wtopic[i] != ptopic[j])) {
-                return -SOL_ERR;
-            }
-            j++;
+static void topic_set_retained(struct topic *t, const struct mqtt_packet *pkt) {
+    size_t len = mqtt_size(pkt, NULL);
+    if (retained_store_enabled == true) {
+        if (pkt->publish.payloadlen == 0) {
+            retained_store_del(t->name);
+            return;
         }
-        /*
-         * Get a pointer to the next '/', called two times because we want to
-         * skip the first occurence, like foo/bar/baz, cause at this point we'
-         * re already at /bar/baz and we don't need a pointer to /bar/baz
-         * again
-         */
-        if (ptopic[0] == '/')
-            ptopic++;
-        ptopic = index(ptopic, '/');
-        if (ptopic[0] == '/')
-            ptopic = index(ptopic + 1, '/');
-        i++;
-    }
-    if (!found && ptopic && multilevel == true)
-        return SOL_OK;
-    if (ptopic && (ptopic[0] == '/' || ptopic[1] != '\0') && multilevel == false)
-        return -SOL_ERR;
-    return SOL_OK;
+        unsigned char *msg = try_alloc(len);
+        mqtt_pack(pkt, msg);
+        retained_store_put(t->name, msg, len);
+        free_memory(msg);
+        return;
+    }
+    free_memory(t->retained_msg);
+    t->retained_msg = NULL;
+    if (pkt->publish.payloadlen == 0)
+        return;
+    t->retained_msg = try_alloc(len);
+    mqtt_pack(pkt, t->retained_msg);
+}
+
+/*
+ * Get the packed retained message of a topic, if any, storing its size.
+ * Must be called with the global lock held.
+ */
+static const unsigned char *topic_retained(const struct topic *t,
+                                           size_t *len) {
+    if (retained_store_enabled == true)
+        return retained_store_get(t->name, len);
+    if (t->retained_msg)
+        *len = alloc_size(t->retained_msg);
+    return t->retained_msg;
 }
 
 /*
@@ -312,6 +831,7 @@ static void set_connack(struct client *c, unsigned char rc, unsigned sp) {
     };
     mqtt_pack(&response, c->wbuf + c->towrite);
     c->towrite += MQTT_ACK_LEN;
+    STAT_INC(packets_sent[CONNACK]);
 
     /*
      * If a session was present and the connected client have disabled the
@@ -321,20 +841,12 @@ static void set_connack(struct client *c, unsigned char rc, unsigned sp) {
     if (c->clean_session == false && sp == 1) {
         log_info("Resuming session for %s", c->client_id);
         /*
-         * If there's already some subscriptions and pending messages,
-         * empty the queue
+         * If there's already some subscriptions and pending messages, start
+         * draining the queue, the remaining part will follow as soon as the
+         * socket has been flushed
          */
-        // TODO check for write buffer size exceed
-        if (list_size(c->session->outgoing_msgs) > 0) {
-            size_t len = 0;
-            list_foreach(item, c->session->outgoing_msgs) {
-                len = mqtt_size(item->data, NULL);
-                mqtt_pack(item->data, c->wbuf + c->towrite);
-                c->towrite += len;
-            }
-            // We want to clean up the queue after the payload set
-            list_clear(c->session->outgoing_msgs, 0);
-        }
+        if (has_queued(c->session))
+            session_drain_queue(c);
     }
 }
 
@@ -354,6 +866,13 @@ static int connect_handler(struct io_event *e) {
         goto clientdc;
     }
 
+    /*
+     * Memory is about to be exhausted, refuse new connections till the
+     * pressure goes down
+     */
+    if (info.memory_level >= MEMORY_EXHAUSTED)
+        goto unavailable;
+
     /*
      * If allow_anonymous is false we need to check for an existing
      * username:password pair match in the authentications table
@@ -361,11 +880,28 @@ static int connect_handler(struct io_event *e) {
     if (conf->allow_anonymous == false) {
         if (c->bits.username == 0 || c->bits.password == 0)
             goto bad_auth;
-        else {
+        if (cc->auth) {
+            // Back from the auth pool, the password has been verified
+            bool verified = cc->auth->verified;
+            DECREF(cc->auth, struct auth_request);
+            cc->auth = NULL;
+            if (verified == false)
+                goto bad_auth;
+        } else {
+            const char *username = (const char *) c->payload.username;
+            const char *password = (const char *) c->payload.password;
             struct authentication *auth = NULL;
-            HASH_FIND_STR(server.auths, (char *) c->payload.username, auth);
-            if (!auth || !check_passwd((char *) c->payload.password, auth->salt))
+            HASH_FIND_STR(server.auths, username, auth);
+            if (!auth)
                 goto bad_auth;
+            /*
+             * Hashing the password is way too slow to be done on the loop,
+             * unless recently verified, it's left to the auth pool
+             */
+            if (!auth_cache_hit(username, password, auth->salt)) {
+                cc->auth = auth_request_new(username, password, auth->salt);
+                return DEFERRED;
+            }
         }
     }
 
@@ -386,20 +922,29 @@ static int connect_handler(struct io_event *e) {
      * Add the new connected client to the global map, if it is already
      * connected, kick him out accordingly to the MQTT v3.1.1 specs.
      */
-    snprintf(cc->client_id, MQTT_CLIENT_ID_LEN, "%s", c->payload.client_id);
+    cc->handle = client_id_intern((const char *) c->payload.client_id);
+    cc->client_id = client_id_get(cc->handle)->id;
 
 #if THREADSNR > 0
     pthread_mutex_lock(&mutex);
 #endif
     // First we check if a session is present
     HASH_FIND_STR(server.sessions, cc->client_id, cc->session);
-    if (cc->session && c->bits.clean_session == true)
-        // Clean session true, we have to clean old session, if any
+    if (cc->session && c->bits.clean_session == true) {
+        /*
+         * Clean session true, we have to clean old session, if any, its
+         * subscriptions would be delivered to the new one as they refer to
+         * the same client ID
+         */
+        session_log(cc->session, WAL_SESSION_DESTROY, NULL, 0, 0);
+        session_unsubscribe_all(cc->session);
         HASH_DEL(server.sessions, cc->session);
-    else if (cc->session)
+    } else if (cc->session) {
         session_present = 1;
+    }
 
     cc->connected = true;
+    cc->keepalive = c->payload.keepalive;
 
     log_info("New client connected as %s (c%i, k%u)",
              c->payload.client_id,
@@ -416,10 +961,16 @@ static int connect_handler(struct io_event *e) {
         HASH_ADD_STR(server.sessions, session_id, cc->session);
     }
 
+    // A new persistent session, or a clean one turning persistent
+    if (session_present == 0 || cc->session->clean_session == true) {
+        cc->session->clean_session = c->bits.clean_session;
+        session_log(cc->session, WAL_SESSION_CREATE, NULL, 0, 0);
+    }
     cc->session->clean_session = c->bits.clean_session;
 
-    // Let's track client on the global map to be used on publish
+    // Let's track client on the global map, its ID resolves to it on publish
     HASH_ADD_STR(server.clients_map, client_id, cc);
+    client_id_get(cc->handle)->client = cc;
 #if THREADSNR > 0
     pthread_mutex_unlock(&mutex);
 #endif
@@ -430,12 +981,16 @@ static int connect_handler(struct io_event *e) {
         const char *will_topic = (const char *) c->payload.will_topic;
         const char *will_message = (const char *) c->payload.will_message;
         // TODO check for will_topic != NULL
-        struct topic *t = topic_store_get_or_put(server.store, will_topic);
-        if (!topic_store_contains(server.store, t->name))
-            topic_store_put(server.store, t);
         // I'm sure that the string will be NUL terminated by unpack function
         size_t msg_len = strlen(will_message);
         size_t tpc_len = strlen(will_topic);
+        // Stored topics end with a '/', like the published ones
+        char will_key[tpc_len + 2];
+        snprintf(will_key, tpc_len + 2, "%s%s", will_topic,
+                 tpc_len && will_topic[tpc_len - 1] == '/' ? "" : "/");
+        struct topic *t = topic_store_get_or_put(server.store, will_key);
+        if (!topic_store_contains(server.store, t->name))
+            topic_store_put(server.store, t);
 
         cc->session->lwt_msg = (struct mqtt_packet) {
             .header = (union mqtt_header) { .byte = PUBLISH_B },
@@ -451,12 +1006,13 @@ static int connect_handler(struct io_event *e) {
         cc->session->lwt_msg.header.bits.qos = c->bits.will_qos;
         // We must store the retained message in the topic
         if (c->bits.will_retain == 1) {
-            size_t publen = mqtt_size(&cc->session->lwt_msg, NULL);
-            unsigned char *payload = try_alloc(publen);
-            mqtt_pack(&cc->session->lwt_msg, payload);
-            // We got a ready-to-be-sent bytestring in the retained message
-            // field
-            t->retained_msg = payload;
+#if THREADSNR > 0
+            pthread_mutex_lock(&mutex);
+#endif
+            topic_set_retained(t, &cc->session->lwt_msg);
+#if THREADSNR > 0
+            pthread_mutex_unlock(&mutex);
+#endif
         }
         log_info("Will message specified (%lu bytes)",
                  cc->session->lwt_msg.publish.payloadlen);
@@ -491,6 +1047,14 @@ not_authorized:
     set_connack(cc, MQTT_NOT_AUTHORIZED, session_present);
 
     return MQTT_NOT_AUTHORIZED;
+
+unavailable:
+    log_warning("Memory pressure, refusing connection from %s",
+                cc->conn.ip);
+    info.connections_rejected++;
+    set_connack(cc, MQTT_SERVER_UNAVAILABLE, session_present);
+
+    return MQTT_SERVER_UNAVAILABLE;
 }
 
 static int disconnect_handler(struct io_event *e) {
@@ -498,13 +1062,14 @@ static int disconnect_handler(struct io_event *e) {
     return -ERRCLIENTDC;
 }
 
-static inline void add_wildcard(const char *topic, struct subscriber *s,
-                                bool wildcard) {
+static inline void add_wildcard(const char *topic, uint32_t handle,
+                                unsigned char qos, bool wildcard) {
     struct subscription *subscription = try_alloc(sizeof(*subscription));
-    subscription->subscriber = s;
+    subscription->handle = handle;
+    subscription->granted_qos = qos;
     subscription->topic = try_strdup(topic);
     subscription->multilevel = wildcard;
-    INCREF(s, struct subscriber);
+    client_id_retain(handle);
     topic_store_add_wildcard(server.store, subscription);
 }
 
@@ -512,25 +1077,69 @@ static void recursive_sub(struct trie_node *node, void *arg) {
     if (!node || !node->data)
         return;
     struct topic *t = node->data;
+    const struct subscriber *s = arg;
+    struct client_session *session = client_id_session(s->handle);
+    topic_add_subscriber(t, s->handle, s->granted_qos);
+    log_debug("Adding subscriber %s to topic %s",
+              session->session_id, t->name);
+    list_push(session->subscriptions, t);
+}
+
+/*
+ * Subscribe a session to a topic filter, creating the topic if not present,
+ * a filter ending with "/#" subscribes to all the children topics as well
+ * while one with a single level wildcard '+' is matched on publish. Shared
+ * by the SUBSCRIBE handler and by the replay of the write-ahead log.
+ * Must be called with the global lock held.
+ * Returns the topic subscribed.
+ */
+static struct topic *session_subscribe(struct client_session *session,
+                                       const char *filter, size_t len,
+                                       unsigned char qos) {
+    bool wildcard = false;
+    char topic[len + 2];
+    snprintf(topic, len + 1, "%s", filter);
+    /* Recursive subscribe to all children topics if the topic ends with "/#" */
+    if (len > 1 && topic[len - 1] == '#' && topic[len - 2] == '/') {
+        topic[len - 1] = '\0';
+        wildcard = true;
+    } else if (len == 0 || topic[len - 1] != '/') {
+        topic[len] = '/';
+        topic[len + 1] = '\0';
+    }
+
+    struct topic *t = topic_store_get_or_put(server.store, topic);
     /*
-     * We need to make a copy of the subscriber cause UTHASH needs a proper
-     * handle to work correctly, otherwise we'll end up freeing the same
-     * refernce on disconnect and break the table
+     * Let's explore two possible scenarios:
+     * 1. Normal topic (no single level wildcard '+') which can end with
+     *    multilevel wildcard '#'
+     * 2. A topic contaning one or more single level wildcard '+'
      */
-    struct subscriber *s = subscriber_clone(arg), *tmp;
-    HASH_FIND_STR(t->subscribers, s->id, tmp);
-    if (!tmp) {
-        INCREF(s, struct subscriber);
-        HASH_ADD_STR(t->subscribers, id, s);
+    if (!index(topic, '+')) {
+        bool subscribed = is_subscribed(t, session->handle);
+        if (session->clean_session == true || !subscribed) {
+            struct subscriber sub =
+                *topic_add_subscriber(t, session->handle, qos);
+            list_push(session->subscriptions, t);
+            if (wildcard == true) {
+                add_wildcard(topic, session->handle, qos, wildcard);
+                topic_store_map(server.store, topic, recursive_sub, &sub);
+            }
+        }
+    } else {
+        /*
+         * Here we encountered at least 1 single level wildcard '+', we add
+         * the topic to the wildcards list as we can't know at this point
+         * which topic it will match
+         */
+        add_wildcard(topic, session->handle, qos, wildcard);
     }
-    log_debug("Adding subscriber %s to topic %s",
-              s->session->session_id, t->name);
-    list_push(s->session->subscriptions, t);
+    t->last_seen = time(NULL);
+    return t;
 }
 
 static int subscribe_handler(struct io_event *e) {
 
-    bool wildcard = false;
     struct mqtt_subscribe *s = &e->data.subscribe;
 
     /*
@@ -545,73 +1154,30 @@ static int subscribe_handler(struct io_event *e) {
 
         log_debug("Received SUBSCRIBE from %s", c->client_id);
 
-        /*
-         * Check if the topic exists already or in case create it and store in
-         * the global map
-         */
-        char topic[s->tuples[i].topic_len + 2];
-        snprintf(topic, s->tuples[i].topic_len + 1, "%s", s->tuples[i].topic);
-
-        log_debug("\t%s (QoS %i)", topic, s->tuples[i].qos);
-        /* Recursive subscribe to all children topics if the topic ends with "/#" */
-        if (topic[s->tuples[i].topic_len - 1] == '#' &&
-            topic[s->tuples[i].topic_len - 2] == '/') {
-            topic[s->tuples[i].topic_len - 1] = '\0';
-            wildcard = true;
-        } else if (topic[s->tuples[i].topic_len - 1] != '/') {
-            topic[s->tuples[i].topic_len] = '/';
-            topic[s->tuples[i].topic_len + 1] = '\0';
-        }
-
-        struct topic *t = topic_store_get_or_put(server.store, topic);
-        /*
-         * Let's explore two possible scenarios:
-         * 1. Normal topic (no single level wildcard '+') which can end with
-         *    multilevel wildcard '#'
-         * 2. A topic contaning one or more single level wildcard '+'
-         */
+        const char *filter = (const char *) s->tuples[i].topic;
+        log_debug("\t%s (QoS %i)", filter, s->tuples[i].qos);
 #if THREADSNR > 0
         pthread_mutex_lock(&c->mutex);
         pthread_mutex_lock(&mutex);
 #endif
-        if (!index(topic, '+')) {
-            struct subscriber *tmp;
-            HASH_FIND_STR(t->subscribers, c->client_id, tmp);
-            if (c->clean_session == true || !tmp) {
-                if (!tmp) {
-                    tmp = topic_add_subscriber(t, e->client->session,
-                                               s->tuples[i].qos);
-                    // we increment reference for the subscriptions session
-                    INCREF(tmp, struct subscriber);
-                }
-                list_push(e->client->session->subscriptions, t);
-                if (wildcard == true) {
-                    add_wildcard(topic, tmp, wildcard);
-                    topic_store_map(server.store, topic, recursive_sub, tmp);
-                }
-            }
-        } else {
-            /*
-             * Here we encountered at least 1 single level wildcard '+', we add
-             * the topic to the wildcards list as we can't know at this point
-             * which topic it will match
-             */
-            struct subscriber *sub = subscriber_new(e->client->session,
-                                                    s->tuples[i].qos);
-            add_wildcard(topic, sub, wildcard);
-        }
-#if THREADSNR > 0
-        pthread_mutex_unlock(&mutex);
-#endif
+        struct topic *t = session_subscribe(c->session, filter,
+                                            s->tuples[i].topic_len,
+                                            s->tuples[i].qos);
+        session_log(c->session, WAL_SUBSCRIBE, filter, s->tuples[i].qos, 0);
+        op_context.topic = t;
+        op_context.subscribers = t->subscribers.size;
 
         // Retained message? Publish it
         // TODO move after SUBACK response
-        if (t->retained_msg) {
-            size_t len = alloc_size(t->retained_msg);
-            memcpy(c->wbuf + c->towrite, t->retained_msg, len);
+        size_t len = 0;
+        const unsigned char *retained = topic_retained(t, &len);
+        if (retained) {
+            memcpy(c->wbuf + c->towrite, retained, len);
             c->towrite += len;
+            STAT_INC(packets_sent[PUBLISH]);
         }
 #if THREADSNR > 0
+        pthread_mutex_unlock(&mutex);
         pthread_mutex_unlock(&c->mutex);
 #endif
         rcs[i] = s->tuples[i].qos;
@@ -631,6 +1197,7 @@ static int subscribe_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
+    STAT_INC(packets_sent[SUBACK]);
 
     log_debug("Sending SUBACK to %s", c->client_id);
 
@@ -639,6 +1206,29 @@ static int subscribe_handler(struct io_event *e) {
     return REPLY;
 }
 
+/*
+ * Remove a session from the subscribers of a topic, the counterpart of
+ * session_subscribe, must be called with the global lock held.
+ */
+static void session_unsubscribe(struct client_session *session,
+                                const char *filter) {
+    struct topic *t = topic_store_get(server.store, filter);
+    if (!t)
+        return;
+    topic_del_subscriber(t, session->handle);
+}
+
+/*
+ * Remove a session from all the topics and wildcards it's subscribed to, must
+ * be called with the global lock held.
+ */
+static void session_unsubscribe_all(struct client_session *session) {
+    topic_store_remove_wildcard(server.store, session->handle);
+    list_foreach(item, session->subscriptions) {
+        topic_del_subscriber(item->data, session->handle);
+    }
+}
+
 static int unsubscribe_handler(struct io_event *e) {
 
     struct client *c = e->client;
@@ -649,12 +1239,11 @@ static int unsubscribe_handler(struct io_event *e) {
     pthread_mutex_lock(&c->mutex);
     pthread_mutex_lock(&mutex);
 #endif
-    struct topic *t = NULL;
     for (int i = 0; i < e->data.unsubscribe.tuples_len; ++i) {
-        t = topic_store_get(server.store,
-                            (const char *) e->data.unsubscribe.tuples[i].topic);
-        if (t)
-            topic_del_subscriber(t, c);
+        const char *filter =
+            (const char *) e->data.unsubscribe.tuples[i].topic;
+        session_unsubscribe(c->session, filter);
+        session_log(c->session, WAL_UNSUBSCRIBE, filter, 0, 0);
     }
 #if THREADSNR > 0
     pthread_mutex_unlock(&mutex);
@@ -666,6 +1255,8 @@ static int unsubscribe_handler(struct io_event *e) {
     pthread_mutex_unlock(&c->mutex);
 #endif
 
+    STAT_INC(packets_sent[UNSUBACK]);
+
     log_debug("Sending UNSUBACK to %s", c->client_id);
 
     mqtt_packet_destroy(&e->data);
@@ -673,6 +1264,35 @@ static int unsubscribe_handler(struct io_event *e) {
     return REPLY;
 }
 
+/*
+ * Resolve the topic of a PUBLISH, looking first at the last topics the client
+ * published to, a miss is looked up in the store and replaces the entry of
+ * the cache with the same hash. Must be called with the global lock held.
+ */
+static struct topic *publisher_topic(struct client *c,
+                                     const struct mqtt_publish *p,
+                                     uint32_t hash) {
+    size_t len = p->topiclen;
+    /*
+     * For convenience we assure that all topics ends with a '/', indicating a
+     * hierarchical level, whether the publisher sent one or not
+     */
+    if (p->topic[len - 1] == '/')
+        len--;
+    struct topic **slot = &c->topics[hash & (CLIENT_TOPIC_CACHE - 1)];
+    struct topic *t = *slot;
+    if (t && t->hash == hash && t->len == len + 1
+        && memcmp(t->name, p->topic, len) == 0)
+        return t;
+    char topic[len + 2];
+    memcpy(topic, p->topic, len);
+    topic[len] = '/';
+    topic[len + 1] = '\0';
+    t = topic_store_get_or_put(server.store, topic);
+    *slot = t;
+    return t;
+}
+
 static int publish_handler(struct io_event *e) {
 
     struct client *c = e->client;
@@ -689,82 +1309,100 @@ static int publish_handler(struct io_event *e) {
               p->topic,
               p->payloadlen);
 
-    info.messages_recv++;
+    STAT_INC(messages_recv);
 
-    char topic[p->topiclen + 2];
     unsigned char qos = hdr->bits.qos;
-
-    /*
-     * For convenience we assure that all topics ends with a '/', indicating a
-     * hierarchical level
-     */
-    if (p->topic[p->topiclen - 1] != '/')
-        snprintf(topic, p->topiclen + 2, "%s/", (const char *) p->topic);
-    else
-        snprintf(topic, p->topiclen + 1, "%s", (const char *) p->topic);
+    uint32_t hash = topic_hash((const char *) p->topic, p->topiclen);
 
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
     pthread_mutex_lock(&mutex);
 #endif
     /*
-     * Retrieve the topic from the global map, if it wasn't created before,
-     * create a new one with the name selected
+     * Retrieve the topic from the cache of the client first, then from the
+     * global map, if it wasn't created before, create a new one with the name
+     * selected
      */
-    struct topic *t = topic_store_get_or_put(server.store, topic);
+    struct topic *t = publisher_topic(c, p, hash);
 
-    /* Check for # wildcards subscriptions */
-    if (topic_store_wildcards_empty(server.store)) {
+    /*
+     * Check for wildcards subscriptions, unless the topic has already been
+     * matched against all of them
+     */
+    if (t->wildcards_gen != server.store->wildcards_gen) {
         topic_store_wildcards_foreach(item, server.store) {
             struct subscription *s = item->data;
-            int matched = match_subscription(topic, s->topic, s->multilevel);
-            if (matched == SOL_OK && !is_subscribed(t, s->subscriber->session)) {
-                /*
-                 * We need to make a copy of the subscriber cause UTHASH needs
-                 * a proper handle to work correctly, otherwise we'll end up
-                 * freeing the same refernce on disconnect and break the table
-                 */
-                struct subscriber *copy = subscriber_clone(s->subscriber);
-                INCREF(copy, struct subscriber);
-                HASH_ADD_STR(t->subscribers, id, copy);
-                list_push(s->subscriber->session->subscriptions, t);
+            int matched = match_subscription(t->name, s->topic, s->multilevel);
+            if (matched == SOL_OK && !is_subscribed(t, s->handle)) {
+                topic_add_subscriber(t, s->handle, s->granted_qos);
+                list_push(client_id_session(s->handle)->subscriptions, t);
             }
         }
+        t->wildcards_gen = server.store->wildcards_gen;
     }
+
+    t->last_seen = time(NULL);
+    op_context.topic = t;
+    op_context.subscribers = t->subscribers.size;
+
+    /*
+     * Retained messages are accessed under the global lock, as they can be
+     * evicted at any time under memory pressure
+     */
+    if (hdr->bits.retain == 1)
+        topic_set_retained(t, &e->data);
 #if THREADSNR > 0
     pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&c->mutex);
 #endif
 
     struct mqtt_packet *pkt = mqtt_packet_alloc(e->data.header.byte);
     // TODO must perform a deep copy here
     pkt->publish = e->data.publish;
+    INCREF(pkt, struct mqtt_packet);
 
-    if (hdr->bits.retain == 1) {
-        t->retained_msg = try_alloc(mqtt_size(&e->data, NULL));
-        mqtt_pack(&e->data, t->retained_msg);
-    }
-#if THREADSNR > 0
-    pthread_mutex_unlock(&c->mutex);
-#endif
-
-    if (publish_message(pkt, t) == 0)
-        DECREF(pkt, struct mqtt_packet);
+    op_lsn = 0;
+    int rc = publish_message(pkt, t, c);
+    DECREF(pkt, struct mqtt_packet);
 
     // We have to answer to the publisher
     if (qos == AT_MOST_ONCE)
         goto exit;
 
+    /*
+     * Some offline session refused the message as its queue was full, by
+     * withholding the ACK the publisher will have to re-send it later
+     */
+    if (rc == -ERRQUEUEFULL) {
+        log_debug("Withholding ACK to %s (m%u), queue full",
+                  c->client_id, orig_mid);
+        goto exit;
+    }
+
     int ptype = qos == EXACTLY_ONCE ? PUBREC : PUBACK;
 
+    mqtt_ack(&e->data, ptype == PUBACK ? PUBACK_B : PUBREC_B);
+    /*
+     * The message has been recorded for some persistent session, the ack
+     * can't get to the publisher before the record is on disk
+     */
+    if ((c->held_acks && list_size(c->held_acks) > 0)
+        || !wal_durable(op_lsn)) {
+        log_debug("Holding %s to %s (m%u) till commit",
+                  ptype == PUBACK ? "PUBACK" : "PUBREC", c->client_id, orig_mid);
+        hold_ack(c, ptype, orig_mid, op_lsn);
+        return NOREPLY;
+    }
+
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
 #endif
-    mqtt_ack(&e->data, ptype == PUBACK ? PUBACK_B : PUBREC_B);
     mqtt_pack_mono(c->wbuf + c->towrite, ptype, orig_mid);
     c->towrite += MQTT_ACK_LEN;
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
+    STAT_INC(packets_sent[ptype]);
     log_debug("Sending %s to %s (m%u)",
               ptype == PUBACK ? "PUBACK" : "PUBREC", c->client_id, orig_mid);
     return REPLY;
@@ -785,13 +1423,17 @@ static int puback_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
 #endif
-    inflight_msg_clear(&c->session->i_msgs[pkt_id]);
-    c->session->i_msgs[pkt_id].packet = NULL;
-    c->session->i_acks[pkt_id] = -1;
-    --c->session->inflights;
+    if (c->session->i_msgs[pkt_id].packet)
+        STAT_LATENCY(LATENCY_PUBACK,
+                     clock_ns() - c->session->i_msgs[pkt_id].sent);
+    if (session_ack(c->session, pkt_id))
+        session_log(c->session, WAL_ACK, NULL, 0, pkt_id);
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
+    // The window has room again, the backlog can go on
+    if (has_queued(c->session) && session_drain_queue(c) == true)
+        return REPLY;
     return NOREPLY;
 }
 
@@ -809,6 +1451,7 @@ static int pubrec_handler(struct io_event *e) {
 #endif
     // Update inflight acks table
     c->session->i_acks[pkt_id] = time(NULL);
+    STAT_INC(packets_sent[PUBREL]);
     log_debug("Sending PUBREL to %s (m%u)", c->client_id, pkt_id);
     return REPLY;
 }
@@ -825,6 +1468,7 @@ static int pubrel_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
+    STAT_INC(packets_sent[PUBCOMP]);
     log_debug("Sending PUBCOMP to %s (m%u)", c->client_id, pkt_id);
     return REPLY;
 }
@@ -836,13 +1480,14 @@ static int pubcomp_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
 #endif
-    c->session->i_acks[pkt_id] = -1;
-    inflight_msg_clear(&c->session->i_msgs[pkt_id]);
-    c->session->i_msgs[pkt_id].packet = NULL;
-    --c->session->inflights;
+    if (session_ack(c->session, pkt_id))
+        session_log(c->session, WAL_ACK, NULL, 0, pkt_id);
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
+    // The window has room again, the backlog can go on
+    if (has_queued(c->session) && session_drain_queue(c) == true)
+        return REPLY;
     return NOREPLY;
 }
 
@@ -857,14 +1502,399 @@ static int pingreq_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_unlock(&e->client->mutex);
 #endif
+    STAT_INC(packets_sent[PINGRESP]);
     log_debug("Sending PINGRESP to %s", e->client->client_id);
     return REPLY;
 }
 
+/*
+ * Report a handler that ran past slow_op_threshold, with the topic and the
+ * number of its subscribers if there was one involved
+ */
+static void slow_op_report(unsigned type, const struct client *c,
+                           uint64_t elapsed) {
+    time_t now = time(NULL);
+    if (now - slow_op_logged < SLOW_OP_LOG_INTERVAL) {
+        ++slow_op_suppressed;
+        return;
+    }
+    slow_op_logged = now;
+    if (op_context.topic)
+        log_warning("Slow %s from %s: %.3fms on %s (%d subscribers), "
+                    "%lu more unreported", packet_names[type], c->client_id,
+                    elapsed / 1e6, op_context.topic->name,
+                    op_context.subscribers, slow_op_suppressed);
+    else
+        log_warning("Slow %s from %s: %.3fms, %lu more unreported",
+                    packet_names[type], c->client_id, elapsed / 1e6,
+                    slow_op_suppressed);
+    slow_op_suppressed = 0;
+}
+
 /*
  * This is the only public API we expose from this module beside
- * publish_message. It just give access to handlers mapped by message type.
+ * publish_message and session_drain_queue. It just give access to handlers
+ * mapped by message type, accounting the time spent in each of them to the
+ * calling loop thread.
  */
 int handle_command(unsigned type, struct io_event *event) {
-    return handlers[type](event);
+    op_context.topic = NULL;
+    uint64_t start = clock_ns();
+    int rc = handlers[type](event);
+    uint64_t elapsed = clock_ns() - start;
+    STAT_INC(handler_calls[type]);
+    STAT_ADD(handler_ns[type], elapsed);
+    if (conf->slow_op_threshold > 0
+        && elapsed >= conf->slow_op_threshold * 1000000) {
+        STAT_INC(handler_slow[type]);
+        slow_op_report(type, event->client, elapsed);
+    }
+    return rc;
+}
+
+/*
+ * Rebuild a message recorded in the write-ahead log, every session replayed
+ * gets a copy of its own, at runtime they're shared by all the subscribers
+ */
+static struct mqtt_packet *replay_packet(const struct wal_record *r,
+                                         unsigned short mid) {
+    struct mqtt_packet *pkt = mqtt_packet_alloc(PUBLISH_B);
+    pkt->header.bits.qos = r->qos;
+    unsigned char *payload = try_alloc(r->payloadlen + 1);
+    memcpy(payload, r->payload, r->payloadlen);
+    payload[r->payloadlen] = '\0';
+    pkt->publish = (struct mqtt_publish) {
+        .pkt_id = mid,
+        .topiclen = strlen(r->topic),
+        .topic = (unsigned char *) try_strdup(r->topic),
+        .payloadlen = r->payloadlen,
+        .payload = payload
+    };
+    return pkt;
+}
+
+/*
+ * Drop a replayed session with all its subscriptions, the outcome of a
+ * CONNECT with clean session set over a persistent one
+ */
+static void replay_discard(struct client_session **sessions,
+                           struct client_session *s) {
+#if THREADSNR > 0
+    pthread_mutex_lock(&mutex);
+#endif
+    session_unsubscribe_all(s);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    HASH_DEL(*sessions, s);
+    DECREF(s, struct client_session);
+}
+
+/*
+ * Apply a record of the write-ahead log to the sessions map of a recovery
+ * shard, called at startup for every record of the sessions of the shard in
+ * order, before accepting any connection. Replayed sessions are offline, the
+ * messages they were waiting an ack for are retransmitted like any other
+ * once the client resumes them. A slot still in use when reassigned means
+ * its ack went lost with the crash. Shards are replayed concurrently, the
+ * topic store is shared and only touched with the global lock held.
+ */
+static int session_replay(const struct wal_record *r, void *arg) {
+    struct client_session **sessions = arg;
+    struct client_session *s = NULL;
+    struct mqtt_packet *pkt = NULL;
+    HASH_FIND_STR(*sessions, r->session_id, s);
+    if (r->type == WAL_SESSION_CREATE) {
+        if (s)
+            replay_discard(sessions, s);
+        s = client_session_alloc(r->session_id);
+        s->clean_session = false;
+        INCREF(s, struct client_session);
+        HASH_ADD_STR(*sessions, session_id, s);
+        return SOL_OK;
+    }
+    // Records of a session already discarded, nothing left to apply
+    if (!s)
+        return SOL_OK;
+    switch (r->type) {
+        case WAL_SESSION_DESTROY:
+            replay_discard(sessions, s);
+            break;
+        case WAL_SUBSCRIBE:
+#if THREADSNR > 0
+            pthread_mutex_lock(&mutex);
+#endif
+            session_subscribe(s, r->topic, strlen(r->topic), r->qos);
+#if THREADSNR > 0
+            pthread_mutex_unlock(&mutex);
+#endif
+            break;
+        case WAL_UNSUBSCRIBE:
+#if THREADSNR > 0
+            pthread_mutex_lock(&mutex);
+#endif
+            session_unsubscribe(s, r->topic);
+#if THREADSNR > 0
+            pthread_mutex_unlock(&mutex);
+#endif
+            break;
+        case WAL_ENQUEUE:
+            pkt = replay_packet(r, 0);
+            // Released right away if spilled, the queue holds no reference
+            INCREF(pkt, struct mqtt_packet);
+            session_push(s, pkt, r->qos, mqtt_size(pkt, NULL));
+            DECREF(pkt, struct mqtt_packet);
+            break;
+        case WAL_DEQUEUE:
+            session_ack(s, r->mid);
+            if (has_queued(s))
+                session_dequeue(s, r->mid);
+            s->next_free_mid = r->mid + 1;
+            break;
+        case WAL_DROP:
+            if (has_queued(s))
+                session_drop_oldest(s);
+            break;
+        case WAL_INFLIGHT:
+            session_ack(s, r->mid);
+            pkt = replay_packet(r, r->mid);
+            INCREF(pkt, struct mqtt_packet);
+            inflight_msg_init(&s->i_msgs[r->mid], pkt);
+            s->i_acks[r->mid] = time(NULL);
+            ++s->inflights;
+            STAT_INC(inflight_messages);
+            s->next_free_mid = r->mid + 1;
+            break;
+        case WAL_ACK:
+            session_ack(s, r->mid);
+            break;
+        default:
+            log_warning("Unknown write-ahead log record type %u", r->type);
+            return -SOL_ERR;
+    }
+    return SOL_OK;
+}
+
+/*
+ * Replay either the log in a directory or a snapshot read from a descriptor,
+ * spread over a number of threads, one per shard of the sessions. Every shard
+ * collects its sessions in a map of its own, merged in the global one once
+ * all of them are done.
+ */
+static long session_rebuild(const char *dir, int fd, unsigned threads,
+                            uint64_t *last) {
+    struct client_session *shards[threads], *s, *tmp;
+    void *args[threads];
+    for (unsigned i = 0; i < threads; ++i) {
+        shards[i] = NULL;
+        args[i] = &shards[i];
+    }
+    long records = dir
+        ? wal_replay_sharded(dir, threads, session_replay, args, last)
+        : wal_replay_snapshot(fd, threads, session_replay, args, last);
+    for (unsigned i = 0; i < threads; ++i) {
+        HASH_ITER(hh, shards[i], s, tmp) {
+            HASH_DEL(shards[i], s);
+            HASH_ADD_STR(server.sessions, session_id, s);
+        }
+    }
+    return records;
+}
+
+/*
+ * Rebuild the persistent sessions from the snapshot and the write-ahead log
+ * in a directory.
+ * Returns the number of records replayed, -1 on error, storing the sequence
+ * number of the last one in the last pointer.
+ */
+long session_recover(const char *dir, unsigned threads, uint64_t *last) {
+    return session_rebuild(dir, -1, threads, last);
+}
+
+/*
+ * Rebuild the sessions handed over by the process being upgraded, all of
+ * them, the clean ones of the connections handed over as well, from the
+ * snapshot it wrote to a descriptor.
+ */
+long session_restore(int fd, unsigned threads, uint64_t *last) {
+    return session_rebuild(NULL, fd, threads, last);
+}
+
+/* Write a record of a session to a snapshot, like session_log does to the log */
+static int snapshot_record(struct wal_snapshot *snap,
+                           const struct client_session *s, unsigned char type,
+                           const char *topic, unsigned char qos,
+                           unsigned short mid, const struct mqtt_packet *pkt) {
+    struct wal_record r = {
+        .type = type,
+        .qos = qos,
+        .mid = mid,
+        .session_id = s->session_id,
+        .topic = pkt ? (const char *) pkt->publish.topic : topic,
+        .payload = pkt ? pkt->publish.payload : NULL,
+        .payloadlen = pkt ? pkt->publish.payloadlen : 0
+    };
+    return wal_snapshot_append(snap, &r);
+}
+
+/*
+ * Write out the persistent sessions as the records rebuilding them through
+ * session_replay: all the sessions are created first, then the wildcard
+ * subscriptions are added, as a plain subscription to the same topic would
+ * shadow them, followed by the plain subscriptions, the offline queue and
+ * the inflight messages of each session. The clean ones are written as well
+ * if requested, to be handed over on upgrade.
+ * Runs in the child forked to take a snapshot, on the memory as it was when
+ * the global lock was held for the fork, so no lock is taken.
+ * Returns -1 on write errors.
+ */
+int session_snapshot(struct wal_snapshot *snap, bool clean) {
+    struct client_session *s, *tmp;
+    HASH_ITER(hh, server.sessions, s, tmp) {
+        if ((clean == true || s->clean_session == false)
+            && snapshot_record(snap, s, WAL_SESSION_CREATE,
+                               NULL, 0, 0, NULL) < 0)
+            return -1;
+    }
+    list_foreach(item, server.store->wildcards) {
+        struct subscription *sub = item->data;
+        s = client_id_session(sub->handle);
+        if (!s || (clean == false && s->clean_session == true))
+            continue;
+        char filter[strlen(sub->topic) + 2];
+        snprintf(filter, sizeof(filter), "%s%s",
+                 sub->topic, sub->multilevel ? "#" : "");
+        if (snapshot_record(snap, s, WAL_SUBSCRIBE, filter,
+                            sub->granted_qos, 0, NULL) < 0)
+            return -1;
+    }
+    HASH_ITER(hh, server.sessions, s, tmp) {
+        if (clean == false && s->clean_session == true)
+            continue;
+        list_foreach(item, s->subscriptions) {
+            struct topic *t = item->data;
+            const struct subscriber *sub =
+                subscribers_find(&t->subscribers, s->handle);
+            if (sub && snapshot_record(snap, s, WAL_SUBSCRIBE, t->name,
+                                       sub->granted_qos, 0, NULL) < 0)
+                return -1;
+        }
+        list_foreach(item, s->outgoing_msgs) {
+            struct queued_msg *qmsg = item->data;
+            if (snapshot_record(snap, s, WAL_ENQUEUE, NULL, qmsg->qos,
+                                0, qmsg->packet) < 0)
+                return -1;
+        }
+        for (size_t i = 0; i < s->spilled.count; ++i) {
+            const struct spill_ref *ref = spill_at(&s->spilled, i);
+            struct mqtt_packet *pkt = spill_load(ref);
+            if (!pkt)
+                return -1;
+            INCREF(pkt, struct mqtt_packet);
+            int err = snapshot_record(snap, s, WAL_ENQUEUE, NULL, ref->qos,
+                                      0, pkt);
+            DECREF(pkt, struct mqtt_packet);
+            if (err < 0)
+                return -1;
+        }
+        unsigned short left = s->inflights;
+        for (int mid = 1; left > 0 && mid < MAX_INFLIGHT_MSGS; ++mid) {
+            if (!s->i_msgs[mid].packet)
+                continue;
+            --left;
+            if (snapshot_record(snap, s, WAL_INFLIGHT, NULL,
+                                s->i_msgs[mid].qos, mid,
+                                s->i_msgs[mid].packet) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pack in the output of a client the acks held back whose records have been
+ * committed, as many as its buffer has room for, the others go out on the
+ * next write. Reads paused by too many acks held are resumed once down to
+ * half of them, by the write of the ones just released.
+ * Returns true if any ack has been released.
+ */
+bool release_client_acks(struct client *c) {
+    bool released = false;
+#if THREADSNR > 0
+    pthread_mutex_lock(&c->mutex);
+#endif
+    while (list_size(c->held_acks) > 0
+           && c->towrite + MQTT_ACK_LEN <= conf->max_request_size) {
+        struct held_ack *ack = c->held_acks->head->data;
+        if (!wal_durable(ack->lsn))
+            break;
+        list_pop(c->held_acks);
+        mqtt_pack_mono(c->wbuf + c->towrite, ack->type, ack->pkt_id);
+        c->towrite += MQTT_ACK_LEN;
+        STAT_INC(packets_sent[ack->type]);
+        free_memory(ack);
+        released = true;
+    }
+    if (released == true && c->acks_blocked == true
+        && list_size(c->held_acks) <= held_acks_max() / 2) {
+        log_debug("Resuming %s, %lu acks held", c->client_id,
+                  list_size(c->held_acks));
+        c->acks_blocked = false;
+        c->paused = PAUSE_NONE;
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&c->mutex);
+#endif
+    return released;
+}
+
+/*
+ * Send out the acks held back by the clients of a loop whose records have
+ * been committed, called by the loop every time the write-ahead log notifies
+ * a commit. Clients disconnected meanwhile, or reused by another loop, are
+ * just forgotten.
+ */
+void release_held_acks(const struct ev_ctx *ctx) {
+    if (!held_clients)
+        return;
+    for (unsigned long n = list_size(held_clients); n > 0; --n) {
+        struct client *c = list_pop(held_clients);
+        if (!c->held_acks || c->ctx != ctx)
+            continue;
+        if (release_client_acks(c) == true)
+            enqueue_event_write(c);
+        if (list_size(c->held_acks) > 0) {
+            list_push_back(held_clients, c);
+        } else {
+            list_destroy(c->held_acks, 0);
+            c->held_acks = NULL;
+        }
+    }
+    if (list_size(held_clients) == 0) {
+        list_destroy(held_clients, 0);
+        held_clients = NULL;
+    }
+}
+
+void flush_held_acks(struct client *c) {
+    if (!c->held_acks)
+        return;
+    while (list_size(c->held_acks) > 0) {
+        struct held_ack *ack = list_pop(c->held_acks);
+        mqtt_pack_mono(c->wbuf + c->towrite, ack->type, ack->pkt_id);
+        c->towrite += MQTT_ACK_LEN;
+        STAT_INC(packets_sent[ack->type]);
+        free_memory(ack);
+    }
+    list_destroy(c->held_acks, 0);
+    c->held_acks = NULL;
+    c->acks_blocked = false;
+}
+
+void discard_held_acks(struct client *c) {
+    if (!c->held_acks)
+        return;
+    list_destroy(c->held_acks, 1);
+    c->held_acks = NULL;
+    c->acks_blocked = false;
 }
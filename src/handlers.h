@@ -28,12 +28,42 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
 struct topic;
+struct client;
+struct client_session;
 struct mqtt_packet;
 struct io_event;
+struct wal_snapshot;
+struct ev_ctx;
+
+int publish_message(struct mqtt_packet *, const struct topic *, struct client *);
+
+bool session_drain_queue(struct client *);
 
-int publish_message(struct mqtt_packet *, const struct topic *);
+size_t session_trim_queue(struct client_session *, size_t);
 
 int handle_command(unsigned, struct io_event *);
 
+long session_recover(const char *, unsigned, uint64_t *);
+
+long session_restore(int, unsigned, uint64_t *);
+
+int session_snapshot(struct wal_snapshot *, bool);
+
+void release_held_acks(const struct ev_ctx *);
+
+bool release_client_acks(struct client *);
+
+/*
+ * Pack all the acks held back by a client in its output, once the log has
+ * been closed, thus committed, before handing the client over on upgrade
+ */
+void flush_held_acks(struct client *);
+
+void discard_held_acks(struct client *);
+
 #endif
@@ -0,0 +1,79 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "histogram.h"
+
+/* Highest value falling in a bucket */
+static uint64_t bucket_max(size_t idx) {
+    if (idx < 2 * HIST_SUB_BUCKETS)
+        return idx;
+    int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t top = HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src) {
+    atomic_fetch_add_explicit(&dst->sum, atomic_load_explicit(&src->sum,
+                              memory_order_relaxed), memory_order_relaxed);
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        size_t n = atomic_load_explicit(&src->buckets[i], memory_order_relaxed);
+        if (n > 0)
+            atomic_fetch_add_explicit(&dst->buckets[i], n,
+                                      memory_order_relaxed);
+    }
+}
+
+size_t histogram_count(const struct histogram *h) {
+    size_t count = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i)
+        count += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    return count;
+}
+
+size_t histogram_count_below(const struct histogram *h, uint64_t value) {
+    size_t count = 0;
+    for (size_t i = 0; i < HIST_BUCKETS && bucket_max(i) <= value; ++i)
+        count += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    return count;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double percentile) {
+    size_t count = histogram_count(h);
+    if (count == 0)
+        return 0;
+    // Rank of the value, rounded up, the first one at least
+    double exact = percentile / 100.0 * count;
+    size_t rank = (size_t) exact;
+    rank += rank < exact || rank == 0;
+    size_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen >= rank)
+            return bucket_max(i);
+    }
+    return bucket_max(HIST_BUCKETS - 1);
+}
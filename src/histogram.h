@@ -0,0 +1,90 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Log-linear histogram, HDR style: values are bucketed by their most
+ * significant bit, each power of two is split into HIST_SUB_BUCKETS linear
+ * sub-buckets, so the relative error is bounded (~6%) over the whole range
+ * with a small, fixed amount of memory and an O(1), branch-light recording.
+ * Values up to HIST_SUB_BUCKETS * 2 are recorded exactly, values past
+ * 2^HIST_MAX_BITS saturate into the last bucket.
+ *
+ * Buckets are atomic counters, updated with relaxed ordering, histograms are
+ * meant to be owned by a thread and merged with the others when read.
+ */
+#define HIST_SUB_BITS     4
+#define HIST_SUB_BUCKETS  (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS     42
+#define HIST_BUCKETS      (HIST_SUB_BUCKETS * (HIST_MAX_BITS - HIST_SUB_BITS + 1))
+
+struct histogram {
+    atomic_size_t sum; // sum of the values recorded, wraps on overflow
+    atomic_size_t buckets[HIST_BUCKETS];
+};
+
+static inline size_t histogram_index(uint64_t value) {
+    if (value < 2 * HIST_SUB_BUCKETS)
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + ((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+static inline void histogram_record(struct histogram *h, uint64_t value) {
+    atomic_fetch_add_explicit(&h->buckets[histogram_index(value)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+/* Add up the counts of src into dst */
+void histogram_merge(struct histogram *, const struct histogram *);
+
+/* Total number of values recorded */
+size_t histogram_count(const struct histogram *);
+
+/*
+ * Number of values recorded up to a given one, counting only the buckets
+ * entirely below it
+ */
+size_t histogram_count_below(const struct histogram *, uint64_t);
+
+/*
+ * Value at a given percentile (0-100), that is the highest value equivalent
+ * to the bucket the percentile falls in, 0 for empty histograms
+ */
+uint64_t histogram_percentile(const struct histogram *, double);
+
+#endif
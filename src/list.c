@@ -157,6 +157,28 @@ List *list_push_back(List *l, void *val) {
     return l;
 }
 
+/*
+ * Remove the value at the front of the list and return it, NULL if the list
+ * is empty
+ * Complexity: O(1)
+ */
+void *list_pop(List *l) {
+
+    if (!l || l->len == 0)
+        return NULL;
+
+    struct list_node *head = l->head;
+    void *data = head->data;
+
+    l->head = head->next;
+    if (--l->len == 0)
+        l->head = l->tail = NULL;
+
+    free_memory(head);
+
+    return data;
+}
+
 static struct list_node *list_remove_single_node(struct list_node *head,
                                                  void *data,
                                                  struct list_node **ret,
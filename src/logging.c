@@ -26,59 +26,690 @@
  */
 
 #include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "logging.h"
 
 #define MAX_LOG_SIZE 120
 
-static FILE *fh = NULL;
-static int logging_level = DEBUG;
+/*
+ * Every thread logging gets its own single-producer single-consumer ring of
+ * records, the writer thread is the only consumer, so no locks are needed on
+ * the hot path: the producer only advances head, the writer only advances
+ * tail. Records not fitting are dropped and counted, a thread never waits for
+ * the disk.
+ */
+#define LOG_RING_SIZE    (1 << 16)
+#define LOG_MAX_RINGS    64
+#define LOG_FLUSH_NSECS  5000000
+#define LOG_OUTPUT_SIZE  (1 << 16)
+
+/*
+ * Formatting is deferred, a record carries just the id of its format string
+ * and the raw bytes of the arguments: integers, doubles and pointers are
+ * widened to 8 bytes, strings are prefixed by their length. The format is
+ * parsed once, the first time it's logged, to know the type of each argument.
+ * Records are 8 bytes aligned, so the ring can always be padded at the end:
+ * the size and id of the padding fit in the first 8 bytes of a header.
+ */
+#define LOG_MAX_ARGS     16
+#define LOG_MAX_FORMATS  4096
+#define LOG_RECORD_SIZE  2048
+#define LOG_ID_TEXT      0       // preformatted "%s", unsupported formats
+#define LOG_ID_DEFINE    0xFFFE  // binary log only, format definition
+#define LOG_ID_PAD       0xFFFF  // ring only, skip to the start
+#define LOG_MAGIC        "SOLLOG\x01\n"
+
+enum log_arg {
+    ARG_INT, ARG_LONG, ARG_LLONG, ARG_UINT, ARG_ULONG, ARG_ULLONG,
+    ARG_SIZE, ARG_DOUBLE, ARG_PTR, ARG_STR
+};
+
+struct log_record {
+    uint32_t size;
+    uint16_t id;
+    uint8_t level;
+    uint8_t nargs;
+    uint64_t time;
+};
+
+struct log_fmt {
+    const char *fmt;
+    int nargs;
+    unsigned char types[LOG_MAX_ARGS];
+};
 
-void sol_log_init(const char *file, int level) {
-    if (!file) return;
-    fh = fopen(file, "a+");
-    logging_level = level;
-    if (!fh)
-        printf("%lu * WARNING: Unable to open file %s\n",
-               (unsigned long) time(NULL), file);
+struct log_ring {
+    volatile atomic_size_t head;
+    volatile atomic_size_t tail;
+    unsigned char buf[LOG_RING_SIZE];
+};
+
+/* Output buffer of the writer, filled by records rendered or copied */
+struct log_output {
+    int fd;
+    size_t len;
+    char buf[LOG_OUTPUT_SIZE];
+};
+
+int sol_log_level = DEBUG;
+
+static int log_mode = LOG_TEXT;
+
+static struct {
+    volatile atomic_int running;
+    volatile atomic_int rings_nr;
+    volatile atomic_ulong dropped;
+    struct log_ring *rings[LOG_MAX_RINGS];
+    pthread_mutex_t mutex; // guards registrations and the outputs
+    pthread_t writer;
+    struct log_output out;  // standard output, always text
+    struct log_output file; // log file, text or binary
+    unsigned char defined[LOG_MAX_FORMATS]; // formats in the binary file
+} logger = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .out = { .fd = STDOUT_FILENO },
+    .file = { .fd = -1 }
+};
+
+/*
+ * Formats registered, indexed by id, looked up by the address of the format
+ * string through an open addressing table, format strings are expected to be
+ * literals or anyway to live as long as the process. Slots are published with
+ * a release store on the key, so lookups need no lock.
+ */
+static struct log_fmt formats[LOG_MAX_FORMATS] = {
+    [LOG_ID_TEXT] = { "%s", 1, { ARG_STR } }
+};
+static volatile atomic_int formats_nr = 1;
+static const char *_Atomic format_keys[LOG_MAX_FORMATS * 2];
+static uint16_t format_ids[LOG_MAX_FORMATS * 2];
+
+static _Thread_local struct log_ring *ring = NULL;
+
+static inline size_t align8(size_t size) {
+    return (size + 7) & ~((size_t) 7);
 }
 
-void sol_log_close(void) {
-    if (fh) {
-        fflush(fh);
-        fclose(fh);
+/*
+ * Scan the conversion specification starting at the char following a '%',
+ * returning the pointer to the conversion char and storing the length of the
+ * flags, width and precision part and the length modifier: the number of
+ * 'l', 'z' for size_t or -1 if it's not supported.
+ */
+static const char *log_spec(const char *p, size_t *speclen, int *lmods) {
+    const char *start = p;
+    while (*p && strchr("-+ #0", *p)) p++;
+    while (isdigit((unsigned char) *p)) p++;
+    if (*p == '.') {
+        p++;
+        while (isdigit((unsigned char) *p)) p++;
+    }
+    *speclen = p - start;
+    *lmods = 0;
+    for (; *p && strchr("hlzjtLq", *p); ++p) {
+        if (*p == 'l' && *lmods >= 0 && *lmods < 2)
+            *lmods += 1;
+        else if (*p == 'z' && *lmods == 0)
+            *lmods = 'z';
+        else if (*p != 'h')
+            *lmods = -1;
     }
+    return p;
 }
 
-void sol_log(int level, const char *fmt, ...) {
+/* Parse a format string, returns false if it can't be deferred */
+static bool log_parse(const char *fmt, struct log_fmt *f) {
+    f->fmt = fmt;
+    f->nargs = 0;
+    size_t speclen;
+    int lmods;
+    for (const char *p = fmt; *p; ++p) {
+        if (*p != '%')
+            continue;
+        if (*(p + 1) == '%') {
+            p++;
+            continue;
+        }
+        if (f->nargs == LOG_MAX_ARGS)
+            return false;
+        p = log_spec(p + 1, &speclen, &lmods);
+        if (lmods < 0)
+            return false;
+        unsigned char type;
+        switch (*p) {
+            case 'd': case 'i':
+                type = lmods == 'z' ? ARG_SIZE :
+                    lmods == 0 ? ARG_INT : lmods == 1 ? ARG_LONG : ARG_LLONG;
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                type = lmods == 'z' ? ARG_SIZE :
+                    lmods == 0 ? ARG_UINT : lmods == 1 ? ARG_ULONG : ARG_ULLONG;
+                break;
+            case 'c':
+                type = ARG_INT;
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+                type = ARG_DOUBLE;
+                break;
+            case 'p':
+                type = ARG_PTR;
+                break;
+            case 's':
+                type = ARG_STR;
+                break;
+            default:
+                // '*' widths, %n and the like are not deferred
+                return false;
+        }
+        f->types[f->nargs++] = type;
+    }
+    return true;
+}
 
-    if (level < logging_level)
-        return;
+/*
+ * Get the id of a format, registering it the first time it's seen, -1 if it
+ * can't be deferred
+ */
+static int log_format_id(const char *fmt) {
+    static int slots_used = 0;
+    size_t mask = LOG_MAX_FORMATS * 2 - 1;
+    size_t slot = ((((uintptr_t) fmt) >> 3) * 2654435761u) & mask;
+    const char *key = NULL;
+    for (;; slot = (slot + 1) & mask) {
+        key = atomic_load_explicit(&format_keys[slot], memory_order_acquire);
+        if (key == fmt)
+            break;
+        if (key)
+            continue;
+        pthread_mutex_lock(&logger.mutex);
+        key = atomic_load_explicit(&format_keys[slot], memory_order_relaxed);
+        /*
+         * Id 0 is taken by the text format, so the ids run out before the
+         * slots, kept at most half full, formats past them aren't deferred
+         */
+        if (!key && slots_used < LOG_MAX_FORMATS) {
+            int id = formats_nr;
+            if (id < LOG_MAX_FORMATS && log_parse(fmt, &formats[id]))
+                formats_nr++;
+            else
+                id = LOG_ID_PAD;
+            format_ids[slot] = id;
+            atomic_store_explicit(&format_keys[slot], fmt,
+                                  memory_order_release);
+            slots_used++;
+            key = fmt;
+        }
+        pthread_mutex_unlock(&logger.mutex);
+        if (!key)
+            return -1;
+        if (key == fmt)
+            break;
+    }
+    return format_ids[slot] == LOG_ID_PAD ? -1 : format_ids[slot];
+}
 
-    assert(fmt);
+/* Pack the arguments of a format in a record, returns its size */
+static size_t log_pack(unsigned char *buf, int level, int id,
+                       const struct log_fmt *f, va_list ap) {
+    struct log_record *rec = (struct log_record *) buf;
+    size_t off = sizeof(*rec);
+    for (int i = 0; i < f->nargs; ++i) {
+        uint64_t v = 0;
+        double d;
+        const char *str;
+        uint16_t len;
+        switch (f->types[i]) {
+            case ARG_INT: v = (int64_t) va_arg(ap, int); break;
+            case ARG_LONG: v = (int64_t) va_arg(ap, long); break;
+            case ARG_LLONG: v = (int64_t) va_arg(ap, long long); break;
+            case ARG_UINT: v = va_arg(ap, unsigned); break;
+            case ARG_ULONG: v = va_arg(ap, unsigned long); break;
+            case ARG_ULLONG: v = va_arg(ap, unsigned long long); break;
+            case ARG_SIZE: v = va_arg(ap, size_t); break;
+            case ARG_PTR: v = (uintptr_t) va_arg(ap, void *); break;
+            case ARG_DOUBLE:
+                d = va_arg(ap, double);
+                memcpy(&v, &d, sizeof(v));
+                break;
+            case ARG_STR:
+                str = va_arg(ap, const char *);
+                str = str ? str : "(null)";
+                len = strnlen(str, MAX_LOG_SIZE);
+                if (off + sizeof(len) + len + 8 * (f->nargs - i)
+                    > LOG_RECORD_SIZE)
+                    len = 0;
+                memcpy(buf + off, &len, sizeof(len));
+                memcpy(buf + off + sizeof(len), str, len);
+                off += sizeof(len) + len;
+                continue;
+        }
+        memcpy(buf + off, &v, sizeof(v));
+        off += sizeof(v);
+    }
+    *rec = (struct log_record) {
+        .size = align8(off), .id = id, .level = level,
+        .nargs = f->nargs, .time = (uint64_t) time(NULL)
+    };
+    return rec->size;
+}
 
-    va_list ap;
-    char msg[MAX_LOG_SIZE + 4];
+/* Pack a message already formatted as the only argument of a record */
+static size_t log_pack_text(unsigned char *buf, int level, const char *msg) {
+    struct log_record *rec = (struct log_record *) buf;
+    uint16_t len = strnlen(msg, MAX_LOG_SIZE + 3);
+    memcpy(buf + sizeof(*rec), &len, sizeof(len));
+    memcpy(buf + sizeof(*rec) + sizeof(len), msg, len);
+    *rec = (struct log_record) {
+        .size = align8(sizeof(*rec) + sizeof(len) + len), .id = LOG_ID_TEXT,
+        .level = level, .nargs = 1, .time = (uint64_t) time(NULL)
+    };
+    return rec->size;
+}
 
-    va_start(ap, fmt);
-    vsnprintf(msg, sizeof(msg), fmt, ap);
-    va_end(ap);
+/*
+ * Render a record as a text line, with the same layout and truncation of the
+ * messages formatted on the spot
+ */
+static size_t log_render(const struct log_fmt *f,
+                         const struct log_record *rec, char *line) {
+    const unsigned char *args = (const unsigned char *) (rec + 1);
+    const unsigned char *end = (const unsigned char *) rec + rec->size;
+    char msg[MAX_LOG_SIZE + 4], spec[32], str[MAX_LOG_SIZE + 4];
+    size_t o = 0, speclen;
+    int lmods, arg = 0, n = 0;
+    for (const char *p = f->fmt; *p && o < sizeof(msg) - 1; ++p) {
+        if (*p != '%' || *(p + 1) == '%') {
+            msg[o++] = *p;
+            p += *p == '%';
+            continue;
+        }
+        const char *conv = log_spec(p + 1, &speclen, &lmods);
+        if (arg == f->nargs || speclen + 4 > sizeof(spec))
+            break;
+        // Same flags, width and precision, length modifier of the widened arg
+        memcpy(spec, p, speclen + 1);
+        char *m = spec + speclen + 1;
+        uint64_t v = 0;
+        uint16_t len = 0;
+        unsigned char t = f->types[arg++];
+        if (t == ARG_STR) {
+            if (args + sizeof(len) <= end)
+                memcpy(&len, args, sizeof(len));
+            if (args + sizeof(len) + len > end || len >= sizeof(str))
+                break;
+            memcpy(str, args + sizeof(len), len);
+            str[len] = '\0';
+            args += sizeof(len) + len;
+            strcpy(m, "s");
+            n = snprintf(msg + o, sizeof(msg) - o, spec, str);
+        } else {
+            if (args + sizeof(v) > end)
+                break;
+            memcpy(&v, args, sizeof(v));
+            args += sizeof(v);
+            if (*conv == 'c') {
+                strcpy(m, "c");
+                n = snprintf(msg + o, sizeof(msg) - o, spec, (int) v);
+            } else if (*conv == 'p') {
+                strcpy(m, "p");
+                n = snprintf(msg + o, sizeof(msg) - o, spec,
+                             (void *) (uintptr_t) v);
+            } else if (t == ARG_DOUBLE) {
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                m[0] = *conv;
+                m[1] = '\0';
+                n = snprintf(msg + o, sizeof(msg) - o, spec, d);
+            } else {
+                m[0] = m[1] = 'l';
+                m[2] = *conv;
+                m[3] = '\0';
+                if (t == ARG_INT || t == ARG_LONG || t == ARG_LLONG)
+                    n = snprintf(msg + o, sizeof(msg) - o, spec, (long long) v);
+                else
+                    n = snprintf(msg + o, sizeof(msg) - o, spec,
+                                 (unsigned long long) v);
+            }
+        }
+        if (n < 0)
+            break;
+        o = o + n < sizeof(msg) - 1 ? o + n : sizeof(msg) - 1;
+        p = conv;
+    }
+    msg[o] = '\0';
 
     /* Truncate message too long and copy 3 bytes to make space for 3 dots */
     memcpy(msg + MAX_LOG_SIZE, "...", 3);
     msg[MAX_LOG_SIZE + 3] = '\0';
 
-    // Open two handler, one for standard output and a second for the
-    // persistent log file
-    FILE *fp = stdout;
+    return sprintf(line, "%lu %s\n", (unsigned long) rec->time, msg);
+}
+
+static void write_all(int dst, const char *buf, size_t len) {
+    ssize_t n = 0;
+    while (len > 0 && (n = write(dst, buf, len)) > 0) {
+        buf += n;
+        len -= n;
+    }
+}
+
+static void log_output_flush(struct log_output *out) {
+    if (out->fd >= 0 && out->len > 0)
+        write_all(out->fd, out->buf, out->len);
+    out->len = 0;
+}
+
+static void log_output_append(struct log_output *out,
+                              const void *data, size_t len) {
+    if (out->len + len > LOG_OUTPUT_SIZE)
+        log_output_flush(out);
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+/*
+ * Write out a record, as text on the standard output, as text or binary on
+ * the log file; binary logs carry the definition of every format before its
+ * first record. Must be called holding the logger lock.
+ */
+static void log_emit(const struct log_record *rec) {
+    char line[MAX_LOG_SIZE + 32];
+    const struct log_fmt *f = &formats[rec->id];
+    size_t len = log_render(f, rec, line);
+    log_output_append(&logger.out, line, len);
+    if (logger.file.fd < 0)
+        return;
+    if (log_mode == LOG_TEXT) {
+        log_output_append(&logger.file, line, len);
+        return;
+    }
+    if (logger.defined[rec->id] == 0) {
+        unsigned char def[sizeof(struct log_record) + LOG_MAX_ARGS + 4];
+        size_t fmtlen = strlen(f->fmt) + 1;
+        uint16_t id = rec->id;
+        struct log_record hdr = {
+            .size = align8(sizeof(hdr) + sizeof(id) + f->nargs + fmtlen),
+            .id = LOG_ID_DEFINE, .nargs = f->nargs, .time = rec->time
+        };
+        memset(def, 0x00, sizeof(def));
+        memcpy(def, &hdr, sizeof(hdr));
+        memcpy(def + sizeof(hdr), &id, sizeof(id));
+        memcpy(def + sizeof(hdr) + sizeof(id), f->types, f->nargs);
+        log_output_append(&logger.file, def, sizeof(hdr) + sizeof(id) + f->nargs);
+        log_output_append(&logger.file, f->fmt, fmtlen);
+        memset(def, 0x00, 8);
+        log_output_append(&logger.file, def,
+                          hdr.size - (sizeof(hdr) + sizeof(id) + f->nargs + fmtlen));
+        logger.defined[rec->id] = 1;
+    }
+    log_output_append(&logger.file, rec, rec->size);
+}
+
+/*
+ * Synchronous fallback, used before the writer thread starts, after it stops
+ * and by threads exceeding the maximum number of rings
+ */
+static void log_emit_direct(const struct log_record *rec) {
+    pthread_mutex_lock(&logger.mutex);
+    log_emit(rec);
+    log_output_flush(&logger.out);
+    log_output_flush(&logger.file);
+    pthread_mutex_unlock(&logger.mutex);
+}
+
+/* Lazily assign a ring to the calling thread, NULL if none are left */
+static struct log_ring *log_ring_get(void) {
+    if (ring)
+        return ring;
+    pthread_mutex_lock(&logger.mutex);
+    int nr = logger.rings_nr;
+    if (nr < LOG_MAX_RINGS) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring) {
+            logger.rings[nr] = ring;
+            logger.rings_nr = nr + 1;
+        }
+    }
+    pthread_mutex_unlock(&logger.mutex);
+    return ring;
+}
+
+/*
+ * Records are stored contiguously, if one doesn't fit before the end of the
+ * ring, the remaining space is padded and the record starts over
+ */
+static bool log_ring_push(struct log_ring *r, const void *rec, size_t len) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t off = head & (LOG_RING_SIZE - 1);
+    size_t pad = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : 0;
+    if (LOG_RING_SIZE - (head - tail) < pad + len)
+        return false;
+    if (pad > 0) {
+        struct log_record skip = { .size = pad, .id = LOG_ID_PAD };
+        memcpy(r->buf + off, &skip, pad < sizeof(skip) ? pad : sizeof(skip));
+        off = 0;
+    }
+    memcpy(r->buf + off, rec, len);
+    atomic_store_explicit(&r->head, head + pad + len, memory_order_release);
+    return true;
+}
+
+/*
+ * Drain all the rings, rendering or copying their records in the output
+ * buffers, written out in batches. Returns the number of bytes drained.
+ */
+static size_t log_flush(void) {
+    size_t total = 0;
+    int nr = logger.rings_nr;
+    pthread_mutex_lock(&logger.mutex);
+    unsigned long dropped = atomic_exchange(&logger.dropped, 0);
+    if (dropped > 0) {
+        _Alignas(8) unsigned char rec[sizeof(struct log_record) + 80];
+        char notice[64];
+        snprintf(notice, sizeof(notice), "* WARNING: %lu log lines dropped",
+                 dropped);
+        log_pack_text(rec, WARNING, notice);
+        log_emit((struct log_record *) rec);
+    }
+    for (int i = 0; i < nr; ++i) {
+        struct log_ring *r = logger.rings[i];
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        total += head - tail;
+        while (tail != head) {
+            const struct log_record *rec = (const struct log_record *)
+                (r->buf + (tail & (LOG_RING_SIZE - 1)));
+            if (rec->id != LOG_ID_PAD)
+                log_emit(rec);
+            tail += rec->size;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    log_output_flush(&logger.out);
+    log_output_flush(&logger.file);
+    pthread_mutex_unlock(&logger.mutex);
+    return total;
+}
+
+static void *log_writer(void *arg) {
+    (void) arg;
+    struct timespec idle = { 0, LOG_FLUSH_NSECS };
+    while (logger.running) {
+        if (log_flush() == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+void sol_log_init(const char *file, int level, int format) {
+    sol_log_level = level;
+    log_mode = format;
+    if (file && file[0]) {
+        logger.file.fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                              0644);
+        if (logger.file.fd < 0)
+            printf("%lu * WARNING: Unable to open file %s\n",
+                   (unsigned long) time(NULL), file);
+        else if (log_mode == LOG_BINARY)
+            write_all(logger.file.fd, LOG_MAGIC, sizeof(LOG_MAGIC) - 1);
+    }
+    logger.running = 1;
+    if (pthread_create(&logger.writer, NULL, log_writer, NULL) != 0)
+        logger.running = 0;
+}
+
+void sol_log_close(void) {
+    if (logger.running) {
+        logger.running = 0;
+        pthread_join(logger.writer, NULL);
+        log_flush();
+        // Every other thread is expected to be gone by now
+        for (int i = 0; i < logger.rings_nr; ++i)
+            free(logger.rings[i]);
+        logger.rings_nr = 0;
+        ring = NULL;
+    }
+    if (logger.file.fd >= 0) {
+        close(logger.file.fd);
+        logger.file.fd = -1;
+    }
+}
+
+unsigned long sol_log_dropped(void) {
+    return logger.dropped;
+}
 
-    if (!fp)
+/*
+ * Decode a binary log, the whole content is read at once, formats definitions
+ * are valid till the next magic string, written every time the file is opened
+ * by a new run. Returns 0 on success, -1 on a truncated or corrupted log.
+ */
+int sol_log_decode(int in, int outfd) {
+    size_t cap = LOG_OUTPUT_SIZE, len = 0, off = 0;
+    unsigned char *buf = malloc(cap);
+    struct log_fmt *table = calloc(LOG_MAX_FORMATS, sizeof(*table));
+    struct log_output *out = malloc(sizeof(*out));
+    ssize_t n = 0;
+    int rc = 0;
+    if (!buf || !table || !out) {
+        rc = -1;
+        goto exit;
+    }
+    while ((n = read(in, buf + len, cap - len)) > 0) {
+        len += n;
+        if (len == cap) {
+            unsigned char *tmp = realloc(buf, cap * 2);
+            if (!tmp) {
+                rc = -1;
+                goto exit;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+    }
+    out->fd = outfd;
+    out->len = 0;
+    char line[MAX_LOG_SIZE + 32];
+    size_t maglen = sizeof(LOG_MAGIC) - 1;
+    struct log_record rec;
+    while (off < len) {
+        if (len - off >= maglen && memcmp(buf + off, LOG_MAGIC, maglen) == 0) {
+            for (int i = 0; i < LOG_MAX_FORMATS; ++i)
+                free((char *) table[i].fmt);
+            memset(table, 0x00, LOG_MAX_FORMATS * sizeof(*table));
+            table[LOG_ID_TEXT] = formats[LOG_ID_TEXT];
+            table[LOG_ID_TEXT].fmt = strdup(formats[LOG_ID_TEXT].fmt);
+            off += maglen;
+            continue;
+        }
+        if (len - off < sizeof(rec)) {
+            rc = -1;
+            break;
+        }
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (rec.size < sizeof(rec) || rec.size > len - off || rec.size % 8) {
+            rc = -1;
+            break;
+        }
+        if (rec.id == LOG_ID_DEFINE) {
+            uint16_t id;
+            const unsigned char *def = buf + off + sizeof(rec);
+            memcpy(&id, def, sizeof(id));
+            if (id >= LOG_MAX_FORMATS || rec.nargs > LOG_MAX_ARGS
+                || sizeof(rec) + sizeof(id) + rec.nargs >= rec.size) {
+                rc = -1;
+                break;
+            }
+            free((char *) table[id].fmt);
+            table[id].nargs = rec.nargs;
+            memcpy(table[id].types, def + sizeof(id), rec.nargs);
+            table[id].fmt = strndup((const char *) def + sizeof(id) + rec.nargs,
+                                    rec.size - sizeof(rec) - sizeof(id) - rec.nargs);
+        } else if (rec.id < LOG_MAX_FORMATS && table[rec.id].fmt) {
+            size_t l = log_render(&table[rec.id],
+                                  (const struct log_record *) (buf + off), line);
+            log_output_append(out, line, l);
+        } else {
+            rc = -1;
+            break;
+        }
+        off += rec.size;
+    }
+    log_output_flush(out);
+exit:
+    if (table)
+        for (int i = 0; i < LOG_MAX_FORMATS; ++i)
+            free((char *) table[i].fmt);
+    free(table);
+    free(out);
+    free(buf);
+    return rc;
+}
+
+void sol_log(int level, const char *fmt, ...) {
+
+    if (level < sol_log_level)
         return;
 
-    fprintf(fp, "%lu %s\n", (unsigned long) time(NULL), msg);
-    if (fh)
-        fprintf(fh, "%lu %s\n", (unsigned long) time(NULL), msg);
+    assert(fmt);
+
+    _Alignas(8) unsigned char rec[LOG_RECORD_SIZE];
+    va_list ap;
+    size_t len = 0;
+    int id = log_format_id(fmt);
+
+    va_start(ap, fmt);
+    if (id >= 0) {
+        len = log_pack(rec, level, id, &formats[id], ap);
+    } else {
+        // Not deferrable, formatted on the spot
+        char msg[MAX_LOG_SIZE + 4];
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        len = log_pack_text(rec, level, msg);
+    }
+    va_end(ap);
+
+    /*
+     * Fatal errors are followed by an exit, the writer thread could have no
+     * time to drain them
+     */
+    struct log_ring *r = NULL;
+    if (logger.running && level != FATAL)
+        r = log_ring_get();
+    if (!r)
+        log_emit_direct((struct log_record *) rec);
+    else if (!log_ring_push(r, rec, len))
+        logger.dropped++;
 }
@@ -30,18 +30,48 @@
 
 enum log_level { DEBUG, INFORMATION, WARNING, ERROR, FATAL };
 
-void sol_log_init(const char *, int);
+/*
+ * Format of the log file, plain text lines or binary records, carrying just
+ * an identifier of the format string and the raw bytes of the arguments, to
+ * be decoded offline with sol_logdecode
+ */
+enum log_format { LOG_TEXT, LOG_BINARY };
+
+/*
+ * Lowest level compiled in, call sites below it are removed entirely,
+ * arguments included, set through the SOL_MIN_LOG_LEVEL CMake option
+ */
+#ifndef SOL_MIN_LOG_LEVEL
+#define SOL_MIN_LOG_LEVEL DEBUG
+#endif
+
+extern int sol_log_level;
+
+void sol_log_init(const char *, int, int);
 void sol_log_close(void);
 void sol_log(int, const char *, ...);
 
-#define log(...) sol_log( __VA_ARGS__ )
+/* Number of log lines dropped as the ring of the logging thread was full */
+unsigned long sol_log_dropped(void);
+
+/* Decode a binary log from a descriptor, writing text lines to another one */
+int sol_log_decode(int, int);
+
+/*
+ * Arguments are evaluated only if the level is enabled, both the checks are
+ * against constants or a global, so no call is made at all otherwise
+ */
+#define log(level, ...) do {                                        \
+    if ((level) >= SOL_MIN_LOG_LEVEL && (level) >= sol_log_level)   \
+        sol_log((level), __VA_ARGS__);                              \
+} while (0)
 #define log_debug(...) log(DEBUG, __VA_ARGS__)
 #define log_warning(...) log(WARNING, __VA_ARGS__)
 #define log_error(...) log(ERROR, __VA_ARGS__)
 #define log_info(...) log(INFORMATION, __VA_ARGS__)
 #define log_fatal(...) do {      \
-    log(FATAL, __VA_ARGS__);     \
-    exit(EXIT_FAILURE);             \
+    sol_log(FATAL, __VA_ARGS__); \
+    exit(EXIT_FAILURE);          \
 } while(0);
 
 #endif
@@ -26,15 +26,24 @@
  */
 
 #include <stdint.h>
+#include <string.h>
+#include "util.h"
 #include "memory.h"
 #include "memorypool.h"
 
 static void memorypool_resize(struct memorypool *);
 
+/* Allocate zeroed blocks, returning the first cache line aligned address */
+static void *blocks_alloc(struct memorypool *pool, size_t size) {
+    pool->base = try_calloc(1, size + CACHE_LINE_SIZE);
+    uintptr_t addr = (uintptr_t) pool->base + CACHE_LINE_SIZE - 1;
+    return (void *) (addr & ~((uintptr_t) CACHE_LINE_SIZE - 1));
+}
+
 struct memorypool *memorypool_new(size_t blocks_nr, size_t blocksize) {
     struct memorypool *pool = try_alloc(sizeof(*pool));
     blocksize = blocksize >= sizeof(intptr_t) ? blocksize : sizeof(intptr_t);
-    pool->memory = try_calloc(blocks_nr, blocksize);
+    pool->memory = blocks_alloc(pool, blocks_nr * blocksize);
     pool->free = pool->memory;
     pool->blocks_nr = blocks_nr;
     pool->blocksize = blocksize;
@@ -78,7 +87,7 @@ struct memorypool *memorypool_new(size_t blocks_nr, size_t blocksize) {
 }
 
 void memorypool_destroy(struct memorypool *pool) {
-    free_memory(pool->memory);
+    free_memory(pool->base);
     free_memory(pool);
 }
 
@@ -111,11 +120,16 @@ void memorypool_free(struct memorypool *pool, void *ptr) {
 }
 
 static void memorypool_resize(struct memorypool *pool) {
+    size_t oldsize = pool->blocks_nr * pool->blocksize;
     pool->blocks_nr *= 2;
     size_t newsize = pool->blocks_nr * pool->blocksize;
     /* We extract next memory block offset position */
     intptr_t offset = *((intptr_t *) pool->free);
-    pool->memory = try_realloc(pool->memory, newsize);
+    /* A realloc wouldn't keep the alignment, blocks are copied over */
+    void *base = pool->base, *memory = pool->memory;
+    pool->memory = blocks_alloc(pool, newsize);
+    memcpy(pool->memory, memory, oldsize);
+    free_memory(base);
     pool->free = (void *)((char *) pool->memory + ((offset-1) * pool->blocksize));
     /*
      * Apply the same logic of the init, but starting from the updated offset,
@@ -33,8 +33,11 @@
  * be pre-allocated and re-use of memory blocks, so no size have to be
  * specified like in a normal malloc but only alloc and free of a pointer is
  * possible.
+ * The first block starts on a cache line, so do all the others when sized by
+ * a multiple of it.
  */
 struct memorypool {
+    void *base;
     void *memory;
     void *free;
     int block_used;
@@ -0,0 +1,405 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ev.h"
+#include "config.h"
+#include "server.h"
+#include "memory.h"
+#include "logging.h"
+#include "network.h"
+#include "metrics.h"
+#include "sol_internal.h"
+
+/* Max size of a request, headers included, anything longer is refused */
+#define METRICS_REQUEST_SIZE  2048
+
+/* Seconds a connection can stay idle before being closed */
+#define METRICS_IDLE_SECS     5
+
+#define METRICS_CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/* Bucket boundaries of the latency histograms, in seconds */
+static const double latency_bounds[] = {
+    1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1.0, 10.0
+};
+
+/* Growing output buffer, the response is rendered once and then written */
+struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * A scrape connection, the request is read entirely, then the response is
+ * written out across as many loop cycles as needed
+ */
+struct metrics_conn {
+    int fd;
+    size_t rlen;
+    char rbuf[METRICS_REQUEST_SIZE];
+    struct metrics_buf out;
+    size_t sent;
+    struct ev_timer timer;
+};
+
+static int listen_fd = -1;
+
+static void buf_printf(struct metrics_buf *b, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        size_t room = b->cap - b->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->data + b->len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t) n < room) {
+            b->len += n;
+            return;
+        }
+        b->cap = b->cap * 2 > b->len + n + 1 ? b->cap * 2 : b->len + n + 1;
+        b->data = try_realloc(b->data, b->cap);
+    }
+}
+
+static void family(struct metrics_buf *b, const char *name,
+                   const char *type, const char *help) {
+    buf_printf(b, "# TYPE sol_%s %s\n# HELP sol_%s %s\n",
+               name, type, name, help);
+}
+
+static void counter(struct metrics_buf *b, const char *name,
+                    const char *help, size_t value) {
+    family(b, name, "counter", help);
+    buf_printf(b, "sol_%s_total %zu\n", name, value);
+}
+
+static void gauge(struct metrics_buf *b, const char *name,
+                  const char *help, long long value) {
+    family(b, name, "gauge", help);
+    buf_printf(b, "sol_%s %lld\n", name, value);
+}
+
+/* Label of a statistics shard, one per loop plus the shared one */
+static void shard_label(int shard, char *label, size_t len) {
+    if (shard == STATS_SHARDS - 1)
+        snprintf(label, len, "shared");
+    else
+        snprintf(label, len, "%d", shard);
+}
+
+/* A sharded counter, a sample per loop, labeled by shard */
+static void loop_counter(struct metrics_buf *b, const char *name,
+                         const char *help, size_t offset) {
+    char label[16];
+    family(b, name, "counter", help);
+    for (int i = 0; i < STATS_SHARDS; ++i) {
+        atomic_size_t *v = (atomic_size_t *)
+            ((char *) &info.shards[i].stats + offset);
+        shard_label(i, label, sizeof(label));
+        buf_printf(b, "sol_%s_total{loop=\"%s\"} %zu\n", name, label,
+                   atomic_load_explicit(v, memory_order_relaxed));
+    }
+}
+
+static void packets_counter(struct metrics_buf *b, const char *dir,
+                            bool received) {
+    char name[32], help[64], label[16];
+    snprintf(name, sizeof(name), "packets_%s", dir);
+    snprintf(help, sizeof(help), "MQTT packets %s, by type", dir);
+    family(b, name, "counter", help);
+    for (int i = 0; i < STATS_SHARDS; ++i) {
+        const struct sol_stats *st = &info.shards[i].stats;
+        shard_label(i, label, sizeof(label));
+        for (int t = 0; t < 16; ++t) {
+            if (!packet_names[t])
+                continue;
+            size_t v = received ? st->packets_recv[t] : st->packets_sent[t];
+            buf_printf(b, "sol_%s_total{loop=\"%s\",type=\"%s\"} %zu\n",
+                       name, label, packet_names[t], v);
+        }
+    }
+}
+
+/*
+ * Per handler counters, a sample per loop and packet type received, scale
+ * turns nanoseconds into seconds, 0 leaves the value as a plain count
+ */
+static void handlers_counter(struct metrics_buf *b, const char *name,
+                             const char *help, size_t offset, double scale) {
+    char label[16];
+    family(b, name, "counter", help);
+    for (int i = 0; i < STATS_SHARDS; ++i) {
+        const atomic_size_t *v = (const atomic_size_t *)
+            ((char *) &info.shards[i].stats + offset);
+        shard_label(i, label, sizeof(label));
+        for (int t = 0; t < 16; ++t) {
+            if (!packet_names[t] || info.shards[i].stats.handler_calls[t] == 0)
+                continue;
+            buf_printf(b, "sol_%s_total{loop=\"%s\",type=\"%s\"} ",
+                       name, label, packet_names[t]);
+            if (scale > 0)
+                buf_printf(b, "%.9f\n", v[t] * scale);
+            else
+                buf_printf(b, "%zu\n", v[t]);
+        }
+    }
+}
+
+static void latency_histogram(struct metrics_buf *b, int metric,
+                              const struct histogram *h) {
+    char name[48];
+    snprintf(name, sizeof(name), "latency_%s_seconds", latency_names[metric]);
+    family(b, name, "histogram", "Latency distribution");
+    size_t nbounds = sizeof(latency_bounds) / sizeof(latency_bounds[0]);
+    for (size_t i = 0; i < nbounds; ++i)
+        buf_printf(b, "sol_%s_bucket{le=\"%g\"} %zu\n", name, latency_bounds[i],
+                   histogram_count_below(h, latency_bounds[i] * 1e9));
+    size_t count = histogram_count(h);
+    buf_printf(b, "sol_%s_bucket{le=\"+Inf\"} %zu\n", name, count);
+    buf_printf(b, "sol_%s_count %zu\n", name, count);
+    buf_printf(b, "sol_%s_sum %.9f\n", name, (double) h->sum / 1e9);
+}
+
+/* Render all the statistics in the OpenMetrics text format */
+static void metrics_render(struct metrics_buf *b) {
+    struct sol_stats *st = try_alloc(sizeof(*st));
+    sol_stats_collect(st);
+
+#if THREADSNR > 0
+    pthread_mutex_lock(&mutex);
+#endif
+    size_t topics = trie_size(server.store->topics);
+    size_t sessions = HASH_COUNT(server.sessions);
+    size_t clients = HASH_COUNT(server.clients_map);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    gauge(b, "uptime_seconds", "Seconds since the start",
+          time(NULL) - info.start_time);
+    gauge(b, "clients_connected", "Clients currently connected",
+          info.active_connections);
+    counter(b, "clients_connections", "Connections accepted",
+            info.total_connections);
+    gauge(b, "clients", "Clients known, offline persistent ones included",
+          clients);
+    gauge(b, "sessions", "Sessions stored", sessions);
+    gauge(b, "topics", "Topics stored", topics);
+    gauge(b, "memory_used_bytes", "Memory in use", memory_used());
+    gauge(b, "memory_max_bytes", "Max memory configured", conf->max_memory);
+    gauge(b, "memory_pressure", "Memory pressure level, 0 to 3",
+          info.memory_level);
+    counter(b, "memory_retained_evicted",
+            "Retained messages evicted under memory pressure",
+            info.retained_evicted);
+    counter(b, "memory_queued_trimmed",
+            "Offline messages trimmed under memory pressure",
+            info.queued_trimmed);
+    counter(b, "memory_connections_rejected",
+            "Connections rejected under memory pressure",
+            info.connections_rejected);
+    counter(b, "log_dropped", "Log lines dropped", sol_log_dropped());
+
+    loop_counter(b, "messages_sent", "Messages sent",
+                 offsetof(struct sol_stats, messages_sent));
+    loop_counter(b, "messages_received", "Messages received",
+                 offsetof(struct sol_stats, messages_recv));
+    loop_counter(b, "messages_dropped",
+                 "QoS 0 messages dropped towards slow consumers",
+                 offsetof(struct sol_stats, messages_dropped));
+    loop_counter(b, "messages_retransmitted", "Messages and acks re-sent",
+                 offsetof(struct sol_stats, messages_retransmitted));
+    loop_counter(b, "bytes_sent", "Bytes sent",
+                 offsetof(struct sol_stats, bytes_sent));
+    loop_counter(b, "bytes_received", "Bytes received",
+                 offsetof(struct sol_stats, bytes_recv));
+    loop_counter(b, "queues_dropped",
+                 "Messages dropped or refused by offline queues",
+                 offsetof(struct sol_stats, queued_dropped));
+    packets_counter(b, "received", true);
+    packets_counter(b, "sent", false);
+    handlers_counter(b, "handler_calls", "Packet handlers invocations",
+                     offsetof(struct sol_stats, handler_calls), 0);
+    handlers_counter(b, "handler_seconds", "Time spent in packet handlers",
+                     offsetof(struct sol_stats, handler_ns), 1e-9);
+    handlers_counter(b, "handler_slow",
+                     "Packet handlers running past slow_op_threshold",
+                     offsetof(struct sol_stats, handler_slow), 0);
+
+    gauge(b, "queues_messages", "Messages held by offline queues",
+          (long long) st->queued_messages);
+    gauge(b, "queues_bytes", "Bytes held by offline queues",
+          (long long) st->queued_bytes);
+    gauge(b, "messages_inflight", "QoS > 0 messages waiting for an ack",
+          (long long) st->inflight_messages);
+
+    for (int i = 0; i < LATENCY_METRICS; ++i)
+        latency_histogram(b, i, &st->latency[i]);
+
+    buf_printf(b, "# EOF\n");
+    free_memory(st);
+}
+
+static void metrics_close(struct ev_ctx *ctx, struct metrics_conn *mc) {
+    ev_timer_del(&mc->timer);
+    ev_del_fd(ctx, mc->fd);
+    close(mc->fd);
+    free_memory(mc->out.data);
+    free_memory(mc);
+}
+
+static void metrics_expired(struct ev_ctx *ctx, void *arg) {
+    metrics_close(ctx, arg);
+}
+
+/*
+ * Read and drop the input pending, closing a connection with unread input
+ * would reset it, possibly before the response got to the other end
+ */
+static void metrics_discard(struct metrics_conn *mc) {
+    char discard[METRICS_REQUEST_SIZE];
+    while (recv(mc->fd, discard, sizeof(discard), 0) > 0);
+}
+
+static void metrics_write(struct ev_ctx *ctx, void *arg) {
+    struct metrics_conn *mc = arg;
+    while (mc->sent < mc->out.len) {
+        ssize_t n = send(mc->fd, mc->out.data + mc->sent,
+                         mc->out.len - mc->sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            ev_fire_event(ctx, mc->fd, EV_WRITE, metrics_write, mc);
+            return;
+        }
+        if (n <= 0)
+            break;
+        mc->sent += n;
+    }
+    metrics_discard(mc);
+    metrics_close(ctx, mc);
+}
+
+/* Prepare the whole response, status line and headers first */
+static void metrics_respond(struct metrics_conn *mc, int status,
+                            const char *reason) {
+    struct metrics_buf body = { try_alloc(4096), 0, 4096 };
+    const char *type = "text/plain; charset=utf-8";
+    if (status == 200) {
+        metrics_render(&body);
+        type = METRICS_CONTENT_TYPE;
+    } else {
+        buf_printf(&body, "%s\n", reason);
+    }
+    mc->out = (struct metrics_buf) { try_alloc(256), 0, 256 };
+    buf_printf(&mc->out, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n"
+               "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+               status, reason, type, body.len);
+    if (mc->out.cap - mc->out.len < body.len) {
+        mc->out.cap = mc->out.len + body.len;
+        mc->out.data = try_realloc(mc->out.data, mc->out.cap);
+    }
+    memcpy(mc->out.data + mc->out.len, body.data, body.len);
+    mc->out.len += body.len;
+    free_memory(body.data);
+}
+
+static void metrics_read(struct ev_ctx *ctx, void *arg) {
+    struct metrics_conn *mc = arg;
+    /*
+     * One request per connection, anything following the headers, be it a
+     * body or a pipelined request, is discarded once the response is ready
+     */
+    if (mc->out.data) {
+        metrics_discard(mc);
+        return;
+    }
+    ssize_t n = recv(mc->fd, mc->rbuf + mc->rlen,
+                     METRICS_REQUEST_SIZE - 1 - mc->rlen, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        metrics_close(ctx, mc);
+        return;
+    }
+    mc->rlen += n;
+    mc->rbuf[mc->rlen] = '\0';
+    if (!strstr(mc->rbuf, "\r\n\r\n") && !strstr(mc->rbuf, "\n\n")) {
+        if (mc->rlen < METRICS_REQUEST_SIZE - 1)
+            return;
+        metrics_respond(mc, 431, "Request Header Fields Too Large");
+    } else if (strncmp(mc->rbuf, "GET ", 4) != 0) {
+        metrics_respond(mc, 405, "Method Not Allowed");
+    } else if (strncmp(mc->rbuf + 4, "/metrics ", 9) == 0
+               || strncmp(mc->rbuf + 4, "/ ", 2) == 0) {
+        metrics_respond(mc, 200, "OK");
+    } else {
+        metrics_respond(mc, 404, "Not Found");
+    }
+    ev_fire_event(ctx, mc->fd, EV_WRITE, metrics_write, mc);
+}
+
+static void metrics_accept(struct ev_ctx *ctx, void *arg) {
+    (void) arg;
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("Metrics accept failed: %s", strerror(errno));
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        struct metrics_conn *mc = try_alloc(sizeof(*mc));
+        mc->fd = fd;
+        mc->rlen = mc->sent = 0;
+        mc->out = (struct metrics_buf) { NULL, 0, 0 };
+        ev_timer_init(&mc->timer, metrics_expired, mc);
+        ev_timer_add(ctx, &mc->timer, METRICS_IDLE_SECS);
+        ev_register_event(ctx, fd, EV_READ, metrics_read, mc);
+    }
+}
+
+void metrics_start(struct ev_ctx *ctx, const char *addr, const char *port) {
+    listen_fd = make_listen(addr, port, INET);
+    ev_register_event(ctx, listen_fd, EV_READ, metrics_accept, NULL);
+    log_info("Serving metrics on http://%s:%s/metrics", addr, port);
+}
+
+void metrics_stop(void) {
+    if (listen_fd >= 0)
+        close(listen_fd);
+    listen_fd = -1;
+}
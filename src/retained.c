@@ -0,0 +1,532 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "retained.h"
+#include "memory.h"
+#include "logging.h"
+
+#define RETAINED_MAGIC          0x534f4c52 // "SOLR"
+#define RETAINED_VERSION        1
+#define RETAINED_SEGMENT_SIZE   (64 * 1024 * 1024)
+#define RETAINED_MAX_SEGMENTS   UINT16_MAX
+#define RETAINED_MIN_SLOTS      4096
+// Compact once garbage is past half the data and at least this many bytes
+#define RETAINED_COMPACT_MIN    (4 * 1024 * 1024)
+#define RETAINED_PATH_MAX       4096
+// Room left in a path for the name of a file of the store
+#define RETAINED_DIR_MAX        (RETAINED_PATH_MAX - 32)
+
+/*
+ * Entries in the data segments are laid out as
+ *
+ *   | topic length (u16) | topic ... | packed PUBLISH ... |
+ *
+ * the total length of the entry is in the index slot pointing to it
+ */
+#define ENTRY_HEADER            sizeof(uint16_t)
+
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t slots;         // power of two
+    uint64_t count;         // slots in use
+    uint64_t garbage;       // bytes of the segments superseded or cleared
+    uint32_t segments;      // data segments created
+    uint32_t used;          // bytes used of the last segment
+    uint32_t generation;    // bumped by every compaction, names the segments
+    uint32_t reserved;
+};
+
+/* An empty slot has length 0, no entry can be that short */
+struct index_slot {
+    uint32_t hash;
+    uint16_t segment;
+    uint16_t reserved;
+    uint32_t offset;
+    uint32_t length;
+};
+
+bool retained_store_enabled = false;
+
+static struct {
+    pthread_mutex_t lock;
+    char dir[RETAINED_DIR_MAX];
+    struct index_header *index;
+    struct index_slot *slots;
+    size_t index_size;
+    unsigned char **segments;
+} store = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* FNV-1a, 0 is left out, it can't be told apart from a zeroed slot */
+static uint32_t topic_hash(const char *topic, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (unsigned char) topic[i]) * 16777619u;
+    return h ? h : 1;
+}
+
+static void store_path(char *path, const char *name) {
+    snprintf(path, RETAINED_PATH_MAX, "%s/%s", store.dir, name);
+}
+
+/*
+ * Map a file of a given size, creating or growing it as needed, growing by
+ * ftruncate leaves it sparse, so unused space takes no room on disk.
+ */
+static void *file_map(const char *path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Failed to open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || ((size_t) st.st_size < size
+                               && ftruncate(fd, size) < 0)) {
+        log_error("Failed to size %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error("Failed to map %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    return map;
+}
+
+static void segment_path(char *path, uint32_t generation, uint32_t id) {
+    char name[32];
+    snprintf(name, sizeof(name), "retained-%u-%05u.dat", generation, id);
+    store_path(path, name);
+}
+
+static int segment_map(uint32_t id) {
+    char path[RETAINED_PATH_MAX];
+    segment_path(path, store.index->generation, id);
+    unsigned char *map = file_map(path, RETAINED_SEGMENT_SIZE);
+    if (!map)
+        return -1;
+    store.segments = try_realloc(store.segments,
+                                 (id + 1) * sizeof(*store.segments));
+    store.segments[id] = map;
+    return 0;
+}
+
+static inline size_t index_size(uint64_t slots) {
+    return sizeof(struct index_header) + slots * sizeof(struct index_slot);
+}
+
+static int index_map(const char *path, uint64_t slots) {
+    void *map = file_map(path, index_size(slots));
+    if (!map)
+        return -1;
+    store.index = map;
+    store.slots = (struct index_slot *) (store.index + 1);
+    store.index_size = index_size(slots);
+    return 0;
+}
+
+static inline const unsigned char *entry_of(const struct index_slot *slot) {
+    return store.segments[slot->segment] + slot->offset;
+}
+
+/*
+ * Linear probing from the home slot of the hash, comparing the topic of the
+ * entries with the same hash. Returns the slot of the topic, or the empty
+ * one where it would go, found is set accordingly.
+ */
+static size_t slot_find(const char *topic, size_t len,
+                        uint32_t hash, bool *found) {
+    uint64_t mask = store.index->slots - 1;
+    size_t i = hash & mask;
+    *found = false;
+    while (store.slots[i].length > 0) {
+        if (store.slots[i].hash == hash) {
+            const unsigned char *e = entry_of(&store.slots[i]);
+            uint16_t elen;
+            memcpy(&elen, e, ENTRY_HEADER);
+            if (elen == len && memcmp(e + ENTRY_HEADER, topic, len) == 0) {
+                *found = true;
+                break;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/*
+ * Double the index, slots are re-inserted by their hash alone into a new
+ * file, renamed over the current one once complete
+ */
+static int index_grow(void) {
+    char path[RETAINED_PATH_MAX], tmp[RETAINED_PATH_MAX];
+    store_path(path, "retained.idx");
+    store_path(tmp, "retained.idx.tmp");
+    unlink(tmp);
+    struct index_header *old = store.index;
+    struct index_slot *old_slots = store.slots;
+    size_t old_size = store.index_size;
+    if (index_map(tmp, old->slots * 2) < 0) {
+        store.index = old;
+        store.slots = old_slots;
+        store.index_size = old_size;
+        return -1;
+    }
+    *store.index = *old;
+    store.index->slots = old->slots * 2;
+    uint64_t mask = store.index->slots - 1;
+    for (uint64_t i = 0; i < old->slots; ++i) {
+        if (old_slots[i].length == 0)
+            continue;
+        size_t j = old_slots[i].hash & mask;
+        while (store.slots[j].length > 0)
+            j = (j + 1) & mask;
+        store.slots[j] = old_slots[i];
+    }
+    munmap(old, old_size);
+    if (rename(tmp, path) < 0) {
+        log_error("Failed to rename %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    log_info("Retained index grown to %lu slots", store.index->slots);
+    return 0;
+}
+
+/*
+ * Backward shift deletion, the slots following the one emptied are moved
+ * back unless already at or past their home slot, so that no lookup stops
+ * early on the hole and no tombstone is needed
+ */
+static void slot_delete(size_t i) {
+    uint64_t mask = store.index->slots - 1;
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (store.slots[j].length == 0)
+            break;
+        size_t home = store.slots[j].hash & mask;
+        // Can the entry in j move to the hole in i, is home out of (i, j]?
+        if ((j > i && (home <= i || home > j))
+            || (j < i && (home <= i && home > j))) {
+            store.slots[i] = store.slots[j];
+            i = j;
+        }
+    }
+    memset(&store.slots[i], 0x00, sizeof(store.slots[i]));
+}
+
+/*
+ * Remove the segments of generations other than the current one, left over
+ * by a compaction interrupted either before switching the index or before
+ * removing the segments it replaced
+ */
+static void segments_clean(void) {
+    DIR *d = opendir(store.dir);
+    if (!d)
+        return;
+    struct dirent *de;
+    char path[RETAINED_PATH_MAX];
+    unsigned generation, id;
+    while ((de = readdir(d))) {
+        if (sscanf(de->d_name, "retained-%u-%u.dat", &generation, &id) != 2
+            || generation == store.index->generation)
+            continue;
+        segment_path(path, generation, id);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+/*
+ * Rewrite the live entries into fresh segments of the next generation, along
+ * with a copy of the index pointing to them, renamed over the current one
+ * once complete, which is what switches the store to the new segments. Every
+ * entry keeps its slot, so no rehashing is needed. On failure the store is
+ * left as it was, the garbage simply waits for the next attempt.
+ */
+static int store_compact(void) {
+    char path[RETAINED_PATH_MAX], tmp[RETAINED_PATH_MAX];
+    store_path(path, "retained.idx");
+    store_path(tmp, "retained.idx.tmp");
+    unlink(tmp);
+    struct index_header *old = store.index;
+    uint32_t generation = old->generation + 1;
+    struct index_header *h = file_map(tmp, store.index_size);
+    if (!h)
+        return -1;
+    *h = *old;
+    h->generation = generation;
+    h->garbage = 0;
+    h->segments = 0;
+    h->used = RETAINED_SEGMENT_SIZE;
+    struct index_slot *slots = (struct index_slot *) (h + 1);
+    unsigned char **segments = NULL;
+    for (uint64_t i = 0; i < old->slots; ++i) {
+        slots[i] = store.slots[i];
+        if (store.slots[i].length == 0)
+            continue;
+        if (h->used + store.slots[i].length > RETAINED_SEGMENT_SIZE) {
+            segment_path(path, generation, h->segments);
+            unsigned char *map = file_map(path, RETAINED_SEGMENT_SIZE);
+            if (!map)
+                goto err;
+            segments = try_realloc(segments,
+                                   (h->segments + 1) * sizeof(*segments));
+            segments[h->segments++] = map;
+            h->used = 0;
+        }
+        memcpy(segments[h->segments - 1] + h->used,
+               entry_of(&store.slots[i]), store.slots[i].length);
+        slots[i].segment = h->segments - 1;
+        slots[i].offset = h->used;
+        h->used += store.slots[i].length;
+    }
+    // An empty store still has its first segment to append to
+    if (h->segments == 0) {
+        segment_path(path, generation, 0);
+        segments = try_alloc(sizeof(*segments));
+        if (!(segments[0] = file_map(path, RETAINED_SEGMENT_SIZE)))
+            goto err;
+        h->segments = 1;
+        h->used = 0;
+    }
+    store_path(path, "retained.idx");
+    if (rename(tmp, path) < 0) {
+        log_error("Failed to rename %s: %s", tmp, strerror(errno));
+        goto err;
+    }
+    uint64_t reclaimed = old->garbage;
+    for (uint32_t i = 0; i < old->segments; ++i) {
+        munmap(store.segments[i], RETAINED_SEGMENT_SIZE);
+        segment_path(path, old->generation, i);
+        unlink(path);
+    }
+    munmap(old, store.index_size);
+    free_memory(store.segments);
+    store.segments = segments;
+    store.index = h;
+    store.slots = slots;
+    log_info("Retained store compacted, %lu bytes reclaimed, %u segments",
+             reclaimed, h->segments);
+    return 0;
+
+err:
+    // Up to the segment that failed, its file may have been created
+    for (uint32_t i = 0; i <= h->segments; ++i) {
+        if (i < h->segments)
+            munmap(segments[i], RETAINED_SEGMENT_SIZE);
+        segment_path(path, generation, i);
+        unlink(path);
+    }
+    free_memory(segments);
+    munmap(h, store.index_size);
+    unlink(tmp);
+    return -1;
+}
+
+/* Whether the garbage is worth a compaction, past half of the data written */
+static inline bool compact_due(const struct index_header *h) {
+    uint64_t data = (uint64_t) (h->segments - 1) * RETAINED_SEGMENT_SIZE
+        + h->used;
+    return h->garbage >= RETAINED_COMPACT_MIN && h->garbage * 2 > data;
+}
+
+int retained_store_open(const char *dir) {
+    if (strlen(dir) >= RETAINED_DIR_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        log_error("Failed to create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    snprintf(store.dir, RETAINED_DIR_MAX, "%s", dir);
+    char path[RETAINED_PATH_MAX];
+    store_path(path, "retained.idx");
+    // The header tells the size to map, a missing index reads as empty
+    struct index_header header = { 0 };
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &header, sizeof(header)) != sizeof(header))
+            memset(&header, 0x00, sizeof(header));
+        close(fd);
+    }
+    if (header.magic != RETAINED_MAGIC || header.version != RETAINED_VERSION
+        || header.slots < RETAINED_MIN_SLOTS
+        || (header.slots & (header.slots - 1)) != 0) {
+        if (header.magic != 0)
+            log_warning("Invalid retained index in %s, starting empty", dir);
+        unlink(path);
+        header = (struct index_header) {
+            .magic = RETAINED_MAGIC,
+            .version = RETAINED_VERSION,
+            .slots = RETAINED_MIN_SLOTS
+        };
+    }
+    if (index_map(path, header.slots) < 0)
+        return -1;
+    *store.index = header;
+    if (store.index->segments == 0) {
+        store.index->segments = 1;
+        store.index->used = 0;
+    }
+    segments_clean();
+    for (uint32_t i = 0; i < store.index->segments; ++i) {
+        if (segment_map(i) < 0) {
+            retained_store_close();
+            return -1;
+        }
+    }
+    retained_store_enabled = true;
+    return 0;
+}
+
+void retained_store_close(void) {
+    pthread_mutex_lock(&store.lock);
+    retained_store_enabled = false;
+    if (store.index) {
+        for (uint32_t i = 0; store.segments && i < store.index->segments; ++i)
+            if (store.segments[i])
+                munmap(store.segments[i], RETAINED_SEGMENT_SIZE);
+        munmap(store.index, store.index_size);
+    }
+    free_memory(store.segments);
+    store.segments = NULL;
+    store.index = NULL;
+    store.slots = NULL;
+    pthread_mutex_unlock(&store.lock);
+}
+
+int retained_store_put(const char *topic, const unsigned char *msg,
+                       size_t len) {
+    size_t topiclen = strlen(topic);
+    size_t entry = ENTRY_HEADER + topiclen + len;
+    if (topiclen > UINT16_MAX || entry > RETAINED_SEGMENT_SIZE) {
+        log_warning("Retained message for %s too large (%lu bytes)",
+                    topic, len);
+        return -1;
+    }
+    int rc = -1;
+    pthread_mutex_lock(&store.lock);
+    struct index_header *h = store.index;
+    if (!h)
+        goto exit;
+    // Keep the load below 70% to bound probing
+    if ((h->count + 1) * 10 > h->slots * 7 && index_grow() < 0)
+        goto exit;
+    h = store.index;
+    if (h->used + entry > RETAINED_SEGMENT_SIZE) {
+        if (h->segments == RETAINED_MAX_SEGMENTS) {
+            log_error("Retained store exhausted, %u segments", h->segments);
+            goto exit;
+        }
+        if (segment_map(h->segments) < 0)
+            goto exit;
+        h->segments++;
+        h->used = 0;
+    }
+    uint32_t offset = h->used;
+    unsigned char *e = store.segments[h->segments - 1] + offset;
+    uint16_t elen = topiclen;
+    memcpy(e, &elen, ENTRY_HEADER);
+    memcpy(e + ENTRY_HEADER, topic, topiclen);
+    memcpy(e + ENTRY_HEADER + topiclen, msg, len);
+    h->used += entry;
+    // The slot is switched to the new entry only once it's complete
+    bool found = false;
+    uint32_t hash = topic_hash(topic, topiclen);
+    size_t i = slot_find(topic, topiclen, hash, &found);
+    if (found == true) {
+        h->garbage += store.slots[i].length;
+    } else {
+        h->count++;
+        store.slots[i].hash = hash;
+    }
+    store.slots[i].segment = h->segments - 1;
+    store.slots[i].offset = offset;
+    store.slots[i].length = entry;
+    if (compact_due(h) == true)
+        store_compact();
+    rc = 0;
+exit:
+    pthread_mutex_unlock(&store.lock);
+    return rc;
+}
+
+const unsigned char *retained_store_get(const char *topic, size_t *len) {
+    const unsigned char *msg = NULL;
+    size_t topiclen = strlen(topic);
+    pthread_mutex_lock(&store.lock);
+    if (!store.index)
+        goto exit;
+    bool found = false;
+    size_t i = slot_find(topic, topiclen, topic_hash(topic, topiclen), &found);
+    if (found == true) {
+        msg = entry_of(&store.slots[i]) + ENTRY_HEADER + topiclen;
+        *len = store.slots[i].length - ENTRY_HEADER - topiclen;
+    }
+exit:
+    pthread_mutex_unlock(&store.lock);
+    return msg;
+}
+
+void retained_store_del(const char *topic) {
+    size_t topiclen = strlen(topic);
+    pthread_mutex_lock(&store.lock);
+    if (!store.index)
+        goto exit;
+    bool found = false;
+    size_t i = slot_find(topic, topiclen, topic_hash(topic, topiclen), &found);
+    if (found == true) {
+        store.index->garbage += store.slots[i].length;
+        store.index->count--;
+        slot_delete(i);
+        if (compact_due(store.index) == true)
+            store_compact();
+    }
+exit:
+    pthread_mutex_unlock(&store.lock);
+}
+
+size_t retained_store_count(void) {
+    pthread_mutex_lock(&store.lock);
+    size_t count = store.index ? store.index->count : 0;
+    pthread_mutex_unlock(&store.lock);
+    return count;
+}
@@ -0,0 +1,86 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RETAINED_H
+#define RETAINED_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Retained messages store backed by memory mapped files, used in place of
+ * the heap copies held by the topics when persistence is enabled, this way
+ * retained messages survive restarts, need no reload at startup and the
+ * cold ones are left to the page cache instead of taking anonymous memory.
+ *
+ * Messages are kept packed, ready to be sent, in append-only data segments
+ * of fixed size, retained-<generation>-<n>.dat, mapped whole. A replaced or
+ * cleared message leaves its old copy behind as garbage, once that's past
+ * half of the data the live entries are copied into the segments of a new
+ * generation and the old ones removed.
+ *
+ * The index, retained.idx, is an open addressing hash table keyed by topic,
+ * mapped as well and updated in place, every slot is 16 bytes carrying the
+ * hash of the topic and the position of its entry. It's grown by rehashing
+ * into a new file renamed over the old one. Both are in host byte order.
+ * Calls are serialized by a lock of the store, entries are never modified
+ * once written so the data pointed can be read out of it, as long as the
+ * caller orders the reads with its own updates.
+ */
+
+/* Set once the store has been opened, topics keep their messages otherwise */
+extern bool retained_store_enabled;
+
+/*
+ * Open the store in a directory, creating it if missing, along with its
+ * index and first data segment. Returns 0 on success, -1 otherwise.
+ */
+int retained_store_open(const char *);
+
+void retained_store_close(void);
+
+/*
+ * Set the retained message of a topic, replacing the previous one if any.
+ * The message is copied packed as passed in. Returns 0 on success, -1 if it
+ * can't fit in a segment or the storage is exhausted.
+ */
+int retained_store_put(const char *, const unsigned char *, size_t);
+
+/*
+ * Get the packed retained message of a topic, storing its size in the last
+ * argument, NULL if there's none. The pointer is into the mapped data and
+ * valid till the next put or del, either can compact the store.
+ */
+const unsigned char *retained_store_get(const char *, size_t *);
+
+/* Clear the retained message of a topic, if any */
+void retained_store_del(const char *);
+
+/* Number of retained messages stored */
+size_t retained_store_count(void);
+
+#endif
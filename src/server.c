@@ -26,9 +26,16 @@
  */
 
 #include <fcntl.h>
+#include <limits.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "ev.h"
 #include "network.h"
 #include "config.h"
@@ -37,7 +44,13 @@
 #include "logging.h"
 #include "handlers.h"
 #include "memorypool.h"
+#include "metrics.h"
 #include "sol_internal.h"
+#include "trace.h"
+#include "wal.h"
+#include "retained.h"
+#include "spill.h"
+#include "upgrade.h"
 
 pthread_mutex_t mutex;
 
@@ -61,6 +74,15 @@ static const double SOL_SECONDS = 88775.24;
  */
 struct sol_info info;
 
+/*
+ * Every loop thread claims a statistics shard when it starts, the others keep
+ * using the shared one, the last
+ */
+_Thread_local struct sol_stats *thread_stats =
+    &info.shards[STATS_SHARDS - 1].stats;
+
+static atomic_int stats_shards_used = ATOMIC_VAR_INIT(0);
+
 /* Broker global instance, contains the topic trie and the clients hashtable */
 struct server server;
 
@@ -117,6 +139,8 @@ static void client_init(struct client *);
 
 static void client_deactivate(struct client *);
 
+static void client_close(struct ev_ctx *, struct client *);
+
 // CALLBACKS for the eventloop
 static void accept_callback(struct ev_ctx *, void *);
 
@@ -130,6 +154,35 @@ static void write_callback(struct ev_ctx *, void *);
  */
 static void process_message(struct ev_ctx *, struct client *);
 
+static void handle_packet(struct ev_ctx *, struct io_event *);
+
+static void auth_ready(struct auth_request *);
+
+static void auth_callback(struct ev_ctx *, void *);
+
+/*
+ * Password verifications completed by the auth pool are handed back to the
+ * loop owning the client through a mailbox of its own, a queue of requests
+ * and a descriptor to wake the loop up, as only that loop can safely resume
+ * or drop the CONNECT waiting. Each request queued holds a reference.
+ */
+struct auth_mailbox {
+    pthread_mutex_t lock;
+    List *done;
+    int fds[2];
+};
+
+/* A CONNECT waiting for its password, along with the mailbox to resume it */
+struct auth_pending {
+    struct io_event io;
+    struct auth_mailbox *box;
+};
+
+static struct auth_mailbox auth_boxes[STATS_SHARDS];
+
+/* Mailbox of the calling loop, if passwords are verified */
+static _Thread_local struct auth_mailbox *auth_box;
+
 /* Periodic routine to publish general stats about the broker on $SOL topics */
 static void publish_stats(struct ev_ctx *, void *);
 
@@ -139,11 +192,29 @@ static void publish_stats(struct ev_ctx *, void *);
  */
 static void inflight_msg_check(struct ev_ctx *, void *);
 
+/*
+ * Periodic routine to compute the memory pressure level and reclaim memory
+ * accordingly
+ */
+static void memory_check(struct ev_ctx *, void *);
+
+/* Periodic routine to shrink the buffers of idle clients of a loop */
+static void release_idle_buffers(struct ev_ctx *, void *);
+
+/*
+ * Periodic routine to take snapshots of the persistent sessions, compacting
+ * the write-ahead log
+ */
+static void snapshot_check(struct ev_ctx *, void *);
+
+/* Loop instrumentation, records the poll wait and busy times of each cycle */
+static void loop_probe(struct ev_ctx *, unsigned long long, unsigned long long);
+
 /*
  * Statistics topics, published every N seconds defined by configuration
  * interval
  */
-#define SYS_TOPICS 11
+#define SYS_TOPICS 23
 
 /*
  * Utility struct for information topics. Just the name of the topic and his
@@ -166,7 +237,51 @@ static const struct sys_topic sys_topics[SYS_TOPICS] = {
     { "$SOL/broker/bytes/received/", 27 },
     { "$SOL/broker/messages/sent/", 26 },
     { "$SOL/broker/messages/received/", 30 },
-    { "$SOL/broker/memory/used", 23 }
+    { "$SOL/broker/memory/used", 23 },
+    { "$SOL/broker/memory/max", 22 },
+    { "$SOL/broker/memory/pressure", 27 },
+    { "$SOL/broker/memory/retained_evicted", 35 },
+    { "$SOL/broker/memory/queued_trimmed", 33 },
+    { "$SOL/broker/memory/connections_rejected", 39 },
+    { "$SOL/broker/messages/dropped", 28 },
+    { "$SOL/broker/messages/retransmitted", 34 },
+    { "$SOL/broker/messages/inflight", 29 },
+    { "$SOL/broker/queues/messages", 27 },
+    { "$SOL/broker/queues/bytes", 24 },
+    { "$SOL/broker/queues/dropped", 26 },
+    { "$SOL/broker/packets/", 20 }
+};
+
+/*
+ * Names of the MQTT packet types, used as the last level of the per-type
+ * packets counters topics, $SOL/broker/packets/{received,sent}/<type>
+ */
+const char *const packet_names[16] = {
+    NULL, "connect", "connack", "publish", "puback", "pubrec", "pubrel",
+    "pubcomp", "subscribe", "suback", "unsubscribe", "unsuback", "pingreq",
+    "pingresp", "disconnect", NULL
+};
+
+/*
+ * Latency histograms, published as a set of percentiles, in nanoseconds, on
+ * $SOL/broker/latency/<name>/<percentile>
+ */
+#define LATENCY_PERCENTILES 4
+
+const char *const latency_names[LATENCY_METRICS] = {
+    "poll_wait", "loop_busy", "publish", "write", "puback"
+};
+
+static const struct {
+    const char *name;
+    double value;
+} latency_percentiles[LATENCY_PERCENTILES] = {
+    { "p50", 50.0 }, { "p90", 90.0 }, { "p99", 99.0 }, { "p999", 99.9 }
+};
+
+/* Memory pressure levels names, published on $SOL/broker/memory/pressure */
+static const char *memory_levels[] = {
+    "normal", "high", "critical", "exhausted"
 };
 
 /* Simple error_code to string function, to be refined */
@@ -205,24 +320,192 @@ static const char *solerr(int rc) {
  * ====================================================
  */
 
+/*
+ * Topics are stored with a trailing '/' to mark the last hierarchical level,
+ * the same goes for information topics, so they can be subscribed to exactly
+ * like any other topic.
+ */
+static inline void sys_topic_key(const struct sys_topic *st, char *key) {
+    snprintf(key, st->len + 2, "%s%s",
+             st->name, st->name[st->len - 1] == '/' ? "" : "/");
+}
+
+/*
+ * Publish a value, as a string, on an information topic, the topic name sent
+ * out is the first topiclen chars of its key
+ */
+static void publish_sys_value(const char *key, size_t topiclen,
+                              const char *value) {
+    struct topic *t = topic_store_get(server.store, key);
+    if (!t)
+        return;
+    struct mqtt_packet p = {
+        .header = (union mqtt_header) { .byte = PUBLISH_B },
+        .publish = (struct mqtt_publish) {
+            .pkt_id = 0,
+            .topiclen = topiclen,
+            .topic = (unsigned char *) key,
+            .payloadlen = strlen(value),
+            .payload = (unsigned char *) value
+        }
+    };
+    publish_message(&p, t, NULL);
+}
+
+/* Publish a value, as a string, on one of the information topics */
+static void publish_sys_topic(int idx, const char *value) {
+    const struct sys_topic *st = &sys_topics[idx];
+    char key[st->len + 2];
+    sys_topic_key(st, key);
+    publish_sys_value(key, st->len, value);
+}
+
+/*
+ * Topic key of a packets counter, dir is either "received" or "sent", returns
+ * false for the packet types not defined by the protocol
+ */
+static bool packet_topic_key(const char *dir, int type, char *key, size_t len) {
+    if (!packet_names[type])
+        return false;
+    snprintf(key, len, "%s%s/%s/", sys_topics[22].name, dir, packet_names[type]);
+    return true;
+}
+
+static void latency_topic_key(int metric, int pct, char *key, size_t len) {
+    snprintf(key, len, "$SOL/broker/latency/%s/%s/",
+             latency_names[metric], latency_percentiles[pct].name);
+}
+
+/* Publish the percentiles of every latency histogram */
+static void publish_latency_stats(const struct sol_stats *st) {
+    char key[64], value[21];
+    for (int i = 0; i < LATENCY_METRICS; ++i) {
+        for (int j = 0; j < LATENCY_PERCENTILES; ++j) {
+            latency_topic_key(i, j, key, sizeof(key));
+            uint64_t ns = histogram_percentile(&st->latency[i],
+                                               latency_percentiles[j].value);
+            snprintf(value, 21, "%llu", (unsigned long long) ns);
+            publish_sys_value(key, strlen(key) - 1, value);
+        }
+    }
+}
+
+/* Publish the counters of packets received and sent, by type */
+static void publish_packet_stats(const struct sol_stats *st) {
+    char key[64], value[21];
+    for (int i = 0; i < 16; ++i) {
+        if (packet_topic_key("received", i, key, sizeof(key))) {
+            snprintf(value, 21, "%lu", st->packets_recv[i]);
+            publish_sys_value(key, strlen(key) - 1, value);
+        }
+        if (packet_topic_key("sent", i, key, sizeof(key))) {
+            snprintf(value, 21, "%lu", st->packets_sent[i]);
+            publish_sys_value(key, strlen(key) - 1, value);
+        }
+    }
+}
+
+/*
+ * Cost of the packet handlers, by packet type received, time in nanoseconds:
+ * $SOL/broker/handlers/<type>/{calls,time,slow}
+ * and the time each loop spent in them, $SOL/broker/handlers/loops/<n>/time
+ */
+#define HANDLER_FIELDS 3
+
+static const char *const handler_fields[HANDLER_FIELDS] = {
+    "calls", "time", "slow"
+};
+
+static bool handler_topic_key(int type, int field, char *key, size_t len) {
+    if (!packet_names[type])
+        return false;
+    snprintf(key, len, "$SOL/broker/handlers/%s/%s/",
+             packet_names[type], handler_fields[field]);
+    return true;
+}
+
+static void handler_loop_topic_key(int loop, char *key, size_t len) {
+    snprintf(key, len, "$SOL/broker/handlers/loops/%d/time/", loop);
+}
+
+/* Publish the cost of the packet handlers, skipping the ones never called */
+static void publish_handler_stats(const struct sol_stats *st) {
+    char key[64], value[21];
+    for (int i = 0; i < 16; ++i) {
+        if (st->handler_calls[i] == 0)
+            continue;
+        const atomic_size_t *values[HANDLER_FIELDS] = {
+            &st->handler_calls[i], &st->handler_ns[i], &st->handler_slow[i]
+        };
+        for (int j = 0; j < HANDLER_FIELDS; ++j) {
+            if (!handler_topic_key(i, j, key, sizeof(key)))
+                break;
+            snprintf(value, 21, "%lu", *values[j]);
+            publish_sys_value(key, strlen(key) - 1, value);
+        }
+    }
+    int loops = atomic_load(&stats_shards_used);
+    for (int i = 0; i < loops && i < STATS_SHARDS - 1; ++i) {
+        size_t ns = 0;
+        for (int j = 0; j < 16; ++j)
+            ns += atomic_load_explicit(&info.shards[i].stats.handler_ns[j],
+                                       memory_order_relaxed);
+        handler_loop_topic_key(i, key, sizeof(key));
+        snprintf(value, 21, "%lu", ns);
+        publish_sys_value(key, strlen(key) - 1, value);
+    }
+}
+
+/* Create the topic of a $SOL statistic, the ones published on are set up */
+static void sys_topic_add(const char *key) {
+    struct topic *t = topic_new(try_strdup(key));
+    if (!t)
+        log_fatal("start_server failed: Out of memory");
+    topic_store_put(server.store, t);
+}
+
+/*
+ * Sum up the statistics shards, reads are relaxed too, the snapshot isn't
+ * atomic as a whole, each counter is
+ */
+void sol_stats_collect(struct sol_stats *st) {
+    atomic_size_t *out = (atomic_size_t *) st;
+    size_t n = sizeof(*st) / sizeof(atomic_size_t);
+    memset(st, 0x00, sizeof(*st));
+    for (int i = 0; i < STATS_SHARDS; ++i) {
+        atomic_size_t *in = (atomic_size_t *) &info.shards[i].stats;
+        for (size_t j = 0; j < n; ++j)
+            atomic_fetch_add_explicit(&out[j], atomic_load_explicit(&in[j],
+                                      memory_order_relaxed),
+                                      memory_order_relaxed);
+    }
+}
+
 /*
  * Publish statistics periodic task, it will be called once every N config
  * defined seconds, it publishes some informations on predefined topics
  */
 static void publish_stats(struct ev_ctx *ctx, void *data) {
-    (void)data;
+    (void) ctx;
+    (void) data;
+
+    struct sol_stats st;
+    sol_stats_collect(&st);
 
     char cclients[21];
     snprintf(cclients, 21, "%lu", info.active_connections);
 
     char bsent[21];
-    snprintf(bsent, 21, "%lu", info.bytes_sent);
+    snprintf(bsent, 21, "%lu", st.bytes_sent);
+
+    char brecv[21];
+    snprintf(brecv, 21, "%lu", st.bytes_recv);
 
     char msent[21];
-    snprintf(msent, 21, "%lu", info.messages_sent);
+    snprintf(msent, 21, "%lu", st.messages_sent);
 
     char mrecv[21];
-    snprintf(mrecv, 21, "%lu", info.messages_recv);
+    snprintf(mrecv, 21, "%lu", st.messages_recv);
 
     long long uptime = time(NULL) - info.start_time;
     char utime[21];
@@ -236,67 +519,217 @@ static void publish_stats(struct ev_ctx *ctx, void *data) {
     char mem[21];
     snprintf(mem, 21, "%lld", memory);
 
-    // $SOL/uptime
-    struct mqtt_packet p = {
-        .header = (union mqtt_header) { .byte = PUBLISH_B },
-        .publish = (struct mqtt_publish) {
-            .pkt_id = 0,
-            .topiclen = sys_topics[2].len,
-            .topic = (unsigned char *) sys_topics[2].name,
-            .payloadlen = strlen(utime),
-            .payload = (unsigned char *) &utime
-        }
-    };
+    char mmax[21];
+    snprintf(mmax, 21, "%lu", conf->max_memory);
 
-    publish_message(&p, topic_store_get(server.store, sys_topics[2].name));
+    char revicted[21];
+    snprintf(revicted, 21, "%lu", info.retained_evicted);
 
-    // $SOL/broker/uptime/sol
-    p.publish.topiclen = sys_topics[3].len;
-    p.publish.topic = (unsigned char *) sys_topics[3].name;
-    p.publish.payloadlen = strlen(sutime);
-    p.publish.payload = (unsigned char *) &sutime;
+    char qtrimmed[21];
+    snprintf(qtrimmed, 21, "%lu", info.queued_trimmed);
 
-    publish_message(&p, topic_store_get(server.store, sys_topics[3].name));
+    char crejected[21];
+    snprintf(crejected, 21, "%lu", info.connections_rejected);
 
-    // $SOL/broker/clients/connected
-    p.publish.topiclen = sys_topics[4].len;
-    p.publish.topic = (unsigned char *) sys_topics[4].name;
-    p.publish.payloadlen = strlen(cclients);
-    p.publish.payload = (unsigned char *) &cclients;
+    char mdropped[21];
+    snprintf(mdropped, 21, "%lu", st.messages_dropped);
+
+    char mretrans[21];
+    snprintf(mretrans, 21, "%lu", st.messages_retransmitted);
+
+    char minflight[21];
+    snprintf(minflight, 21, "%lu", st.inflight_messages);
+
+    char qmessages[21];
+    snprintf(qmessages, 21, "%lu", st.queued_messages);
+
+    char qbytes[21];
+    snprintf(qbytes, 21, "%lu", st.queued_bytes);
+
+    char qdropped[21];
+    snprintf(qdropped, 21, "%lu", st.queued_dropped);
+
+    // $SOL/uptime
+    publish_sys_topic(2, utime);
+
+    // $SOL/broker/uptime/sol
+    publish_sys_topic(3, sutime);
 
-    publish_message(&p, topic_store_get(server.store, sys_topics[4].name));
+    // $SOL/broker/clients/connected
+    publish_sys_topic(4, cclients);
 
     // $SOL/broker/bytes/sent
-    p.publish.topiclen = sys_topics[6].len;
-    p.publish.topic = (unsigned char *) sys_topics[6].name;
-    p.publish.payloadlen = strlen(bsent);
-    p.publish.payload = (unsigned char *) &bsent;
+    publish_sys_topic(6, bsent);
 
-    publish_message(&p, topic_store_get(server.store, sys_topics[6].name));
+    // $SOL/broker/bytes/received
+    publish_sys_topic(7, brecv);
 
     // $SOL/broker/messages/sent
-    p.publish.topiclen = sys_topics[8].len;
-    p.publish.topic = (unsigned char *) sys_topics[8].name;
-    p.publish.payloadlen = strlen(msent);
-    p.publish.payload = (unsigned char *) &msent;
-
-    publish_message(&p, topic_store_get(server.store, sys_topics[8].name));
+    publish_sys_topic(8, msent);
 
     // $SOL/broker/messages/received
-    p.publish.topiclen = sys_topics[9].len;
-    p.publish.topic = (unsigned char *) sys_topics[9].name;
-    p.publish.payloadlen = strlen(mrecv);
-    p.publish.payload = (unsigned char *) &mrecv;
-
-    publish_message(&p, topic_store_get(server.store, sys_topics[9].name));
+    publish_sys_topic(9, mrecv);
 
     // $SOL/broker/memory/used
-    p.publish.topiclen = sys_topics[10].len;
-    p.publish.topic = (unsigned char *) sys_topics[10].name;
-    p.publish.payloadlen = strlen(mem);
-    p.publish.payload = (unsigned char *) &mem;
+    publish_sys_topic(10, mem);
+
+    // $SOL/broker/memory/max
+    publish_sys_topic(11, mmax);
+
+    // $SOL/broker/memory/pressure
+    publish_sys_topic(12, memory_levels[info.memory_level]);
+
+    // $SOL/broker/memory/retained_evicted
+    publish_sys_topic(13, revicted);
+
+    // $SOL/broker/memory/queued_trimmed
+    publish_sys_topic(14, qtrimmed);
+
+    // $SOL/broker/memory/connections_rejected
+    publish_sys_topic(15, crejected);
+
+    // $SOL/broker/messages/dropped
+    publish_sys_topic(16, mdropped);
+
+    // $SOL/broker/messages/retransmitted
+    publish_sys_topic(17, mretrans);
+
+    // $SOL/broker/messages/inflight
+    publish_sys_topic(18, minflight);
+
+    // $SOL/broker/queues/messages
+    publish_sys_topic(19, qmessages);
+
+    // $SOL/broker/queues/bytes
+    publish_sys_topic(20, qbytes);
+
+    // $SOL/broker/queues/dropped
+    publish_sys_topic(21, qdropped);
 
-    publish_message(&p, topic_store_get(server.store, sys_topics[10].name));
+    // $SOL/broker/packets/{received,sent}/<type>
+    publish_packet_stats(&st);
+
+    // $SOL/broker/latency/<name>/<percentile>
+    publish_latency_stats(&st);
+
+    // $SOL/broker/handlers/<type>/{calls,time,slow}
+    publish_handler_stats(&st);
+}
+
+/*
+ * Auxiliary function to be mapped on every topic of the store, evict the
+ * retained message of topics that have been idle for long enough
+ */
+static void evict_retained(struct trie_node *node, void *arg) {
+    if (!node || !node->data)
+        return;
+    struct topic *t = node->data;
+    time_t now = *((time_t *) arg);
+    if (!t->retained_msg || now - t->last_seen < MEMORY_IDLE_SECS)
+        return;
+    log_debug("Evicting retained message of %s (%lu bytes)",
+              t->name, alloc_size(t->retained_msg));
+    free_memory(t->retained_msg);
+    t->retained_msg = NULL;
+    info.retained_evicted++;
+}
+
+/*
+ * Memory governor periodic task, it computes the pressure level by comparing
+ * the memory in use with the max_memory configured and applies the tiers of
+ * load shedding that run from the main loop: eviction of idle retained
+ * messages and trimming of offline session queues.
+ * Release of idle client buffers is carried out by each loop for the clients
+ * it owns, see release_idle_buffers, while new connections are refused
+ * directly by the connect handler.
+ */
+static void memory_check(struct ev_ctx *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    if (conf->max_memory == 0)
+        return;
+    size_t pct = memory_used() * 100 / conf->max_memory;
+    int level = MEMORY_NORMAL;
+    if (pct >= MEMORY_EXHAUSTED_PCT)
+        level = MEMORY_EXHAUSTED;
+    else if (pct >= MEMORY_CRITICAL_PCT)
+        level = MEMORY_CRITICAL;
+    else if (pct >= MEMORY_HIGH_PCT)
+        level = MEMORY_HIGH;
+    if (level != info.memory_level)
+        log_warning("Memory pressure %s -> %s (%lu%% of %lu bytes used)",
+                    memory_levels[info.memory_level], memory_levels[level],
+                    pct, conf->max_memory);
+    info.memory_level = level;
+    if (level == MEMORY_NORMAL)
+        return;
+    time_t now = time(NULL);
+#if THREADSNR > 0
+    pthread_mutex_lock(&mutex);
+#endif
+    topic_store_map(server.store, NULL, evict_retained, &now);
+    if (level >= MEMORY_CRITICAL) {
+        /*
+         * Halve the queue of every offline session, the oldest messages go
+         * first
+         */
+        struct client_session *s, *tmp;
+        HASH_ITER(hh, server.sessions, s, tmp) {
+            if (!has_queued(s))
+                continue;
+            struct client *c = client_id_get(s->handle)->client;
+            if (c && c->online == true)
+                continue;
+            info.queued_trimmed +=
+                session_trim_queue(s, queued_count(s) / 2);
+        }
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+/*
+ * Shrink the read buffer of the idle clients owned by the calling loop, it
+ * runs periodically on every loop, as the read buffer is accessed only by the
+ * thread owning the client no further synchronization is required. The
+ * buffer will grow again on demand as soon as a new packet is received.
+ * Write buffers are left untouched, as they're filled by other threads as
+ * well.
+ */
+static void release_idle_buffers(struct ev_ctx *ctx, void *data) {
+    (void) data;
+    if (info.memory_level < MEMORY_HIGH)
+        return;
+    time_t now = time(NULL);
+    struct client *c, *tmp;
+#if THREADSNR > 0
+    pthread_mutex_lock(&mutex);
+#endif
+    HASH_ITER(hh, server.clients_map, c, tmp) {
+        if (c->ctx != ctx || c->online == false || !c->rbuf)
+            continue;
+        if (c->status != WAITING_HEADER || c->read > 0
+            || now - c->last_seen < MEMORY_IDLE_SECS
+            || alloc_size(c->rbuf) <= IDLE_CLIENT_BUFSIZE)
+            continue;
+        log_debug("Shrinking read buffer of %s", c->client_id);
+        c->rbuf = try_realloc(c->rbuf, IDLE_CLIENT_BUFSIZE);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+/*
+ * Loop probe, called at the end of every cycle of each loop, which records on
+ * the statistics shard of the loop thread
+ */
+static void loop_probe(struct ev_ctx *ctx, unsigned long long wait,
+                       unsigned long long busy) {
+    (void) ctx;
+    STAT_LATENCY(LATENCY_POLL_WAIT, wait);
+    STAT_LATENCY(LATENCY_LOOP_BUSY, busy);
 }
 
 /*
@@ -311,12 +744,17 @@ static void inflight_msg_check(struct ev_ctx *ctx, void *data) {
     (void) data;
     (void) ctx;
     size_t size = 0;
-    time_t now = time(NULL);
     struct mqtt_packet *p = NULL;
     struct client *c, *tmp;
 #if THREADSNR > 0
     pthread_mutex_lock(&mutex);
 #endif
+    /*
+     * Read once the lock is held, a message sent meanwhile would look as
+     * sent in the future, the unsigned difference wrapping into a timeout
+     */
+    time_t now = time(NULL);
+    uint64_t now_ns = clock_ns();
     HASH_ITER(hh, server.clients_map, c, tmp) {
         if (!c || !c->connected || !c->session || !has_inflight(c->session))
             continue;
@@ -327,8 +765,10 @@ static void inflight_msg_check(struct ev_ctx *ctx, void *data) {
             // TODO remove 20 hardcoded value
             // Messages
             if (c->session->i_msgs[i].packet
-                && (now - c->session->i_msgs[i].seen) > 20) {
+                && (now_ns - c->session->i_msgs[i].sent) / 1000000000 > 20) {
                 log_debug("Re-sending message to %s", c->client_id);
+                TRACE(inflight__retransmit, c, c->client_id, i,
+                      now_ns - c->session->i_msgs[i].sent);
                 p = c->session->i_msgs[i].packet;
                 p->header.bits.qos = c->session->i_msgs[i].qos;
                 // Set DUP flag to 1
@@ -339,23 +779,27 @@ static void inflight_msg_check(struct ev_ctx *ctx, void *data) {
                 c->towrite += size;
                 enqueue_event_write(c);
                 // Update information stats
-                info.messages_sent++;
+                STAT_INC(messages_sent);
+                STAT_INC(messages_retransmitted);
+                STAT_INC(packets_sent[PUBLISH]);
             }
-            // ACKs
-            if (c->session->i_acks[i] > 0
-                && (now - c->session->i_acks[i]) > 20) {
+            // ACKs, a message just re-sent will be acked again
+            else if (c->session->i_acks[i] > 0
+                     && (now - c->session->i_acks[i]) > 20) {
                 log_debug("Re-sending ack to %s", c->client_id);
-                struct mqtt_packet ack;
+                struct mqtt_packet ack = {
+                    .header = (union mqtt_header) { .byte = PUBREL_B }
+                };
                 mqtt_ack(&ack, i);
-                // Set DUP flag to 1
-                mqtt_set_dup(&ack);
                 size = mqtt_size(&ack, NULL);
                 // Serialize the packet and send it out again
-                mqtt_pack(p, c->wbuf + c->towrite);
+                mqtt_pack(&ack, c->wbuf + c->towrite);
                 c->towrite += size;
                 enqueue_event_write(c);
                 // Update information stats
-                info.messages_sent++;
+                STAT_INC(messages_sent);
+                STAT_INC(messages_retransmitted);
+                STAT_INC(packets_sent[PUBREL]);
             }
         }
 #if THREADSNR > 0
@@ -367,6 +811,155 @@ static void inflight_msg_check(struct ev_ctx *ctx, void *data) {
 #endif
 }
 
+/*
+ * Snapshot of the persistent sessions being written by a child process, the
+ * sequence number it covers, and the one covered by the last snapshot taken
+ */
+static struct {
+    pid_t pid;
+    uint64_t lsn;
+    uint64_t taken;
+    uint64_t started;
+    time_t last;
+} snapshot;
+
+/*
+ * Fork a child writing a snapshot of the persistent sessions. The fork is
+ * done holding the global lock, every change to the sessions except for the
+ * acks is applied and logged under it, so the child sees the sessions as the
+ * records up to the rotation of the log left them, sharing their memory
+ * copy-on-write with the loops, which carry on as soon as the lock is
+ * released. An ack logged after the rotation but already applied is just
+ * replayed again on top of the snapshot, finding nothing left to release.
+ */
+static void snapshot_start(void) {
+    pid_t pid = -1;
+#if THREADSNR > 0
+    pthread_mutex_lock(&mutex);
+#endif
+    uint64_t lsn = wal_rotate();
+    if (lsn > snapshot.taken)
+        pid = fork();
+    if (pid == 0) {
+        // No logging in here, the log writer thread didn't survive the fork
+        int err = 0;
+        struct wal_snapshot *snap = wal_snapshot_begin(lsn);
+        if (!snap || session_snapshot(snap, false) < 0)
+            err = errno ? errno : EIO;
+        if (snap && wal_snapshot_end(snap) < 0 && err == 0)
+            err = errno ? errno : EIO;
+        _exit(err);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    snapshot.last = time(NULL);
+    if (pid < 0) {
+        // Nothing new since the last snapshot otherwise
+        if (lsn > snapshot.taken)
+            log_error("Failed to fork the snapshot: %s", strerror(errno));
+        return;
+    }
+    snapshot.pid = pid;
+    snapshot.lsn = lsn;
+    snapshot.started = clock_ns();
+}
+
+/*
+ * Collect the child writing the snapshot, blocking or not according to the
+ * flags, then compact the log if it succeeded
+ */
+static void snapshot_finish(int flags) {
+    int status = 0;
+    pid_t pid = waitpid(snapshot.pid, &status, flags);
+    if (pid == 0)
+        return;
+    snapshot.pid = 0;
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        log_error("Snapshot up to record %llu failed: %s",
+                  (unsigned long long) snapshot.lsn,
+                  pid < 0 ? strerror(errno) : !WIFEXITED(status)
+                  ? "killed by a signal" : strerror(WEXITSTATUS(status)));
+        wal_snapshot_abort();
+        return;
+    }
+    long removed = wal_snapshot_commit(snapshot.lsn);
+    if (removed < 0)
+        return;
+    snapshot.taken = snapshot.lsn;
+    log_info("Snapshot up to record %llu taken in %.3fs, %ld log segments "
+             "removed", (unsigned long long) snapshot.lsn,
+             (clock_ns() - snapshot.started) / 1e9, removed);
+}
+
+static void snapshot_check(struct ev_ctx *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    if (snapshot.pid > 0)
+        snapshot_finish(WNOHANG);
+    else if (time(NULL) - snapshot.last >= (time_t) conf->snapshot_interval)
+        snapshot_start();
+}
+
+/*
+ * Binary upgrade in progress, the new process and the channel to it, ready
+ * once it asked for the state along with its settings, handed over as soon
+ * as all the loops stopped
+ */
+static struct {
+    pid_t pid;
+    int channel;
+    bool ready;
+    struct upgrade_msg params;
+} upgrading = { .channel = -1 };
+
+static void upgrade_ready(struct ev_ctx *, void *);
+
+/*
+ * Upgrade requested, exec the new binary and wait for it to be ready, the
+ * loops keep serving meanwhile
+ */
+static void upgrade_start(struct ev_ctx *ctx, void *data) {
+    (void) data;
+    if (upgrading.pid > 0) {
+        log_warning("Upgrade already in progress, pid %d", (int) upgrading.pid);
+        return;
+    }
+    upgrading.channel = upgrade_spawn(&upgrading.pid);
+    if (upgrading.channel < 0) {
+        log_error("Unable to start the upgrade: %s", strerror(errno));
+        upgrading.pid = 0;
+        return;
+    }
+    log_info("Upgrading, new process started with pid %d", (int) upgrading.pid);
+    ev_register_event(ctx, upgrading.channel, EV_READ, upgrade_ready, NULL);
+}
+
+/*
+ * The new process asked for the state, or died before, in that case this one
+ * just carries on. Otherwise all the loops are stopped, start_server hands
+ * the state over once they're all done.
+ */
+static void upgrade_ready(struct ev_ctx *ctx, void *data) {
+    (void) data;
+    ev_del_fd(ctx, upgrading.channel);
+    int n = upgrade_recv(upgrading.channel, &upgrading.params, NULL, 0);
+    if (n < 0 || upgrading.params.type != UPGRADE_READY) {
+        log_error("Upgrade aborted, pid %d failed to start: %s",
+                  (int) upgrading.pid,
+                  n < 0 ? strerror(errno) : "unexpected message");
+        close(upgrading.channel);
+        upgrading.channel = -1;
+        // The channel is closed only by exiting, it's not going to block
+        waitpid(upgrading.pid, NULL, 0);
+        upgrading.pid = 0;
+        return;
+    }
+    upgrading.ready = true;
+    log_info("Handing over to pid %d", (int) upgrading.pid);
+    stop_server();
+}
+
 /*
  * ======================================================
  *  Private functions and callbacks for server behaviour
@@ -382,7 +975,8 @@ static void client_init(struct client *client) {
     client->online = true;
     client->connected = false;
     client->clean_session = true;
-    client->client_id[0] = '\0';
+    client->handle = CLIENT_ID_NONE;
+    client->client_id = client_id_get(CLIENT_ID_NONE)->id;
     client->status = WAITING_HEADER;
     client->rc = 0;
     client->rpos = ATOMIC_VAR_INIT(0);
@@ -392,14 +986,120 @@ static void client_init(struct client *client) {
         client->rbuf = try_calloc(conf->max_request_size, sizeof(unsigned char));
     client->wrote = ATOMIC_VAR_INIT(0);
     client->towrite = ATOMIC_VAR_INIT(0);
+    client->write_queued = ATOMIC_VAR_INIT(0);
     if (!client->wbuf)
         client->wbuf = try_calloc(conf->max_request_size, sizeof(unsigned char));
     client->last_seen = time(NULL);
+    // Till a CONNECT negotiates it, the server keepalive applies
+    client->keepalive = conf->keepalive > USHRT_MAX ? USHRT_MAX : conf->keepalive;
     client->has_lwt = false;
     client->session = NULL;
+    client->congested = false;
+    client->paused = PAUSE_NONE;
+    client->blocked = NULL;
+    client->auth = NULL;
+    client->held_acks = NULL;
+    client->acks_blocked = false;
+    memset(client->topics, 0, sizeof(client->topics));
     pthread_mutex_init(&client->mutex, NULL);
 }
 
+/*
+ * Pause the reads of a client if requested by backpressure, leaving the
+ * descriptor monitored just for errors and hang ups. Must be called by the
+ * loop owning the client, it has no effect till its output has been flushed.
+ * Returns true if the client has been paused.
+ */
+static bool client_pause_reads(struct ev_ctx *ctx, struct client *c) {
+    bool paused = false;
+#if THREADSNR > 0
+    pthread_mutex_lock(&c->mutex);
+#endif
+    if (c->paused != PAUSE_NONE && c->towrite == 0) {
+        ev_fire_event(ctx, c->conn.fd, EV_NONE, read_callback, c);
+        c->paused = PAUSE_APPLIED;
+        paused = true;
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&c->mutex);
+#endif
+    return paused;
+}
+
+/*
+ * Check if the output of a slow consumer went down to the low watermark, in
+ * that case it's no more considered a slow consumer.
+ * Returns true if the client just stopped being a slow consumer.
+ */
+static bool client_output_drained(struct client *c) {
+    bool drained = false;
+#if THREADSNR > 0
+    pthread_mutex_lock(&c->mutex);
+#endif
+    if (c->congested == true
+        && c->towrite - c->wrote <= conf->output_low_watermark) {
+        c->congested = false;
+        drained = true;
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&c->mutex);
+#endif
+    return drained;
+}
+
+/*
+ * Resume the reads of all the publishers paused while feeding a client. A
+ * publisher still having some output to flush is just marked as resumed, its
+ * write callback will take care of re-arming the reads.
+ */
+static void client_resume_publishers(struct client *c) {
+#if THREADSNR > 0
+    pthread_mutex_lock(&c->mutex);
+#endif
+    List *blocked = c->blocked;
+    c->blocked = NULL;
+#if THREADSNR > 0
+    pthread_mutex_unlock(&c->mutex);
+#endif
+    if (!blocked)
+        return;
+#if THREADSNR > 0
+    pthread_mutex_lock(&mutex);
+#endif
+    list_foreach(item, blocked) {
+        struct client *pub = item->data;
+#if THREADSNR > 0
+        pthread_mutex_lock(&pub->mutex);
+#endif
+        if (pub->paused == PAUSE_APPLIED && pub->towrite == 0)
+            ev_fire_event(pub->ctx, pub->conn.fd, EV_READ, read_callback, pub);
+        if (pub->paused != PAUSE_NONE)
+            log_debug("Resuming %s", pub->client_id);
+        pub->paused = PAUSE_NONE;
+#if THREADSNR > 0
+        pthread_mutex_unlock(&pub->mutex);
+#endif
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    list_destroy(blocked, 0);
+}
+
+/*
+ * Drop the clean session of a client going away along with its
+ * subscriptions, must be called with the global lock held
+ */
+static void client_session_discard(struct client *client) {
+    uint32_t handle = client->session->handle;
+    topic_store_remove_wildcard(server.store, handle);
+    list_foreach(item, client->session->subscriptions) {
+        topic_del_subscriber(item->data, handle);
+    }
+    HASH_DEL(server.sessions, client->session);
+    DECREF(client->session, struct client_session);
+}
+
 /*
  * As we really don't want to completely de-allocate a client in favor of
  * making it reusable by another connection we simply deactivate it according
@@ -408,11 +1108,37 @@ static void client_init(struct client *client) {
  */
 static void client_deactivate(struct client *client) {
 
+    ev_timer_del(&client->keepalive_timer);
+
+    // Drop the CONNECT still waiting for its password to be verified
+    if (client->auth) {
+        auth_cancel(client->auth);
+        struct auth_pending *pending = client->auth->data;
+        if (pending) {
+            mqtt_packet_destroy(&pending->io.data);
+            free_memory(pending);
+            client->auth->data = NULL;
+        }
+        DECREF(client->auth, struct auth_request);
+        client->auth = NULL;
+    }
+
+    // Don't leave behind publishers paused because of this client
+    client_resume_publishers(client);
+
+    // Acks still waiting for a commit have no one to go to anymore
+    discard_held_acks(client);
+
 #if THREADSNR > 0
     pthread_mutex_lock(&client->mutex);
 #endif
     if (client->online == false) return;
 
+    TRACE(client__deactivate, client, client->client_id);
+
+    client->paused = PAUSE_NONE;
+    client->congested = false;
+
     client->rpos = client->toread = client->read = 0;
     client->wrote = client->towrite = 0;
     close_connection(&client->conn);
@@ -422,24 +1148,38 @@ static void client_deactivate(struct client *client) {
 #if THREADSNR > 0
     pthread_mutex_lock(&mutex);
 #endif
+    /*
+     * Persistent clients are never given back to the pool, so their buffers
+     * won't be used anymore, the others keep them to be recycled by the
+     * next connection unless memory is running low
+     */
+    if (client->clean_session == false || info.memory_level >= MEMORY_HIGH) {
+        free_memory(client->rbuf);
+        free_memory(client->wbuf);
+        client->rbuf = client->wbuf = NULL;
+    }
+    // Publishes to its ID won't find it connected anymore
+    struct client_id *id = client_id_get(client->handle);
+    if (id->client == client)
+        id->client = NULL;
+    /*
+     * Persistent clients stay on the global map, keyed by their interned ID,
+     * which is kept along with them
+     */
     if (client->clean_session == true) {
-        if (client->session) {
-            topic_store_remove_wildcard(server.store, client->client_id);
-            list_foreach(item, client->session->subscriptions) {
-                topic_del_subscriber(item->data, client);
-            }
-            HASH_DEL(server.sessions, client->session);
-            DECREF(client->session, struct client_session);
-        }
+        if (client->session)
+            client_session_discard(client);
         if (client->connected == true)
             HASH_DEL(server.clients_map, client);
+        client_id_release(client->handle);
+        client->handle = CLIENT_ID_NONE;
+        client->client_id = client_id_get(CLIENT_ID_NONE)->id;
         memorypool_free(server.pool, client);
     }
 #if THREADSNR > 0
     pthread_mutex_unlock(&mutex);
 #endif
     client->connected = false;
-    client->client_id[0] = '\0';
 #if THREADSNR > 0
     pthread_mutex_unlock(&client->mutex);
     pthread_mutex_destroy(&client->mutex);
@@ -554,6 +1294,13 @@ static ssize_t recv_packet(struct client *c) {
         c->rpos = pos + 1;
         c->toread = pktlen + pos + 1;  // pos = bytes used to store length
 
+        /*
+         * The read buffer may have been shrunk while the client was idle,
+         * grow it back to fit the entire packet
+         */
+        if (alloc_size(c->rbuf) < c->toread)
+            c->rbuf = try_realloc(c->rbuf, c->toread);
+
         /* Looks like we got an ACK packet, we're done reading */
         if (pktlen <= 4)
             goto exit;
@@ -576,6 +1323,8 @@ static ssize_t recv_packet(struct client *c) {
 
 exit:
 
+    TRACE(packet__recv, c, *c->rbuf >> 4, c->toread);
+
     return SOL_OK;
 }
 
@@ -609,7 +1358,7 @@ static inline int read_data(struct client *c) {
     if (c->read < c->toread)
         return -ERREAGAIN;
 
-    info.bytes_recv += c->read;
+    STAT_ADD(bytes_recv, c->read);
 
     return SOL_OK;
 
@@ -637,7 +1386,8 @@ static inline int write_data(struct client *c) {
     if (c->wrote < c->towrite && errno == EAGAIN)
         goto eagain;
     // Update information stats
-    info.bytes_sent += c->towrite;
+    STAT_ADD(bytes_sent, c->towrite);
+    TRACE(write__done, c, c->towrite);
     // Reset client written bytes track fields
     c->towrite = c->wrote = 0;
 #if THREADSNR > 0
@@ -671,15 +1421,41 @@ eagain:
  */
 static void write_callback(struct ev_ctx *ctx, void *arg) {
     struct client *client = arg;
+    uint64_t queued = 0;
     int err = write_data(client);
+    // Back to the low watermark, the publishers paused can go on
+    if ((err == SOL_OK || err == -ERREAGAIN) && client_output_drained(client))
+        client_resume_publishers(client);
     switch (err) {
         case SOL_OK:
+            queued = atomic_exchange(&client->write_queued, 0);
+            if (queued > 0)
+                STAT_LATENCY(LATENCY_WRITE, clock_ns() - queued);
+            /*
+             * The socket has been flushed, acks committed that didn't fit
+             * the output go out first, then if the session has a backlog of
+             * queued messages we pack the next batch and wait for the socket
+             * to be writable again before proceeding, unless its receive
+             * window is full, the acks will resume it.
+             */
+            if (client->held_acks && release_client_acks(client) == true) {
+                enqueue_event_write(client);
+                break;
+            }
+            if (client->session && has_queued(client->session)
+                && session_drain_queue(client) == true) {
+                enqueue_event_write(client);
+                break;
+            }
             /*
              * Rearm descriptor making it ready to receive input,
              * read_callback will be the callback to be used; also reset the
-             * read buffer status for the client.
+             * read buffer status for the client, unless reads have been
+             * paused by backpressure.
              */
             client->status = WAITING_HEADER;
+            if (client_pause_reads(ctx, client) == true)
+                break;
             ev_fire_event(ctx, client->conn.fd, EV_READ, read_callback, client);
             break;
         case -ERREAGAIN:
@@ -704,6 +1480,92 @@ static void write_callback(struct ev_ctx *ctx, void *arg) {
     }
 }
 
+/*
+ * Close the connection of a client lost without a DISCONNECT, whether for an
+ * error or for an expired keepalive, publishing its LWT message if present.
+ */
+static void client_close(struct ev_ctx *ctx, struct client *c) {
+    /*
+     * Publish, if present, LWT message, publish_message takes the global lock
+     * on its own. Subscribers may track the message beyond the session
+     * lifetime, so it's moved out of the session into a packet of its own.
+     */
+    if (c->has_lwt == true) {
+        struct mqtt_packet *lwt =
+            mqtt_packet_alloc(c->session->lwt_msg.header.byte);
+        lwt->publish = c->session->lwt_msg.publish;
+        memset(&c->session->lwt_msg.publish, 0x00, sizeof(lwt->publish));
+        c->has_lwt = false;
+        char tname[lwt->publish.topiclen + 2];
+        bool slash = lwt->publish.topiclen
+            && lwt->publish.topic[lwt->publish.topiclen - 1] == '/';
+        snprintf(tname, lwt->publish.topiclen + 2, "%s%s",
+                 (const char *) lwt->publish.topic, slash ? "" : "/");
+        struct topic *t = topic_store_get(server.store, tname);
+        INCREF(lwt, struct mqtt_packet);
+        if (t)
+            publish_message(lwt, t, NULL);
+        DECREF(lwt, struct mqtt_packet);
+    }
+#if THREADSNR > 0
+    pthread_mutex_lock(&mutex);
+#endif
+    // Clean resources
+    ev_del_fd(ctx, c->conn.fd);
+    // Persistent sessions keep their subscriptions while offline
+    if (c->session && c->session->clean_session == true
+        && list_size(c->session->subscriptions) > 0) {
+        list_foreach(item, c->session->subscriptions) {
+            log_debug("Deleting %s from topic %s",
+                      c->client_id, ((struct topic *) item->data)->name);
+            topic_del_subscriber(item->data, c->session->handle);
+        }
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    client_deactivate(c);
+    info.active_connections--;
+    info.total_connections--;
+}
+
+static void keepalive_expired(struct ev_ctx *, void *);
+
+/*
+ * (Re)schedule the keepalive expiry of a client, one and a half times the
+ * keepalive after the last read, according to MQTT specs. A zero keepalive
+ * disables the check.
+ */
+static void keepalive_schedule(struct ev_ctx *ctx, struct client *c) {
+    if (c->keepalive == 0) {
+        ev_timer_del(&c->keepalive_timer);
+        return;
+    }
+    time_t deadline = c->last_seen + (c->keepalive * 3 + 1) / 2;
+    if (ev_timer_add(ctx, &c->keepalive_timer, deadline - ctx->now) < 0)
+        log_error("Unable to schedule keepalive check for %s", c->client_id);
+}
+
+/*
+ * Timing wheel callback, reads just refresh the last_seen timestamp of the
+ * client, so the check is lazy: if the client has been seen since the timer
+ * was scheduled, it's just moved forward, otherwise the client is gone.
+ * Publishers paused by backpressure are not reading, so they're spared.
+ */
+static void keepalive_expired(struct ev_ctx *ctx, void *data) {
+    struct client *c = data;
+    if (c->keepalive == 0)
+        return;
+    if (c->paused != PAUSE_NONE
+        || ctx->now < c->last_seen + (c->keepalive * 3 + 1) / 2) {
+        keepalive_schedule(ctx, c);
+        return;
+    }
+    log_info("Keepalive expired for %s (%s), closing connection",
+             c->client_id, c->conn.ip);
+    client_close(ctx, c);
+}
+
 /*
  * Handle incoming connections, create a a fresh new struct client structure
  * and link it to the fd, ready to be set in EV_READ event, then schedule a
@@ -742,6 +1604,10 @@ static void accept_callback(struct ev_ctx *ctx, void *data) {
         c->conn = conn;
         client_init(c);
         c->ctx = ctx;
+        ev_timer_init(&c->keepalive_timer, keepalive_expired, c);
+        keepalive_schedule(ctx, c);
+
+        TRACE(client__accept, c, fd, c->conn.ip);
 
         /* Add it to the epoll loop */
         ev_register_event(ctx, fd, EV_READ, read_callback, c);
@@ -761,6 +1627,8 @@ static void accept_callback(struct ev_ctx *ctx, void *data) {
  */
 static void read_callback(struct ev_ctx *ctx, void *data) {
     struct client *c = data;
+    /* Record last action as of now, the loop clock is enough */
+    c->last_seen = ctx->now;
     if (c->status == SENDING_DATA)
         return;
     /*
@@ -776,8 +1644,6 @@ static void read_callback(struct ev_ctx *ctx, void *data) {
              * link it with the IO event containing the decode payload
              * ready to be processed
              */
-            /* Record last action as of now */
-            c->last_seen = time(NULL);
             c->status = SENDING_DATA;
             process_message(ctx, c);
             break;
@@ -794,32 +1660,7 @@ static void read_callback(struct ev_ctx *ctx, void *data) {
              */
             log_error("Closing connection with %s (%s): %s",
                       c->client_id, c->conn.ip, solerr(rc));
-#if THREADSNR > 0
-            pthread_mutex_lock(&mutex);
-#endif
-            // Publish, if present, LWT message
-            if (c->has_lwt == true) {
-                char *tname = (char *) c->session->lwt_msg.publish.topic;
-                struct topic *t = topic_store_get(server.store, tname);
-                if (t)
-                    publish_message(&c->session->lwt_msg, t);
-            }
-            // Clean resources
-            ev_del_fd(ctx, c->conn.fd);
-            // Remove from subscriptions for now
-            if (c->session && list_size(c->session->subscriptions) > 0) {
-                list_foreach(item, c->session->subscriptions) {
-                    log_debug("Deleting %s from topic %s",
-                              c->client_id, ((struct topic *) item->data)->name);
-                    topic_del_subscriber(item->data, c);
-                }
-            }
-#if THREADSNR > 0
-            pthread_mutex_unlock(&mutex);
-#endif
-            client_deactivate(c);
-            info.active_connections--;
-            info.total_connections--;
+            client_close(ctx, c);
             break;
         case -ERREAGAIN:
             /*
@@ -850,24 +1691,53 @@ static void process_message(struct ev_ctx *ctx, struct client *c) {
      */
     mqtt_unpack(c->rbuf + c->rpos, &io.data, *c->rbuf, c->read - c->rpos);
     c->toread = c->read = c->rpos = 0;
-    c->rc = handle_command(io.data.header.bits.type, &io);
+    STAT_INC(packets_recv[io.data.header.bits.type]);
+    TRACE(packet__dispatch, c, io.data.header.bits.type);
+    handle_packet(ctx, &io);
+}
+
+/*
+ * Executes the handler of an unpacked packet, reacting accordingly to its
+ * outcome
+ */
+static void handle_packet(struct ev_ctx *ctx, struct io_event *e) {
+    struct client *c = e->client;
+    c->rc = handle_command(e->data.header.bits.type, e);
+    TRACE(packet__handled, c, e->data.header.bits.type, c->rc);
     switch (c->rc) {
         case REPLY:
         case MQTT_NOT_AUTHORIZED:
         case MQTT_BAD_USERNAME_OR_PASSWORD:
+        case MQTT_SERVER_UNAVAILABLE:
             /*
              * Write out to client, after a request has been processed in
              * worker thread routine. Just send out all bytes stored in the
              * reply buffer to the reply file descriptor.
              */
             enqueue_event_write(c);
+            /* Keepalive has just been negotiated */
+            if (e->data.header.bits.type == CONNECT)
+                keepalive_schedule(ctx, c);
             /* Free resource, ACKs will be free'd closing the server */
-            if (io.data.header.bits.type != PUBLISH)
-                mqtt_packet_destroy(&io.data);
+            if (e->data.header.bits.type != PUBLISH)
+                mqtt_packet_destroy(&e->data);
+            break;
+        case DEFERRED:
+            /*
+             * The packet is kept aside and handled again once the password
+             * has been verified by the auth pool, meanwhile the client is
+             * not read anymore, hang ups are still notified.
+             */
+            c->status = WAITING_HEADER;
+            ev_fire_event(ctx, c->conn.fd, EV_NONE, read_callback, c);
+            struct auth_pending *pending = try_alloc(sizeof(*pending));
+            pending->io = *e;
+            pending->box = auth_box;
+            auth_submit(c->auth, auth_ready, pending);
             break;
         case -ERRCLIENTDC:
             ev_del_fd(ctx, c->conn.fd);
-            client_deactivate(io.client);
+            client_deactivate(e->client);
             // Update stats
             info.active_connections--;
             info.total_connections--;
@@ -877,19 +1747,303 @@ static void process_message(struct ev_ctx *ctx, struct client *c) {
             break;
         default:
             c->status = WAITING_HEADER;
-            if (io.data.header.bits.type != PUBLISH)
-                mqtt_packet_destroy(&io.data);
+            if (e->data.header.bits.type != PUBLISH)
+                mqtt_packet_destroy(&e->data);
+            // Stop reading from a publisher feeding a slow consumer
+            client_pause_reads(ctx, c);
             break;
     }
 }
 
+/*
+ * Auth pool callback, executed by a worker thread once a password has been
+ * verified, the request is queued on the mailbox of the loop owning the
+ * client, which completes the CONNECT handling. The client isn't touched
+ * here, it can be closed by its loop meanwhile.
+ */
+static void auth_ready(struct auth_request *req) {
+    struct auth_mailbox *box = ((struct auth_pending *) req->data)->box;
+    INCREF(req, struct auth_request);
+    pthread_mutex_lock(&box->lock);
+    list_push_back(box->done, req);
+    pthread_mutex_unlock(&box->lock);
+#ifdef __linux__
+    (void) eventfd_write(box->fds[1], 1);
+#else
+    (void) write(box->fds[1], &(unsigned long){1}, sizeof(unsigned long));
+#endif
+}
+
+/*
+ * Drain the mailbox of the loop, resuming the CONNECT of the requests
+ * verified, unless their client has been closed meanwhile, which cancelled
+ * them and dropped the packet already.
+ */
+static void auth_callback(struct ev_ctx *ctx, void *data) {
+    struct auth_mailbox *box = data;
+#ifdef __linux__
+    eventfd_t count;
+    (void) eventfd_read(box->fds[0], &count);
+#else
+    unsigned long count;
+    while (read(box->fds[0], &count, sizeof(count)) > 0);
+#endif
+    pthread_mutex_lock(&box->lock);
+    List *done = box->done;
+    box->done = list_new(NULL);
+    pthread_mutex_unlock(&box->lock);
+    while (list_size(done) > 0) {
+        struct auth_request *req = list_pop(done);
+        struct auth_pending *pending = req->data;
+        if (req->cancelled == false && pending) {
+            req->data = NULL;
+            handle_packet(ctx, &pending->io);
+            free_memory(pending);
+        }
+        DECREF(req, struct auth_request);
+    }
+    list_destroy(done, 0);
+}
+
+/*
+ * Open the mailbox of a loop, returns the descriptor to be watched for the
+ * requests verified or -1 on error
+ */
+static int auth_mailbox_open(struct auth_mailbox *box) {
+#ifdef __linux__
+    if ((box->fds[0] = box->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+#else
+    if (pipe(box->fds) < 0)
+        return -1;
+    fcntl(box->fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(box->fds[1], F_SETFL, O_NONBLOCK);
+#endif
+    pthread_mutex_init(&box->lock, NULL);
+    box->done = list_new(NULL);
+    return box->fds[0];
+}
+
+/* To be called once the auth pool stopped, nothing can be queued anymore */
+static void auth_mailbox_close(struct auth_mailbox *box) {
+    if (!box->done)
+        return;
+    while (list_size(box->done) > 0) {
+        struct auth_request *req = list_pop(box->done);
+        struct auth_pending *pending = req->data;
+        if (req->cancelled == false && pending) {
+            mqtt_packet_destroy(&pending->io.data);
+            free_memory(pending);
+            req->data = NULL;
+        }
+        DECREF(req, struct auth_request);
+    }
+    list_destroy(box->done, 0);
+    box->done = NULL;
+    close(box->fds[0]);
+    if (box->fds[1] != box->fds[0])
+        close(box->fds[1]);
+    pthread_mutex_destroy(&box->lock);
+}
+
+/*
+ * Write-ahead log commit callback, the acks held back by the clients of the
+ * loop for the records just synced can be sent out
+ */
+static void commit_callback(struct ev_ctx *ctx, void *arg) {
+    (void) arg;
+    release_held_acks(ctx);
+}
+
+/* Loops not stopped yet, see stop_handler */
+static atomic_int loops_running = ATOMIC_VAR_INIT(THREADSNR + 1);
+
 /*
  * Eventloop stop callback, will be triggered by an EV_CLOSEFD event and stop
- * the running loop, unblocking the call.
+ * the running loop, unblocking the call. Events sent while the loops are busy
+ * add up into a single one, so it's passed on to the next loop, till all of
+ * them stopped.
  */
 static void stop_handler(struct ev_ctx *ctx, void *arg) {
     (void) arg;
     ev_stop(ctx);
+    if (atomic_fetch_sub(&loops_running, 1) > 1)
+        stop_server();
+}
+
+/*
+ * Clients handed over by the process upgraded, spread over the loops. Each
+ * loop sets its own up before starting and waits for the others to do the
+ * same, no client can be reached by a publish before its loop is set.
+ */
+static struct {
+    struct client **clients;
+    size_t count;
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} adopted = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Rebuild the clients handed over from the clients file, attaching them to
+ * the sessions restored, before any loop starts
+ */
+static void upgrade_adopt(struct upgrade_state *st) {
+    adopted.clients = try_alloc((st->nclients + 1) * sizeof(struct client *));
+    for (size_t i = 0; i < st->nclients; ++i) {
+        struct client *c = memorypool_alloc(server.pool);
+        connection_init(&c->conn, NULL);
+        client_init(c);
+        struct mqtt_packet lwt;
+        if (upgrade_unpack_client(st->clients, c, &lwt) < 0) {
+            log_error("Clients handed over are corrupted, %lu dropped",
+                      (unsigned long) (st->nclients - i));
+            memorypool_free(server.pool, c);
+            for (size_t j = i; j < st->nclients; ++j)
+                close(st->client_fds[j]);
+            break;
+        }
+        c->conn.fd = st->client_fds[i];
+        c->connected = true;
+        HASH_FIND_STR(server.sessions, c->client_id, c->session);
+        if (!c->session) {
+            log_error("No session handed over for %s, closing connection",
+                      c->client_id);
+            close(c->conn.fd);
+            mqtt_packet_destroy(&lwt);
+            client_id_release(c->handle);
+            memorypool_free(server.pool, c);
+            continue;
+        }
+        c->session->clean_session = c->clean_session;
+        if (c->has_lwt == true) {
+            c->session->lwt_msg = lwt;
+            // Stored topics end with a '/', like the published ones
+            size_t len = lwt.publish.topiclen;
+            char will_key[len + 2];
+            snprintf(will_key, len + 2, "%s%s", (const char *) lwt.publish.topic,
+                     len && lwt.publish.topic[len - 1] == '/' ? "" : "/");
+            topic_store_get_or_put(server.store, will_key);
+        }
+        HASH_ADD_STR(server.clients_map, client_id, c);
+        client_id_get(c->handle)->client = c;
+        adopted.clients[adopted.count++] = c;
+        info.active_connections++;
+        info.total_connections++;
+    }
+    adopted.pending = adopted.count > 0 ? THREADSNR + 1 : 0;
+}
+
+/*
+ * Set up the clients handed over falling to a loop, resuming whatever they
+ * were doing: reading a packet, possibly half read, or writing out their
+ * output, the one left by the old process or queued meanwhile
+ */
+static void adopt_clients(struct ev_ctx *ctx, int shard) {
+    for (size_t i = shard; i < adopted.count; i += THREADSNR + 1) {
+        struct client *c = adopted.clients[i];
+        c->ctx = ctx;
+        ev_timer_init(&c->keepalive_timer, keepalive_expired, c);
+        keepalive_schedule(ctx, c);
+        ev_register_event(ctx, c->conn.fd, EV_READ, read_callback, c);
+        if (c->towrite > 0 || c->status == SENDING_DATA
+            || has_queued(c->session))
+            enqueue_event_write(c);
+    }
+    pthread_mutex_lock(&adopted.lock);
+    if (--adopted.pending == 0)
+        pthread_cond_broadcast(&adopted.cond);
+    while (adopted.pending > 0)
+        pthread_cond_wait(&adopted.cond, &adopted.lock);
+    pthread_mutex_unlock(&adopted.lock);
+}
+
+/*
+ * Hand the state over to the new process once all the loops stopped. The
+ * plaintext clients connected go along with their buffers, provided they fit
+ * the new settings, the others are closed and will reconnect. Persistent
+ * clients gone offline are left alone, their connection is already closed
+ * and their session travels in the snapshot like the others. The log is
+ * closed first, the acks it was holding back are then committed and go out
+ * with the output handed over, then the sessions are written to a snapshot,
+ * the clean ones of the clients handed over included. The stores are closed
+ * before sending the state, the new process opens them again on receiving.
+ */
+static void upgrade_transfer(int sfd) {
+    const struct upgrade_msg *params = &upgrading.params;
+    struct upgrade_state st = { .listen_fd = sfd, .sessions_fd = -1 };
+    struct client *c, *tmp;
+    if (snapshot.pid > 0)
+        snapshot_finish(0);
+    HASH_ITER(hh, server.clients_map, c, tmp) {
+        if (c->online == false)
+            continue;
+        size_t held = c->held_acks ? list_size(c->held_acks) : 0;
+        size_t out = c->towrite + held * MQTT_ACK_LEN;
+        if (conf->tls == false && params->tls == false
+            && c->read <= params->max_request_size
+            && out <= conf->max_request_size
+            && out - c->wrote <= params->max_request_size)
+            continue;
+        log_info("Closing connection with %s (%s), not handed over",
+                 c->client_id, c->conn.ip);
+        discard_held_acks(c);
+        if (c->clean_session == true && c->session)
+            client_session_discard(c);
+        close_connection(&c->conn);
+        HASH_DEL(server.clients_map, c);
+    }
+    st.lsn = wal_rotate();
+    wal_close();
+    FILE *sessions = tmpfile();
+    st.clients = tmpfile();
+    st.client_fds = try_alloc((HASH_COUNT(server.clients_map) + 1) * sizeof(int));
+    int err = !sessions || !st.clients ? -1 : 0;
+    HASH_ITER(hh, server.clients_map, c, tmp) {
+        if (err < 0)
+            break;
+        if (c->online == false)
+            continue;
+        flush_held_acks(c);
+        err = upgrade_pack_client(st.clients, c);
+        st.client_fds[st.nclients++] = c->conn.fd;
+    }
+    // The offset is shared with the new process, it has to read from the start
+    if (err == 0 && (fflush(st.clients) != 0 || fseek(st.clients, 0, SEEK_SET) < 0))
+        err = -1;
+    if (err == 0) {
+        st.sessions_fd = fileno(sessions);
+        struct wal_snapshot *snap =
+            wal_snapshot_open(dup(st.sessions_fd), st.lsn);
+        err = session_snapshot(snap, true);
+        if (wal_snapshot_end(snap) < 0)
+            err = -1;
+    }
+    spill_close();
+    retained_store_close();
+    metrics_stop();
+    if (err == 0) {
+        err = upgrade_handover(upgrading.channel, &st);
+    } else {
+        int saved = errno;
+        close(upgrading.channel);
+        errno = saved ? saved : EIO;
+    }
+    if (err < 0)
+        log_error("Upgrade failed handing over to pid %d: %s",
+                  (int) upgrading.pid, strerror(errno));
+    else
+        log_info("Handed over %lu clients and %u sessions to pid %d",
+                 (unsigned long) st.nclients, HASH_COUNT(server.sessions),
+                 (int) upgrading.pid);
+    if (sessions)
+        fclose(sessions);
+    if (st.clients)
+        fclose(st.clients);
+    free_memory(st.client_fds);
 }
 
 /*
@@ -904,6 +2058,9 @@ static void eventloop_start(void *args) {
     struct ev_ctx ctx;
     int sfd = loop_data->fd;
     ev_init(&ctx, EVENTLOOP_MAX_EVENTS);
+    int shard = atomic_fetch_add(&stats_shards_used, 1);
+    thread_stats = &info.shards[shard].stats;
+    ev_set_probe(&ctx, loop_probe);
     // Register stop event
 #ifdef __linux__
     ev_register_event(&ctx, conf->run, EV_CLOSEFD|EV_READ, stop_handler, NULL);
@@ -912,11 +2069,36 @@ static void eventloop_start(void *args) {
 #endif
     // Register listening FD with accept callback
     ev_register_event(&ctx, sfd, EV_READ, accept_callback, &sfd);
+    // Passwords verified by the auth pool resume the CONNECT on this loop
+    if (conf->allow_anonymous == false) {
+        auth_box = &auth_boxes[shard];
+        if (auth_mailbox_open(auth_box) < 0)
+            log_fatal("eventloop_start failed: Unable to open the auth mailbox");
+        ev_register_event(&ctx, auth_box->fds[0], EV_READ,
+                          auth_callback, auth_box);
+    }
+    // Group commits of the write-ahead log release the acks held back
+    int commit_fd = wal_notify_fd();
+    if (commit_fd >= 0)
+        ev_register_event(&ctx, commit_fd, EV_CLOSEFD|EV_READ,
+                          commit_callback, NULL);
     // Register periodic tasks
     if (loop_data->cronjobs == true) {
         ev_register_cron(&ctx, publish_stats, NULL, conf->stats_pub_interval, 0);
         ev_register_cron(&ctx, inflight_msg_check, NULL, 1, 0);
+        ev_register_cron(&ctx, memory_check, NULL, 1, 0);
+        if (wal_enabled == true && conf->snapshot_interval > 0)
+            ev_register_cron(&ctx, snapshot_check, NULL, 1, 0);
+        if (conf->metrics_port[0])
+            metrics_start(&ctx, conf->metrics_address, conf->metrics_port);
+        if (upgrade_request_fd() >= 0)
+            ev_register_event(&ctx, upgrade_request_fd(), EV_CLOSEFD|EV_READ,
+                              upgrade_start, NULL);
     }
+    // Every loop takes care of the buffers of its own clients
+    ev_register_cron(&ctx, release_idle_buffers, NULL, 1, 0);
+    if (adopted.pending > 0)
+        adopt_clients(&ctx, shard);
     // Start the loop, blocking call
     ev_run(&ctx);
     ev_destroy(&ctx);
@@ -933,8 +2115,24 @@ static void eventloop_start(void *args) {
  * schedules an EV_WRITE event with a client pointer set to write carried
  * contents out on the socket descriptor.
  */
-void enqueue_event_write(const struct client *c) {
-    ev_fire_event(c->ctx, c->conn.fd, EV_WRITE, write_callback, (void *) c);
+void enqueue_event_write(struct client *c) {
+    // Only the first write pending is timed, till the output is flushed
+    uint64_t none = 0;
+    if (atomic_load_explicit(&c->write_queued, memory_order_relaxed) == 0)
+        atomic_compare_exchange_strong(&c->write_queued, &none, clock_ns());
+    ev_fire_event(c->ctx, c->conn.fd, EV_WRITE, write_callback, c);
+}
+
+/*
+ * Stop all the loops, async signal safe. The first loop getting the event
+ * passes it on, see stop_handler.
+ */
+void stop_server(void) {
+#ifdef __linux__
+    eventfd_write(conf->run, 1);
+#else
+    (void) write(conf->run[0], &(unsigned long) {1}, sizeof(unsigned long));
+#endif
 }
 
 /*
@@ -958,20 +2156,122 @@ int start_server(const char *addr, const char *port) {
     server.sessions = NULL;
     pthread_mutex_init(&mutex, NULL);
 
-    if (conf->allow_anonymous == false)
+    if (conf->allow_anonymous == false) {
         if (!config_read_passwd_file(conf->password_file, &server.auths))
             log_error("Failed to read password file");
+        if (auth_pool_start(conf->auth_workers, conf->auth_cache_size) < 0)
+            log_fatal("start_server failed: Unable to start the auth pool");
+    }
 
     /* Generate stats topics */
     for (int i = 0; i < SYS_TOPICS; i++) {
-        struct topic *t = topic_new(try_strdup(sys_topics[i].name));
-        if (!t)
-            log_fatal("start_server failed: Out of memory");
-        topic_store_put(server.store, t);
+        char key[sys_topics[i].len + 2];
+        sys_topic_key(&sys_topics[i], key);
+        sys_topic_add(key);
+    }
+    for (int i = 0; i < 16; i++) {
+        char key[64];
+        for (int j = 0; j < 2; ++j)
+            if (packet_topic_key(j ? "sent" : "received", i, key, sizeof(key)))
+                sys_topic_add(key);
+    }
+    for (int i = 0; i < LATENCY_METRICS; i++) {
+        char key[64];
+        for (int j = 0; j < LATENCY_PERCENTILES; ++j) {
+            latency_topic_key(i, j, key, sizeof(key));
+            sys_topic_add(key);
+        }
+    }
+    for (int i = 0; i < 16; i++) {
+        char key[64];
+        for (int j = 0; j < HANDLER_FIELDS; ++j)
+            if (handler_topic_key(i, j, key, sizeof(key)))
+                sys_topic_add(key);
+    }
+    for (int i = 0; i < STATS_SHARDS - 1; i++) {
+        char key[64];
+        handler_loop_topic_key(i, key, sizeof(key));
+        sys_topic_add(key);
+    }
+
+    /*
+     * Started by an upgrade, everything is set up, the old process can stop
+     * serving and hand its state over, meanwhile this one waits for it
+     */
+    struct upgrade_state handed = { .listen_fd = -1, .sessions_fd = -1 };
+    bool inherited = upgrade_inherited();
+    if (inherited == true && upgrade_receive(&handed) < 0)
+        log_fatal("Unable to receive the state from the process upgraded: %s",
+                  strerror(errno));
+
+    if (conf->data_dir[0] != '\0') {
+        if (mkdir(conf->data_dir, 0700) < 0 && errno != EEXIST)
+            log_fatal("Unable to create %s: %s",
+                      conf->data_dir, strerror(errno));
+        if (conf->queue_spill_threshold > 0) {
+            char spill_dir[sizeof(conf->data_dir) + 16];
+            snprintf(spill_dir, sizeof(spill_dir), "%s/spill", conf->data_dir);
+            if (spill_open(spill_dir) < 0)
+                log_fatal("Unable to open the spill store in %s: %s",
+                          spill_dir, strerror(errno));
+        }
+    }
+
+    /*
+     * Rebuild the sessions handed over by the process upgraded, if any, the
+     * persistent ones from the snapshot and the write-ahead log otherwise,
+     * if enabled, before accepting any connection, spread over as many
+     * threads as the loops, then start recording on a new segment
+     */
+    uint64_t last = 0, started = clock_ns();
+    if (inherited == true) {
+        long records = session_restore(handed.sessions_fd, THREADSNR + 1, &last);
+        if (records < 0)
+            log_fatal("Unable to restore the sessions handed over: %s",
+                      strerror(errno));
+        close(handed.sessions_fd);
+        log_info("Restored %ld records handed over in %.3fs, %u sessions, "
+                 "up to record %llu", records, (clock_ns() - started) / 1e9,
+                 HASH_COUNT(server.sessions), (unsigned long long) last);
+        upgrade_adopt(&handed);
+        fclose(handed.clients);
+        free_memory(handed.client_fds);
+    } else if (conf->data_dir[0] != '\0') {
+        long records = session_recover(conf->data_dir, THREADSNR + 1, &last);
+        if (records < 0)
+            log_fatal("Unable to replay the write-ahead log in %s: %s",
+                      conf->data_dir, strerror(errno));
+        log_info("Replayed %ld write-ahead log records in %.3fs over %d "
+                 "threads, %u sessions restored", records,
+                 (clock_ns() - started) / 1e9, THREADSNR + 1,
+                 HASH_COUNT(server.sessions));
+    }
+
+    if (conf->data_dir[0] != '\0') {
+        struct wal_options opts = {
+            .segment_size = conf->wal_segment_size,
+            .durability = conf->wal_durability,
+            .commit_interval = conf->wal_commit_interval,
+            .commit_bytes = conf->wal_commit_bytes
+        };
+        if (wal_open(conf->data_dir, &opts, last + 1) < 0)
+            log_fatal("Unable to open the write-ahead log in %s: %s",
+                      conf->data_dir, strerror(errno));
+        snapshot.taken = last;
+        snapshot.last = time(NULL);
+        // Retained messages are served from the mapped store, no reload
+        char retained_dir[sizeof(conf->data_dir) + 16];
+        snprintf(retained_dir, sizeof(retained_dir),
+                 "%s/retained", conf->data_dir);
+        if (retained_store_open(retained_dir) < 0)
+            log_fatal("Unable to open the retained store in %s: %s",
+                      retained_dir, strerror(errno));
+        log_info("Retained store open, %lu messages", retained_store_count());
     }
 
-    /* Start listening for new connections */
-    int sfd = make_listen(addr, port, conf->socket_family);
+    /* Start listening for new connections, unless handed over */
+    int sfd = inherited == true
+        ? handed.listen_fd : make_listen(addr, port, conf->socket_family);
 
     /* Setup SSL in case of flag true */
     if (conf->tls == true) {
@@ -992,18 +2292,37 @@ int start_server(const char *addr, const char *port) {
         pthread_create(&thrs[i], NULL, (void * (*) (void *)) &eventloop_start, &loop_start);
     }
 #endif
-    loop_start.cronjobs = true;
+    /*
+     * The loop running the cronjobs gets its own payload, flipping the flag of
+     * the shared one would race with the threads still starting up
+     */
+    struct listen_payload main_loop = { sfd, ATOMIC_VAR_INIT(true) };
     // start eventloop, could be spread on multiple threads
-    eventloop_start(&loop_start);
+    eventloop_start(&main_loop);
 
 #if THREADSNR > 0
     for (int i = 0; i < THREADSNR; ++i)
         pthread_join(thrs[i], NULL);
 #endif
 
+    if (upgrading.ready == true)
+        upgrade_transfer(sfd);
+    free_memory(adopted.clients);
+
     close(sfd);
+    if (conf->allow_anonymous == false) {
+        auth_pool_stop();
+        for (int i = 0; i < STATS_SHARDS; ++i)
+            auth_mailbox_close(&auth_boxes[i]);
+    }
     AUTH_DESTROY(server.auths);
     topic_store_destroy(server.store);
+    // A snapshot still being written is worth waiting for, restart is faster
+    if (snapshot.pid > 0)
+        snapshot_finish(0);
+    wal_close();
+    spill_close();
+    retained_store_close();
 
     /* Destroy SSL context, if any present */
     if (conf->tls == true) {
@@ -30,8 +30,10 @@
 
 #include "mqtt.h"
 #include "pack.h"
+#include "util.h"
 #include "trie.h"
 #include "network.h"
+#include "histogram.h"
 
 /*
  * Number of worker threads to be created. Each one will host his own ev_ctx
@@ -52,6 +54,34 @@
  */
 #define BASE_CLIENTS_NUM  1024 * 128
 
+/*
+ * Memory pressure levels, computed periodically as a percentage of the
+ * max_memory configured. Each level enables a more aggressive tier of load
+ * shedding on top of the previous ones:
+ * - HIGH       evict retained messages of idle topics and release the
+ *              buffers of idle clients
+ * - CRITICAL   trim the queues of offline sessions
+ * - EXHAUSTED  reject new connections with CONNACK server unavailable
+ */
+#define MEMORY_NORMAL       0
+#define MEMORY_HIGH         1
+#define MEMORY_CRITICAL     2
+#define MEMORY_EXHAUSTED    3
+
+/* Usage thresholds (percentage of max_memory) of each pressure level */
+#define MEMORY_HIGH_PCT         70
+#define MEMORY_CRITICAL_PCT     85
+#define MEMORY_EXHAUSTED_PCT    95
+
+/*
+ * Seconds of inactivity after which a topic retained message or a client
+ * read buffer are considered idle and can be reclaimed under pressure
+ */
+#define MEMORY_IDLE_SECS        60
+
+/* Size of the read buffer of an idle client after being shrunk */
+#define IDLE_CLIENT_BUFSIZE     1024
+
 /*
  * IO event strucuture, it's the main information that will be communicated
  * between threads, every request packet will be wrapped into an IO event and
@@ -64,35 +94,105 @@ struct io_event {
     struct mqtt_packet data;
 };
 
+/*
+ * Statistics updated on the hot path, once or more per packet. Each loop
+ * thread owns a shard, on its own cache line, so that no core ever contends
+ * a counter with another one, they're only summed up when read. Threads
+ * without a shard of their own (e.g. the auth workers) share the last one.
+ * Gauges, like the depth of the queues, are tracked as a sum of increments
+ * and decrements, thus a single shard can go "negative", the total can't.
+ */
+#define STATS_SHARDS (THREADSNR + 2)
+
+/*
+ * Latencies tracked, in nanoseconds, published as percentiles on
+ * $SOL/broker/latency/<name>/{p50,p90,p99,p999}
+ * - POLL_WAIT   time blocked in ev_poll waiting for events
+ * - LOOP_BUSY   time spent running the callbacks fired by a single poll
+ * - PUBLISH     fan-out of an inbound PUBLISH, till the last subscriber has
+ *               been served or its message enqueued
+ * - WRITE       from a write scheduled on a client to its output flushed
+ * - PUBACK      round-trip of QoS 1 messages, from PUBLISH to PUBACK
+ */
+enum latency_metric {
+    LATENCY_POLL_WAIT,
+    LATENCY_LOOP_BUSY,
+    LATENCY_PUBLISH,
+    LATENCY_WRITE,
+    LATENCY_PUBACK,
+    LATENCY_METRICS
+};
+
+struct sol_stats {
+    /* Total number of sent messages */
+    atomic_size_t messages_sent;
+    /* Total number of received messages */
+    atomic_size_t messages_recv;
+    /* Total number of QoS 0 messages dropped towards slow consumers */
+    atomic_size_t messages_dropped;
+    /* Total number of QoS > 0 messages and acks re-sent */
+    atomic_size_t messages_retransmitted;
+    /* Total number of bytes sent out */
+    atomic_size_t bytes_sent;
+    /* Total number of bytes received */
+    atomic_size_t bytes_recv;
+    /* Messages and bytes currently held by the offline queues */
+    atomic_size_t queued_messages;
+    atomic_size_t queued_bytes;
+    /* Total number of messages dropped or refused by the offline queues */
+    atomic_size_t queued_dropped;
+    /* QoS > 0 messages currently waiting for an ack */
+    atomic_size_t inflight_messages;
+    /* Packets received and sent, indexed by MQTT packet type */
+    atomic_size_t packets_recv[16];
+    atomic_size_t packets_sent[16];
+    /*
+     * Packet handlers invocations, nanoseconds spent running them and how
+     * many of them ran past slow_op_threshold, indexed by MQTT packet type
+     */
+    atomic_size_t handler_calls[16];
+    atomic_size_t handler_ns[16];
+    atomic_size_t handler_slow[16];
+    /* Latency histograms, indexed by enum latency_metric */
+    struct histogram latency[LATENCY_METRICS];
+};
+
+struct sol_stats_shard {
+    _Alignas(CACHE_LINE_SIZE) struct sol_stats stats;
+};
+
 /* Global informations statistics structure */
 struct sol_info {
     /* Number of clients currently connected */
     atomic_size_t active_connections;
     /* Total number of clients connected since the start */
     atomic_size_t total_connections;
-    /* Total number of sent messages */
-    atomic_size_t messages_sent;
-    /* Total number of received messages */
-    atomic_size_t messages_recv;
     /* Timestamp of the start time */
     atomic_size_t start_time;
     /* Seconds passed since the start */
     atomic_size_t uptime;
-    /* Total number of bytes received */
-    atomic_size_t bytes_sent;
-    /* Total number of bytes sent out */
-    atomic_size_t bytes_recv;
+    /* Current memory pressure level */
+    atomic_int memory_level;
+    /* Total number of retained messages evicted under memory pressure */
+    atomic_size_t retained_evicted;
+    /* Total number of offline messages trimmed under memory pressure */
+    atomic_size_t queued_trimmed;
+    /* Total number of connections rejected under memory pressure */
+    atomic_size_t connections_rejected;
+    /* Per-thread counters, see struct sol_stats */
+    struct sol_stats_shard shards[STATS_SHARDS];
 };
 
 #define INIT_INFO do { \
     info.active_connections = ATOMIC_VAR_INIT(0);   \
     info.total_connections = ATOMIC_VAR_INIT(0);    \
-    info.messages_sent = ATOMIC_VAR_INIT(0);        \
-    info.messages_recv = ATOMIC_VAR_INIT(0);        \
     info.start_time = ATOMIC_VAR_INIT(0);           \
     info.uptime = ATOMIC_VAR_INIT(0);               \
-    info.bytes_sent = ATOMIC_VAR_INIT(0);           \
-    info.bytes_recv = ATOMIC_VAR_INIT(0);           \
+    info.memory_level = ATOMIC_VAR_INIT(0);         \
+    info.retained_evicted = ATOMIC_VAR_INIT(0);     \
+    info.queued_trimmed = ATOMIC_VAR_INIT(0);       \
+    info.connections_rejected = ATOMIC_VAR_INIT(0); \
+    memset(info.shards, 0x00, sizeof(info.shards)); \
 } while (0)
 
 /*
@@ -101,6 +201,31 @@ struct sol_info {
  */
 extern struct sol_info info;
 
+/* Statistics shard of the calling thread */
+extern _Thread_local struct sol_stats *thread_stats;
+
+/*
+ * Update a sharded statistic, relaxed as the counters order nothing, they're
+ * just summed up from time to time
+ */
+#define STAT_ADD(field, n) \
+    atomic_fetch_add_explicit(&thread_stats->field, (n), memory_order_relaxed)
+#define STAT_SUB(field, n) \
+    atomic_fetch_sub_explicit(&thread_stats->field, (n), memory_order_relaxed)
+#define STAT_INC(field) STAT_ADD(field, 1)
+#define STAT_DEC(field) STAT_SUB(field, 1)
+#define STAT_LATENCY(metric, ns) \
+    histogram_record(&thread_stats->latency[(metric)], (ns))
+
+/* Sum up all the shards in a single snapshot */
+void sol_stats_collect(struct sol_stats *);
+
+/* Lowercase names of the MQTT packet types, NULL for the reserved ones */
+extern const char *const packet_names[16];
+
+/* Names of the latency metrics, indexed by enum latency_metric */
+extern const char *const latency_names[LATENCY_METRICS];
+
 /*
  * Main structure, a global instance will be instantiated at start, tracking
  * topics, connected clients and registered closures.
@@ -135,12 +260,18 @@ extern struct server server;
  */
 int start_server(const char *, const char *);
 
+/*
+ * Stop the loops, making start_server return, async signal safe. An upgrade
+ * handed over, if requested, before returning.
+ */
+void stop_server(void);
+
 /*
  * Fire a write callback to reply after a client request, under the hood it
  * schedules an EV_WRITE event with a client pointer set to write carried
  * contents out on the socket descriptor.
  */
-void enqueue_event_write(const struct client *);
+void enqueue_event_write(struct client *);
 
 /*
  * Make the entire process a daemon running in background
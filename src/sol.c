@@ -26,26 +26,23 @@
  */
 
 #include <signal.h>
-#ifdef __linux__
-#include <sys/eventfd.h>
-#endif
 #include <unistd.h>
 #include "util.h"
 #include "config.h"
 #include "server.h"
 #include "logging.h"
+#include "upgrade.h"
 
 // Stops epoll_wait loops by sending an event
 static void sigint_handler(int signum) {
     (void) signum;
-    for (int i = 0; i < THREADSNR + 1; ++i) {
-#ifdef __linux__
-        eventfd_write(conf->run, 1);
-#else
-        (void) write(conf->run[0], &(unsigned long) {1}, sizeof(unsigned long));
-#endif
-        usleep(1500);
-    }
+    stop_server();
+}
+
+// Hands over to the binary on disk, see upgrade.h
+static void sigusr2_handler(int signum) {
+    (void) signum;
+    upgrade_request();
 }
 
 static const char *flag_description[] = {
@@ -68,8 +65,14 @@ void print_help(char *me) {
 
 int main (int argc, char **argv) {
 
+    if (upgrade_init(argv) < 0) {
+        perror("upgrade_init");
+        exit(EXIT_FAILURE);
+    }
+
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigint_handler);
+    signal(SIGUSR2, sigusr2_handler);
 
     char *addr = DEFAULT_HOSTNAME;
     char *port = DEFAULT_PORT;
@@ -116,11 +119,16 @@ int main (int argc, char **argv) {
     // Try to load a configuration, if found
     config_load(confpath);
 
-    sol_log_init(conf->logpath, conf->loglevel);
-
-    if (daemon == 1)
+    /*
+     * Before starting the log writer thread, which wouldn't survive a fork.
+     * Started by an upgrade it's detached already if the old process was,
+     * forking again would lose the pid the old one is waiting on.
+     */
+    if (daemon == 1 && upgrade_inherited() == false)
         daemonize();
 
+    sol_log_init(conf->logpath, conf->loglevel, conf->log_format);
+
     // Print configuration
     config_print();
 
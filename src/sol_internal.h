@@ -31,10 +31,13 @@
 #include "util.h"
 #include "pack.h"
 #include "list.h"
+#include "ev.h"
+#include "auth.h"
 #include "mqtt.h"
 #include "trie.h"
 #include "uthash.h"
 #include "network.h"
+#include "spill.h"
 
 /* Generic return codes without a defined purpose */
 #define SOL_OK              0
@@ -49,6 +52,7 @@
  * - error EAGAIN from a non-blocking read/write function
  * - error sending/receiving data on a connected socket
  * - error OUT OF MEMORY
+ * - error session queue full, message refused by policy
  */
 #define ERRCLIENTDC         1
 #define ERRPACKETERR        2
@@ -56,30 +60,64 @@
 #define ERREAGAIN           4
 #define ERRSOCKETERR        5
 #define ERRNOMEM            6
+#define ERRQUEUEFULL        7
 
 /*
  * Return code of handler functions, signaling if there's data payload to be
  * sent out or if the server just need to re-arm closure for reading incoming
- * bytes
+ * bytes. DEFERRED means the reply will be produced later on, once an
+ * asynchronous task (e.g. a password verification) completes
  */
 #define REPLY               0
 #define NOREPLY             1
+#define DEFERRED            2
 
 /* The maximum number of pending/not acknowledged packets for each client */
 #define MAX_INFLIGHT_MSGS 65536
 
+/*
+ * An MQTT subscriber refers to a client session through the handle of its ID
+ * and carries the granted QoS, which is the QoS given by the server for each
+ * topic it's subscribed.
+ */
+struct subscriber {
+    uint32_t handle; /* Handle of the client ID */
+    unsigned char granted_qos; /* The QoS given by the server for each topic */
+};
+
+/*
+ * The subscribers of a topic, a contiguous array scanned on publish and an
+ * index by handle for the membership tests, built once the set is large
+ * enough to need one. Zero initialized means empty.
+ */
+struct subscribers {
+    struct subscriber *items;
+    uint32_t *index; /* Positions in items plus one by handle, 0 is empty */
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t nslots; /* Slots of the index, power of two */
+};
+
 /*
  * An MQTT topic is composed by a name which identify it, a retained message
- * which must be forwarded to all subscribing clients and a map of subscribers,
- * the handle is a struct subscriber pointer which have to be initialized at
- * NULL.
+ * which must be forwarded to all subscribing clients and the set of its
+ * subscribers. The last_seen timestamp tracks the last publish or
+ * subscription on the topic, used to detect idle retained messages under
+ * memory pressure.
  *
- * See https://troydhanson.github.io/uthash/userguide.html for more info
+ * Names are stored once, always ending with a '/', their length and hash are
+ * computed on creation so that a publish can be resolved to its topic without
+ * walking the store, see topic_hash. Topics are never removed from the store
+ * while running, a pointer to one stays valid.
  */
 struct topic {
     const char *name;
+    size_t len; /* Length of the name, trailing '/' included */
+    uint32_t hash; /* topic_hash of the name, trailing '/' excluded */
+    unsigned wildcards_gen; /* Wildcards generation last matched against */
     unsigned char *retained_msg;
-    struct subscriber *subscribers; /* UTHASH handle pointer, must be NULL */
+    time_t last_seen;
+    struct subscribers subscribers;
 };
 
 /*
@@ -92,34 +130,41 @@ struct topic_store {
     // A list of wildcards subscriptions, as it's not possible to know in
     // advance what topics will match some wildcard subscriptions
     List *wildcards;
+    // Bumped on every wildcard added, topics already matched against the
+    // current generation don't need to be matched again
+    unsigned wildcards_gen;
 };
 
 /*
- * An MQTT subscriber wraps a client session and is composed by a granted QoS
- * which is the QoS given by the server for each topic it's subscribed, an ID
- * which is the same of the client it refers to and two utility members to
- * handle it's sharing between structures.
- *
- * It's hashable according to UTHASH APIs. For more info check
- * https://troydhanson.github.io/uthash/userguide.html
+ * Client IDs are interned once in a global table and referred to by a 32 bit
+ * handle, by the session and the connection of the client as well as by every
+ * subscription it makes, which would copy the ID otherwise. An entry also
+ * resolves the handle to the session and the connected client, if any, so
+ * that no lookup by ID is needed on publish. Both are set and read with the
+ * global lock held.
+ * Handles are reference counted, each subscriber entry holds one, the 0 one
+ * refers to the empty ID of clients yet to be connected.
  */
-struct subscriber {
-    struct client_session *session; /* Session referring to a client */
-    unsigned char granted_qos; /* The QoS given by the server for each topic */
-    char id[MQTT_CLIENT_ID_LEN]; /* Client ID key */
-    UT_hash_handle hh; /* UTHASH handle, needed to use UTHASH macros */
-    struct ref refcount; /* Reference counting struct, to share the struct easily */
+struct client_id {
+    const char *id; /* The client ID according to MQTT specs */
+    struct client_session *session; /* The session of the client, if any */
+    struct client *client; /* The client connected with this ID, if any */
+    uint32_t hash; /* Hash of the ID, indexing the table */
+    uint32_t refs; /* References held, the next free handle once released */
 };
 
+#define CLIENT_ID_NONE 0
+
 /*
  * Utility struct to store wildcard subscriptions. Just wrap a subscriber
- * paired with a topic name and a flag to indicate if it's a '#' multilevel
- * subscription or not.
+ * handle and its QoS paired with a topic name and a flag to indicate if it's
+ * a '#' multilevel subscription or not.
  */
 struct subscription {
     bool multilevel; /* Flag for '#' subscriptions */
+    unsigned char granted_qos; /* The QoS given by the server */
+    uint32_t handle; /* Handle of the client ID subscribing */
     const char *topic; /* Topic name the subscription refers to */
-    struct subscriber *subscriber; /* Reference to the subscriber */
 };
 
 /*
@@ -130,11 +175,24 @@ struct subscription {
  * It's meant to be used in a fixed length array.
  */
 struct inflight_msg {
-    time_t seen; /* Timestamp of the last time we have seen this msg */
+    uint64_t sent; /* Monotonic ns of the last time this msg has been sent */
     struct mqtt_packet *packet; /* The payload to be written out in case of timeout */
     unsigned char qos; /* The QoS at the time of the publish */
 };
 
+/*
+ * Messages waiting to be delivered to a session, they're queued while the
+ * client is offline or while an older backlog is still being written out.
+ * The message identifier is assigned only on the effective write, so all we
+ * need to track is the QoS granted at the time of the publish and the size
+ * of the packed message, accounted in the byte budget of the queue.
+ */
+struct queued_msg {
+    size_t size; /* Size in bytes of the packed message */
+    unsigned char qos; /* The QoS at the time of the publish */
+    struct mqtt_packet *packet; /* The payload to be written out */
+};
+
 /*
  * The client actions can be summarized as a roughly simple state machine,
  * comprised by 4 states:
@@ -159,6 +217,23 @@ enum client_status {
     SENDING_DATA
 };
 
+/*
+ * Backpressure states of a publisher feeding a slow consumer. The pause of
+ * the reads is requested while the publish is being handled and effectively
+ * applied by the loop owning the publisher only after its output has been
+ * flushed, till the slow consumer output goes down to the low watermark.
+ */
+#define PAUSE_NONE          0
+#define PAUSE_REQUESTED     1
+#define PAUSE_APPLIED       2
+
+/*
+ * Publishers tend to send to the same few topics over and over, each client
+ * keeps the last topics it published to, so that they're resolved without a
+ * lookup on the topic store. Must be a power of two.
+ */
+#define CLIENT_TOPIC_CACHE  8
+
 /*
  * Wrapper structure around a connected client, each client can be a publisher
  * or a subscriber, it can be used to track sessions too.
@@ -166,13 +241,26 @@ enum client_status {
  * start of the application will serve us a client pool, read and write buffers
  * are initialized lazily.
  *
+ * Fields are grouped by access, the ones touched on every packet read or
+ * written come first, the pool hands out clients aligned to a cache line,
+ * the ones only touched on connection, disconnection or by the timers start
+ * on a cache line of their own.
+ *
  * It's an hashable struct which will be tracked during the execution of the
  * application, see https://troydhanson.github.io/uthash/userguide.html.
  */
 struct client {
     struct ev_ctx *ctx; /* An event context refrence mostly used to fire write events */
-    int rc;  /* Return code of the message just handled */
-    int status; /* Current status of the client (state machine) */
+    struct client_session *session; /* The session associated to the client */
+    unsigned char *rbuf; /* The reading buffer */
+    unsigned char *wbuf; /* The writing buffer */
+    volatile atomic_size_t read; /* The number of bytes already read */
+    volatile atomic_size_t toread; /* The number of bytes that have to be read */
+    volatile atomic_size_t wrote; /* The number of bytes already written */
+    volatile atomic_size_t towrite; /* The number of bytes we have to write */
+    _Atomic uint64_t write_queued; /* Monotonic ns of the first write still
+                                    * pending, 0 if none */
+    time_t last_seen; /* The timestamp of the last action performed */
     volatile atomic_int rpos; /* The nr of bytes to skip after a complete
                                * packet has * been read. This because according
                                * to MQTT, length is encoded on multiple bytes
@@ -182,23 +270,29 @@ struct client {
                                * know it, so we need an offset to know where
                                * the actual packet will start
                                */
-    volatile atomic_size_t read; /* The number of bytes already read */
-    volatile atomic_size_t toread; /* The number of bytes that have to be read */
-    unsigned char *rbuf; /* The reading buffer */
-    volatile atomic_size_t wrote; /* The number of bytes already written */
-    volatile atomic_size_t towrite; /* The number of bytes we have to write */
-    unsigned char *wbuf; /* The writing buffer */
-    char client_id[MQTT_CLIENT_ID_LEN]; /* The client ID according to MQTT specs */
-    struct connection conn; /* A connection structure, takes care of plain or
-                             * TLS encrypted communication by using callbacks
-                             */
-    struct client_session *session; /* The session associated to the client */
-    time_t last_seen; /* The timestamp of the last action performed */
+    int status; /* Current status of the client (state machine) */
+    int rc;  /* Return code of the message just handled */
+    int paused; /* Backpressure state of the reads, see PAUSE_* */
     bool online;  /* Just an online flag */
     bool connected; /* States if the client has already processed a connection packet */
-    bool has_lwt; /* States if the connection packet carried a LWT message */
     bool clean_session; /* States if the connection packet was set to clean session */
+    bool congested; /* Output above the high watermark, not yet back to the low one */
+    uint32_t handle; /* Handle of the interned client ID */
     pthread_mutex_t mutex; /* Inner lock for the client, this avoid race-conditions on shared parts */
+    struct connection conn; /* A connection structure, takes care of plain or
+                             * TLS encrypted communication by using callbacks
+                             */
+    _Alignas(CACHE_LINE_SIZE)
+    const char *client_id; /* The client ID according to MQTT specs, interned */
+    unsigned short keepalive; /* Keepalive in seconds, negotiated on CONNECT */
+    bool has_lwt; /* States if the connection packet carried a LWT message */
+    struct ev_timer keepalive_timer; /* Keepalive expiry on the loop wheel */
+    List *blocked; /* Publishers paused while feeding this client */
+    struct auth_request *auth; /* Pending password verification, if any */
+    List *held_acks; /* Acks waiting for a write-ahead log commit, if any */
+    bool acks_blocked; /* Reads paused for too many acks held */
+    struct topic *topics[CLIENT_TOPIC_CACHE]; /* Topics lately published to,
+                                               * by hash */
     UT_hash_handle hh; /* UTHASH handle, needed to use UTHASH macros */
 };
 
@@ -217,10 +311,13 @@ struct client {
 struct client_session {
     unsigned next_free_mid; /* The next 'free' message ID */
     List *subscriptions; /* All the clients subscriptions, stored as topic structs */
-    List *outgoing_msgs; /* Outgoing messages during disconnection time, stored as mqtt_packet pointers */
+    List *outgoing_msgs; /* Outgoing messages during disconnection time, stored as queued_msg pointers */
+    size_t outgoing_bytes; /* Bytes currently queued, spilled ones included */
+    struct spill_queue spilled; /* Tail of the queue spilled to disk, following outgoing_msgs */
     volatile atomic_ushort inflights; /* Just a counter stating the presence of inflight messages */
     bool clean_session; /* Clean session flag */
-    char session_id[MQTT_CLIENT_ID_LEN]; /* The client_id the session refers to */
+    uint32_t handle; /* Handle of the interned client ID the session refers to */
+    const char *session_id; /* The client_id the session refers to, interned */
     struct mqtt_packet lwt_msg; /* A possibly NULL LWT message, will be set on connection */
     time_t *i_acks; /* Inflight ACKs that must be cleared */
     struct inflight_msg *i_msgs; /* Inflight MSGs that must be sent out DUP in case of timeout */
@@ -238,31 +335,68 @@ extern pthread_mutex_t mutex;
 struct server;
 
 /*
- * Checks if a client is subscribed to a topic by trying to fetch the
- * client_session by its ID on the subscribers inner hashmap of the topic.
+ * Return the handle of a client ID, interning it if not already present, the
+ * handle stays valid till released as many times as interned or retained.
+ * The function may fail as it needs to allocate the ID on the heap.
+ */
+uint32_t client_id_intern(const char *);
+
+/*
+ * Take or drop a reference to a client ID handle, the last one released frees
+ * the ID and gives the handle back to the table. CLIENT_ID_NONE is ignored.
+ */
+void client_id_retain(uint32_t);
+void client_id_release(uint32_t);
+
+/*
+ * Return the entry of a client ID handle, it can't fail and it doesn't lock,
+ * the caller must hold a reference to the handle.
+ */
+struct client_id *client_id_get(uint32_t);
+
+#define client_id_session(handle) (client_id_get(handle)->session)
+
+/*
+ * Return the subscriber referring to the client ID handle, NULL if not found
+ */
+struct subscriber *subscribers_find(const struct subscribers *, uint32_t);
+
+/*
+ * Append a subscriber with the passed in client ID handle and QoS, which is
+ * retained till the subscriber is removed. If the handle is already
+ * subscribed, the existing subscriber is returned instead.
+ * The pointer returned is valid till the next change to the set.
+ */
+struct subscriber *subscribers_add(struct subscribers *, uint32_t,
+                                   unsigned char);
+
+/*
+ * Remove the subscriber referring to the client ID handle, if any, and
+ * release the handle. The last subscriber takes its place in the array.
+ */
+void subscribers_del(struct subscribers *, uint32_t);
+
+/*
+ * Release the handles of all the subscribers and free the set memory, which
+ * is left empty
  */
-bool is_subscribed(const struct topic *, const struct client_session *);
+void subscribers_destroy(struct subscribers *);
 
 /*
- * Allocate memory on the heap to create and return a pointer to a struct
- * subscriber, assigining the passed in QoS, session pointer, and
- * instantiating a reference counter to 0.
- * It may fail as it needs to allocate some bytes on the heap.
+ * Checks if a client is subscribed to a topic by looking up the handle of
+ * its ID in the subscribers of the topic.
  */
-struct subscriber *subscriber_new(struct client_session *, unsigned char);
+bool is_subscribed(const struct topic *, uint32_t);
 
 /*
- * Allocate memory on the heap to clone a subscriber pointer, deep copies all
- * fields into the newly allocated pointer except for the reference counter,
- * the new pointer will have its own refcount set to 0. Finally the newly
- * allocated pointer is returned.
- * It may fail as it needs to allocate some bytes on the heap.
+ * FNV-1a hash of a topic name, without the trailing '/' if any, the same for
+ * the name as published and the one stored
  */
-struct subscriber *subscriber_clone(const struct subscriber *);
+uint32_t topic_hash(const char *, size_t);
 
 /*
- * Initialize a struct topic pointer by setting its name, subscribers and
- * retained_msg are set to NULL.
+ * Initialize a struct topic pointer by setting its name, subscribers are
+ * empty and retained_msg is set to NULL.
  * The function expects a non-null pointer and can't fail, if a null topic
  * is passed, the function return prematurely.
  */
@@ -281,23 +415,21 @@ struct topic *topic_new(const char *);
 void topic_destroy(struct topic *);
 
 /*
- * Allocate a new subscriber struct on the heap referring to the passed in
- * topic, client_session and QoS, then add it to the topic map.
+ * Add a subscriber to the topic referring to the passed in client ID handle
+ * and QoS. If the handle is already subscribed, the existing subscriber is
+ * returned, valid till the subscribers of the topic change.
  * The function can fail as a memory allocation is requested, if it fails the
  * program execution graceful crash.
  */
-struct subscriber *topic_add_subscriber(struct topic *,
-                                        struct client_session *, unsigned char);
+struct subscriber *topic_add_subscriber(struct topic *, uint32_t,
+                                        unsigned char);
 
 /*
  * Remove a subscriber from the topic, the subscriber to be removed refers to
- * the client_id belonging to the client pointer passed in.
- * The subscriber deletion is really a reference count subtraction, DECREF
- * macro takes care of the counter, if it reaches 0 it de-allocates the memory
- * reserved to the struct subscriber.
+ * the client ID handle passed in, which is released along with it.
  * The function can't fail.
  */
-void topic_del_subscriber(struct topic *, struct client *);
+void topic_del_subscriber(struct topic *, uint32_t);
 
 /*
  * Allocate a new store structure on the heap and return it after its
@@ -350,9 +482,9 @@ void topic_store_del(struct topic_store *, const char *);
 void topic_store_add_wildcard(struct topic_store *, struct subscription *);
 
 /*
- * Remove a wildcard by id key from the topic_store struct
+ * Remove the wildcards of a client ID handle from the topic_store struct
  */
-void topic_store_remove_wildcard(struct topic_store *, char *);
+void topic_store_remove_wildcard(struct topic_store *, uint32_t);
 
 /*
  * Run a function to each node of the topic_store trie holding the topic
@@ -366,9 +498,21 @@ void topic_store_map(struct topic_store *, const char *,
  */
 bool topic_store_wildcards_empty(const struct topic_store *);
 
+/*
+ * Check if a topic matches a wildcard subscription, return SOL_OK on match.
+ * Both names end with a '/', a '#' subscription has it stripped and is
+ * flagged multilevel.
+ */
+int match_subscription(const char *, const char *, bool);
+
 #define topic_store_wildcards_foreach(item, store)  \
     list_foreach(item, store->wildcards)
 
 #define has_inflight(session) ((session)->inflights > 0)
 
+#define queued_count(session) \
+    (list_size((session)->outgoing_msgs) + (session)->spilled.count)
+
+#define has_queued(session) (queued_count(session) > 0)
+
 #define inflight_msg_clear(msg) DECREF((msg)->packet, struct mqtt_packet)
@@ -0,0 +1,272 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "spill.h"
+#include "memory.h"
+#include "logging.h"
+
+#define SPILL_PATH_MAX      4096
+// Room left in a path for the name of a segment
+#define SPILL_DIR_MAX       (SPILL_PATH_MAX - 32)
+// Offsets are 32 bits wide, segments stay well within
+#define SPILL_SEGMENT_SIZE  (64 * 1024 * 1024)
+#define SPILL_MIN_REFS      16
+
+bool spill_enabled = false;
+
+/* A segment still holding messages, the last one is being appended to */
+struct spill_segment {
+    uint32_t id;
+    int fd;
+    size_t live;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    char dir[SPILL_DIR_MAX];
+    struct spill_segment *segments;
+    size_t nsegments;
+    uint32_t next_id;
+    size_t used;
+} store = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void segment_path(char *path, uint32_t id) {
+    snprintf(path, SPILL_PATH_MAX, "%s/spill-%010u.dat", store.dir, id);
+}
+
+static bool is_segment(const char *name) {
+    unsigned id;
+    char tail[5] = {0};
+    return sscanf(name, "spill-%10u%4s", &id, tail) == 2
+        && strcmp(tail, ".dat") == 0;
+}
+
+static void segment_remove(struct spill_segment *seg) {
+    char path[SPILL_PATH_MAX];
+    segment_path(path, seg->id);
+    close(seg->fd);
+    unlink(path);
+    size_t i = seg - store.segments;
+    memmove(seg, seg + 1, (store.nsegments - i - 1) * sizeof(*seg));
+    store.nsegments--;
+}
+
+/*
+ * Start a new segment to append to, the current one goes if all of its
+ * messages have already been consumed. It's kept, still the one appended to,
+ * if the new one can't be opened. Must be called with the lock held.
+ */
+static struct spill_segment *segment_new(void) {
+    char path[SPILL_PATH_MAX];
+    segment_path(path, store.next_id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  0600);
+    if (fd < 0) {
+        log_error("Failed to open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    if (store.nsegments > 0 && store.segments[store.nsegments - 1].live == 0)
+        segment_remove(&store.segments[store.nsegments - 1]);
+    store.segments = try_realloc(store.segments, (store.nsegments + 1)
+                                 * sizeof(struct spill_segment));
+    struct spill_segment *seg = &store.segments[store.nsegments++];
+    *seg = (struct spill_segment) { .id = store.next_id++, .fd = fd };
+    store.used = 0;
+    return seg;
+}
+
+/* Must be called with the lock held */
+static struct spill_segment *segment_get(uint32_t id) {
+    for (size_t i = 0; i < store.nsegments; ++i)
+        if (store.segments[i].id == id)
+            return &store.segments[i];
+    return NULL;
+}
+
+/*
+ * Release a message of a segment, removing it once empty unless it's still
+ * being appended to. Must be called with the lock held.
+ */
+static void segment_release(uint32_t id) {
+    struct spill_segment *seg = segment_get(id);
+    if (!seg || --seg->live > 0
+        || seg == &store.segments[store.nsegments - 1])
+        return;
+    segment_remove(seg);
+}
+
+int spill_open(const char *dir) {
+    if (strlen(dir) >= SPILL_DIR_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        log_error("Failed to create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    snprintf(store.dir, SPILL_DIR_MAX, "%s", dir);
+    // Left over by the previous run, the log spills the queues again
+    DIR *d = opendir(dir);
+    if (!d)
+        return -1;
+    char path[SPILL_PATH_MAX];
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (!is_segment(ent->d_name))
+            continue;
+        snprintf(path, SPILL_PATH_MAX, "%s/%s", dir, ent->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    pthread_mutex_lock(&store.lock);
+    struct spill_segment *seg = segment_new();
+    pthread_mutex_unlock(&store.lock);
+    if (!seg)
+        return -1;
+    spill_enabled = true;
+    return 0;
+}
+
+void spill_close(void) {
+    pthread_mutex_lock(&store.lock);
+    spill_enabled = false;
+    char path[SPILL_PATH_MAX];
+    for (size_t i = 0; i < store.nsegments; ++i) {
+        close(store.segments[i].fd);
+        segment_path(path, store.segments[i].id);
+        unlink(path);
+    }
+    free_memory(store.segments);
+    store.segments = NULL;
+    store.nsegments = 0;
+    pthread_mutex_unlock(&store.lock);
+}
+
+int spill_push(struct spill_queue *q, const unsigned char *buf, size_t size,
+               unsigned char qos) {
+    int err = -1;
+    pthread_mutex_lock(&store.lock);
+    if (store.nsegments == 0 || size > SPILL_SEGMENT_SIZE)
+        goto exit;
+    struct spill_segment *seg = &store.segments[store.nsegments - 1];
+    if (store.used + size > SPILL_SEGMENT_SIZE && !(seg = segment_new()))
+        goto exit;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(seg->fd, buf + written, size - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            log_error("Failed to spill a queued message: %s", strerror(errno));
+            if (ftruncate(seg->fd, store.used) < 0)
+                log_error("Failed to truncate the spill segment: %s",
+                          strerror(errno));
+            goto exit;
+        }
+        written += n;
+    }
+    if (q->count == q->cap) {
+        // Grow the ring unrolling it, the head goes back to the start
+        size_t cap = q->cap ? q->cap * 2 : SPILL_MIN_REFS;
+        struct spill_ref *refs = try_alloc(cap * sizeof(*refs));
+        for (size_t i = 0; i < q->count; ++i)
+            refs[i] = *spill_at(q, i);
+        free_memory(q->refs);
+        q->refs = refs;
+        q->cap = cap;
+        q->head = 0;
+    }
+    q->refs[(q->head + q->count) % q->cap] = (struct spill_ref) {
+        .segment = seg->id,
+        .offset = store.used,
+        .size = size,
+        .qos = qos
+    };
+    q->count++;
+    q->bytes += size;
+    seg->live++;
+    store.used += size;
+    err = 0;
+exit:
+    pthread_mutex_unlock(&store.lock);
+    return err;
+}
+
+int spill_read(const struct spill_ref *ref, unsigned char *buf) {
+    int err = -1;
+    pthread_mutex_lock(&store.lock);
+    struct spill_segment *seg = segment_get(ref->segment);
+    if (!seg)
+        goto exit;
+    size_t done = 0;
+    while (done < ref->size) {
+        ssize_t n = pread(seg->fd, buf + done,
+                          ref->size - done, ref->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            log_error("Failed to read a spilled message: %s",
+                      n < 0 ? strerror(errno) : "short read");
+            goto exit;
+        }
+        done += n;
+    }
+    err = 0;
+exit:
+    pthread_mutex_unlock(&store.lock);
+    return err;
+}
+
+void spill_pop(struct spill_queue *q) {
+    if (q->count == 0)
+        return;
+    const struct spill_ref *ref = spill_at(q, 0);
+    pthread_mutex_lock(&store.lock);
+    segment_release(ref->segment);
+    pthread_mutex_unlock(&store.lock);
+    q->bytes -= ref->size;
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+}
+
+void spill_clear(struct spill_queue *q) {
+    pthread_mutex_lock(&store.lock);
+    for (size_t i = 0; i < q->count; ++i)
+        segment_release(spill_at(q, i)->segment);
+    pthread_mutex_unlock(&store.lock);
+    free_memory(q->refs);
+    *q = (struct spill_queue) { 0 };
+}
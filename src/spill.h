@@ -0,0 +1,108 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Spill store of the offline queues. Once the messages a session holds in
+ * memory pass a threshold the following ones are written out packed, as
+ * they'd go on the wire, and the session keeps just a reference to each of
+ * them, 16 bytes, so a queue can grow to millions of messages with the
+ * memory taken staying flat.
+ *
+ * Messages are appended to segments of fixed size, spill-<n>.dat, shared by
+ * all the sessions, a segment is removed as soon as the last message it
+ * holds has been consumed or dropped. Nothing is synced, the store only
+ * offloads memory: queues of the persistent sessions are made durable by
+ * the write-ahead log, replaying it spills them again, so whatever is found
+ * in the directory on open is stale and removed.
+ * Calls are serialized by a lock of the store.
+ */
+
+/* Position of a message spilled and the QoS it's going to be sent with */
+struct spill_ref {
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t size;
+    unsigned char qos;
+};
+
+/*
+ * Tail of an offline queue spilled, a ring of references in the order the
+ * messages were queued, along with their total size
+ */
+struct spill_queue {
+    struct spill_ref *refs;
+    size_t head;
+    size_t count;
+    size_t cap;
+    size_t bytes;
+};
+
+/* Set once the store has been opened, queues are kept in memory otherwise */
+extern bool spill_enabled;
+
+/*
+ * Open the store in a directory, creating it if missing and removing the
+ * segments found. Returns 0 on success, -1 otherwise.
+ */
+int spill_open(const char *);
+
+void spill_close(void);
+
+/*
+ * Append a packed message to the tail of a queue. Returns 0 on success, -1
+ * on write errors, the message is then to be kept in memory.
+ */
+int spill_push(struct spill_queue *, const unsigned char *, size_t,
+               unsigned char);
+
+/* Remove the message at the head of a queue, releasing its space */
+void spill_pop(struct spill_queue *);
+
+/* Remove all the messages of a queue and free it */
+void spill_clear(struct spill_queue *);
+
+/* Reference to the n-th message from the head of a queue */
+static inline const struct spill_ref *spill_at(const struct spill_queue *q,
+                                               size_t n) {
+    return &q->refs[(q->head + n) % q->cap];
+}
+
+/*
+ * Read a message spilled in a buffer large enough for its size. Returns 0 on
+ * success, -1 on read errors.
+ */
+int spill_read(const struct spill_ref *, unsigned char *);
+
+#endif
@@ -28,54 +28,155 @@
 #include "memory.h"
 #include "sol_internal.h"
 
-static void subscriber_destroy(const struct ref *);
+/*
+ * Subscribers of a topic are stored contiguously, in no particular order, so
+ * that a publish walks them with a linear scan. Up to INDEX_MIN_SIZE of them
+ * are looked up by a scan as well, past that an open addressing index maps
+ * each handle to its position in the array, plus one as 0 marks an empty
+ * slot. The array is halved when down to a quarter of its capacity.
+ */
+#define MIN_CAPACITY    4
+#define INDEX_MIN_SIZE  16
+
+/* Handles are mostly sequential, spread them over the slots */
+static inline uint32_t handle_hash(uint32_t handle) {
+    handle ^= handle >> 16;
+    handle *= 0x45d9f3bu;
+    handle ^= handle >> 16;
+    return handle;
+}
+
+/* Linear probing, returns the slot of the handle or the empty one ending the run */
+static uint32_t slot_find(const struct subscribers *subs, uint32_t handle) {
+    uint32_t mask = subs->nslots - 1, i = handle_hash(handle) & mask;
+    while (subs->index[i] && subs->items[subs->index[i] - 1].handle != handle)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/*
+ * Empty a slot shifting back the entries following it in the same run which
+ * wouldn't be found anymore, the same as the client ID table does.
+ */
+static void slot_remove(struct subscribers *subs, uint32_t i) {
+    uint32_t mask = subs->nslots - 1, j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!subs->index[j])
+            break;
+        uint32_t home =
+            handle_hash(subs->items[subs->index[j] - 1].handle) & mask;
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays)
+            continue;
+        subs->index[i] = subs->index[j];
+        i = j;
+    }
+    subs->index[i] = 0;
+}
+
+/* Rebuild the index for the current size, dropping it if small enough */
+static void index_rebuild(struct subscribers *subs) {
+    free_memory(subs->index);
+    subs->index = NULL;
+    subs->nslots = 0;
+    if (subs->size <= INDEX_MIN_SIZE)
+        return;
+    uint32_t nslots = INDEX_MIN_SIZE * 2;
+    while (nslots < subs->capacity * 2)
+        nslots *= 2;
+    subs->nslots = nslots;
+    subs->index = try_calloc(nslots, sizeof(*subs->index));
+    for (uint32_t pos = 0; pos < subs->size; ++pos)
+        subs->index[slot_find(subs, subs->items[pos].handle)] = pos + 1;
+}
+
+static void subscribers_resize(struct subscribers *subs, uint32_t capacity) {
+    subs->items = try_realloc(subs->items, capacity * sizeof(*subs->items));
+    subs->capacity = capacity;
+    index_rebuild(subs);
+}
+
+/*
+ * Return the subscriber referring to the client ID handle, NULL if not found
+ */
+struct subscriber *subscribers_find(const struct subscribers *subs,
+                                    uint32_t handle) {
+    if (subs->index) {
+        uint32_t pos = subs->index[slot_find(subs, handle)];
+        return pos ? &subs->items[pos - 1] : NULL;
+    }
+    for (uint32_t pos = 0; pos < subs->size; ++pos)
+        if (subs->items[pos].handle == handle)
+            return &subs->items[pos];
+    return NULL;
+}
 
 /*
- * Allocate memory on the heap to create and return a pointer to a struct
- * subscriber, assigining the passed in QoS, session pointer, and
- * instantiating a reference counter to 0.
- * It may fail as it needs to allocate some bytes on the heap.
+ * Append a subscriber with the passed in client ID handle and QoS, which is
+ * retained till the subscriber is removed. If the handle is already
+ * subscribed, the existing subscriber is returned instead.
+ * The pointer returned is valid till the next change to the set.
  */
-struct subscriber *subscriber_new(struct client_session * s, unsigned char qos) {
-    struct subscriber *sub = try_alloc(sizeof(*sub));
-    sub->session = s;
-    sub->granted_qos = qos;
-    sub->refcount = (struct ref) { .count = 0, .free = subscriber_destroy };
-    memcpy(sub->id, s->session_id, MQTT_CLIENT_ID_LEN);
-    return sub;
+struct subscriber *subscribers_add(struct subscribers *subs, uint32_t handle,
+                                   unsigned char qos) {
+    struct subscriber *sub = subscribers_find(subs, handle);
+    if (sub)
+        return sub;
+    if (subs->size == subs->capacity)
+        subscribers_resize(subs, subs->capacity ?
+                           subs->capacity * 2 : MIN_CAPACITY);
+    uint32_t pos = subs->size++;
+    subs->items[pos] = (struct subscriber) {
+        .handle = handle, .granted_qos = qos
+    };
+    if (subs->index)
+        subs->index[slot_find(subs, handle)] = pos + 1;
+    else if (subs->size > INDEX_MIN_SIZE)
+        index_rebuild(subs);
+    client_id_retain(handle);
+    return &subs->items[pos];
 }
 
 /*
- * Allocate memory on the heap to clone a subscriber pointer, deep copies all
- * fields into the newly allocated pointer except for the reference counter,
- * the new pointer will have its own refcount set to 0. Finally the newly
- * allocated pointer is returned.
- * It may fail as it needs to allocate some bytes on the heap.
+ * Remove the subscriber referring to the client ID handle, if any, and
+ * release the handle. The last subscriber takes its place in the array.
  */
-struct subscriber *subscriber_clone(const struct subscriber *s) {
-    struct subscriber *sub = try_alloc(sizeof(*sub));
-    sub->session = s->session;
-    sub->granted_qos = s->granted_qos;
-    sub->refcount = (struct ref) { .count = 0, .free = subscriber_destroy };
-    memcpy(sub->id, s->id, MQTT_CLIENT_ID_LEN);
-    return sub;
+void subscribers_del(struct subscribers *subs, uint32_t handle) {
+    struct subscriber *sub = subscribers_find(subs, handle);
+    if (!sub)
+        return;
+    uint32_t pos = sub - subs->items, last = subs->size - 1;
+    if (subs->index) {
+        slot_remove(subs, slot_find(subs, handle));
+        if (pos != last)
+            subs->index[slot_find(subs, subs->items[last].handle)] = pos + 1;
+    }
+    subs->items[pos] = subs->items[last];
+    subs->size--;
+    client_id_release(handle);
+    if (subs->size == 0)
+        subscribers_destroy(subs);
+    else if (subs->capacity > MIN_CAPACITY && subs->size <= subs->capacity / 4)
+        subscribers_resize(subs, subs->capacity / 2);
 }
 
 /*
- * Checks if a client is subscribed to a topic by trying to fetch the
- * client_session by its ID on the subscribers inner hashmap of the topic.
+ * Release the handles of all the subscribers and free the set memory, which
+ * is left empty
  */
-bool is_subscribed(const struct topic *t, const struct client_session *s) {
-    struct subscriber *dummy = NULL;
-    HASH_FIND_STR(t->subscribers, s->session_id, dummy);
-    return dummy != NULL;
+void subscribers_destroy(struct subscribers *subs) {
+    for (uint32_t pos = 0; pos < subs->size; ++pos)
+        client_id_release(subs->items[pos].handle);
+    free_memory(subs->items);
+    free_memory(subs->index);
+    *subs = (struct subscribers) { 0 };
 }
 
 /*
- * Auxiliary function, defines the destructor behavior for subscriber, just
- * decreasing the reference counter till 0, then free the memory.
+ * Checks if a client is subscribed to a topic by looking up the handle of
+ * its ID in the subscribers of the topic.
  */
-static void subscriber_destroy(const struct ref *r) {
-    struct subscriber *sub = container_of(r, struct subscriber, refcount);
-    free_memory(sub);
+bool is_subscribed(const struct topic *t, uint32_t handle) {
+    return subscribers_find(&t->subscribers, handle) != NULL;
 }
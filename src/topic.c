@@ -25,12 +25,26 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
 #include "memory.h"
 #include "sol_internal.h"
 
 /*
- * Initialize a struct topic pointer by setting its name, subscribers and
- * retained_msg are set to NULL.
+ * FNV-1a hash of a topic name, without the trailing '/' if any, the same for
+ * the name as published and the one stored
+ */
+uint32_t topic_hash(const char *name, size_t len) {
+    if (len > 0 && name[len - 1] == '/')
+        len--;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return h;
+}
+
+/*
+ * Initialize a struct topic pointer by setting its name, subscribers are
+ * empty and retained_msg is set to NULL.
  * The function expects a non-null pointer and can't fail, if a null topic
  * is passed, the function return prematurely.
  */
@@ -38,8 +52,12 @@ void topic_init(struct topic *t, const char *name) {
     if (!t)
         return;
     t->name = name;
-    t->subscribers = NULL;
+    t->len = strlen(name);
+    t->hash = topic_hash(name, t->len);
+    t->wildcards_gen = 0;
+    t->subscribers = (struct subscribers) { 0 };
     t->retained_msg = NULL;
+    t->last_seen = time(NULL);
 }
 
 /*
@@ -61,49 +79,27 @@ void topic_destroy(struct topic *t) {
         return;
     free_memory((void *) t->name);
     free_memory(t->retained_msg);
-    if (!t->subscribers) {
-        free_memory(t);
-        return;
-    }
-    struct subscriber *sub, *dummy;
-    HASH_ITER(hh, t->subscribers, sub, dummy) {
-        if (!sub)
-            continue;
-        HASH_DEL(t->subscribers, sub);
-        free_memory(sub);
-    }
+    subscribers_destroy(&t->subscribers);
     free_memory(t);
 }
 
 /*
- * Allocate a new subscriber struct on the heap referring to the passed in
- * topic, client_session and QoS, then add it to the topic map.
+ * Add a subscriber to the topic referring to the passed in client ID handle
+ * and QoS. If the handle is already subscribed, the existing subscriber is
+ * returned, valid till the subscribers of the topic change.
  * The function can fail as a memory allocation is requested, if it fails the
  * program execution graceful crash.
  */
-struct subscriber *topic_add_subscriber(struct topic *t,
-                                        struct client_session *s,
+struct subscriber *topic_add_subscriber(struct topic *t, uint32_t handle,
                                         unsigned char qos) {
-    struct subscriber *sub = subscriber_new(s, qos), *tmp;
-    HASH_FIND_STR(t->subscribers, sub->id, tmp);
-    if (!tmp)
-        HASH_ADD_STR(t->subscribers, id, sub);
-    return sub;
+    return subscribers_add(&t->subscribers, handle, qos);
 }
 
 /*
  * Remove a subscriber from the topic, the subscriber to be removed refers to
- * the client_id belonging to the client pointer passed in.
- * The subscriber deletion is really a reference count subtraction, DECREF
- * macro takes care of the counter, if it reaches 0 it de-allocates the memory
- * reserved to the struct subscriber.
+ * the client ID handle passed in, which is released along with it.
  * The function can't fail.
  */
-void topic_del_subscriber(struct topic *t, struct client *c) {
-    struct subscriber *sub = NULL;
-    HASH_FIND_STR(t->subscribers, c->client_id, sub);
-    if (sub) {
-        HASH_DEL(t->subscribers, sub);
-        DECREF(sub, struct subscriber);
-    }
+void topic_del_subscriber(struct topic *t, uint32_t handle) {
+    subscribers_del(&t->subscribers, handle);
 }
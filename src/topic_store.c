@@ -26,6 +26,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
 #include "trie.h"
 #include "list.h"
 #include "memory.h"
@@ -48,6 +49,7 @@ struct topic_store *topic_store_new(void) {
     struct topic_store *store = try_alloc(sizeof(*store));
     store->topics = trie_new(topic_destructor);
     store->wildcards = list_new(wildcard_destructor);
+    store->wildcards_gen = 0;
     return store;
 }
 
@@ -113,17 +115,18 @@ struct topic *topic_store_get_or_put(struct topic_store *store,
 
 /*
  * Add a wildcard topic to the topic_store struct, does not check if it already
- * exists
+ * exists. All topics will have to be matched against the wildcards again.
  */
 void topic_store_add_wildcard(struct topic_store *store, struct subscription *s) {
     store->wildcards = list_push(store->wildcards, s);
+    store->wildcards_gen++;
 }
 
 /*
- * Remove a wildcard by id key from the topic_store struct
+ * Remove the wildcards of a client ID handle from the topic_store struct
  */
-void topic_store_remove_wildcard(struct topic_store *store, char *id) {
-    list_remove(store->wildcards, id, subscription_cmp);
+void topic_store_remove_wildcard(struct topic_store *store, uint32_t handle) {
+    list_remove(store->wildcards, &handle, subscription_cmp);
 }
 
 /*
@@ -142,6 +145,29 @@ bool topic_store_wildcards_empty(const struct topic_store *store) {
     return list_size(store->wildcards) == 0;
 }
 
+/*
+ * Check if a topic match a wildcard subscription. It works with + and # as
+ * well, walking both names once: a '+' consumes a whole level of the topic,
+ * a '#' subscription, stored without it, matches all the topics it prefixes.
+ */
+int match_subscription(const char *topic, const char *wtopic, bool multilevel) {
+    while (*wtopic) {
+        if (*wtopic == '+') {
+            if (!*topic)
+                return -SOL_ERR;
+            while (*topic && *topic != '/')
+                topic++;
+            wtopic++;
+            continue;
+        }
+        if (*wtopic != *topic)
+            return -SOL_ERR;
+        wtopic++;
+        topic++;
+    }
+    return multilevel == true || !*topic ? SOL_OK : -SOL_ERR;
+}
+
 /*
  * Auxiliary function, destructor to be passed in to init a list structure,
  * this one is used to correctly destroy struct subscription items
@@ -150,7 +176,7 @@ static int wildcard_destructor(struct list_node *node) {
     if (!node)
         return -SOL_ERR;
     struct subscription *s = node->data;
-    DECREF(s->subscriber, struct subscriber);
+    client_id_release(s->handle);
     free_memory((char *) s->topic);
     free_memory(s);
     free_memory(node);
@@ -175,6 +201,6 @@ static bool topic_destructor(struct trie_node *node, bool flag) {
  */
 static int subscription_cmp(const void *ptr_s1, const void *ptr_s2) {
     struct subscription *s1 = ((struct list_node *) ptr_s1)->data;
-    const char *id = ptr_s2;
-    return STREQ(s1->subscriber->id, id, MQTT_CLIENT_ID_LEN);
+    const uint32_t *handle = ptr_s2;
+    return s1->handle == *handle;
 }
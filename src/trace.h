@@ -0,0 +1,62 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * USDT static tracepoints on the packet lifecycle, compiled in when the
+ * SystemTap SDT header is available (systemtap-sdt-dev or equivalent) and
+ * the USDT build option is on. Each probe is a single nop in the text plus a
+ * note in the ELF, bpftrace, perf or SystemTap patch it into a trap only
+ * while attached, so they are left in production builds. Arguments are
+ * evaluated anyway, probes must only be passed fields already at hand.
+ *
+ * Every probe is in the "sol" provider and, where a client is involved,
+ * takes the struct client address first, to be used as a correlation key:
+ *
+ * client__accept       (client, fd, ip)
+ * packet__recv         (client, type, bytes)     full frame read
+ * packet__dispatch     (client, type)            unpacked, handler called
+ * packet__handled      (client, type, rc)        handler returned
+ * publish__enqueue     (client, id, topic, qos, queued)  once per recipient
+ * write__done          (client, bytes)           output buffer flushed
+ * client__deactivate   (client, id)
+ * inflight__retransmit (client, id, mid, age_ns)
+ *
+ * publish__enqueue passes a NULL client for offline sessions, queued is 1
+ * when the message went to the session backlog instead of the output
+ * buffer. See tools/bpftrace for scripts deriving per-stage latencies.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE(probe, ...) STAP_PROBEV(sol, probe, __VA_ARGS__)
+#else
+#define TRACE(probe, ...) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,445 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "pack.h"
+#include "config.h"
+#include "memory.h"
+#include "logging.h"
+#include "upgrade.h"
+#include "sol_internal.h"
+
+#define UPGRADE_MAGIC       0x534f4c55 // "SOLU"
+#define UPGRADE_PATH_MAX    4096
+// Name of the variable telling the new process where the channel is
+#define UPGRADE_ENV         "SOL_UPGRADE_FD"
+// The channel is moved right after the standard streams in the new process
+#define UPGRADE_CHANNEL_FD  3
+
+#define UPGRADE_FLAG_CLEAN  (1 << 0)
+#define UPGRADE_FLAG_LWT    (1 << 1)
+
+extern char **environ;
+
+/*
+ * Binary to exec and its arguments, the channel to the old process if
+ * started by an upgrade, and the descriptors written to request one
+ */
+static struct {
+    char binary[UPGRADE_PATH_MAX];
+    char **argv;
+    int channel;
+    int request[2];
+} upgrade = { .channel = -1, .request = { -1, -1 } };
+
+/*
+ * Resolve the path of the binary as it was run, looking it up in the PATH if
+ * it carries no directory. It's not read from /proc, an upgrade replaces the
+ * file, it'd be found deleted there.
+ */
+static void resolve_binary(const char *name) {
+    snprintf(upgrade.binary, UPGRADE_PATH_MAX, "%s", name);
+    if (strchr(name, '/')) {
+        realpath(name, upgrade.binary);
+        return;
+    }
+    const char *path = getenv("PATH");
+    while (path && *path) {
+        const char *end = strchr(path, ':');
+        size_t len = end ? (size_t) (end - path) : strlen(path);
+        char candidate[UPGRADE_PATH_MAX];
+        snprintf(candidate, sizeof(candidate), "%.*s/%s", (int) len, path, name);
+        if (len > 0 && access(candidate, X_OK) == 0) {
+            realpath(candidate, upgrade.binary);
+            return;
+        }
+        path = end ? end + 1 : NULL;
+    }
+}
+
+int upgrade_init(char **argv) {
+    upgrade.argv = argv;
+    resolve_binary(argv[0]);
+    const char *channel = getenv(UPGRADE_ENV);
+    if (channel) {
+        upgrade.channel = atoi(channel);
+        unsetenv(UPGRADE_ENV);
+    }
+#ifdef __linux__
+    upgrade.request[0] = upgrade.request[1] =
+        eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (upgrade.request[0] < 0)
+        return -1;
+#else
+    if (pipe(upgrade.request) < 0)
+        return -1;
+    for (int i = 0; i < 2; ++i) {
+        fcntl(upgrade.request[i], F_SETFL, O_NONBLOCK);
+        fcntl(upgrade.request[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    return 0;
+}
+
+bool upgrade_inherited(void) {
+    return upgrade.channel >= 0;
+}
+
+void upgrade_request(void) {
+#ifdef __linux__
+    eventfd_write(upgrade.request[1], 1);
+#else
+    (void) write(upgrade.request[1], &(unsigned long) {1}, sizeof(unsigned long));
+#endif
+}
+
+int upgrade_request_fd(void) {
+    return upgrade.request[0];
+}
+
+/* Close every descriptor from a number on, in the child about to exec */
+static void close_from(int lowfd, long maxfd) {
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, lowfd, ~0U, 0) == 0)
+        return;
+#endif
+    for (long fd = lowfd; fd < maxfd; ++fd)
+        close(fd);
+}
+
+int upgrade_spawn(pid_t *pid) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+        return -1;
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+    /*
+     * Everything the child needs is prepared before forking, other threads
+     * may hold the allocator locks, only async signal safe calls after
+     */
+    size_t n = 0;
+    while (environ[n])
+        ++n;
+    char **envp = try_alloc((n + 2) * sizeof(char *));
+    char channel[32];
+    snprintf(channel, sizeof(channel), "%s=%d",
+             UPGRADE_ENV, UPGRADE_CHANNEL_FD);
+    size_t envc = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0)
+            envp[envc++] = environ[i];
+    envp[envc++] = channel;
+    envp[envc] = NULL;
+    long maxfd = sysconf(_SC_OPEN_MAX);
+    *pid = fork();
+    if (*pid == 0) {
+        // dup2 doesn't carry the close-on-exec flag over
+        if (sv[1] != UPGRADE_CHANNEL_FD)
+            dup2(sv[1], UPGRADE_CHANNEL_FD);
+        else
+            fcntl(sv[1], F_SETFD, 0);
+        close_from(UPGRADE_CHANNEL_FD + 1, maxfd);
+        execve(upgrade.binary, upgrade.argv, envp);
+        _exit(127);
+    }
+    free_memory(envp);
+    close(sv[1]);
+    if (*pid < 0) {
+        close(sv[0]);
+        return -1;
+    }
+    return sv[0];
+}
+
+int upgrade_send(int chan, const struct upgrade_msg *msg,
+                 const int *fds, int nfds) {
+    union {
+        char buf[CMSG_SPACE(UPGRADE_FDS_MAX * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = (void *) msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (nfds > 0) {
+        memset(&control, 0x00, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(chan, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == sizeof(*msg) ? 0 : -1;
+}
+
+int upgrade_recv(int chan, struct upgrade_msg *msg, int *fds, int maxfds) {
+    union {
+        char buf[CMSG_SPACE(UPGRADE_FDS_MAX * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    ssize_t n;
+    do {
+        n = recvmsg(chan, &mh, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        if (n == 0)
+            errno = ECONNRESET;
+        return -1;
+    }
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg;
+         cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int received[count];
+        memcpy(received, CMSG_DATA(cmsg), count * sizeof(int));
+        for (int i = 0; i < count; ++i) {
+            if (nfds == maxfds) {
+                close(received[i]);
+                continue;
+            }
+            fcntl(received[i], F_SETFD, FD_CLOEXEC);
+            fds[nfds++] = received[i];
+        }
+    }
+    if (n != sizeof(*msg) || msg->magic != UPGRADE_MAGIC
+        || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        while (nfds > 0)
+            close(fds[--nfds]);
+        errno = EPROTO;
+        return -1;
+    }
+    return nfds;
+}
+
+int upgrade_receive(struct upgrade_state *st) {
+    int fds[3], n, err = -1;
+    *st = (struct upgrade_state) { .listen_fd = -1, .sessions_fd = -1 };
+    struct upgrade_msg msg = {
+        .magic = UPGRADE_MAGIC,
+        .type = UPGRADE_READY,
+        .max_request_size = conf->max_request_size,
+        .tls = conf->tls
+    };
+    if (upgrade_send(upgrade.channel, &msg, NULL, 0) < 0)
+        goto exit;
+    n = upgrade_recv(upgrade.channel, &msg, fds, 3);
+    if (n < 0)
+        goto exit;
+    if (msg.type != UPGRADE_STATE || n != 3) {
+        while (n > 0)
+            close(fds[--n]);
+        errno = EPROTO;
+        goto exit;
+    }
+    st->lsn = msg.lsn;
+    st->listen_fd = fds[0];
+    st->sessions_fd = fds[1];
+    st->clients = fdopen(fds[2], "r");
+    if (!st->clients) {
+        close(fds[2]);
+        goto exit;
+    }
+    size_t total = msg.count;
+    st->client_fds = try_alloc((total > 0 ? total : 1) * sizeof(int));
+    while (st->nclients < total) {
+        size_t left = total - st->nclients;
+        n = upgrade_recv(upgrade.channel, &msg, st->client_fds + st->nclients,
+                         left < UPGRADE_FDS_MAX ? left : UPGRADE_FDS_MAX);
+        if (n < 0)
+            goto exit;
+        st->nclients += n;
+        if (msg.type != UPGRADE_FDS || n == 0) {
+            errno = EPROTO;
+            goto exit;
+        }
+    }
+    err = 0;
+exit:
+    close(upgrade.channel);
+    upgrade.channel = -1;
+    return err;
+}
+
+int upgrade_handover(int chan, const struct upgrade_state *st) {
+    int fds[3] = { st->listen_fd, st->sessions_fd, fileno(st->clients) };
+    struct upgrade_msg msg = {
+        .magic = UPGRADE_MAGIC,
+        .type = UPGRADE_STATE,
+        .lsn = st->lsn,
+        .count = st->nclients
+    };
+    int err = upgrade_send(chan, &msg, fds, 3);
+    for (size_t i = 0; err == 0 && i < st->nclients; i += UPGRADE_FDS_MAX) {
+        size_t left = st->nclients - i;
+        msg.type = UPGRADE_FDS;
+        msg.count = left < UPGRADE_FDS_MAX ? left : UPGRADE_FDS_MAX;
+        err = upgrade_send(chan, &msg, st->client_fds + i, msg.count);
+    }
+    close(chan);
+    return err;
+}
+
+static int write_bytes(FILE *f, const void *buf, size_t len) {
+    return len > 0 && fwrite(buf, len, 1, f) != 1 ? -1 : 0;
+}
+
+static int read_bytes(FILE *f, void *buf, size_t len) {
+    return len > 0 && fread(buf, len, 1, f) != 1 ? -1 : 0;
+}
+
+static int write_u16(FILE *f, uint16_t v) {
+    unsigned char buf[2];
+    packi16(buf, v);
+    return write_bytes(f, buf, 2);
+}
+
+static int write_u32(FILE *f, uint32_t v) {
+    unsigned char buf[4];
+    packi32(buf, v);
+    return write_bytes(f, buf, 4);
+}
+
+static int read_u16(FILE *f, uint16_t *v) {
+    unsigned char buf[2];
+    if (read_bytes(f, buf, 2) < 0)
+        return -1;
+    *v = unpacku16(buf);
+    return 0;
+}
+
+static int read_u32(FILE *f, uint32_t *v) {
+    unsigned char buf[4];
+    if (read_bytes(f, buf, 4) < 0)
+        return -1;
+    *v = unpacku32(buf);
+    return 0;
+}
+
+int upgrade_pack_client(FILE *f, const struct client *c) {
+    size_t idlen = strlen(c->client_id), iplen = strlen(c->conn.ip);
+    const struct mqtt_packet *lwt = c->has_lwt ? &c->session->lwt_msg : NULL;
+    size_t in = c->rbuf ? c->read : 0;
+    size_t out = c->wbuf ? c->towrite - c->wrote : 0;
+    unsigned char flags = (c->clean_session ? UPGRADE_FLAG_CLEAN : 0)
+        | (lwt ? UPGRADE_FLAG_LWT : 0);
+    unsigned char head[] = {
+        iplen, flags, lwt ? lwt->header.byte : 0, c->status
+    };
+    if (write_u16(f, idlen) < 0 || write_bytes(f, c->client_id, idlen) < 0
+        || write_bytes(f, head, 1) < 0 || write_bytes(f, c->conn.ip, iplen) < 0
+        || write_bytes(f, head + 1, 3) < 0 || write_u16(f, c->keepalive) < 0)
+        return -1;
+    if (lwt && (write_u16(f, lwt->publish.topiclen) < 0
+                || write_u32(f, lwt->publish.payloadlen) < 0
+                || write_bytes(f, lwt->publish.topic, lwt->publish.topiclen) < 0
+                || write_bytes(f, lwt->publish.payload,
+                               lwt->publish.payloadlen) < 0))
+        return -1;
+    if (write_u32(f, c->rpos) < 0 || write_u32(f, in) < 0
+        || write_u32(f, c->toread) < 0 || write_bytes(f, c->rbuf, in) < 0
+        || write_u32(f, out) < 0 || write_bytes(f, c->wbuf + c->wrote, out) < 0)
+        return -1;
+    return 0;
+}
+
+int upgrade_unpack_client(FILE *f, struct client *c, struct mqtt_packet *lwt) {
+    uint16_t idlen, keepalive, topiclen = 0;
+    uint32_t payloadlen = 0, rpos, in, toread, out;
+    unsigned char head[4];
+    char id[MQTT_CLIENT_ID_LEN];
+    memset(lwt, 0x00, sizeof(*lwt));
+    if (read_u16(f, &idlen) < 0 || idlen >= MQTT_CLIENT_ID_LEN
+        || read_bytes(f, id, idlen) < 0
+        || read_bytes(f, head, 1) < 0 || head[0] >= sizeof(c->conn.ip)
+        || read_bytes(f, c->conn.ip, head[0]) < 0
+        || read_bytes(f, head + 1, 3) < 0 || head[3] > SENDING_DATA
+        || read_u16(f, &keepalive) < 0)
+        goto err;
+    c->status = head[3];
+    id[idlen] = '\0';
+    c->conn.ip[head[0]] = '\0';
+    c->clean_session = head[1] & UPGRADE_FLAG_CLEAN;
+    c->has_lwt = head[1] & UPGRADE_FLAG_LWT;
+    c->keepalive = keepalive;
+    if (c->has_lwt) {
+        if (read_u16(f, &topiclen) < 0 || read_u32(f, &payloadlen) < 0)
+            goto err;
+        lwt->header.byte = head[2];
+        lwt->publish.topiclen = topiclen;
+        lwt->publish.payloadlen = payloadlen;
+        lwt->publish.topic = try_calloc(topiclen + 1, 1);
+        lwt->publish.payload = try_calloc(payloadlen + 1, 1);
+        if (read_bytes(f, lwt->publish.topic, topiclen) < 0
+            || read_bytes(f, lwt->publish.payload, payloadlen) < 0)
+            goto err;
+    }
+    if (read_u32(f, &rpos) < 0 || read_u32(f, &in) < 0
+        || read_u32(f, &toread) < 0 || in > conf->max_request_size
+        || toread > conf->max_request_size
+        || read_bytes(f, c->rbuf, in) < 0
+        || read_u32(f, &out) < 0 || out > conf->max_request_size
+        || read_bytes(f, c->wbuf, out) < 0)
+        goto err;
+    c->rpos = rpos;
+    c->read = in;
+    c->toread = toread;
+    c->wrote = 0;
+    c->towrite = out;
+    c->handle = client_id_intern(id);
+    c->client_id = client_id_get(c->handle)->id;
+    return 0;
+err:
+    free_memory(lwt->publish.topic);
+    free_memory(lwt->publish.payload);
+    memset(lwt, 0x00, sizeof(*lwt));
+    c->has_lwt = false;
+    errno = EPROTO;
+    return -1;
+}
@@ -0,0 +1,152 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct client;
+struct mqtt_packet;
+
+/*
+ * Binary upgrade without downtime. On SIGUSR2 the running process execs the
+ * binary it was started from, the new one, with the same arguments, keeping
+ * a Unix socket to it open. Once the new process is ready, loaded the
+ * configuration and the password file, it asks for the state: the old one
+ * stops its loops and hands over, as SCM_RIGHTS messages, the listening
+ * socket, a snapshot of the sessions, the clean ones of the clients handed
+ * over as well, and the connected plaintext clients along with their
+ * buffered input and output, then exits. Connections waiting to be accepted
+ * queue on the listening socket meanwhile, the others never notice.
+ *
+ *     OLD                                NEW
+ *      | --- fork, exec ---------------->  |
+ *      | <-------------------- READY ----- |
+ *   stop loops                             |
+ *      | --- STATE (listen, sessions,      |
+ *      |     clients file) ------------->  |
+ *      | --- FDS (client sockets) x N -->  |
+ *    exit                               serve
+ */
+
+#define UPGRADE_READY  1
+#define UPGRADE_STATE  2
+#define UPGRADE_FDS    3
+
+/*
+ * Message exchanged on the channel, count is the number of clients for the
+ * STATE, of descriptors carried for FDS. READY carries the settings of the
+ * new process limiting what can be handed over to it.
+ */
+struct upgrade_msg {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t lsn;
+    uint64_t count;
+    uint64_t max_request_size;
+    bool tls;
+};
+
+/*
+ * Descriptors handed over with the STATE, followed by those of the clients,
+ * in the order of the clients file
+ */
+struct upgrade_state {
+    uint64_t lsn;
+    int listen_fd;
+    int sessions_fd;
+    FILE *clients;
+    size_t nclients;
+    int *client_fds;
+};
+
+/*
+ * To be called first thing by main, records the path of the binary to exec
+ * on upgrade and, in a process started by an upgrade, the channel to the old
+ * one, removing it from the environment. Returns -1 if the request channel
+ * can't be created.
+ */
+int upgrade_init(char **);
+
+/* True in a process started by an upgrade, till the state is received */
+bool upgrade_inherited(void);
+
+/* Async signal safe, asks the loop watching upgrade_request_fd to upgrade */
+void upgrade_request(void);
+
+int upgrade_request_fd(void);
+
+/*
+ * Fork and exec the new binary. Returns the channel to it, storing its pid,
+ * -1 on error.
+ */
+int upgrade_spawn(pid_t *);
+
+/*
+ * Send or receive a message on the channel with the descriptors it carries,
+ * at most UPGRADE_FDS_MAX. Receiving returns the number of descriptors
+ * received, -1 on errors or if the other end hung up.
+ */
+#define UPGRADE_FDS_MAX 200
+
+int upgrade_send(int, const struct upgrade_msg *, const int *, int);
+
+int upgrade_recv(int, struct upgrade_msg *, int *, int);
+
+/*
+ * New process side, send READY and wait for the whole state. Returns 0 on
+ * success, -1 otherwise, the channel is closed in any case.
+ */
+int upgrade_receive(struct upgrade_state *);
+
+/*
+ * Old process side, hand over the state, then all the client descriptors,
+ * in batches. Returns 0 on success, -1 otherwise, the channel is closed in
+ * any case, the descriptors handed over are left to the caller.
+ */
+int upgrade_handover(int, const struct upgrade_state *);
+
+/*
+ * Record of a client in the clients file: its id, address, connection
+ * settings and LWT, the state of the packet being read with the input read
+ * so far, and the output not yet written. Returns -1 on write errors.
+ */
+int upgrade_pack_client(FILE *, const struct client *);
+
+/*
+ * Read the next record in a client, initialized with buffers large enough,
+ * its LWT goes in the packet passed in, to be set in the session, its ID is
+ * interned, the client holding the handle. Returns 0 on success, -1 on errors
+ * or if it doesn't fit the buffers.
+ */
+int upgrade_unpack_client(FILE *, struct client *, struct mqtt_packet *);
+
+#endif
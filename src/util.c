@@ -130,8 +130,15 @@ void generate_random_id(char *dest) {
     snprintf(dest, MQTT_CLIENT_ID_LEN - 1, "%s-%lu", SOL_PREFIX, utime_ns);
 }
 
+/*
+ * Passwords are verified by multiple threads, crypt_r with a per-thread
+ * work area is used as crypt shares a static one.
+ */
 bool check_passwd(const char *passwd, const char *salt) {
-    return STREQ(crypt(passwd, salt), salt, strlen(salt));
+    static _Thread_local struct crypt_data data;
+    data.initialized = 0;
+    const char *hash = crypt_r(passwd, salt, &data);
+    return hash && STREQ(hash, salt, strlen(salt));
 }
 
 long get_fh_soft_limit(void) {
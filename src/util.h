@@ -28,6 +28,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <time.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -43,6 +44,15 @@ bool check_passwd(const char *, const char *);
 
 long get_fh_soft_limit(void);
 
+/* Monotonic clock in nanoseconds, for measuring intervals */
+static inline uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define CACHE_LINE_SIZE 64
+
 #define STREQ(s1, s2, len) strncasecmp(s1, s2, len) == 0 ? true : false
 
 #define container_of(ptr, type, field) \
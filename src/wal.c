@@ -0,0 +1,900 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "wal.h"
+#include "pack.h"
+#include "memory.h"
+#include "logging.h"
+
+#define WAL_FRAME_HEADER    8
+#define WAL_BODY_HEADER     14
+#define WAL_PATH_MAX        4096
+// Room left in a path for the name of a segment or of a snapshot
+#define WAL_DIR_MAX         (WAL_PATH_MAX - 48)
+
+#define SNAPSHOT_MAGIC      0x534f4c53
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_HEADER     16
+// Records are buffered and written out in chunks of this size
+#define SNAPSHOT_CHUNK      (1 << 20)
+
+bool wal_enabled = false;
+
+/*
+ * The log being written, appends are serialized by the lock, the encoding
+ * buffer is reused across them and only ever grows. In group mode the
+ * committer thread syncs the segment out of the lock, a segment being
+ * synced can't be closed till it's done.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t committer;
+    bool stop;
+    bool syncing;
+    int fd;
+    char dir[WAL_DIR_MAX];
+    struct wal_options opts;
+    size_t segment_used;
+    size_t pending;
+    uint64_t next_lsn;
+    atomic_uint_least64_t committed;
+    unsigned char *buf;
+    size_t bufsize;
+    int (*notify)[2];
+    size_t notify_nr;
+} wal = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+    .next_lsn = 1
+};
+
+/*
+ * A snapshot being written, records are encoded in a buffer of its own, the
+ * writer runs in a forked child where the lock of the log may have been left
+ * held by a thread that doesn't exist there
+ */
+struct wal_snapshot {
+    int fd;
+    uint64_t lsn;
+    unsigned char *buf;
+    size_t bufsize;
+    size_t used;
+};
+
+/* CRC-32 (IEEE 802.3), table generated on first use */
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const unsigned char *data, size_t len) {
+    uint32_t c = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; ++i)
+        c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+static void segment_path(char *path, const char *dir, uint64_t lsn) {
+    snprintf(path, WAL_PATH_MAX, "%s/wal-%020llu.log",
+             dir, (unsigned long long) lsn);
+}
+
+static bool is_segment(const char *name) {
+    unsigned long long lsn;
+    char tail[5] = {0};
+    return sscanf(name, "wal-%20llu%4s", &lsn, tail) == 2
+        && strcmp(tail, ".log") == 0;
+}
+
+static void snapshot_path(char *path, const char *dir, uint64_t lsn) {
+    snprintf(path, WAL_PATH_MAX, "%s/snapshot-%020llu.snap",
+             dir, (unsigned long long) lsn);
+}
+
+static void snapshot_tmp_path(char *path, const char *dir) {
+    snprintf(path, WAL_PATH_MAX, "%s/snapshot.tmp", dir);
+}
+
+static bool is_snapshot(const char *name) {
+    unsigned long long lsn;
+    char tail[6] = {0};
+    return sscanf(name, "snapshot-%20llu%5s", &lsn, tail) == 2
+        && strcmp(tail, ".snap") == 0;
+}
+
+/* Sequence number a segment or a snapshot is named after */
+static uint64_t name_lsn(const char *name) {
+    return strtoull(strchr(name, '-') + 1, NULL, 10);
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/*
+ * List the files of a directory matching a kind, sorted by name, being zero
+ * padded sequence numbers that's their order in the log as well. Returns the
+ * number of names stored, to be freed by the caller, -1 on error.
+ */
+static long list_files(const char *dir, bool (*match)(const char *),
+                       char ***files) {
+    DIR *d = opendir(dir);
+    if (!d)
+        return -1;
+    size_t n = 0, cap = 16;
+    char **names = try_alloc(cap * sizeof(char *));
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (!match(ent->d_name))
+            continue;
+        if (n == cap) {
+            cap *= 2;
+            names = try_realloc(names, cap * sizeof(char *));
+        }
+        names[n++] = try_strdup(ent->d_name);
+    }
+    closedir(d);
+    qsort(names, n, sizeof(char *), name_cmp);
+    *files = names;
+    return n;
+}
+
+static void free_files(char **names, long n) {
+    for (long i = 0; i < n; ++i)
+        free_memory(names[i]);
+    free_memory(names);
+}
+
+/* Sync a directory, for the names created or removed in it to be durable */
+static void sync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fsync(fd) < 0)
+        log_error("Failed to sync %s: %s", dir, strerror(errno));
+    close(fd);
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, buf + written, size - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        written += n;
+    }
+    return 0;
+}
+
+/*
+ * Decode a record body, strings are stored NUL terminated so they can be
+ * pointed to straight in the mapped segment. Returns false if the lengths
+ * declared don't fit the body.
+ */
+static bool record_decode(unsigned char *body, size_t len,
+                          struct wal_record *r) {
+    if (len < WAL_BODY_HEADER + 2 + 4)
+        return false;
+    unsigned char *end = body + len;
+    r->lsn = ntohll(body);
+    r->type = body[8];
+    r->qos = body[9];
+    r->mid = unpacku16(body + 10);
+    size_t idlen = unpacku16(body + 12);
+    body += WAL_BODY_HEADER;
+    if (idlen == 0 || body + idlen + 2 > end || body[idlen - 1] != '\0')
+        return false;
+    r->session_id = (const char *) body;
+    body += idlen;
+    size_t topiclen = unpacku16(body);
+    body += 2;
+    if (body + topiclen + 4 > end
+        || (topiclen > 0 && body[topiclen - 1] != '\0'))
+        return false;
+    r->topic = topiclen > 0 ? (const char *) body : NULL;
+    body += topiclen;
+    r->payloadlen = unpacku32(body);
+    body += 4;
+    if (body + r->payloadlen != end)
+        return false;
+    r->payload = body;
+    return true;
+}
+
+/* FNV-1a of a session id, picks the shard its records are applied by */
+static uint32_t id_hash(const unsigned char *id, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * A file being replayed, mapped in full, frames start past the header of a
+ * snapshot and are applied up to the end of the last one verified. Records up
+ * to the sequence number `from` are already part of the snapshot loaded.
+ */
+struct replay_file {
+    char *path;
+    unsigned char *map;
+    size_t size;
+    size_t start;
+    size_t valid;
+    uint64_t from;
+    bool torn;
+};
+
+struct replay {
+    struct replay_file *files;
+    size_t nfiles;
+    unsigned shards;
+    int (*apply)(const struct wal_record *, void *);
+    void **args;
+};
+
+/*
+ * A replay thread, first it verifies one every `shards` frames, storing for
+ * each file where the frames it verified end, then it applies the records
+ * whose session falls in its shard
+ */
+struct replay_worker {
+    const struct replay *replay;
+    unsigned shard;
+    size_t *valid;
+    long replayed;
+    uint64_t last;
+    pthread_t thread;
+};
+
+static void *replay_verify(void *arg) {
+    struct replay_worker *w = arg;
+    const struct replay *rp = w->replay;
+    struct wal_record r;
+    for (size_t i = 0; i < rp->nfiles; ++i) {
+        const struct replay_file *f = &rp->files[i];
+        size_t off = f->start;
+        for (size_t k = 0; off < f->size; ++k) {
+            if (f->size - off < WAL_FRAME_HEADER)
+                break;
+            size_t len = unpacku32(f->map + off);
+            if (len > f->size - off - WAL_FRAME_HEADER)
+                break;
+            unsigned char *body = f->map + off + WAL_FRAME_HEADER;
+            if (k % rp->shards == w->shard
+                && (crc32(body, len) != unpacku32(f->map + off + 4)
+                    || !record_decode(body, len, &r)))
+                break;
+            off += WAL_FRAME_HEADER + len;
+        }
+        w->valid[i] = off;
+    }
+    return NULL;
+}
+
+static void *replay_apply(void *arg) {
+    struct replay_worker *w = arg;
+    const struct replay *rp = w->replay;
+    struct wal_record r;
+    for (size_t i = 0; i < rp->nfiles; ++i) {
+        const struct replay_file *f = &rp->files[i];
+        size_t off = f->start;
+        while (off < f->valid) {
+            size_t len = unpacku32(f->map + off);
+            unsigned char *body = f->map + off + WAL_FRAME_HEADER;
+            off += WAL_FRAME_HEADER + len;
+            // Verified already, the session id follows the fixed header
+            size_t idlen = unpacku16(body + 12);
+            if (id_hash(body + WAL_BODY_HEADER, idlen) % rp->shards != w->shard)
+                continue;
+            record_decode(body, len, &r);
+            // Records of a snapshot taken before any was logged are all 0
+            if (f->from > 0 && r.lsn <= f->from)
+                continue;
+            rp->apply(&r, rp->args[w->shard]);
+            if (r.lsn > w->last)
+                w->last = r.lsn;
+            w->replayed++;
+        }
+    }
+    return NULL;
+}
+
+/* Run a phase of the replay on every worker, the calling thread is the first */
+static void replay_run(struct replay_worker *workers, unsigned n,
+                       void *(*fn)(void *)) {
+    for (unsigned i = 1; i < n; ++i)
+        pthread_create(&workers[i].thread, NULL, fn, &workers[i]);
+    fn(&workers[0]);
+    for (unsigned i = 1; i < n; ++i)
+        pthread_join(workers[i].thread, NULL);
+}
+
+/* Map a file to be replayed, an empty one is left unmapped */
+static int replay_map(struct replay_file *f, const char *dir,
+                      const char *name) {
+    char path[WAL_PATH_MAX];
+    snprintf(path, WAL_PATH_MAX, "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    f->path = try_strdup(path);
+    f->size = st.st_size;
+    if (f->size > 0) {
+        f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (f->map == MAP_FAILED) {
+            log_error("Failed to map %s: %s", path, strerror(errno));
+            f->map = NULL;
+            f->size = 0;
+            close(fd);
+            return -1;
+        }
+        // Read ahead, the whole file is going to be walked in order
+        madvise(f->map, f->size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    }
+    close(fd);
+    return 0;
+}
+
+long wal_replay(const char *dir,
+                int (*apply)(const struct wal_record *, void *),
+                void *arg, uint64_t *last) {
+    return wal_replay_sharded(dir, 1, apply, &arg, last);
+}
+
+/*
+ * Verify and apply the files mapped for a replay, a snapshot if any comes
+ * first. Returns the number of records applied, -1 on error, storing the
+ * sequence number of the last one in the last pointer.
+ */
+static long replay_files(struct replay *rp, bool snapshot, uint64_t from,
+                         uint64_t *last) {
+    long total = -1;
+    struct replay_worker *workers =
+        try_calloc(rp->shards, sizeof(struct replay_worker));
+    for (unsigned i = 0; i < rp->shards; ++i) {
+        workers[i].replay = rp;
+        workers[i].shard = i;
+        workers[i].valid = try_alloc(rp->nfiles * sizeof(size_t));
+    }
+    replay_run(workers, rp->shards, replay_verify);
+    /*
+     * A file is valid up to the first frame failing verification, whoever
+     * found it. A snapshot is renamed in place only once completely written
+     * and synced, so unlike a segment it's corrupted rather than torn.
+     */
+    for (size_t i = 0; i < rp->nfiles; ++i) {
+        struct replay_file *f = &rp->files[i];
+        f->valid = f->size;
+        for (unsigned j = 0; j < rp->shards; ++j)
+            if (workers[j].valid[i] < f->valid)
+                f->valid = workers[j].valid[i];
+        if (f->valid == f->size)
+            continue;
+        if (snapshot == true && i == 0) {
+            log_error("Snapshot %s is corrupted", f->path);
+            errno = EINVAL;
+            goto exit;
+        }
+        log_warning("Truncating %s at %lu, %lu bytes torn",
+                    f->path, f->valid, f->size - f->valid);
+        f->torn = true;
+    }
+    replay_run(workers, rp->shards, replay_apply);
+    total = 0;
+    *last = from;
+    for (unsigned i = 0; i < rp->shards; ++i) {
+        total += workers[i].replayed;
+        if (workers[i].last > *last)
+            *last = workers[i].last;
+    }
+exit:
+    for (unsigned i = 0; i < rp->shards; ++i)
+        free_memory(workers[i].valid);
+    free_memory(workers);
+    return total;
+}
+
+/* Check the header of a snapshot mapped, returning the sequence number */
+static int snapshot_header(struct replay_file *f, uint64_t *lsn) {
+    if (f->size < SNAPSHOT_HEADER
+        || unpacku32(f->map) != SNAPSHOT_MAGIC
+        || unpacku32(f->map + 4) != SNAPSHOT_VERSION) {
+        log_error("Snapshot %s has an unknown format", f->path);
+        errno = EINVAL;
+        return -1;
+    }
+    *lsn = ntohll(f->map + 8);
+    f->start = SNAPSHOT_HEADER;
+    return 0;
+}
+
+long wal_replay_sharded(const char *dir, unsigned shards,
+                        int (*apply)(const struct wal_record *, void *),
+                        void **args, uint64_t *last) {
+    pthread_once(&crc_once, crc_table_init);
+    *last = 0;
+    char **snapshots = NULL, **segments = NULL;
+    long nsnapshots = list_files(dir, is_snapshot, &snapshots);
+    if (nsnapshots < 0)
+        return errno == ENOENT ? 0 : -1;
+    long nsegments = list_files(dir, is_segment, &segments);
+    if (nsegments < 0) {
+        free_files(snapshots, nsnapshots);
+        return -1;
+    }
+    long total = -1;
+    uint64_t from = 0;
+    struct replay rp = {
+        .files = try_calloc(nsegments + 1, sizeof(struct replay_file)),
+        .shards = shards > 0 ? shards : 1,
+        .apply = apply,
+        .args = args
+    };
+    /*
+     * Only the newest snapshot counts, an older one is left around just by a
+     * crash in the middle of a compaction, then the records past it follow
+     */
+    if (nsnapshots > 0) {
+        struct replay_file *f = &rp.files[rp.nfiles++];
+        if (replay_map(f, dir, snapshots[nsnapshots - 1]) < 0
+            || snapshot_header(f, &from) < 0)
+            goto exit;
+    }
+    for (long i = 0; i < nsegments; ++i) {
+        struct replay_file *f = &rp.files[rp.nfiles++];
+        if (replay_map(f, dir, segments[i]) < 0)
+            goto exit;
+        f->from = from;
+    }
+    total = replay_files(&rp, nsnapshots > 0, from, last);
+exit:
+    for (size_t i = 0; i < rp.nfiles; ++i) {
+        struct replay_file *f = &rp.files[i];
+        if (f->map)
+            munmap(f->map, f->size);
+        if (f->torn == true && truncate(f->path, f->valid) < 0)
+            log_error("Failed to truncate %s: %s", f->path, strerror(errno));
+        free_memory(f->path);
+    }
+    free_memory(rp.files);
+    free_files(snapshots, nsnapshots);
+    free_files(segments, nsegments);
+    return total;
+}
+
+long wal_replay_snapshot(int fd, unsigned shards,
+                         int (*apply)(const struct wal_record *, void *),
+                         void **args, uint64_t *last) {
+    pthread_once(&crc_once, crc_table_init);
+    *last = 0;
+    long total = -1;
+    uint64_t from = 0;
+    struct replay_file file = { .path = (char *) "(handed over)" };
+    struct replay rp = {
+        .files = &file,
+        .nfiles = 1,
+        .shards = shards > 0 ? shards : 1,
+        .apply = apply,
+        .args = args
+    };
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -1;
+    file.size = st.st_size;
+    if (file.size > 0) {
+        file.map = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file.map == MAP_FAILED)
+            return -1;
+        madvise(file.map, file.size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    }
+    if (snapshot_header(&file, &from) == 0)
+        total = replay_files(&rp, true, from, last);
+    if (file.map)
+        munmap(file.map, file.size);
+    return total;
+}
+
+/*
+ * Start a new segment, the current one is synced before being closed unless
+ * durability is none, this way a commit only has to care about the last one.
+ * Must be called with the lock held.
+ */
+static int segment_open(uint64_t lsn) {
+    char path[WAL_PATH_MAX];
+    segment_path(path, wal.dir, lsn);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (wal.fd >= 0) {
+        while (wal.syncing == true)
+            pthread_cond_wait(&wal.cond, &wal.lock);
+        if (wal.opts.durability != WAL_DURABILITY_NONE && fdatasync(wal.fd) < 0)
+            log_error("Failed to sync the log: %s", strerror(errno));
+        close(wal.fd);
+    }
+    wal.fd = fd;
+    wal.segment_used = 0;
+    return 0;
+}
+
+/* Wake up the loops waiting for commits, a write to each notification fd */
+static void commit_notify(void) {
+    for (size_t i = 0; i < wal.notify_nr; ++i) {
+#ifdef __linux__
+        (void) eventfd_write(wal.notify[i][1], 1);
+#else
+        (void) write(wal.notify[i][1], &(unsigned long){1},
+                     sizeof(unsigned long));
+#endif
+    }
+}
+
+/*
+ * Committer thread of the group mode, it syncs the records appended so far
+ * once per commit interval, or as soon as enough bytes are pending, then
+ * publishes the sequence number made durable and notifies the loops. A
+ * single fdatasync thus covers all the records appended during the window
+ * by any thread.
+ */
+static void *committer(void *arg) {
+    (void) arg;
+    struct timespec deadline;
+    pthread_mutex_lock(&wal.lock);
+    while (wal.stop == false) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += wal.opts.commit_interval * 1000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (wal.stop == false && wal.pending < wal.opts.commit_bytes)
+            if (pthread_cond_timedwait(&wal.cond, &wal.lock,
+                                       &deadline) == ETIMEDOUT)
+                break;
+        if (wal.pending == 0)
+            continue;
+        uint64_t lsn = wal.next_lsn - 1;
+        int fd = wal.fd;
+        wal.pending = 0;
+        wal.syncing = true;
+        pthread_mutex_unlock(&wal.lock);
+        int err = fdatasync(fd);
+        pthread_mutex_lock(&wal.lock);
+        wal.syncing = false;
+        pthread_cond_broadcast(&wal.cond);
+        if (err < 0) {
+            // Nothing is acknowledged till a sync succeeds
+            log_error("Failed to sync the log: %s", strerror(errno));
+            wal.pending = 1;
+            continue;
+        }
+        atomic_store(&wal.committed, lsn);
+        commit_notify();
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return NULL;
+}
+
+int wal_open(const char *dir, const struct wal_options *opts,
+             uint64_t next_lsn) {
+    pthread_once(&crc_once, crc_table_init);
+    if (strlen(dir) >= WAL_DIR_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        log_error("Failed to create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    snprintf(wal.dir, WAL_DIR_MAX, "%s", dir);
+    wal.opts = *opts;
+    wal.next_lsn = next_lsn > 0 ? next_lsn : 1;
+    // Everything already on disk has been synced by the replay
+    atomic_store(&wal.committed, wal.next_lsn - 1);
+    pthread_mutex_lock(&wal.lock);
+    int err = segment_open(wal.next_lsn);
+    pthread_mutex_unlock(&wal.lock);
+    if (err < 0)
+        return -1;
+    wal.stop = false;
+    if (wal.opts.durability == WAL_DURABILITY_ASYNC
+        || wal.opts.durability == WAL_DURABILITY_GROUP)
+        pthread_create(&wal.committer, NULL, committer, NULL);
+    wal_enabled = true;
+    return 0;
+}
+
+int wal_notify_fd(void) {
+    if (wal_enabled == false || wal.opts.durability != WAL_DURABILITY_GROUP)
+        return -1;
+    int fds[2];
+#ifdef __linux__
+    if ((fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+#else
+    if (pipe(fds) < 0)
+        return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#endif
+    pthread_mutex_lock(&wal.lock);
+    wal.notify = try_realloc(wal.notify,
+                             (wal.notify_nr + 1) * sizeof(*wal.notify));
+    wal.notify[wal.notify_nr][0] = fds[0];
+    wal.notify[wal.notify_nr++][1] = fds[1];
+    pthread_mutex_unlock(&wal.lock);
+    return fds[0];
+}
+
+bool wal_durable(uint64_t lsn) {
+    return wal.opts.durability != WAL_DURABILITY_GROUP
+        || lsn <= atomic_load(&wal.committed);
+}
+
+void wal_close(void) {
+    pthread_mutex_lock(&wal.lock);
+    bool committing = wal_enabled == true
+        && (wal.opts.durability == WAL_DURABILITY_ASYNC
+            || wal.opts.durability == WAL_DURABILITY_GROUP);
+    wal_enabled = false;
+    wal.stop = true;
+    pthread_cond_broadcast(&wal.cond);
+    pthread_mutex_unlock(&wal.lock);
+    if (committing == true)
+        pthread_join(wal.committer, NULL);
+    pthread_mutex_lock(&wal.lock);
+    if (wal.fd >= 0) {
+        if (wal.opts.durability != WAL_DURABILITY_NONE && fdatasync(wal.fd) < 0)
+            log_error("Failed to sync the log: %s", strerror(errno));
+        close(wal.fd);
+    }
+    wal.fd = -1;
+    // The loops are gone by now, they don't need to be notified anymore
+    for (size_t i = 0; i < wal.notify_nr; ++i) {
+        close(wal.notify[i][0]);
+        if (wal.notify[i][1] != wal.notify[i][0])
+            close(wal.notify[i][1]);
+    }
+    free_memory(wal.notify);
+    wal.notify = NULL;
+    wal.notify_nr = 0;
+    free_memory(wal.buf);
+    wal.buf = NULL;
+    wal.bufsize = 0;
+    pthread_mutex_unlock(&wal.lock);
+}
+
+/*
+ * Encode a record at an offset of a buffer, growing it as needed, returns
+ * the size of the frame
+ */
+static size_t record_encode(unsigned char **buf, size_t *bufsize, size_t off,
+                            const struct wal_record *r, uint64_t lsn) {
+    size_t idlen = strlen(r->session_id) + 1;
+    size_t topiclen = r->topic ? strlen(r->topic) + 1 : 0;
+    size_t len = WAL_BODY_HEADER + idlen + 2 + topiclen + 4 + r->payloadlen;
+    if (*bufsize < off + WAL_FRAME_HEADER + len) {
+        *bufsize = off + WAL_FRAME_HEADER + len;
+        *buf = try_realloc(*buf, *bufsize);
+    }
+    unsigned char *frame = *buf + off;
+    unsigned char *body = frame + WAL_FRAME_HEADER, *p = body;
+    htonll(p, lsn);
+    p[8] = r->type;
+    p[9] = r->qos;
+    packi16(p + 10, r->mid);
+    packi16(p + 12, idlen);
+    p += WAL_BODY_HEADER;
+    memcpy(p, r->session_id, idlen);
+    p += idlen;
+    packi16(p, topiclen);
+    p += 2;
+    if (topiclen > 0)
+        memcpy(p, r->topic, topiclen);
+    p += topiclen;
+    packi32(p, r->payloadlen);
+    p += 4;
+    if (r->payloadlen > 0)
+        memcpy(p, r->payload, r->payloadlen);
+    packi32(frame, len);
+    packi32(frame + 4, crc32(body, len));
+    return WAL_FRAME_HEADER + len;
+}
+
+uint64_t wal_append(const struct wal_record *r) {
+    uint64_t lsn = 0;
+    pthread_mutex_lock(&wal.lock);
+    if (wal.fd < 0)
+        goto exit;
+    size_t size = record_encode(&wal.buf, &wal.bufsize, 0, r, wal.next_lsn);
+    if (wal.segment_used > 0 && wal.segment_used + size > wal.opts.segment_size)
+        segment_open(wal.next_lsn);
+    if (write_full(wal.fd, wal.buf, size) < 0) {
+        log_error("Failed to append to the log: %s", strerror(errno));
+        // Don't leave a partial record in between the next ones
+        if (ftruncate(wal.fd, wal.segment_used) < 0)
+            log_error("Failed to truncate the log: %s", strerror(errno));
+        goto exit;
+    }
+    wal.segment_used += size;
+    lsn = wal.next_lsn++;
+    switch (wal.opts.durability) {
+        case WAL_DURABILITY_SYNC:
+            if (fdatasync(wal.fd) < 0)
+                log_error("Failed to sync the log: %s", strerror(errno));
+            else
+                atomic_store(&wal.committed, lsn);
+            break;
+        case WAL_DURABILITY_GROUP:
+        case WAL_DURABILITY_ASYNC:
+            wal.pending += size;
+            if (wal.pending >= wal.opts.commit_bytes)
+                pthread_cond_broadcast(&wal.cond);
+            break;
+    }
+exit:
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+uint64_t wal_rotate(void) {
+    uint64_t lsn = 0;
+    pthread_mutex_lock(&wal.lock);
+    if (wal.fd < 0)
+        goto exit;
+    // An empty segment is already named after the next record
+    if (wal.segment_used > 0 && segment_open(wal.next_lsn) < 0)
+        goto exit;
+    lsn = wal.next_lsn - 1;
+exit:
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+struct wal_snapshot *wal_snapshot_begin(uint64_t lsn) {
+    char path[WAL_PATH_MAX];
+    snapshot_tmp_path(path, wal.dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+    return wal_snapshot_open(fd, lsn);
+}
+
+struct wal_snapshot *wal_snapshot_open(int fd, uint64_t lsn) {
+    // The log may have never been opened
+    pthread_once(&crc_once, crc_table_init);
+    struct wal_snapshot *snap = try_alloc(sizeof(*snap));
+    *snap = (struct wal_snapshot) {
+        .fd = fd,
+        .lsn = lsn,
+        .bufsize = SNAPSHOT_CHUNK,
+        .used = SNAPSHOT_HEADER
+    };
+    snap->buf = try_alloc(snap->bufsize);
+    packi32(snap->buf, SNAPSHOT_MAGIC);
+    packi32(snap->buf + 4, SNAPSHOT_VERSION);
+    htonll(snap->buf + 8, lsn);
+    return snap;
+}
+
+int wal_snapshot_append(struct wal_snapshot *snap,
+                        const struct wal_record *r) {
+    snap->used += record_encode(&snap->buf, &snap->bufsize,
+                                snap->used, r, snap->lsn);
+    if (snap->used < SNAPSHOT_CHUNK)
+        return 0;
+    int err = write_full(snap->fd, snap->buf, snap->used);
+    snap->used = 0;
+    return err;
+}
+
+int wal_snapshot_end(struct wal_snapshot *snap) {
+    int err = write_full(snap->fd, snap->buf, snap->used);
+    if (err == 0)
+        err = fdatasync(snap->fd);
+    int saved = errno;
+    close(snap->fd);
+    free_memory(snap->buf);
+    free_memory(snap);
+    errno = saved;
+    return err;
+}
+
+void wal_snapshot_abort(void) {
+    char path[WAL_PATH_MAX];
+    snapshot_tmp_path(path, wal.dir);
+    unlink(path);
+}
+
+long wal_snapshot_commit(uint64_t lsn) {
+    char tmp[WAL_PATH_MAX], path[WAL_PATH_MAX];
+    snapshot_tmp_path(tmp, wal.dir);
+    snapshot_path(path, wal.dir, lsn);
+    if (rename(tmp, path) < 0) {
+        log_error("Failed to rename %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    sync_dir(wal.dir);
+    /*
+     * The log was rotated when the snapshot was started, every segment named
+     * after a sequence number up to the one of the snapshot is covered by it
+     */
+    char **names = NULL;
+    long n = list_files(wal.dir, is_snapshot, &names), removed = 0;
+    for (long i = 0; i < n; ++i) {
+        if (name_lsn(names[i]) >= lsn)
+            continue;
+        snprintf(path, WAL_PATH_MAX, "%s/%s", wal.dir, names[i]);
+        unlink(path);
+    }
+    free_files(names, n);
+    n = list_files(wal.dir, is_segment, &names);
+    for (long i = 0; i < n; ++i) {
+        if (name_lsn(names[i]) > lsn)
+            continue;
+        snprintf(path, WAL_PATH_MAX, "%s/%s", wal.dir, names[i]);
+        if (unlink(path) == 0)
+            removed++;
+    }
+    free_files(names, n);
+    sync_dir(wal.dir);
+    return removed;
+}
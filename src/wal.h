@@ -0,0 +1,216 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Write-ahead log of the persistent sessions, every change to the state of a
+ * clean_session == false session is appended as a record to the log as it's
+ * applied in memory, so the sessions, their subscriptions, their offline
+ * queues and their inflight messages can be rebuilt after a restart by
+ * replaying the log in order.
+ *
+ * The log is a sequence of segments in the data directory, wal-<lsn>.log
+ * named after the sequence number of their first record, a new segment is
+ * started once the current one grows past the configured size. Each record
+ * is framed as
+ *
+ *   | length (u32) | crc32 (u32) | body (length bytes)                      |
+ *
+ * with a body of
+ *
+ *   | lsn (u64) | type (u8) | qos (u8) | mid (u16) |
+ *   | id length (u16) | id ... \0 | topic length (u16) | topic ... \0 |
+ *   | payload length (u32) | payload ...                               |
+ *
+ * all integers in network byte order. A record torn by a crash fails the
+ * length or the checksum verification, the segment is truncated there on
+ * replay, every record before it is valid.
+ *
+ * To keep the replay short the log is compacted by snapshots, the state of
+ * the sessions up to a sequence number written out as the records that
+ * rebuild it, framed the same way, in snapshot-<lsn>.snap after a header of
+ *
+ *   | magic (u32) | version (u32) | lsn (u64) |
+ *
+ * the segments it covers are removed once it's in place. Replay loads the
+ * newest snapshot, then the records of the segments past it.
+ */
+enum wal_record_type {
+    WAL_SESSION_CREATE = 1, // a persistent session has been created
+    WAL_SESSION_DESTROY,    // a persistent session has been discarded
+    WAL_SUBSCRIBE,          // topic filter and granted QoS
+    WAL_UNSUBSCRIBE,        // topic filter
+    WAL_ENQUEUE,            // message appended to the offline queue
+    WAL_DEQUEUE,            // head of the queue sent out as mid
+    WAL_DROP,               // head of the queue dropped
+    WAL_INFLIGHT,           // message sent out straight away as mid
+    WAL_ACK                 // inflight mid acknowledged by the client
+};
+
+/*
+ * When the records appended reach the disk:
+ * - none, left to the kernel, a crash of the host may lose them
+ * - async, synced in background once per commit interval, nothing waits
+ * - group, like async but acks depending on a record are held back till the
+ *   commit covering it, one fdatasync for every record of the window
+ * - sync, synced on every append before returning
+ */
+enum wal_durability {
+    WAL_DURABILITY_NONE,
+    WAL_DURABILITY_ASYNC,
+    WAL_DURABILITY_GROUP,
+    WAL_DURABILITY_SYNC
+};
+
+struct wal_options {
+    size_t segment_size;        // size past which a new segment is started
+    int durability;             // one of enum wal_durability
+    unsigned commit_interval;   // microseconds between commits
+    size_t commit_bytes;        // bytes pending forcing an early commit
+};
+
+/*
+ * A single change, the fields meaningful depend on the type. On replay the
+ * strings are NUL terminated and, like the payload, valid only during the
+ * call to the apply callback.
+ */
+struct wal_record {
+    uint64_t lsn;
+    unsigned char type;
+    unsigned char qos;
+    unsigned short mid;
+    const char *session_id;
+    const char *topic;
+    const unsigned char *payload;
+    size_t payloadlen;
+};
+
+/* Set once the log has been opened, nothing has to be recorded otherwise */
+extern bool wal_enabled;
+
+struct wal_snapshot;
+
+/*
+ * Replay the snapshot and the segments found in a directory, oldest first,
+ * calling apply for every valid record. Returns the number of records
+ * replayed, or -1 on read errors, storing the sequence number of the last
+ * one in the last pointer.
+ */
+long wal_replay(const char *, int (*apply)(const struct wal_record *, void *),
+                void *, uint64_t *);
+
+/*
+ * Replay spread over a number of shards, each applied by a thread of its own
+ * with its own argument from the array passed in. Records go to the shard
+ * picked by the hash of their session id, so the ones of a session are still
+ * applied in order, by the same thread. Checksums are verified in parallel
+ * as well, before applying anything.
+ */
+long wal_replay_sharded(const char *, unsigned,
+                        int (*apply)(const struct wal_record *, void *),
+                        void **, uint64_t *);
+
+/*
+ * Sharded replay of a single snapshot read from a descriptor, e.g. the state
+ * handed over by a process being upgraded. Unlike a log it's replayed whole
+ * or not at all, -1 is returned on a corrupted one, setting errno to EINVAL.
+ */
+long wal_replay_snapshot(int, unsigned,
+                         int (*apply)(const struct wal_record *, void *),
+                         void **, uint64_t *);
+
+/*
+ * Open the log for writing on a directory, creating it if missing. Records
+ * are numbered starting from the sequence number passed in, a fresh segment
+ * is started, existing ones are left untouched. In async and group mode a
+ * committer thread is started as well.
+ */
+int wal_open(const char *, const struct wal_options *, uint64_t);
+
+void wal_close(void);
+
+/*
+ * Append a record to the log, it's thread-safe, records are written in the
+ * order they're appended. Returns the sequence number assigned, 0 on error.
+ */
+uint64_t wal_append(const struct wal_record *);
+
+/*
+ * Check if a record has reached the disk, only group mode ever defers it,
+ * in the other modes there's nothing worth waiting for.
+ */
+bool wal_durable(uint64_t);
+
+/*
+ * Create a descriptor readable after every commit, for an event loop to
+ * release what was waiting for it. Returns -1 if not in group mode.
+ */
+int wal_notify_fd(void);
+
+/*
+ * Start a new segment, for the records appended from now on to be kept apart
+ * from the ones a snapshot is going to cover. Returns the sequence number of
+ * the last record before it, 0 if there's none or on error.
+ */
+uint64_t wal_rotate(void);
+
+/*
+ * Write a snapshot covering the log up to a sequence number, as returned by
+ * wal_rotate: begin creates a temporary file in the data directory, append
+ * adds the records, buffered, end flushes and syncs them. They only touch
+ * the snapshot, so they can run in a process forked from a threaded one.
+ * Return -1 and set errno on error.
+ */
+struct wal_snapshot *wal_snapshot_begin(uint64_t);
+
+/*
+ * Write a snapshot on a descriptor of the caller's instead, e.g. a temporary
+ * file to be handed to another process, end closes it as well
+ */
+struct wal_snapshot *wal_snapshot_open(int, uint64_t);
+
+int wal_snapshot_append(struct wal_snapshot *, const struct wal_record *);
+
+int wal_snapshot_end(struct wal_snapshot *);
+
+/*
+ * Put a snapshot completely written in place and compact the log, removing
+ * the older snapshots and every segment covered. Returns the number of
+ * segments removed, -1 on error.
+ */
+long wal_snapshot_commit(uint64_t);
+
+/* Remove a snapshot left incomplete */
+void wal_snapshot_abort(void);
+
+#endif
@@ -127,6 +127,51 @@ def create_subscribe(mid, topics):
     return packet
 
 
+def create_publish(topic, payload, qos=0, mid=0, retain=False):
+    topic = topic.encode("utf-8")
+    body = struct.pack("!H" + str(len(topic)) + "s", len(topic), topic)
+    if qos > 0:
+        body += struct.pack("!H", mid)
+    body += payload
+    header = 0x30 | (qos << 1) | (1 if retain else 0)
+    return struct.pack("!B", header) + mqtt_encode_len(len(body)) + body
+
+
+def create_puback(mid):
+    return struct.pack("!BBH", 0x40, 2, mid)
+
+
+def read_packet(sock):
+    """Read a whole packet, returning its fixed header byte and its body"""
+    def recv_exactly(n):
+        data = b""
+        while len(data) < n:
+            chunk = sock.recv(n - len(data))
+            if not chunk:
+                raise ConnectionError("connection closed")
+            data += chunk
+        return data
+    header = recv_exactly(1)[0]
+    remaining_length, mult = 0, 1
+    while True:
+        byte = recv_exactly(1)[0]
+        remaining_length += (byte & 127) * mult
+        mult *= 128
+        if byte & 128 == 0:
+            break
+    return header, recv_exactly(remaining_length)
+
+
+def read_publish(header, body):
+    """Topic, message id and payload of a PUBLISH body"""
+    tlen = struct.unpack("!H", body[:2])[0]
+    topic, body = body[2:2 + tlen].decode("utf-8"), body[2 + tlen:]
+    mid = 0
+    if (header >> 1) & 0x03:
+        mid, body = struct.unpack("!H", body[:2])[0], body[2:]
+    return topic, mid, body
+
+
 def create_unsubscribe(mid, topic):
     topic = topic.encode("utf-8")
     pack_format = "!BBHH" + str(len(topic)) + "s"
@@ -0,0 +1,104 @@
+import os
+import time
+import socket
+import shutil
+import signal
+import tempfile
+import subprocess
+import sol_test
+import base_testcase
+
+PORT = 18884
+MESSAGES = 70000
+MAX_INFLIGHT = 1000
+
+CONF = """ip_address 127.0.0.1
+ip_port {port}
+log_level ERROR
+data_dir {data_dir}
+queue_spill_threshold 64KB
+max_queued_messages 0
+max_queued_bytes 0
+max_inflight_messages {max_inflight}
+snapshot_interval 0
+stats_publish_interval 0
+"""
+
+
+class TestSpill(base_testcase.BaseTestcase):
+    """
+    A broker of its own, with a data directory to spill the offline queues to
+    """
+
+    @classmethod
+    def setUpClass(cls):
+        cls.data_dir = tempfile.mkdtemp(prefix='sol_spill.')
+        cls.conf = os.path.join(cls.data_dir, 'sol.conf')
+        with open(cls.conf, 'w') as f:
+            f.write(CONF.format(port=PORT, max_inflight=MAX_INFLIGHT,
+                                data_dir=os.path.join(cls.data_dir, 'data')))
+        cls.broker = subprocess.Popen(['./sol', '-c', cls.conf],
+                                      stdout=subprocess.DEVNULL,
+                                      preexec_fn=os.setsid)
+        time.sleep(.5)
+
+    @classmethod
+    def tearDownClass(cls):
+        os.kill(cls.broker.pid, signal.SIGTERM)
+        cls.broker.wait()
+        shutil.rmtree(cls.data_dir)
+
+    def open_session(self, client_id, clean_session):
+        conn = self.get_connection(('127.0.0.1', PORT))
+        conn.settimeout(10)
+        conn.send(sol_test.create_connect(client_id, clean_session))
+        _, rc = sol_test.read_connack(conn.recv(4))
+        self.assertEqual(rc, 0)
+        return conn
+
+    def test_spilled_queue_ids_not_reused(self):
+        """
+        More messages queued than message identifiers, acked slowly once the
+        session is resumed: no identifier is given out again while the
+        message holding it is unacknowledged and the window is respected
+        """
+        conn = self.open_session('spill-sub', False)
+        conn.send(sol_test.create_subscribe(1, {'spill/test': 1}))
+        sol_test.read_packet(conn)
+        conn.close()
+
+        publisher = self.open_session('spill-pub', True)
+        for i in range(MESSAGES):
+            mid = i % 65535 + 1
+            publisher.send(sol_test.create_publish('spill/test', b'%08d' % i,
+                                                   1, mid))
+            if (i + 1) % 1000 == 0:
+                for _ in range(1000):
+                    sol_test.read_packet(publisher)
+        for _ in range(MESSAGES % 1000):
+            sol_test.read_packet(publisher)
+        publisher.close()
+
+        conn = self.open_session('spill-sub', False)
+        unacked, received = [], 0
+        while received < MESSAGES:
+            # Acked only once the window is full, the oldest half first
+            if len(unacked) == MAX_INFLIGHT:
+                conn.settimeout(.05)
+                with self.assertRaises(socket.timeout):
+                    sol_test.read_packet(conn)
+                conn.settimeout(10)
+                for mid in unacked[:MAX_INFLIGHT // 2]:
+                    conn.send(sol_test.create_puback(mid))
+                del unacked[:MAX_INFLIGHT // 2]
+            header, body = sol_test.read_packet(conn)
+            self.assertEqual(header >> 4, 3)
+            _, mid, payload = sol_test.read_publish(header, body)
+            self.assertNotIn(mid, unacked)
+            self.assertEqual(payload, b'%08d' % received)
+            unacked.append(mid)
+            received += 1
+        for mid in unacked:
+            conn.send(sol_test.create_puback(mid))
+        self.send_disconnect(conn)
+        conn.close()
@@ -0,0 +1,314 @@
+#!/usr/bin/env python3
+"""
+Performance scenarios, each one boots a broker on a local port with a
+generated configuration, drives it with sol_loadgen and compares throughput,
+p99 latency and peak RSS of the broker against tests/perf/baseline.json:
+
+    python3 tests/perf/run.py --sol ./sol --loadgen ./sol_loadgen fanout
+    python3 tests/perf/run.py --sol ./sol --loadgen ./sol_loadgen --update
+
+The upgrade scenario sends SIGUSR2 to the broker halfway through, the new
+process takes over the connections, so any client error is a failure.
+
+Exits 1 on regressions and 77 when a scenario can't run on this host, e.g.
+too few file descriptors, which CTest reports as skipped. --update rewrites
+the baseline with the figures measured, to be run on the machine gating the
+builds. --scale shrinks the connection counts for smaller hosts, figures are
+only compared against a baseline recorded at the same scale.
+"""
+
+import os
+import sys
+import json
+import time
+import signal
+import socket
+import argparse
+import resource
+import tempfile
+import subprocess
+
+SKIP = 77
+
+BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        'baseline.json')
+
+# Connection buffers are sized on max_request_size, 16KB fits every payload
+# the scenarios send; no max_memory, the memory pressure tiers would refuse
+# connections and throttle publishers instead of letting RSS be measured
+CONFIG = """ip_address 127.0.0.1
+ip_port {port}
+log_level ERROR
+log_path {logpath}
+max_queued_messages 1000
+max_request_size 16KB
+max_memory 0
+tcp_backlog 4096
+stats_publish_interval 0
+"""
+
+# Every scenario lists publishers, subscribers, the ones of the two following
+# --scale, the other sol_loadgen arguments and the latency that matters: end
+# to end for messages, CONNACK otherwise. An upgrade is requested after the
+# seconds given, if any
+SCENARIOS = {
+    'fanout': {
+        'publishers': 1,
+        'subscribers': 10000,
+        'scaled': ('subscribers',),
+        'latency': 'end_to_end',
+        'args': ['-r', '20', '-d', '10'],
+    },
+    'fanin': {
+        'publishers': 10000,
+        'subscribers': 1,
+        'scaled': ('publishers',),
+        'latency': 'end_to_end',
+        'args': ['-r', '5', '-d', '10'],
+    },
+    'idle': {
+        'publishers': 0,
+        'subscribers': 100000,
+        'scaled': ('subscribers',),
+        'latency': 'connect',
+        'args': ['-t', '1000', '-d', '10',
+                 '-b', '127.0.0.1,127.0.0.2,127.0.0.3,127.0.0.4,127.0.0.5'],
+    },
+    'qos2': {
+        'publishers': 8,
+        'subscribers': 8,
+        'scaled': (),
+        'latency': 'end_to_end',
+        'args': ['-t', '8', '-q', '2', '-m', '64', '-d', '10'],
+    },
+    'upgrade': {
+        'publishers': 100,
+        'subscribers': 1000,
+        'scaled': ('subscribers',),
+        'latency': 'end_to_end',
+        'args': ['-q', '1', '-r', '20', '-d', '10'],
+        'upgrade_after': 5,
+    },
+}
+
+
+class Skip(Exception):
+    pass
+
+
+def raise_fd_limit(needed):
+    """Both the broker and the generator hold a descriptor per connection"""
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if hard != resource.RLIM_INFINITY and hard < needed:
+        raise Skip(f'needs {needed} file descriptors, hard limit is {hard}')
+    if soft != resource.RLIM_INFINITY and soft < needed:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+
+def wait_port(port, timeout=5):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), .2).close()
+            return
+        except OSError:
+            time.sleep(.1)
+    raise RuntimeError(f'broker not listening on {port}')
+
+
+def peak_rss_kb(pid):
+    try:
+        with open(f'/proc/{pid}/status') as status:
+            for line in status:
+                if line.startswith('VmHWM:'):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return None
+
+
+def upgraded_pid(old, conf, timeout=10):
+    """The process taking over is found by the configuration it was given"""
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        for entry in os.listdir('/proc'):
+            if not entry.isdigit() or int(entry) == old:
+                continue
+            try:
+                with open(f'/proc/{entry}/cmdline', 'rb') as f:
+                    if conf.encode() in f.read().split(b'\0'):
+                        return int(entry)
+            except OSError:
+                pass
+        time.sleep(.1)
+    raise RuntimeError('no process took over on upgrade')
+
+
+def stop(pid, timeout=10):
+    try:
+        os.kill(pid, signal.SIGTERM)
+    except ProcessLookupError:
+        return
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            os.kill(pid, 0)
+        except ProcessLookupError:
+            return
+        time.sleep(.1)
+    os.kill(pid, signal.SIGKILL)
+
+
+def clients(name, scale):
+    scenario = SCENARIOS[name]
+    counts = {}
+    for role in ('publishers', 'subscribers'):
+        n = scenario[role]
+        if role in scenario['scaled']:
+            n = max(1, round(n * scale))
+        counts[role] = n
+    return counts['publishers'], counts['subscribers']
+
+
+def run_scenario(name, args):
+    scenario = SCENARIOS[name]
+    publishers, subscribers = clients(name, args.scale)
+    raise_fd_limit(publishers + subscribers + 256)
+    with tempfile.TemporaryDirectory(prefix='sol-perf-') as tmp:
+        conf = os.path.join(tmp, 'sol.conf')
+        with open(conf, 'w') as f:
+            f.write(CONFIG.format(port=args.port,
+                                  logpath=os.path.join(tmp, 'sol.log')))
+        broker = subprocess.Popen([args.sol, '-c', conf],
+                                  stdout=subprocess.DEVNULL,
+                                  stderr=subprocess.DEVNULL)
+        pid = broker.pid
+        try:
+            wait_port(args.port)
+            gen = subprocess.Popen([args.loadgen, '-p', str(args.port),
+                                    '-i', f'perf-{name}',
+                                    '-P', str(publishers),
+                                    '-S', str(subscribers)] + scenario['args'],
+                                   stdout=subprocess.PIPE,
+                                   stderr=subprocess.PIPE)
+            try:
+                if 'upgrade_after' in scenario:
+                    time.sleep(scenario['upgrade_after'])
+                    broker.send_signal(signal.SIGUSR2)
+                    pid = upgraded_pid(broker.pid, conf)
+                    if broker.wait(10) != 0:
+                        raise RuntimeError('broker upgraded exited with '
+                                           f'{broker.returncode}')
+                out, err = gen.communicate(timeout=args.timeout)
+            finally:
+                if gen.poll() is None:
+                    gen.kill()
+                    gen.wait()
+            rss = peak_rss_kb(pid)
+            if pid == broker.pid and broker.poll() is not None:
+                raise RuntimeError(f'broker exited with {broker.returncode}')
+        finally:
+            if pid != broker.pid:
+                stop(pid)
+            broker.terminate()
+            try:
+                broker.wait(10)
+            except subprocess.TimeoutExpired:
+                broker.kill()
+                broker.wait()
+    try:
+        report = json.loads(out)
+    except ValueError:
+        sys.stderr.write(err.decode())
+        raise RuntimeError(f'sol_loadgen exited with {gen.returncode}'
+                           ' and no report')
+    if report['errors']:
+        sys.stderr.write(err.decode())
+        raise RuntimeError(f"{report['errors']} client errors")
+    latency = report['latency_ns'][scenario['latency']]
+    return {
+        'msgs_per_sec': report['received']['msgs_per_sec'],
+        'p99_ns': latency['p99'],
+        'peak_rss_kb': rss,
+    }
+
+
+def compare(name, measured, baseline, tolerances):
+    """
+    Throughput may drop, latency and memory may grow, each by its tolerance,
+    metrics without a baseline figure are reported but not checked
+    """
+    ok = True
+    checks = (('msgs_per_sec', -1), ('p99_ns', 1), ('peak_rss_kb', 1))
+    for metric, direction in checks:
+        value, ref = measured.get(metric), baseline.get(metric)
+        if value is None or not ref:
+            print(f'  {metric:14} {value!s:>14}   no baseline')
+            continue
+        limit = ref * (1 + direction * tolerances[metric])
+        failed = value > limit if direction > 0 else value < limit
+        ok = ok and not failed
+        print(f'  {metric:14} {value:>14.0f}   baseline {ref:>12.0f}'
+              f'   limit {limit:>12.0f}   {"REGRESSION" if failed else "ok"}')
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--sol', default='./sol')
+    parser.add_argument('--loadgen', default='./sol_loadgen')
+    parser.add_argument('--baseline', default=BASELINE)
+    parser.add_argument('--port', type=int, default=18883)
+    parser.add_argument('--timeout', type=int, default=240)
+    parser.add_argument('--scale', type=float, default=1.0,
+                        help='factor applied to the connection counts')
+    parser.add_argument('--update', action='store_true',
+                        help='write the measured figures as the new baseline')
+    parser.add_argument('scenarios', nargs='*', default=sorted(SCENARIOS))
+    args = parser.parse_args()
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+
+    if args.update:
+        # Figures recorded at another scale can't be kept alongside
+        if baseline.get('scale') != args.scale:
+            baseline['scenarios'] = {}
+        baseline['scale'] = args.scale
+
+    ok, skipped = True, 0
+    for name in args.scenarios:
+        publishers, subscribers = clients(name, args.scale)
+        print(f'{name}: {publishers} publishers, {subscribers} subscribers')
+        try:
+            if not args.update and baseline.get('scale') != args.scale:
+                raise Skip(f"baseline recorded at scale {baseline.get('scale')}"
+                           f', run with --update to record one at {args.scale}')
+            measured = run_scenario(name, args)
+        except Skip as e:
+            print(f'  skipped, {e}')
+            skipped += 1
+            continue
+        except (RuntimeError, subprocess.TimeoutExpired) as e:
+            print(f'  failed, {e}')
+            ok = False
+            continue
+        if args.update:
+            baseline['scenarios'][name] = measured
+            print('  ' + json.dumps(measured))
+        else:
+            ok &= compare(name, measured,
+                          baseline['scenarios'].get(name, {}),
+                          baseline['tolerance'])
+
+    if args.update:
+        with open(args.baseline, 'w') as f:
+            json.dump(baseline, f, indent=4)
+            f.write('\n')
+    if not ok:
+        return 1
+    return SKIP if skipped == len(args.scenarios) else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,306 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "unit.h"
+#include "persistence_test.h"
+#include "../src/wal.h"
+#include "../src/retained.h"
+
+#define RECORDS_NR 10
+
+/* Create an empty directory to work in */
+static char *dir_new(void) {
+    static char dir[32];
+    snprintf(dir, sizeof(dir), "/tmp/sol_test.XXXXXX");
+    return mkdtemp(dir);
+}
+
+/* Remove a directory along with the files in it */
+static void dir_remove(const char *dir) {
+    char path[512];
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) < 0 ? -1 : st.st_size;
+}
+
+struct replayed {
+    int count;
+    bool ordered;
+};
+
+static int count_record(const struct wal_record *r, void *arg) {
+    struct replayed *rp = arg;
+    char payload[16];
+    snprintf(payload, sizeof(payload), "msg-%d", rp->count);
+    rp->ordered = rp->ordered && r->lsn == (uint64_t) rp->count + 1
+        && r->type == WAL_ENQUEUE && r->qos == 1
+        && strcmp(r->session_id, "session") == 0
+        && strcmp(r->topic, "a/b") == 0
+        && r->payloadlen == strlen(payload)
+        && memcmp(r->payload, payload, r->payloadlen) == 0;
+    rp->count++;
+    return 0;
+}
+
+/*
+ * Tests a write-ahead log round trip, the records appended are replayed in
+ * order and a torn tail is truncated away, keeping every record before it
+ */
+static char *test_wal_replay(void) {
+    char *dir = dir_new();
+    ASSERT("wal::wal_replay...FAIL", dir != NULL);
+    struct wal_options opts = {
+        .segment_size = 1024 * 1024,
+        .durability = WAL_DURABILITY_NONE
+    };
+    ASSERT("wal::wal_replay...FAIL", wal_open(dir, &opts, 1) == 0);
+    char path[512], payload[16];
+    snprintf(path, sizeof(path), "%s/wal-%020d.log", dir, 1);
+    off_t valid = 0;
+    for (int i = 0; i < RECORDS_NR; ++i) {
+        snprintf(payload, sizeof(payload), "msg-%d", i);
+        struct wal_record r = {
+            .type = WAL_ENQUEUE,
+            .qos = 1,
+            .session_id = "session",
+            .topic = "a/b",
+            .payload = (unsigned char *) payload,
+            .payloadlen = strlen(payload)
+        };
+        ASSERT("wal::wal_replay...FAIL", wal_append(&r) == (uint64_t) i + 1);
+        // The size up to the last record, the one to be torn
+        if (i == RECORDS_NR - 2)
+            valid = file_size(path);
+    }
+    wal_close();
+    off_t size = file_size(path);
+    ASSERT("wal::wal_replay...FAIL", valid > 0 && size > valid);
+
+    struct replayed rp = { 0, true };
+    uint64_t last = 0;
+    ASSERT("wal::wal_replay...FAIL",
+           wal_replay(dir, count_record, &rp, &last) == RECORDS_NR);
+    ASSERT("wal::wal_replay...FAIL", rp.count == RECORDS_NR && rp.ordered);
+    ASSERT("wal::wal_replay...FAIL", last == RECORDS_NR);
+    ASSERT("wal::wal_replay...FAIL", file_size(path) == size);
+
+    // Flip the last byte of the payload of the last record
+    FILE *fp = fopen(path, "r+");
+    ASSERT("wal::wal_replay...FAIL", fp != NULL);
+    fseek(fp, size - 1, SEEK_SET);
+    int c = fgetc(fp);
+    fseek(fp, size - 1, SEEK_SET);
+    fputc(c ^ 0xff, fp);
+    fclose(fp);
+
+    rp = (struct replayed) { 0, true };
+    ASSERT("wal::wal_replay...FAIL",
+           wal_replay(dir, count_record, &rp, &last) == RECORDS_NR - 1);
+    ASSERT("wal::wal_replay...FAIL", rp.count == RECORDS_NR - 1 && rp.ordered);
+    ASSERT("wal::wal_replay...FAIL", last == RECORDS_NR - 1);
+    ASSERT("wal::wal_replay...FAIL", file_size(path) == valid);
+
+    // A frame cut short is torn the same way
+    ASSERT("wal::wal_replay...FAIL", truncate(path, valid - 3) == 0);
+    rp = (struct replayed) { 0, true };
+    ASSERT("wal::wal_replay...FAIL",
+           wal_replay(dir, count_record, &rp, &last) == RECORDS_NR - 2);
+    ASSERT("wal::wal_replay...FAIL", rp.count == RECORDS_NR - 2 && rp.ordered);
+    ASSERT("wal::wal_replay...FAIL", file_size(path) < valid - 3);
+
+    dir_remove(dir);
+    printf("wal::wal_replay...OK\n");
+    return 0;
+}
+
+#define TOPICS_NR 4000
+
+/* Check every topic in a range of the ones put holds its own message */
+static bool retained_check(int from, int to, int step) {
+    char topic[32], msg[32];
+    size_t len;
+    for (int i = from; i < to; i += step) {
+        snprintf(topic, sizeof(topic), "dev/%d/state", i);
+        snprintf(msg, sizeof(msg), "value-%d", i);
+        const unsigned char *m = retained_store_get(topic, &len);
+        if (!m || len != strlen(msg) || memcmp(m, msg, len) != 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Tests the retained index growing past its initial 4096 slots, every
+ * message is still found after the rehash and after a reopen
+ */
+static char *test_retained_store_grow(void) {
+    char *dir = dir_new();
+    ASSERT("retained::retained_store_grow...FAIL", dir != NULL);
+    ASSERT("retained::retained_store_grow...FAIL",
+           retained_store_open(dir) == 0);
+    char path[512], topic[32], msg[32];
+    snprintf(path, sizeof(path), "%s/retained.idx", dir);
+    off_t size = file_size(path);
+    for (int i = 0; i < TOPICS_NR; ++i) {
+        snprintf(topic, sizeof(topic), "dev/%d/state", i);
+        snprintf(msg, sizeof(msg), "value-%d", i);
+        ASSERT("retained::retained_store_grow...FAIL",
+               retained_store_put(topic, (unsigned char *) msg,
+                                  strlen(msg)) == 0);
+    }
+    ASSERT("retained::retained_store_grow...FAIL", file_size(path) > size);
+    ASSERT("retained::retained_store_grow...FAIL",
+           retained_store_count() == TOPICS_NR);
+    ASSERT("retained::retained_store_grow...FAIL",
+           retained_check(0, TOPICS_NR, 1) == true);
+    size_t len;
+    ASSERT("retained::retained_store_grow...FAIL",
+           retained_store_get("dev/none", &len) == NULL);
+    retained_store_close();
+    ASSERT("retained::retained_store_grow...FAIL",
+           retained_store_open(dir) == 0);
+    ASSERT("retained::retained_store_grow...FAIL",
+           retained_store_count() == TOPICS_NR);
+    ASSERT("retained::retained_store_grow...FAIL",
+           retained_check(0, TOPICS_NR, 1) == true);
+    retained_store_close();
+    dir_remove(dir);
+    printf("retained::retained_store_grow...OK\n");
+    return 0;
+}
+
+/*
+ * Tests clearing retained messages, the ones left are still found past the
+ * slots emptied, which are shifted back rather than marked
+ */
+static char *test_retained_store_del(void) {
+    char *dir = dir_new();
+    ASSERT("retained::retained_store_del...FAIL", dir != NULL);
+    ASSERT("retained::retained_store_del...FAIL",
+           retained_store_open(dir) == 0);
+    char topic[32], msg[32];
+    for (int i = 0; i < TOPICS_NR; ++i) {
+        snprintf(topic, sizeof(topic), "dev/%d/state", i);
+        snprintf(msg, sizeof(msg), "value-%d", i);
+        retained_store_put(topic, (unsigned char *) msg, strlen(msg));
+    }
+    for (int i = 0; i < TOPICS_NR; i += 2) {
+        snprintf(topic, sizeof(topic), "dev/%d/state", i);
+        retained_store_del(topic);
+    }
+    // Clearing an absent one changes nothing
+    retained_store_del("dev/0/state");
+    ASSERT("retained::retained_store_del...FAIL",
+           retained_store_count() == TOPICS_NR / 2);
+    ASSERT("retained::retained_store_del...FAIL",
+           retained_check(1, TOPICS_NR, 2) == true);
+    size_t len;
+    for (int i = 0; i < TOPICS_NR; i += 2) {
+        snprintf(topic, sizeof(topic), "dev/%d/state", i);
+        ASSERT("retained::retained_store_del...FAIL",
+               retained_store_get(topic, &len) == NULL);
+    }
+    retained_store_close();
+    dir_remove(dir);
+    printf("retained::retained_store_del...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the compaction of the data segments, replacing the same messages
+ * over and over till the garbage is past 4MB, only the last ones are left
+ * in the segments of the next generation
+ */
+static char *test_retained_store_compact(void) {
+    char *dir = dir_new();
+    ASSERT("retained::retained_store_compact...FAIL", dir != NULL);
+    ASSERT("retained::retained_store_compact...FAIL",
+           retained_store_open(dir) == 0);
+    char topic[32], msg[1024], path[512];
+    memset(msg, 'x', sizeof(msg));
+    for (int round = 0; round < 5000; ++round) {
+        int i = round % 10;
+        snprintf(topic, sizeof(topic), "dev/%d/state", i);
+        int n = snprintf(msg, sizeof(msg), "value-%d", round);
+        msg[n] = 'x';
+        retained_store_put(topic, (unsigned char *) msg, sizeof(msg));
+    }
+    snprintf(path, sizeof(path), "%s/retained-0-00000.dat", dir);
+    ASSERT("retained::retained_store_compact...FAIL", file_size(path) < 0);
+    snprintf(path, sizeof(path), "%s/retained-1-00000.dat", dir);
+    ASSERT("retained::retained_store_compact...FAIL", file_size(path) > 0);
+    ASSERT("retained::retained_store_compact...FAIL",
+           retained_store_count() == 10);
+    char expected[16];
+    size_t len;
+    for (int i = 0; i < 10; ++i) {
+        snprintf(topic, sizeof(topic), "dev/%d/state", i);
+        snprintf(expected, sizeof(expected), "value-%d", 4990 + i);
+        const unsigned char *m = retained_store_get(topic, &len);
+        ASSERT("retained::retained_store_compact...FAIL",
+               m && len == sizeof(msg)
+               && memcmp(m, expected, strlen(expected)) == 0);
+    }
+    retained_store_close();
+    dir_remove(dir);
+    printf("retained::retained_store_compact...OK\n");
+    return 0;
+}
+
+/*
+ * All persistence tests
+ */
+char *persistence_test() {
+
+    RUN_TEST(test_wal_replay);
+    RUN_TEST(test_retained_store_grow);
+    RUN_TEST(test_retained_store_del);
+    RUN_TEST(test_retained_store_compact);
+
+    return 0;
+}
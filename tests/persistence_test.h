@@ -0,0 +1,6 @@
+#ifndef PERSISTENCE_TEST_H
+#define PERSISTENCE_TEST_H
+
+char *persistence_test();
+
+#endif
@@ -27,6 +27,7 @@
 
 #include <stdio.h>
 #include "structures_test.h"
+#include "persistence_test.h"
 
 
 int tests_run = 0;
@@ -35,6 +36,10 @@ int tests_run = 0;
 int main(void) {
     printf("\nSTRUCTURES TESTS\n\n");
     char *result = structures_test();
+    if (result == 0) {
+        printf("\nPERSISTENCE TESTS\n\n");
+        result = persistence_test();
+    }
     if (result != 0)
         printf(" %s\n", result);
     else
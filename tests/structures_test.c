@@ -34,6 +34,8 @@
 #include "../src/list.h"
 #include "../src/memory.h"
 #include "../src/iterator.h"
+#include "../src/histogram.h"
+#include "../src/sol_internal.h"
 
 /*
  * Tests the init feature of the list
@@ -83,6 +85,22 @@ static char *test_list_push_back(void) {
     return 0;
 }
 
+/*
+ * Tests the pop feature of the list
+ */
+static char *test_list_pop(void) {
+    List *l = list_new(NULL);
+    char *x = "abc", *y = "def";
+    list_push_back(l, x);
+    list_push_back(l, y);
+    ASSERT("list::list_pop...FAIL", list_pop(l) == x && l->len == 1);
+    ASSERT("list::list_pop...FAIL", list_pop(l) == y && l->len == 0);
+    ASSERT("list::list_pop...FAIL", list_pop(l) == NULL && !l->tail);
+    list_destroy(l, 0);
+    printf("list::list_pop...OK\n");
+    return 0;
+}
+
 
 static int compare_str(const void *arg1, const void *arg2) {
 
@@ -108,6 +126,42 @@ static char *test_list_remove_node(void) {
     return 0;
 }
 
+static bool match_str(const struct list_node *node, const char *str) {
+    return strcmp(node->data, str) == 0;
+}
+
+static int free_node(struct list_node *node) {
+    free_memory(node);
+    return 0;
+}
+
+/*
+ * Tests the remove feature of the list, past the head and on the tail
+ */
+static char *test_list_remove(void) {
+    List *l = list_new(free_node);
+    char *x = "abc", *y = "def", *z = "ghi";
+    list_push_back(l, x);
+    list_push_back(l, y);
+    list_push_back(l, z);
+    list_remove(l, y, match_str);
+    ASSERT("list::list_remove...FAIL", l->len == 2);
+    ASSERT("list::list_remove...FAIL", l->head->data == x);
+    ASSERT("list::list_remove...FAIL", l->head->next == l->tail);
+    ASSERT("list::list_remove...FAIL", l->tail->data == z);
+    list_remove(l, z, match_str);
+    ASSERT("list::list_remove...FAIL", l->len == 1);
+    ASSERT("list::list_remove...FAIL", l->tail == l->head);
+    ASSERT("list::list_remove...FAIL", l->tail->next == NULL);
+    // Appending after removing the tail must link from the new one
+    list_push_back(l, y);
+    ASSERT("list::list_remove...FAIL", l->head->next == l->tail);
+    ASSERT("list::list_remove...FAIL", l->tail->data == y);
+    list_destroy(l, 0);
+    printf("list::list_remove...OK\n");
+    return 0;
+}
+
 /*
  * Tests the list iterator
  */
@@ -272,6 +326,250 @@ static char *test_trie_prefix_count(void) {
     return 0;
 }
 
+/*
+ * Histogram tests
+ */
+
+static char *test_histogram_percentile(void) {
+    struct histogram *h = try_calloc(1, sizeof(*h));
+    ASSERT("histogram::histogram_percentile...FAIL",
+           histogram_percentile(h, 50.0) == 0);
+    // Small values are recorded exactly
+    for (int i = 1; i <= 20; ++i)
+        histogram_record(h, i);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           histogram_count(h) == 20);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           histogram_percentile(h, 50.0) == 10);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           histogram_percentile(h, 100.0) == 20);
+    // Larger ones within the relative error of a sub-bucket
+    for (int i = 0; i < 980; ++i)
+        histogram_record(h, 1000000);
+    uint64_t p99 = histogram_percentile(h, 99.0);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           p99 >= 1000000 && p99 < 1000000 + 1000000 / HIST_SUB_BUCKETS);
+    // Out of range values saturate into the last bucket
+    histogram_record(h, UINT64_MAX);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           histogram_percentile(h, 100.0) == (1ULL << HIST_MAX_BITS) - 1);
+    free_memory(h);
+    printf("histogram::histogram_percentile...OK\n");
+    return 0;
+}
+
+static char *test_histogram_merge(void) {
+    struct histogram *a = try_calloc(1, sizeof(*a));
+    struct histogram *b = try_calloc(1, sizeof(*b));
+    for (int i = 0; i < 100; ++i) {
+        histogram_record(a, 5000);
+        histogram_record(b, 70000);
+    }
+    histogram_merge(a, b);
+    ASSERT("histogram::histogram_merge...FAIL", histogram_count(a) == 200);
+    ASSERT("histogram::histogram_merge...FAIL", a->sum == 7500000);
+    ASSERT("histogram::histogram_merge...FAIL",
+           histogram_count_below(a, 10000) == 100);
+    ASSERT("histogram::histogram_merge...FAIL",
+           histogram_percentile(a, 50.0) < 6000);
+    ASSERT("histogram::histogram_merge...FAIL",
+           histogram_percentile(a, 90.0) >= 70000);
+    free_memory(a);
+    free_memory(b);
+    printf("histogram::histogram_merge...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the interning of client IDs, a handle is shared by the same ID and
+ * given back to the table once released as many times as taken
+ */
+static char *test_client_id_intern(void) {
+    uint32_t a = client_id_intern("client-a");
+    uint32_t b = client_id_intern("client-b");
+    ASSERT("client_id::client_id_intern...FAIL", a != CLIENT_ID_NONE);
+    ASSERT("client_id::client_id_intern...FAIL", a != b);
+    ASSERT("client_id::client_id_intern...FAIL",
+           client_id_intern("client-a") == a);
+    ASSERT("client_id::client_id_intern...FAIL",
+           strcmp(client_id_get(a)->id, "client-a") == 0);
+    ASSERT("client_id::client_id_intern...FAIL", client_id_get(a)->refs == 2);
+    client_id_retain(a);
+    ASSERT("client_id::client_id_intern...FAIL", client_id_get(a)->refs == 3);
+    client_id_release(a);
+    client_id_release(a);
+    ASSERT("client_id::client_id_intern...FAIL",
+           strcmp(client_id_get(a)->id, "client-a") == 0);
+    client_id_release(a);
+    // The handle released is the next one given out, to a different ID
+    uint32_t c = client_id_intern("client-c");
+    ASSERT("client_id::client_id_intern...FAIL", c == a);
+    ASSERT("client_id::client_id_intern...FAIL",
+           strcmp(client_id_get(c)->id, "client-c") == 0);
+    ASSERT("client_id::client_id_intern...FAIL",
+           strcmp(client_id_get(b)->id, "client-b") == 0);
+    // A new handle for an ID seen before, the old one being taken
+    uint32_t d = client_id_intern("client-a");
+    ASSERT("client_id::client_id_intern...FAIL", d != b && d != c);
+    client_id_release(b);
+    client_id_release(c);
+    client_id_release(d);
+    printf("client_id::client_id_intern...OK\n");
+    return 0;
+}
+
+#define SUBSCRIBERS_NR 64
+
+static char *test_subscribers_add(void) {
+    struct subscribers subs = { 0 };
+    uint32_t handles[SUBSCRIBERS_NR];
+    char id[16];
+    for (int i = 0; i < SUBSCRIBERS_NR; ++i) {
+        snprintf(id, sizeof(id), "sub-%d", i);
+        handles[i] = client_id_intern(id);
+        struct subscriber *sub = subscribers_add(&subs, handles[i], i % 3);
+        ASSERT("subscribers::subscribers_add...FAIL",
+               sub && sub->handle == handles[i] && sub->granted_qos == i % 3);
+        // The index only past 16 subscribers, lookups the same either way
+        ASSERT("subscribers::subscribers_add...FAIL",
+               (subs.index != NULL) == (subs.size > 16));
+        for (int j = 0; j <= i; ++j)
+            ASSERT("subscribers::subscribers_add...FAIL",
+                   subscribers_find(&subs, handles[j])->handle == handles[j]);
+    }
+    // Adding again returns the existing one, holding no more references
+    struct subscriber *sub = subscribers_add(&subs, handles[20], 2);
+    ASSERT("subscribers::subscribers_add...FAIL",
+           sub->handle == handles[20] && sub->granted_qos == 20 % 3);
+    ASSERT("subscribers::subscribers_add...FAIL", subs.size == SUBSCRIBERS_NR);
+    ASSERT("subscribers::subscribers_add...FAIL",
+           client_id_get(handles[20])->refs == 2);
+    subscribers_destroy(&subs);
+    ASSERT("subscribers::subscribers_add...FAIL",
+           subs.size == 0 && !subs.items && !subs.index);
+    for (int i = 0; i < SUBSCRIBERS_NR; ++i) {
+        ASSERT("subscribers::subscribers_add...FAIL",
+               client_id_get(handles[i])->refs == 1);
+        client_id_release(handles[i]);
+    }
+    printf("subscribers::subscribers_add...OK\n");
+    return 0;
+}
+
+static char *test_subscribers_del(void) {
+    struct subscribers subs = { 0 };
+    uint32_t handles[SUBSCRIBERS_NR];
+    char id[16];
+    for (int i = 0; i < SUBSCRIBERS_NR; ++i) {
+        snprintf(id, sizeof(id), "sub-%d", i);
+        handles[i] = client_id_intern(id);
+        subscribers_add(&subs, handles[i], 1);
+    }
+    // The last one just goes, a middle one is replaced by the last
+    subscribers_del(&subs, handles[SUBSCRIBERS_NR - 1]);
+    ASSERT("subscribers::subscribers_del...FAIL",
+           subs.size == SUBSCRIBERS_NR - 1);
+    ASSERT("subscribers::subscribers_del...FAIL",
+           !subscribers_find(&subs, handles[SUBSCRIBERS_NR - 1]));
+    subscribers_del(&subs, handles[10]);
+    ASSERT("subscribers::subscribers_del...FAIL",
+           subs.items[10].handle == handles[SUBSCRIBERS_NR - 2]);
+    ASSERT("subscribers::subscribers_del...FAIL",
+           !subscribers_find(&subs, handles[10]));
+    ASSERT("subscribers::subscribers_del...FAIL",
+           subscribers_find(&subs, handles[SUBSCRIBERS_NR - 2])
+           == &subs.items[10]);
+    // Removing an absent one changes nothing
+    subscribers_del(&subs, handles[10]);
+    ASSERT("subscribers::subscribers_del...FAIL",
+           subs.size == SUBSCRIBERS_NR - 2);
+    // Down to a quarter the array shrinks, then the index is dropped
+    uint32_t capacity = subs.capacity;
+    bool shrunk = false;
+    for (int i = 0; i < SUBSCRIBERS_NR - 1; ++i) {
+        if (i == 10)
+            continue;
+        subscribers_del(&subs, handles[i]);
+        if (subs.size == 0)
+            break;
+        ASSERT("subscribers::subscribers_del...FAIL",
+               (subs.index != NULL) == (subs.size > 16));
+        // Never below the minimum capacity of 4
+        ASSERT("subscribers::subscribers_del...FAIL",
+               subs.size > subs.capacity / 4 || subs.capacity == 4);
+        shrunk |= subs.capacity < capacity;
+        for (int j = i + 1; j < SUBSCRIBERS_NR - 1; ++j)
+            ASSERT("subscribers::subscribers_del...FAIL",
+                   (subscribers_find(&subs, handles[j]) != NULL) == (j != 10));
+    }
+    ASSERT("subscribers::subscribers_del...FAIL", shrunk == true);
+    ASSERT("subscribers::subscribers_del...FAIL",
+           subs.size == 0 && !subs.items && !subs.index);
+    for (int i = 0; i < SUBSCRIBERS_NR; ++i) {
+        ASSERT("subscribers::subscribers_del...FAIL",
+               client_id_get(handles[i])->refs == 1);
+        client_id_release(handles[i]);
+    }
+    printf("subscribers::subscribers_del...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the wildcard matcher on names as stored, with a trailing '/', a "/#"
+ * filter being stored without the '#' and flagged as multilevel
+ */
+static char *test_match_subscription(void) {
+    // '+' at the start, in the middle and at the end
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/b/", "+/b/", false) == SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/c/", "+/b/", false) != SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/b/c/", "+/b/", false) != SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/b/c/", "a/+/c/", false) == SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/b/d/", "a/+/c/", false) != SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/c/", "a/+/c/", false) != SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/b/", "a/+/", false) == SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/b/c/", "a/+/", false) != SOL_OK);
+    // An empty level is still a level
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a//b/", "a/+/b/", false) == SOL_OK);
+    // "a/#" matches "a/" and all of its children, not the topics it prefixes
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/", "a/", true) == SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/b/c/", "a/", true) == SOL_OK);
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("ab/", "a/", true) != SOL_OK);
+    // "a/+" needs a level past "a/"
+    ASSERT("topic::match_subscription...FAIL",
+           match_subscription("a/", "a/+/", false) != SOL_OK);
+    printf("topic::match_subscription...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the hash of a topic, the same whether the name has a trailing '/' or
+ * not, so that the topic cache of a client hits either way
+ */
+static char *test_topic_hash(void) {
+    ASSERT("topic::topic_hash...FAIL",
+           topic_hash("a/b", 3) == topic_hash("a/b/", 4));
+    ASSERT("topic::topic_hash...FAIL",
+           topic_hash("a/b", 3) != topic_hash("a/c", 3));
+    struct topic *t = topic_new(try_strdup("a/b/"));
+    ASSERT("topic::topic_hash...FAIL",
+           t->hash == topic_hash("a/b", 3) && t->len == 4);
+    topic_destroy(t);
+    printf("topic::topic_hash...OK\n");
+    return 0;
+}
+
 /*
  * All datastructure tests
  */
@@ -281,7 +579,9 @@ char *structures_test() {
     RUN_TEST(test_list_destroy);
     RUN_TEST(test_list_push);
     RUN_TEST(test_list_push_back);
+    RUN_TEST(test_list_pop);
     RUN_TEST(test_list_remove_node);
+    RUN_TEST(test_list_remove);
     RUN_TEST(test_list_iterator);
     RUN_TEST(test_trie_create_node);
     RUN_TEST(test_trie_new);
@@ -290,6 +590,13 @@ char *structures_test() {
     RUN_TEST(test_trie_delete);
     RUN_TEST(test_trie_prefix_delete);
     RUN_TEST(test_trie_prefix_count);
+    RUN_TEST(test_histogram_percentile);
+    RUN_TEST(test_histogram_merge);
+    RUN_TEST(test_client_id_intern);
+    RUN_TEST(test_subscribers_add);
+    RUN_TEST(test_subscribers_del);
+    RUN_TEST(test_match_subscription);
+    RUN_TEST(test_topic_hash);
 
     return 0;
 }
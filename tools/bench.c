@@ -0,0 +1,548 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks of the core data structures and of the MQTT codec. Every
+ * case runs a fixed amount of operations a few times, the first run warms up
+ * caches and allocator and is discarded, and results are printed as a JSON
+ * document on stdout so that runs can be stored and compared:
+ *
+ *     sol_bench                       # default sizes, 5 repetitions
+ *     sol_bench -t 10000,10000000     # topic counts of the topic store cases
+ *     sol_bench -r 11 -f codec/       # only cases whose name contains codec/
+ *
+ * Inputs are generated from a fixed seed, so two runs of the same binary
+ * execute exactly the same operations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/mqtt.h"
+#include "../src/util.h"
+#include "../src/config.h"
+#include "../src/memory.h"
+#include "../src/memorypool.h"
+#include "../src/sol_internal.h"
+
+#define MAX_REPS        64
+#define MAX_SIZES       16
+#define LOOKUPS         1000000
+#define MATCH_CHECKS    4000000
+#define CODEC_OPS       1000000
+#define POOL_BLOCKS     1024
+#define POOL_ROUNDS     1000
+
+typedef uint64_t bench_fn(void *, size_t);
+
+static int reps = 5;
+
+static const char *filter = NULL;
+
+static int results = 0;
+
+/* Sink for computed values, keeps the compiler from dropping the work */
+static volatile size_t sink;
+
+static uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t xorshift64(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static bool selected(const char *name) {
+    return !filter || strstr(name, filter);
+}
+
+/*
+ * Run a case reps + 1 times and print its JSON entry, `param` names the size
+ * the case is parametrized on, if any, and `ops` is the amount of operations
+ * a single run of `fn` accounts for
+ */
+static void bench_run(const char *name, const char *param, size_t value,
+                      size_t ops, bench_fn *fn, void *ctx) {
+    if (!selected(name))
+        return;
+    uint64_t samples[MAX_REPS];
+    fn(ctx, ops);
+    for (int i = 0; i < reps; ++i)
+        samples[i] = fn(ctx, ops);
+    qsort(samples, reps, sizeof(*samples), cmp_u64);
+    double min = (double) samples[0] / ops;
+    double median = (double) samples[reps / 2] / ops;
+    double max = (double) samples[reps - 1] / ops;
+    printf("%s\n    {\"name\": \"%s\", \"params\": {", results++ ? "," : "", name);
+    if (param)
+        printf("\"%s\": %zu", param, value);
+    printf("}, \"ops\": %zu, \"reps\": %d, \"ns_per_op\": {\"min\": %.2f, "
+           "\"median\": %.2f, \"max\": %.2f}, \"ops_per_sec\": %.0f}",
+           ops, reps, min, median, max, median > 0 ? 1e9 / median : 0.0);
+    fflush(stdout);
+}
+
+/*
+ * Topic store cases, keys are shaped as the broker stores them, levels
+ * separated by '/' with a trailing one, and share prefixes the way device
+ * topics do
+ */
+
+struct topics_ctx {
+    size_t n;
+    char **keys;
+    struct topic **topics;
+    struct topic_store *store;
+};
+
+static char *topic_key(size_t i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "site%zu/device%zu/sensor%zu/",
+             i % 97, i / 97, i % 7);
+    return try_strdup(buf);
+}
+
+static void topics_init(struct topics_ctx *t, size_t n) {
+    t->n = n;
+    t->keys = try_alloc(n * sizeof(char *));
+    t->topics = try_alloc(n * sizeof(struct topic *));
+    for (size_t i = 0; i < n; ++i)
+        t->keys[i] = topic_key(i);
+    // Shuffle, topics are never created in order
+    for (size_t i = n - 1; i > 0; --i) {
+        size_t j = xorshift64() % (i + 1);
+        char *tmp = t->keys[i];
+        t->keys[i] = t->keys[j];
+        t->keys[j] = tmp;
+    }
+    t->store = NULL;
+}
+
+static void topics_free(struct topics_ctx *t) {
+    if (t->store)
+        topic_store_destroy(t->store);
+    for (size_t i = 0; i < t->n; ++i)
+        free_memory(t->keys[i]);
+    free_memory(t->keys);
+    free_memory(t->topics);
+}
+
+static uint64_t bench_topic_insert(void *ctx, size_t ops) {
+    struct topics_ctx *t = ctx;
+    if (t->store)
+        topic_store_destroy(t->store);
+    t->store = topic_store_new();
+    for (size_t i = 0; i < ops; ++i)
+        t->topics[i] = topic_new(try_strdup(t->keys[i]));
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < ops; ++i)
+        topic_store_put(t->store, t->topics[i]);
+    return clock_ns() - start;
+}
+
+static uint64_t bench_topic_lookup(void *ctx, size_t ops) {
+    struct topics_ctx *t = ctx;
+    size_t found = 0;
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < ops; ++i)
+        found += topic_store_get(t->store, t->keys[xorshift64() % t->n]) != NULL;
+    uint64_t elapsed = clock_ns() - start;
+    sink = found;
+    return elapsed;
+}
+
+static uint64_t bench_topic_miss(void *ctx, size_t ops) {
+    struct topics_ctx *t = ctx;
+    char key[64];
+    size_t found = 0;
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        // Same prefixes as the stored ones, diverging on the last level
+        size_t k = xorshift64() % t->n;
+        snprintf(key, sizeof(key), "site%zu/device%zu/actuator/", k % 97, k / 97);
+        found += topic_store_get(t->store, key) != NULL;
+    }
+    uint64_t elapsed = clock_ns() - start;
+    sink = found;
+    return elapsed;
+}
+
+static void bench_topics(const size_t *sizes, int nsizes) {
+    if (!selected("topic_store/insert") && !selected("topic_store/lookup")
+        && !selected("topic_store/lookup_miss"))
+        return;
+    for (int i = 0; i < nsizes; ++i) {
+        struct topics_ctx t;
+        topics_init(&t, sizes[i]);
+        bench_run("topic_store/insert", "topics", t.n, t.n,
+                  bench_topic_insert, &t);
+        if (!t.store) {
+            // Insert filtered out, the lookups still need a populated store
+            bench_topic_insert(&t, t.n);
+        }
+        bench_run("topic_store/lookup", "topics", t.n, LOOKUPS,
+                  bench_topic_lookup, &t);
+        bench_run("topic_store/lookup_miss", "topics", t.n, LOOKUPS,
+                  bench_topic_miss, &t);
+        topics_free(&t);
+    }
+}
+
+/*
+ * Wildcard matching, one operation is a published topic checked against the
+ * whole wildcard list, what publish_message does for every inbound PUBLISH
+ */
+
+struct wildcards_ctx {
+    size_t n;
+    struct { char *topic; bool multilevel; } *subs;
+    char *pubs[256];
+};
+
+static uint64_t bench_wildcard_match(void *ctx, size_t ops) {
+    struct wildcards_ctx *w = ctx;
+    size_t matched = 0;
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        const char *topic = w->pubs[i % 256];
+        for (size_t j = 0; j < w->n; ++j)
+            matched += match_subscription(topic, w->subs[j].topic,
+                                          w->subs[j].multilevel) == SOL_OK;
+    }
+    uint64_t elapsed = clock_ns() - start;
+    sink = matched;
+    return elapsed;
+}
+
+static void bench_wildcards(void) {
+    static const size_t counts[] = { 10, 100, 1000, 10000 };
+    char buf[64];
+    for (size_t c = 0; c < sizeof(counts) / sizeof(*counts); ++c) {
+        struct wildcards_ctx w = { .n = counts[c] };
+        w.subs = try_alloc(w.n * sizeof(*w.subs));
+        // A mix of the three shapes: a/+/c/, a/b/# and a/+/#
+        for (size_t i = 0; i < w.n; ++i) {
+            size_t k = xorshift64() % 1000;
+            switch (i % 3) {
+                case 0:
+                    snprintf(buf, sizeof(buf), "site%zu/+/sensor%zu/",
+                             k % 97, k % 7);
+                    break;
+                case 1:
+                    snprintf(buf, sizeof(buf), "site%zu/device%zu/",
+                             k % 97, k / 97);
+                    break;
+                case 2:
+                    snprintf(buf, sizeof(buf), "site%zu/+/", k % 97);
+                    break;
+            }
+            w.subs[i].topic = try_strdup(buf);
+            w.subs[i].multilevel = i % 3 != 0;
+        }
+        for (size_t i = 0; i < 256; ++i)
+            w.pubs[i] = topic_key(xorshift64() % 1000);
+        size_t ops = MATCH_CHECKS / w.n;
+        bench_run("wildcard/match", "subscriptions", w.n, ops,
+                  bench_wildcard_match, &w);
+        for (size_t i = 0; i < w.n; ++i)
+            free_memory(w.subs[i].topic);
+        for (size_t i = 0; i < 256; ++i)
+            free_memory(w.pubs[i]);
+        free_memory(w.subs);
+    }
+}
+
+/*
+ * Codec cases, encode covers what the broker packs, decode what it receives
+ * from clients, every decoded packet is released as the broker does
+ */
+
+struct codec_ctx {
+    struct mqtt_packet pkt;
+    u8 *buf;
+    usize len;
+};
+
+static uint64_t bench_pack(void *ctx, size_t ops) {
+    struct codec_ctx *c = ctx;
+    usize total = 0;
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < ops; ++i)
+        total += mqtt_pack(&c->pkt, c->buf);
+    uint64_t elapsed = clock_ns() - start;
+    sink = total;
+    return elapsed;
+}
+
+static uint64_t bench_unpack(void *ctx, size_t ops) {
+    struct codec_ctx *c = ctx;
+    unsigned pos = 0;
+    usize total = 0;
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        struct mqtt_packet pkt;
+        usize len = mqtt_decode_length(c->buf + 1, &pos);
+        mqtt_unpack(c->buf + 1 + pos, &pkt, *c->buf, len);
+        total += pkt.header.byte;
+        mqtt_packet_destroy(&pkt);
+    }
+    uint64_t elapsed = clock_ns() - start;
+    sink = total;
+    return elapsed;
+}
+
+static uint64_t bench_decode_length(void *ctx, size_t ops) {
+    struct codec_ctx *c = ctx;
+    unsigned pos = 0;
+    usize total = 0;
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < ops; ++i)
+        total += mqtt_decode_length(c->buf, &pos);
+    uint64_t elapsed = clock_ns() - start;
+    sink = total + pos;
+    return elapsed;
+}
+
+static u8 *put_u16(u8 *p, u16 v) {
+    *p++ = v >> 8;
+    *p++ = v & 0xFF;
+    return p;
+}
+
+static u8 *put_str(u8 *p, const char *s) {
+    size_t len = strlen(s);
+    p = put_u16(p, len);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* Prepend fixed header byte and remaining length to a variable part */
+static usize frame(u8 *dst, u8 byte, const u8 *body, usize len) {
+    dst[0] = byte;
+    int n = mqtt_encode_length(dst + 1, len);
+    memcpy(dst + 1 + n, body, len);
+    return 1 + n + len;
+}
+
+static void bench_codec(void) {
+    static u8 payload[1024];
+    static const char topic[] = "site1/device2/sensor3/";
+    static const struct { const char *name; u8 byte; } acks[] = {
+        { "puback", PUBACK_B }, { "pubrec", PUBREC_B },
+        { "pubrel", PUBREL_B }, { "pubcomp", PUBCOMP_B },
+        { "unsuback", UNSUBACK_B }
+    };
+    u8 rcs[4] = { 0, 1, 2, 1 };
+    u8 body[2048], *p;
+    char name[64];
+    struct codec_ctx c = { .buf = try_alloc(4096) };
+
+    memset(payload, 'x', sizeof(payload));
+
+    c.pkt = (struct mqtt_packet) { .header = { .byte = CONNACK_B } };
+    mqtt_connack(&c.pkt, 0, 0);
+    bench_run("codec/encode/connack", NULL, 0, CODEC_OPS, bench_pack, &c);
+
+    for (size_t i = 0; i < sizeof(acks) / sizeof(*acks); ++i) {
+        c.pkt = (struct mqtt_packet) { .header = { .byte = acks[i].byte } };
+        mqtt_ack(&c.pkt, 42);
+        snprintf(name, sizeof(name), "codec/encode/%s", acks[i].name);
+        bench_run(name, NULL, 0, CODEC_OPS, bench_pack, &c);
+    }
+
+    c.pkt = (struct mqtt_packet) { .header = { .byte = SUBACK_B } };
+    mqtt_suback(&c.pkt, 42, rcs, sizeof(rcs));
+    bench_run("codec/encode/suback", NULL, 0, CODEC_OPS, bench_pack, &c);
+    mqtt_packet_destroy(&c.pkt);
+
+    c.pkt = (struct mqtt_packet) { .header = { .byte = PINGRESP_B } };
+    bench_run("codec/encode/pingresp", NULL, 0, CODEC_OPS, bench_pack, &c);
+
+    static const size_t sizes[] = { 16, 1024 };
+    for (int qos = 0; qos < 2; ++qos) {
+        for (int i = 0; i < 2; ++i) {
+            c.pkt = (struct mqtt_packet) {
+                .header = { .byte = PUBLISH_B },
+                .publish = (struct mqtt_publish) {
+                    .pkt_id = qos ? 42 : 0,
+                    .topiclen = sizeof(topic) - 1,
+                    .topic = (u8 *) topic,
+                    .payloadlen = sizes[i],
+                    .payload = payload
+                }
+            };
+            c.pkt.header.bits.qos = qos;
+            snprintf(name, sizeof(name), "codec/encode/publish_qos%d", qos);
+            bench_run(name, "payload", sizes[i], CODEC_OPS, bench_pack, &c);
+            // Packed bytes are exactly what a client sends, decode them too
+            mqtt_pack(&c.pkt, c.buf);
+            snprintf(name, sizeof(name), "codec/decode/publish_qos%d", qos);
+            bench_run(name, "payload", sizes[i], CODEC_OPS, bench_unpack, &c);
+        }
+    }
+
+    // CONNECT with client id, username and password
+    p = body;
+    p = put_str(p, "MQTT");
+    *p++ = 4;
+    *p++ = 0xC2;
+    p = put_u16(p, 60);
+    p = put_str(p, "bench-client");
+    p = put_str(p, "user");
+    p = put_str(p, "secret");
+    frame(c.buf, 0x10, body, p - body);
+    bench_run("codec/decode/connect", NULL, 0, CODEC_OPS, bench_unpack, &c);
+
+    p = put_u16(body, 42);
+    for (int i = 0; i < 3; ++i) {
+        p = put_str(p, topic);
+        *p++ = i % 3;
+    }
+    frame(c.buf, 0x82, body, p - body);
+    bench_run("codec/decode/subscribe", NULL, 0, CODEC_OPS, bench_unpack, &c);
+
+    p = put_u16(body, 42);
+    for (int i = 0; i < 3; ++i)
+        p = put_str(p, topic);
+    frame(c.buf, 0xA2, body, p - body);
+    bench_run("codec/decode/unsubscribe", NULL, 0, CODEC_OPS, bench_unpack, &c);
+
+    put_u16(body, 42);
+    frame(c.buf, PUBACK_B, body, 2);
+    bench_run("codec/decode/puback", NULL, 0, CODEC_OPS, bench_unpack, &c);
+
+    // Remaining length fields of 1 to 4 bytes
+    static const usize lengths[] = { 127, 16383, 2097151, 268435455 };
+    for (int i = 0; i < 4; ++i) {
+        mqtt_encode_length(c.buf, lengths[i]);
+        bench_run("codec/decode_length", "bytes", i + 1, CODEC_OPS,
+                  bench_decode_length, &c);
+    }
+
+    free_memory(c.buf);
+}
+
+/*
+ * Allocation cases, a batch of blocks is allocated then released, the way
+ * short lived objects churn on the hot path
+ */
+
+struct alloc_ctx {
+    struct memorypool *pool;
+    size_t blocksize;
+    void *blocks[POOL_BLOCKS];
+};
+
+static uint64_t bench_pool(void *ctx, size_t ops) {
+    struct alloc_ctx *a = ctx;
+    uint64_t start = clock_ns();
+    for (size_t r = 0; r < ops / POOL_BLOCKS; ++r) {
+        for (size_t i = 0; i < POOL_BLOCKS; ++i)
+            a->blocks[i] = memorypool_alloc(a->pool);
+        for (size_t i = 0; i < POOL_BLOCKS; ++i)
+            memorypool_free(a->pool, a->blocks[i]);
+    }
+    return clock_ns() - start;
+}
+
+static uint64_t bench_heap(void *ctx, size_t ops) {
+    struct alloc_ctx *a = ctx;
+    uint64_t start = clock_ns();
+    for (size_t r = 0; r < ops / POOL_BLOCKS; ++r) {
+        for (size_t i = 0; i < POOL_BLOCKS; ++i)
+            a->blocks[i] = try_alloc(a->blocksize);
+        for (size_t i = 0; i < POOL_BLOCKS; ++i)
+            free_memory(a->blocks[i]);
+    }
+    return clock_ns() - start;
+}
+
+static void bench_alloc(void) {
+    static const size_t sizes[] = { 64, 512 };
+    for (int i = 0; i < 2; ++i) {
+        // Twice the batch, a growing pool moves the blocks handed out
+        struct alloc_ctx a = {
+            .pool = memorypool_new(POOL_BLOCKS * 2, sizes[i]),
+            .blocksize = sizes[i]
+        };
+        bench_run("memorypool/alloc_free", "blocksize", sizes[i],
+                  POOL_BLOCKS * POOL_ROUNDS, bench_pool, &a);
+        bench_run("try_alloc/alloc_free", "blocksize", sizes[i],
+                  POOL_BLOCKS * POOL_ROUNDS, bench_heap, &a);
+        memorypool_destroy(a.pool);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-r repetitions] [-t topics,...] [-f filter]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    size_t sizes[MAX_SIZES] = { 10000, 100000, 1000000 };
+    int nsizes = 3, opt;
+    char *tok;
+    while ((opt = getopt(argc, argv, "r:t:f:")) != -1) {
+        switch (opt) {
+            case 'r':
+                reps = atoi(optarg);
+                if (reps < 1 || reps > MAX_REPS)
+                    usage(argv[0]);
+                break;
+            case 't':
+                nsizes = 0;
+                for (tok = strtok(optarg, ","); tok && nsizes < MAX_SIZES;
+                     tok = strtok(NULL, ","))
+                    if ((sizes[nsizes] = strtoull(tok, NULL, 10)) > 1)
+                        nsizes++;
+                if (nsizes == 0)
+                    usage(argv[0]);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    printf("{\n  \"version\": \"%s\",\n  \"reps\": %d,\n  \"benchmarks\": [",
+           VERSION, reps);
+    bench_topics(sizes, nsizes);
+    bench_wildcards();
+    bench_codec();
+    bench_alloc();
+    printf("\n  ]\n}\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,956 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Load generator speaking MQTT to a running broker, built on the event loop
+ * and the codec of the broker itself. Subscribers connect first, then the
+ * publishers; once every subscription is acknowledged publishers start to
+ * send messages carrying their send time in the first 8 bytes of the payload
+ * and subscribers record the end-to-end latency on receipt:
+ *
+ *     sol_loadgen -P 10 -S 100 -q 1 -s 64-1024 -d 30
+ *     sol_loadgen -P 500 -S 500 -t 50 -W 20 -r 100 -w 4
+ *     sol_loadgen -P 1000 -S 0 -c 200 -T -p 8883       # TLS connect storm
+ *
+ * Progress is printed every second on stderr, the final report is a JSON
+ * document on stdout. Send times are read from the monotonic clock, latencies
+ * only make sense running the generator on a single host.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "../src/ev.h"
+#include "../src/mqtt.h"
+#include "../src/util.h"
+#include "../src/memory.h"
+#include "../src/histogram.h"
+
+#define TOPIC_ROOT      "loadgen"
+#define MAX_PAYLOAD     (1 << 20)
+#define MAX_WINDOW      1024
+#define MAX_WORKERS     64
+#define SMALL_BUF       4096
+#define PUB_WBUF        (64 * 1024)
+#define FILL_BATCH      64
+#define TICK_NS         1000000
+#define CONNECT_TIMEOUT 30
+#define MAX_BIND        64
+
+enum lg_state {
+    LG_CONNECTING,
+    LG_HANDSHAKE,
+    LG_CONNACK,
+    LG_SUBACK,
+    LG_READY,
+    LG_CLOSED
+};
+
+enum lg_phase { PHASE_CONNECT, PHASE_RUN, PHASE_DRAIN, PHASE_STOP };
+
+struct worker;
+
+struct lg_client {
+    int fd;
+    int mask;
+    SSL *ssl;
+    unsigned index;         // index among the publishers or the subscribers
+    bool publisher;
+    enum lg_state state;
+    struct worker *w;
+    char topic[64];
+    uint64_t started;       // connect start, for the CONNACK latency
+    size_t published;
+    unsigned inflight;
+    unsigned next_slot;
+    uint64_t *slots;        // send time by packet id - 1, 0 for free slots
+    u8 *rbuf;
+    size_t rlen, rsize;
+    u8 *wbuf;
+    size_t wpos, wlen, wsize;
+};
+
+/*
+ * Every worker runs an event loop on its own thread, owning a share of the
+ * clients. Counters are read by the main thread for the progress report.
+ */
+struct worker {
+    pthread_t thread;
+    struct ev_ctx ctx;
+    struct lg_client *clients;
+    size_t nclients;
+    size_t launched;        // clients whose connection has been started
+    uint64_t first_tick;
+    uint64_t seed;
+    u8 *payload;
+    atomic_size_t sent;
+    atomic_size_t bytes_sent;
+    atomic_size_t received;
+    atomic_size_t bytes_recv;
+    atomic_size_t acked;
+    atomic_size_t connected;
+    atomic_size_t subscribed;
+    atomic_size_t errors;
+    struct histogram e2e;
+    struct histogram ack;
+    struct histogram connect;
+};
+
+static struct {
+    const char *host;
+    const char *port;
+    unsigned publishers;
+    unsigned subscribers;
+    int qos;
+    size_t payload_min;
+    size_t payload_max;
+    unsigned rate;          // messages per second per publisher, 0 unbounded
+    unsigned topics;
+    unsigned wildcards;     // percentage of wildcard subscribers
+    unsigned connect_rate;  // connections per second, 0 unbounded
+    unsigned duration;
+    unsigned workers;
+    unsigned window;        // QoS > 0 messages in flight per publisher
+    bool tls;
+    const char *cafile;
+    const char *prefix;
+} opts = {
+    .host = "127.0.0.1",
+    .port = "1883",
+    .publishers = 1,
+    .subscribers = 1,
+    .qos = 0,
+    .payload_min = 64,
+    .payload_max = 64,
+    .rate = 0,
+    .topics = 1,
+    .wildcards = 0,
+    .connect_rate = 0,
+    .duration = 10,
+    .workers = 1,
+    .window = 32,
+    .tls = false,
+    .cafile = NULL,
+    .prefix = "sol-loadgen"
+};
+
+static struct sockaddr_storage addr;
+
+static socklen_t addrlen;
+
+/*
+ * Local addresses connections are spread over, a single source address runs
+ * out of ephemeral ports at around 28k connections to the same broker port
+ */
+static struct sockaddr_storage binds[MAX_BIND];
+
+static socklen_t bindlens[MAX_BIND];
+
+static unsigned nbinds = 0;
+
+static SSL_CTX *ssl_ctx;
+
+static _Atomic int phase = PHASE_CONNECT;
+
+static _Atomic uint64_t run_start;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static atomic_int reported_errors = 0;
+
+static void client_io(struct ev_ctx *, void *);
+
+static void client_error(struct lg_client *c, const char *what) {
+    // A connect storm gone wrong would flood the terminal, report a few
+    if (atomic_fetch_add(&reported_errors, 1) < 10)
+        fprintf(stderr, "%s %u: %s\n",
+                c->publisher ? "publisher" : "subscriber", c->index, what);
+    atomic_fetch_add_explicit(&c->w->errors, 1, memory_order_relaxed);
+}
+
+static void client_close(struct lg_client *c) {
+    if (c->state == LG_CLOSED)
+        return;
+    ev_del_fd(&c->w->ctx, c->fd);
+    if (c->ssl)
+        SSL_free(c->ssl);
+    c->ssl = NULL;
+    close(c->fd);
+    c->state = LG_CLOSED;
+}
+
+static void client_fail(struct lg_client *c, const char *what) {
+    client_error(c, what);
+    client_close(c);
+}
+
+static void client_arm(struct lg_client *c, int mask) {
+    if (c->mask == mask)
+        return;
+    c->mask = mask;
+    ev_fire_event(&c->w->ctx, c->fd, mask, client_io, c);
+}
+
+/*
+ * Plain and TLS I/O, both return the number of bytes transferred, 0 if the
+ * operation would block and -1 on errors or closed connections
+ */
+static ssize_t lg_send(struct lg_client *c, const u8 *buf, size_t len) {
+    if (c->ssl) {
+        ERR_clear_error();
+        int n = SSL_write(c->ssl, buf, len);
+        if (n > 0)
+            return n;
+        int err = SSL_get_error(c->ssl, n);
+        return err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ? 0 : -1;
+    }
+    ssize_t n = send(c->fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    return n;
+}
+
+static ssize_t lg_recv(struct lg_client *c, u8 *buf, size_t len) {
+    if (c->ssl) {
+        ERR_clear_error();
+        int n = SSL_read(c->ssl, buf, len);
+        if (n > 0)
+            return n;
+        int err = SSL_get_error(c->ssl, n);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+    }
+    ssize_t n = recv(c->fd, buf, len, 0);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    return n == 0 ? -1 : n;
+}
+
+static uint64_t xorshift64(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static u8 *put_u16(u8 *p, u16 v) {
+    *p++ = v >> 8;
+    *p++ = v & 0xFF;
+    return p;
+}
+
+static u8 *put_str(u8 *p, const char *s) {
+    size_t len = strlen(s);
+    p = put_u16(p, len);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/*
+ * The codec packs only what a broker sends, CONNECT and SUBSCRIBE are framed
+ * here, variable header and payload first, then moved past the fixed header
+ */
+static void client_frame(struct lg_client *c, u8 byte, u8 *end) {
+    u8 *body = c->wbuf + c->wlen + 5;
+    size_t len = end - body;
+    u8 *p = c->wbuf + c->wlen;
+    *p++ = byte;
+    p += mqtt_encode_length(p, len);
+    memmove(p, body, len);
+    c->wlen = p + len - c->wbuf;
+}
+
+static void client_compact(struct lg_client *c) {
+    if (c->wpos == 0)
+        return;
+    memmove(c->wbuf, c->wbuf + c->wpos, c->wlen - c->wpos);
+    c->wlen -= c->wpos;
+    c->wpos = 0;
+}
+
+static void send_connect(struct lg_client *c) {
+    char id[64];
+    snprintf(id, sizeof(id), "%s-%d-%c%u", opts.prefix, getpid(),
+             c->publisher ? 'p' : 's', c->index);
+    client_compact(c);
+    u8 *p = c->wbuf + c->wlen + 5;
+    p = put_str(p, "MQTT");
+    *p++ = 4;       // protocol level, MQTT v3.1.1
+    *p++ = 0x02;    // clean session
+    p = put_u16(p, 0);
+    p = put_str(p, id);
+    client_frame(c, 0x10, p);
+    c->state = LG_CONNACK;
+}
+
+static void send_subscribe(struct lg_client *c) {
+    client_compact(c);
+    u8 *p = c->wbuf + c->wlen + 5;
+    p = put_u16(p, 1);
+    p = put_str(p, c->topic);
+    *p++ = opts.qos;
+    client_frame(c, 0x82, p);
+    c->state = LG_SUBACK;
+}
+
+static void send_ack(struct lg_client *c, u8 type, u16 pkt_id) {
+    client_compact(c);
+    if (c->wlen + MQTT_ACK_LEN > c->wsize)
+        return;
+    c->wlen += mqtt_pack_mono(c->wbuf + c->wlen, type, pkt_id);
+}
+
+static void publisher_fill(struct lg_client *c) {
+    struct worker *w = c->w;
+    size_t budget = FILL_BATCH;
+    uint64_t now = clock_ns();
+    if (opts.rate) {
+        uint64_t elapsed = now - atomic_load(&run_start);
+        size_t due = elapsed * opts.rate / 1000000000ULL;
+        if (due <= c->published)
+            return;
+        if (due - c->published < budget)
+            budget = due - c->published;
+    }
+    client_compact(c);
+    struct mqtt_packet pkt = {
+        .header = { .byte = PUBLISH_B },
+        .publish = (struct mqtt_publish) {
+            .topiclen = strlen(c->topic),
+            .topic = (u8 *) c->topic,
+            .payload = w->payload
+        }
+    };
+    pkt.header.bits.qos = opts.qos;
+    for (; budget > 0; --budget) {
+        if (opts.qos > AT_MOST_ONCE && c->inflight == opts.window)
+            break;
+        pkt.publish.payloadlen = opts.payload_min;
+        if (opts.payload_max > opts.payload_min)
+            pkt.publish.payloadlen += xorshift64(&w->seed) %
+                (opts.payload_max - opts.payload_min + 1);
+        if (c->wlen + mqtt_size(&pkt, NULL) > c->wsize)
+            break;
+        if (opts.qos > AT_MOST_ONCE) {
+            unsigned slot = c->next_slot;
+            while (c->slots[slot])
+                slot = (slot + 1) % opts.window;
+            c->next_slot = (slot + 1) % opts.window;
+            c->slots[slot] = now;
+            c->inflight++;
+            pkt.publish.pkt_id = slot + 1;
+        }
+        memcpy(w->payload, &now, sizeof(now));
+        c->wlen += mqtt_pack(&pkt, c->wbuf + c->wlen);
+        c->published++;
+        atomic_fetch_add_explicit(&w->sent, 1, memory_order_relaxed);
+    }
+}
+
+static void publisher_complete(struct lg_client *c, u16 pkt_id) {
+    if (pkt_id == 0 || pkt_id > opts.window || !c->slots[pkt_id - 1])
+        return;
+    histogram_record(&c->w->ack, clock_ns() - c->slots[pkt_id - 1]);
+    c->slots[pkt_id - 1] = 0;
+    c->inflight--;
+    atomic_fetch_add_explicit(&c->w->acked, 1, memory_order_relaxed);
+}
+
+/*
+ * Send what's buffered and arm the descriptor for the next cycle: writes are
+ * watched while something is left behind, or to keep an unbounded publisher
+ * going as soon as the socket can take more
+ */
+static void client_flush(struct lg_client *c) {
+    while (c->wpos < c->wlen) {
+        ssize_t n = lg_send(c, c->wbuf + c->wpos, c->wlen - c->wpos);
+        if (n < 0) {
+            client_fail(c, "connection lost writing");
+            return;
+        }
+        if (n == 0)
+            break;
+        c->wpos += n;
+        atomic_fetch_add_explicit(&c->w->bytes_sent, n, memory_order_relaxed);
+    }
+    if (c->wpos == c->wlen)
+        c->wpos = c->wlen = 0;
+    bool more = c->wlen > 0;
+    if (!more && c->publisher && c->state == LG_READY && opts.rate == 0
+        && atomic_load_explicit(&phase, memory_order_relaxed) == PHASE_RUN)
+        more = opts.qos == AT_MOST_ONCE || c->inflight < opts.window;
+    client_arm(c, more ? EV_READ | EV_WRITE : EV_READ);
+}
+
+static void client_pump(struct lg_client *c) {
+    if (c->state == LG_CLOSED)
+        return;
+    if (c->publisher && c->state == LG_READY
+        && atomic_load_explicit(&phase, memory_order_relaxed) == PHASE_RUN)
+        publisher_fill(c);
+    client_flush(c);
+}
+
+static void client_handle(struct lg_client *c, u8 byte, u8 *buf, usize len) {
+    struct worker *w = c->w;
+    struct mqtt_packet pkt;
+    uint64_t sent = 0;
+    switch (byte >> 4) {
+        case CONNACK:
+            if (c->state != LG_CONNACK || len < 2 || buf[1] != 0) {
+                client_fail(c, "connection refused");
+                return;
+            }
+            histogram_record(&w->connect, clock_ns() - c->started);
+            atomic_fetch_add_explicit(&w->connected, 1, memory_order_relaxed);
+            if (c->publisher)
+                c->state = LG_READY;
+            else
+                send_subscribe(c);
+            break;
+        case SUBACK:
+            if (len < 3 || buf[2] == 0x80) {
+                client_fail(c, "subscription refused");
+                return;
+            }
+            c->state = LG_READY;
+            atomic_fetch_add_explicit(&w->subscribed, 1, memory_order_relaxed);
+            break;
+        case PUBLISH:
+            if (mqtt_unpack(buf, &pkt, byte, len) != MQTT_OK) {
+                client_fail(c, "malformed PUBLISH");
+                return;
+            }
+            if (pkt.publish.payloadlen >= sizeof(sent))
+                memcpy(&sent, pkt.publish.payload, sizeof(sent));
+            // Retained or stale messages from a previous run carry no
+            // meaningful timestamp
+            if (sent >= atomic_load_explicit(&run_start, memory_order_relaxed)
+                && sent > 0)
+                histogram_record(&w->e2e, clock_ns() - sent);
+            atomic_fetch_add_explicit(&w->received, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&w->bytes_recv, pkt.publish.payloadlen,
+                                      memory_order_relaxed);
+            if (pkt.header.bits.qos == AT_LEAST_ONCE)
+                send_ack(c, PUBACK, pkt.publish.pkt_id);
+            else if (pkt.header.bits.qos == EXACTLY_ONCE)
+                send_ack(c, PUBREC, pkt.publish.pkt_id);
+            mqtt_packet_destroy(&pkt);
+            break;
+        case PUBACK:
+        case PUBCOMP:
+            mqtt_unpack(buf, &pkt, byte, len);
+            publisher_complete(c, pkt.ack.pkt_id);
+            break;
+        case PUBREC:
+            mqtt_unpack(buf, &pkt, byte, len);
+            send_ack(c, PUBREL, pkt.ack.pkt_id);
+            break;
+        case PUBREL:
+            mqtt_unpack(buf, &pkt, byte, len);
+            send_ack(c, PUBCOMP, pkt.ack.pkt_id);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Read all that's available and handle every complete packet, partial ones
+ * are kept at the start of the buffer for the next round
+ */
+static void client_read(struct lg_client *c) {
+    for (;;) {
+        ssize_t n = lg_recv(c, c->rbuf + c->rlen, c->rsize - c->rlen);
+        if (n < 0) {
+            client_fail(c, "connection lost reading");
+            return;
+        }
+        if (n == 0)
+            return;
+        c->rlen += n;
+        size_t pos = 0;
+        while (c->rlen - pos >= 2) {
+            size_t avail = c->rlen - pos, lenbytes = 1;
+            // Remaining length must be complete before decoding it
+            while (lenbytes < avail && lenbytes <= 4
+                   && (c->rbuf[pos + lenbytes] & 0x80))
+                lenbytes++;
+            if (lenbytes > 4) {
+                client_fail(c, "malformed remaining length");
+                return;
+            }
+            if (lenbytes == avail)
+                break;
+            unsigned hdrlen = 0;
+            usize len = mqtt_decode_length(c->rbuf + pos + 1, &hdrlen);
+            if (1 + hdrlen + len > c->rsize) {
+                client_fail(c, "packet too large");
+                return;
+            }
+            if (1 + hdrlen + len > avail)
+                break;
+            client_handle(c, c->rbuf[pos], c->rbuf + pos + 1 + hdrlen, len);
+            if (c->state == LG_CLOSED)
+                return;
+            pos += 1 + hdrlen + len;
+        }
+        memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+        c->rlen -= pos;
+    }
+}
+
+static void client_io(struct ev_ctx *ctx, void *arg) {
+    struct lg_client *c = arg;
+    int err = 0, rc;
+    socklen_t errlen = sizeof(err);
+    switch (c->state) {
+        case LG_CONNECTING:
+            if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0
+                || err != 0) {
+                client_fail(c, err ? strerror(err) : "connect failed");
+                return;
+            }
+            if (!opts.tls) {
+                send_connect(c);
+                break;
+            }
+            c->ssl = SSL_new(ssl_ctx);
+            SSL_set_fd(c->ssl, c->fd);
+            SSL_set_mode(c->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                         SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+            c->state = LG_HANDSHAKE;
+            // fallthrough
+        case LG_HANDSHAKE:
+            ERR_clear_error();
+            if ((rc = SSL_connect(c->ssl)) != 1) {
+                err = SSL_get_error(c->ssl, rc);
+                if (err == SSL_ERROR_WANT_READ)
+                    client_arm(c, EV_READ);
+                else if (err == SSL_ERROR_WANT_WRITE)
+                    client_arm(c, EV_READ | EV_WRITE);
+                else
+                    client_fail(c, "TLS handshake failed");
+                return;
+            }
+            send_connect(c);
+            break;
+        case LG_CLOSED:
+            return;
+        default:
+            client_read(c);
+            break;
+    }
+    client_pump(c);
+}
+
+static void client_start(struct worker *w, struct lg_client *c) {
+    c->started = clock_ns();
+    c->fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        client_error(c, strerror(errno));
+        c->state = LG_CLOSED;
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(c->fd, F_SETFD, FD_CLOEXEC);
+    if (nbinds > 0) {
+        unsigned k = c->publisher ? opts.subscribers + c->index : c->index;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+        if (bind(c->fd, (struct sockaddr *) &binds[k % nbinds],
+                 bindlens[k % nbinds]) < 0) {
+            client_error(c, strerror(errno));
+            close(c->fd);
+            c->state = LG_CLOSED;
+            return;
+        }
+    }
+    if (connect(c->fd, (struct sockaddr *) &addr, addrlen) < 0
+        && errno != EINPROGRESS) {
+        client_error(c, strerror(errno));
+        close(c->fd);
+        c->state = LG_CLOSED;
+        return;
+    }
+    c->state = LG_CONNECTING;
+    c->mask = EV_WRITE;
+    ev_register_event(&w->ctx, c->fd, EV_WRITE, client_io, c);
+}
+
+/*
+ * Cron of every worker: starts the connections due at the configured rate,
+ * paces rate limited publishers and tears everything down once the run is
+ * over
+ */
+static void worker_tick(struct ev_ctx *ctx, void *arg) {
+    struct worker *w = arg;
+    int p = atomic_load(&phase);
+    if (p == PHASE_STOP) {
+        static const u8 disconnect[2] = { DISCONNECT << 4, 0 };
+        for (size_t i = 0; i < w->nclients; ++i) {
+            struct lg_client *c = &w->clients[i];
+            if (c->state == LG_READY)
+                lg_send(c, disconnect, sizeof(disconnect));
+            client_close(c);
+        }
+        ev_stop(ctx);
+        return;
+    }
+    size_t due = w->nclients;
+    if (opts.connect_rate) {
+        uint64_t now = clock_ns();
+        if (!w->first_tick)
+            w->first_tick = now;
+        // Every worker paces its own share of the connections
+        due = (now - w->first_tick) * opts.connect_rate /
+            (1000000000ULL * opts.workers) + 1;
+        due = due < w->nclients ? due : w->nclients;
+    }
+    while (w->launched < due)
+        client_start(w, &w->clients[w->launched++]);
+    if (p == PHASE_RUN && opts.rate) {
+        for (size_t i = 0; i < w->nclients; ++i)
+            if (w->clients[i].publisher)
+                client_pump(&w->clients[i]);
+    } else if (p == PHASE_RUN) {
+        // Unbounded publishers are kept going by write readiness, just kick
+        // the ones idling since the connection phase
+        for (size_t i = 0; i < w->nclients; ++i)
+            if (w->clients[i].publisher && w->clients[i].mask == EV_READ
+                && w->clients[i].state == LG_READY && !w->clients[i].published)
+                client_pump(&w->clients[i]);
+    }
+}
+
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    ev_init(&w->ctx, 1024);
+    ev_register_cron(&w->ctx, worker_tick, w, 0, TICK_NS);
+    ev_run(&w->ctx);
+    ev_destroy(&w->ctx);
+    return NULL;
+}
+
+static void sigint_handler(int signum) {
+    (void) signum;
+    interrupted = 1;
+}
+
+static size_t sum(struct worker *workers, size_t offset) {
+    size_t total = 0;
+    for (unsigned i = 0; i < opts.workers; ++i)
+        total += atomic_load((atomic_size_t *) ((char *) &workers[i] + offset));
+    return total;
+}
+
+#define SUM(workers, field) sum(workers, offsetof(struct worker, field))
+
+static void print_latency(const char *name, const struct histogram *h,
+                          bool last) {
+    printf("    \"%s\": {\"count\": %zu, \"p50\": %llu, \"p90\": %llu, "
+           "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}%s\n", name,
+           histogram_count(h),
+           (unsigned long long) histogram_percentile(h, 50.0),
+           (unsigned long long) histogram_percentile(h, 90.0),
+           (unsigned long long) histogram_percentile(h, 99.0),
+           (unsigned long long) histogram_percentile(h, 99.9),
+           (unsigned long long) histogram_percentile(h, 100.0),
+           last ? "" : ",");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n\n"
+            "  -H host         broker address, default 127.0.0.1\n"
+            "  -p port         broker port, default 1883\n"
+            "  -P publishers   number of publishers, default 1\n"
+            "  -S subscribers  number of subscribers, default 1\n"
+            "  -q qos          QoS of publishes and subscriptions, default 0\n"
+            "  -s min[-max]    payload size range in bytes, default 64\n"
+            "  -r rate         messages/s per publisher, default 0 (unbounded)\n"
+            "  -t topics       distinct topics, publishers and subscribers "
+            "spread over them, default 1\n"
+            "  -W percent      subscribers on " TOPIC_ROOT "/+ or "
+            TOPIC_ROOT "/# instead of a single topic, default 0\n"
+            "  -c rate         connections/s, default 0 (all at once)\n"
+            "  -d seconds      publishing time, default 10\n"
+            "  -w workers      threads running the clients, default 1\n"
+            "  -m window       QoS 1/2 messages in flight per publisher, "
+            "default 32\n"
+            "  -T              connect over TLS\n"
+            "  -C cafile       verify the broker certificate against cafile\n"
+            "  -i prefix       client id prefix, default sol-loadgen\n"
+            "  -b addr,...     local addresses to spread the connections "
+            "over\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    char *dash;
+    while ((opt = getopt(argc, argv, "H:p:P:S:q:s:r:t:W:c:d:w:m:TC:i:b:h")) != -1) {
+        switch (opt) {
+            case 'H': opts.host = optarg; break;
+            case 'p': opts.port = optarg; break;
+            case 'P': opts.publishers = atoi(optarg); break;
+            case 'S': opts.subscribers = atoi(optarg); break;
+            case 'q': opts.qos = atoi(optarg); break;
+            case 's':
+                opts.payload_min = opts.payload_max = strtoul(optarg, &dash, 10);
+                if (*dash == '-')
+                    opts.payload_max = strtoul(dash + 1, NULL, 10);
+                break;
+            case 'r': opts.rate = atoi(optarg); break;
+            case 't': opts.topics = atoi(optarg); break;
+            case 'W': opts.wildcards = atoi(optarg); break;
+            case 'c': opts.connect_rate = atoi(optarg); break;
+            case 'd': opts.duration = atoi(optarg); break;
+            case 'w': opts.workers = atoi(optarg); break;
+            case 'm': opts.window = atoi(optarg); break;
+            case 'T': opts.tls = true; break;
+            case 'C': opts.cafile = optarg; opts.tls = true; break;
+            case 'i': opts.prefix = optarg; break;
+            case 'b':
+                for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+                    struct addrinfo *res, hint = {
+                        .ai_flags = AI_NUMERICHOST, .ai_socktype = SOCK_STREAM
+                    };
+                    if (nbinds == MAX_BIND || getaddrinfo(tok, NULL, &hint, &res))
+                        usage(argv[0]);
+                    memcpy(&binds[nbinds], res->ai_addr, res->ai_addrlen);
+                    bindlens[nbinds++] = res->ai_addrlen;
+                    freeaddrinfo(res);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if (opts.qos < 0 || opts.qos > EXACTLY_ONCE
+        || opts.payload_min < sizeof(uint64_t)
+        || opts.payload_max < opts.payload_min
+        || opts.payload_max > MAX_PAYLOAD || opts.topics == 0
+        || opts.wildcards > 100 || opts.workers == 0
+        || opts.workers > MAX_WORKERS || opts.window == 0
+        || opts.window > MAX_WINDOW || opts.duration == 0
+        || opts.publishers + opts.subscribers == 0)
+        usage(argv[0]);
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *result;
+    int rc = getaddrinfo(opts.host, opts.port, &hints, &result);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", opts.host, gai_strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&addr, result->ai_addr, result->ai_addrlen);
+    addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    if (opts.tls) {
+        ssl_ctx = SSL_CTX_new(TLS_client_method());
+        if (opts.cafile) {
+            if (SSL_CTX_load_verify_locations(ssl_ctx, opts.cafile, NULL) != 1) {
+                ERR_print_errors_fp(stderr);
+                exit(EXIT_FAILURE);
+            }
+            SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+        } else {
+            SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, sigint_handler);
+
+    /*
+     * Clients are dealt round-robin to the workers, subscribers first so they
+     * are in place before any publisher shows up
+     */
+    unsigned total = opts.publishers + opts.subscribers;
+    struct worker *workers = try_calloc(opts.workers, sizeof(*workers));
+    for (unsigned i = 0; i < opts.workers; ++i) {
+        workers[i].clients = try_calloc(total / opts.workers + 1,
+                                        sizeof(struct lg_client));
+        workers[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        workers[i].payload = try_alloc(opts.payload_max);
+        memset(workers[i].payload, 'x', opts.payload_max);
+    }
+    for (unsigned k = 0; k < total; ++k) {
+        struct worker *w = &workers[k % opts.workers];
+        struct lg_client *c = &w->clients[w->nclients++];
+        c->w = w;
+        c->fd = -1;
+        c->publisher = k >= opts.subscribers;
+        c->index = c->publisher ? k - opts.subscribers : k;
+        if (c->publisher) {
+            snprintf(c->topic, sizeof(c->topic), TOPIC_ROOT "/t%u",
+                     c->index % opts.topics);
+            c->slots = try_calloc(opts.window, sizeof(uint64_t));
+            c->rsize = SMALL_BUF;
+            c->wsize = PUB_WBUF > opts.payload_max * 2 + 128 ?
+                PUB_WBUF : opts.payload_max * 2 + 128;
+        } else {
+            if (c->index * 100 < opts.wildcards * opts.subscribers)
+                snprintf(c->topic, sizeof(c->topic), TOPIC_ROOT "/%c",
+                         c->index % 2 ? '#' : '+');
+            else
+                snprintf(c->topic, sizeof(c->topic), TOPIC_ROOT "/t%u",
+                         c->index % opts.topics);
+            c->rsize = opts.payload_max + 128 > SMALL_BUF ?
+                opts.payload_max + 128 : SMALL_BUF;
+            c->wsize = SMALL_BUF;
+        }
+        c->rbuf = try_alloc(c->rsize);
+        c->wbuf = try_alloc(c->wsize);
+    }
+
+    for (unsigned i = 0; i < opts.workers; ++i)
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+
+    // Connection phase, wait for every CONNACK and SUBACK
+    uint64_t start = clock_ns(), deadline = CONNECT_TIMEOUT;
+    if (opts.connect_rate)
+        deadline += total / opts.connect_rate;
+    size_t connected = 0, subscribed = 0, errors = 0, ticks = 0;
+    while (!interrupted) {
+        usleep(100000);
+        connected = SUM(workers, connected);
+        subscribed = SUM(workers, subscribed);
+        errors = SUM(workers, errors);
+        if (subscribed == opts.subscribers && connected == total)
+            break;
+        if (++ticks % 10 == 0)
+            fprintf(stderr, "connecting: %zu/%u connected, %zu/%u subscribed,"
+                    " %zu errors\n", connected, total, subscribed,
+                    opts.subscribers, errors);
+        // Some clients failed, go on with the others
+        if (errors && connected + errors >= total
+            && subscribed + errors >= opts.subscribers)
+            break;
+        if ((clock_ns() - start) / 1000000000ULL >= deadline) {
+            fprintf(stderr, "connection phase timed out\n");
+            interrupted = 1;
+        }
+    }
+    uint64_t connect_time = clock_ns() - start;
+
+    // Publishing phase
+    size_t last_sent = 0, last_recv = 0;
+    atomic_store(&run_start, clock_ns());
+    atomic_store(&phase, PHASE_RUN);
+    for (unsigned s = 1; s <= opts.duration && !interrupted; ++s) {
+        sleep(1);
+        size_t sent = SUM(workers, sent), recv = SUM(workers, received);
+        fprintf(stderr, "[%3us] sent %zu msg/s, received %zu msg/s, "
+                "%zu errors\n", s, sent - last_sent, recv - last_recv,
+                SUM(workers, errors));
+        last_sent = sent;
+        last_recv = recv;
+    }
+    uint64_t elapsed = clock_ns() - atomic_load(&run_start);
+
+    // Let in flight messages land, then tear down
+    atomic_store(&phase, PHASE_DRAIN);
+    for (int i = 0; i < 20 && !interrupted; ++i) {
+        usleep(100000);
+        size_t recv = SUM(workers, received);
+        if (recv == last_recv
+            && (opts.qos == AT_MOST_ONCE
+                || SUM(workers, acked) == SUM(workers, sent)))
+            break;
+        last_recv = recv;
+    }
+    atomic_store(&phase, PHASE_STOP);
+    for (unsigned i = 0; i < opts.workers; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    struct histogram *e2e = try_calloc(3, sizeof(struct histogram));
+    struct histogram *ack = e2e + 1, *conn = e2e + 2;
+    for (unsigned i = 0; i < opts.workers; ++i) {
+        histogram_merge(e2e, &workers[i].e2e);
+        histogram_merge(ack, &workers[i].ack);
+        histogram_merge(conn, &workers[i].connect);
+    }
+    double secs = elapsed / 1e9;
+    size_t sent = SUM(workers, sent), received = SUM(workers, received);
+    printf("{\n  \"config\": {\"publishers\": %u, \"subscribers\": %u, "
+           "\"qos\": %d, \"payload_min\": %zu, \"payload_max\": %zu, "
+           "\"rate\": %u, \"topics\": %u, \"wildcards\": %u, "
+           "\"connect_rate\": %u, \"workers\": %u, \"window\": %u, "
+           "\"tls\": %s},\n", opts.publishers, opts.subscribers, opts.qos,
+           opts.payload_min, opts.payload_max, opts.rate, opts.topics,
+           opts.wildcards, opts.connect_rate, opts.workers, opts.window,
+           opts.tls ? "true" : "false");
+    printf("  \"connect_seconds\": %.3f,\n  \"duration_seconds\": %.3f,\n",
+           connect_time / 1e9, secs);
+    errors = SUM(workers, errors);
+    printf("  \"connected\": %zu,\n  \"errors\": %zu,\n",
+           SUM(workers, connected), errors);
+    printf("  \"sent\": {\"messages\": %zu, \"bytes\": %zu, \"acked\": %zu, "
+           "\"msgs_per_sec\": %.0f},\n", sent, SUM(workers, bytes_sent),
+           SUM(workers, acked), sent / secs);
+    printf("  \"received\": {\"messages\": %zu, \"bytes\": %zu, "
+           "\"msgs_per_sec\": %.0f},\n", received, SUM(workers, bytes_recv),
+           received / secs);
+    printf("  \"latency_ns\": {\n");
+    print_latency("end_to_end", e2e, false);
+    print_latency("ack", ack, false);
+    print_latency("connect", conn, true);
+    printf("  }\n}\n");
+
+    free_memory(e2e);
+    for (unsigned i = 0; i < opts.workers; ++i) {
+        for (size_t j = 0; j < workers[i].nclients; ++j) {
+            free_memory(workers[i].clients[j].rbuf);
+            free_memory(workers[i].clients[j].wbuf);
+            free_memory(workers[i].clients[j].slots);
+        }
+        free_memory(workers[i].clients);
+        free_memory(workers[i].payload);
+    }
+    free_memory(workers);
+    if (ssl_ctx)
+        SSL_CTX_free(ssl_ctx);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Decoder of the binary logs written with `log_format binary`, renders them
+ * as the text lines the broker would have written:
+ *
+ *     sol_logdecode /tmp/sol.log
+ *     tail -c +1 -f /tmp/sol.log | sol_logdecode
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../src/logging.h"
+
+int main(int argc, char **argv) {
+    int fd = STDIN_FILENO;
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [logfile]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 2 && (fd = open(argv[1], O_RDONLY)) < 0) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    int rc = sol_log_decode(fd, STDOUT_FILENO);
+    if (rc < 0)
+        fprintf(stderr, "%s: truncated or corrupted log\n", argv[0]);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}